@@ -0,0 +1,438 @@
+// Microbenchmarks of the codec primitives: variable byte integers, UTF-8 validation,
+// properties, CONNECT/PUBLISH decoding and CONNACK encoding. Each benchmark runs
+// in batches until it has taken at least --min-time-ms, the best of --repetitions
+// runs is kept (the least disturbed by the rest of the machine).
+//
+// Results go to stdout as JSON (ns/op and bytes/s), a readable table to stderr.
+//
+// usage: lmqtt_bench [--filter <substring>] [--min-time-ms <ms>] [--repetitions <n>]
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "lmqtt.h"
+
+namespace lmqtt {
+
+// reaches into lmqtt_packet and client_config, like a connection would
+class codec_bench {
+public:
+    static std::shared_ptr<lmqtt_packet> make_packet(packet_type type, uint8_t controlField, std::vector<uint8_t> body) {
+        auto packet = std::make_shared<lmqtt_packet>();
+        packet->_clientCfg = std::make_shared<client_config>();
+        packet->_header._controlField = controlField;
+        packet->_header._packetLen = static_cast<uint32_t>(body.size());
+        packet->_body = std::move(body);
+        if (packet->create_fixed_header() != reason_code::SUCCESS || packet->_type != type) {
+            return nullptr;
+        }
+        return packet;
+    }
+
+    static reason_code decode_connect(lmqtt_packet& packet) {
+        // decoding CONNECT fills the client config, start from a blank one as a new client would
+        packet._clientCfg->_userProprieties.clear();
+        return packet.decode_connect_packet_body();
+    }
+
+    static reason_code decode_publish(lmqtt_packet& packet) {
+        return packet.decode_publish_packet_body();
+    }
+
+    static reason_code decode_properties(lmqtt_packet& packet, uint32_t start, uint32_t size) {
+        packet._clientCfg->_userProprieties.clear();
+        return packet.decode_properties(start, size);
+    }
+
+    static return_code create_connack(lmqtt_packet& packet) {
+        return packet.create_connack_packet(packet_type::CONNACK, reason_code::SUCCESS);
+    }
+
+    static size_t body_size(const lmqtt_packet& packet) {
+        return packet._body.size();
+    }
+};
+
+} // namespace lmqtt
+
+namespace {
+
+using lmqtt::packet_type;
+using lmqtt::reason_code;
+using lmqtt::return_code;
+
+// keeps the compiler from optimizing a result away
+template <typename T>
+inline void do_not_optimize(const T& value) {
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "r,m"(value) : "memory");
+#else
+    static volatile const T* sink;
+    sink = &value;
+#endif
+}
+
+struct options {
+    std::string _filter;
+    double _minTimeMs = 200;
+    size_t _repetitions = 5;
+};
+
+struct result {
+    std::string _name;
+    uint64_t _iterations = 0;
+    double _nsPerOp = 0;
+    size_t _bytesPerOp = 0;
+    double _bytesPerSecond = 0;
+};
+
+class runner {
+public:
+    explicit runner(const options& opts) :
+        _options(opts) {}
+
+    // fn() is one operation over bytesPerOp bytes, it returns false if the operation
+    // did not do what it should (the benchmark is then reported as failed)
+    template <typename Fn>
+    void run(const std::string& name, size_t bytesPerOp, Fn&& fn) {
+        if (!_options._filter.empty() && name.find(_options._filter) == std::string::npos) {
+            return;
+        }
+        if (!fn()) {
+            std::fprintf(stderr, "%-40s FAILED\n", name.c_str());
+            _failed = true;
+            return;
+        }
+
+        // find a batch size that takes about a millisecond, so the clock does not matter
+        uint64_t batch = 1;
+        for (;;) {
+            const double ns = time_batch(fn, batch);
+            if (ns > 1e6 || batch > (uint64_t(1) << 30)) {
+                break;
+            }
+            batch *= 2;
+        }
+
+        double bestNsPerOp = 0;
+        uint64_t iterations = 0;
+        for (size_t rep = 0; rep < _options._repetitions; ++rep) {
+            double elapsed = 0;
+            uint64_t done = 0;
+            while (elapsed < _options._minTimeMs * 1e6) {
+                elapsed += time_batch(fn, batch);
+                done += batch;
+            }
+            const double nsPerOp = elapsed / static_cast<double>(done);
+            if (!rep || nsPerOp < bestNsPerOp) {
+                bestNsPerOp = nsPerOp;
+            }
+            iterations += done;
+        }
+
+        result r;
+        r._name = name;
+        r._iterations = iterations;
+        r._nsPerOp = bestNsPerOp;
+        r._bytesPerOp = bytesPerOp;
+        r._bytesPerSecond = bytesPerOp ? static_cast<double>(bytesPerOp) * 1e9 / bestNsPerOp : 0;
+        std::fprintf(stderr, "%-40s %12.2f ns/op %12.2f MB/s\n", name.c_str(), r._nsPerOp, r._bytesPerSecond / 1e6);
+        _results.push_back(std::move(r));
+    }
+
+    void write_json(std::FILE* out) const {
+        std::fprintf(out, "{\n  \"context\": {\n");
+        std::fprintf(out, "    \"compiler\": \"%s\",\n", get_compiler());
+#ifdef NDEBUG
+        std::fprintf(out, "    \"build_type\": \"release\",\n");
+#else
+        std::fprintf(out, "    \"build_type\": \"debug\",\n");
+#endif
+        std::fprintf(out, "    \"min_time_ms\": %.0f,\n", _options._minTimeMs);
+        std::fprintf(out, "    \"repetitions\": %zu\n", _options._repetitions);
+        std::fprintf(out, "  },\n  \"benchmarks\": [\n");
+        for (size_t i = 0; i < _results.size(); ++i) {
+            const result& r = _results[i];
+            std::fprintf(out,
+                "    { \"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.3f, \"bytes_per_op\": %zu, \"bytes_per_second\": %.0f }%s\n",
+                r._name.c_str(),
+                static_cast<unsigned long long>(r._iterations),
+                r._nsPerOp,
+                r._bytesPerOp,
+                r._bytesPerSecond,
+                (i + 1 == _results.size()) ? "" : ",");
+        }
+        std::fprintf(out, "  ]\n}\n");
+    }
+
+    [[nodiscard]] bool has_failed() const noexcept {
+        return _failed;
+    }
+
+private:
+    template <typename Fn>
+    static double time_batch(Fn& fn, uint64_t batch) {
+        const auto start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < batch; ++i) {
+            do_not_optimize(fn());
+        }
+        const auto end = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::nano>(end - start).count();
+    }
+
+    static const char* get_compiler() {
+#if defined(__clang__)
+        return "clang " __clang_version__;
+#elif defined(__GNUC__)
+        return "gcc " __VERSION__;
+#elif defined(_MSC_VER)
+        return "msvc";
+#else
+        return "unknown";
+#endif
+    }
+
+    options _options;
+    std::vector<result> _results;
+    bool _failed = false;
+};
+
+// ---- corpora
+
+std::string make_ascii_corpus(size_t size) {
+    const std::string_view words = "sensors/house/kitchen/temperature 21.5 humidity 40 ";
+    std::string corpus;
+    while (corpus.size() < size) {
+        corpus.append(words);
+    }
+    corpus.resize(size);
+    return corpus;
+}
+
+// latin accents (2 bytes), symbols (3 bytes) and emojis (4 bytes) between ascii words
+std::string make_mixed_corpus(size_t size) {
+    const std::string_view words = "capteur/cuisine/temp\xC3\xA9rature 21,5 \xE2\x82\xAC \xF0\x9F\x8C\xA1 d\xC3\xA9j\xC3\xA0 ";
+    std::string corpus;
+    while (corpus.size() + words.size() <= size) {
+        corpus.append(words);
+    }
+    return corpus;
+}
+
+// 3 bytes code points only
+std::string make_cjk_corpus(size_t size) {
+    const std::string_view words = "\xE6\xB8\xA9\xE5\xBA\xA6\xE4\xBC\xA0\xE6\x84\x9F\xE5\x99\xA8\xE5\x8E\xA8\xE6\x88\xBF";
+    std::string corpus;
+    while (corpus.size() + words.size() <= size) {
+        corpus.append(words);
+    }
+    return corpus;
+}
+
+// ---- packets
+
+void append_u16(std::vector<uint8_t>& out, uint16_t value) {
+    out.push_back(static_cast<uint8_t>(value >> 8));
+    out.push_back(static_cast<uint8_t>(value & 0xFF));
+}
+
+void append_u32(std::vector<uint8_t>& out, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        out.push_back(static_cast<uint8_t>((value >> shift) & 0xFF));
+    }
+}
+
+void append_string(std::vector<uint8_t>& out, std::string_view str) {
+    append_u16(out, static_cast<uint16_t>(str.size()));
+    out.insert(out.end(), str.begin(), str.end());
+}
+
+void append_variable_int(std::vector<uint8_t>& out, uint32_t value) {
+    uint8_t buff[4];
+    uint8_t size = 0;
+    (void)lmqtt::utils::encode_variable_int(buff, 4, value, size);
+    out.insert(out.end(), buff, buff + size);
+}
+
+// count CONNECT properties: the unique ones first, then user properties
+std::vector<uint8_t> make_connect_properties(size_t count) {
+    std::vector<uint8_t> properties;
+    for (size_t i = 0; i < count; ++i) {
+        switch (i) {
+        case 0:
+            properties.push_back(0x11); // session expiry interval
+            append_u32(properties, 3600);
+            break;
+        case 1:
+            properties.push_back(0x21); // receive maximum
+            append_u16(properties, 64);
+            break;
+        case 2:
+            properties.push_back(0x27); // maximum packet size
+            append_u32(properties, 1 << 20);
+            break;
+        case 3:
+            properties.push_back(0x22); // topic alias maximum
+            append_u16(properties, 16);
+            break;
+        default:
+            properties.push_back(0x26); // user property
+            append_string(properties, "region");
+            append_string(properties, "eu-west-" + std::to_string(i));
+            break;
+        }
+    }
+    return properties;
+}
+
+std::vector<uint8_t> make_connect_body(size_t propertyCount) {
+    std::vector<uint8_t> body;
+    append_string(body, "MQTT");
+    body.push_back(0x05);                   // protocol version
+    body.push_back(0x02);                   // clean start
+    append_u16(body, 60);                   // keep alive
+    const auto properties = make_connect_properties(propertyCount);
+    append_variable_int(body, static_cast<uint32_t>(properties.size()));
+    body.insert(body.end(), properties.begin(), properties.end());
+    append_string(body, "bench-client-0001");
+    return body;
+}
+
+std::vector<uint8_t> make_publish_body(uint8_t qos, size_t payloadSize) {
+    std::vector<uint8_t> body;
+    append_string(body, "sensors/house/kitchen/temperature");
+    if (qos) {
+        append_u16(body, 1);
+    }
+    body.push_back(0x00);                   // no properties
+    body.resize(body.size() + payloadSize, 'x');
+    return body;
+}
+
+// ---- benchmarks
+
+void bench_variable_int(runner& r) {
+    // biggest value of each encoded size
+    const uint32_t values[] = { 0x7F, 0x3FFF, 0x1FFFFF, 0xFFFFFFF };
+    for (size_t i = 0; i < 4; ++i) {
+        const size_t size = i + 1;
+        uint8_t encoded[4];
+        uint8_t encodedSize = 0;
+        (void)lmqtt::utils::encode_variable_int(encoded, 4, values[i], encodedSize);
+
+        r.run("decode_variable_int/" + std::to_string(size) + "B", size, [&encoded, value = values[i]]() {
+            uint32_t decoded = 0;
+            uint8_t offset = 0;
+            const return_code rc = lmqtt::utils::decode_variable_int(encoded, decoded, offset, 4);
+            do_not_optimize(decoded);
+            return rc == return_code::OK && decoded == value;
+        });
+
+        r.run("encode_variable_int/" + std::to_string(size) + "B", size, [value = values[i], size]() {
+            uint8_t buff[4];
+            uint8_t written = 0;
+            const return_code rc = lmqtt::utils::encode_variable_int(buff, 4, value, written);
+            do_not_optimize(buff);
+            return rc == return_code::OK && written == size;
+        });
+    }
+}
+
+void bench_utf8(runner& r) {
+    const std::pair<const char*, std::string> corpora[] = {
+        { "ascii", make_ascii_corpus(1024) },
+        { "mixed", make_mixed_corpus(1024) },
+        { "cjk", make_cjk_corpus(1024) },
+    };
+    for (const auto& [name, corpus] : corpora) {
+        r.run(std::string("utf8_is_valid_content/") + name, corpus.size(), [&corpus = corpus]() {
+            return lmqtt::utf8_utils::is_valid_content(corpus) == lmqtt::utf8_utils::utf8_str_check::WELL_FORMED;
+        });
+    }
+}
+
+void bench_properties(runner& r) {
+    for (size_t count : { 1, 4, 16, 64 }) {
+        auto packet = lmqtt::codec_bench::make_packet(packet_type::CONNECT, 0x10, make_connect_body(count));
+        const auto properties = make_connect_properties(count);
+        // properties start after protocol name (6), version (1), flags (1), keep alive (2)
+        // and the property length
+        const uint32_t start = 10 + lmqtt::utils::get_variable_int_size(static_cast<uint32_t>(properties.size()));
+        r.run("decode_properties/" + std::to_string(count), properties.size(), [&packet, start, size = properties.size()]() {
+            return lmqtt::codec_bench::decode_properties(*packet, start, static_cast<uint32_t>(size)) == reason_code::SUCCESS;
+        });
+    }
+}
+
+void bench_connect(runner& r) {
+    for (size_t count : { 0, 4, 16 }) {
+        auto packet = lmqtt::codec_bench::make_packet(packet_type::CONNECT, 0x10, make_connect_body(count));
+        r.run("decode_connect_packet_body/" + std::to_string(count) + "_properties", lmqtt::codec_bench::body_size(*packet), [&packet]() {
+            return lmqtt::codec_bench::decode_connect(*packet) == reason_code::SUCCESS;
+        });
+    }
+}
+
+void bench_publish(runner& r) {
+    for (uint8_t qos : { 0, 1 }) {
+        for (size_t payloadSize : { 16, 1000 }) {
+            auto packet = lmqtt::codec_bench::make_packet(
+                packet_type::PUBLISH,
+                static_cast<uint8_t>(0x30 | (qos << 1)),
+                make_publish_body(qos, payloadSize)
+            );
+            r.run(
+                "decode_publish_packet_body/qos" + std::to_string(qos) + "/" + std::to_string(payloadSize) + "B",
+                lmqtt::codec_bench::body_size(*packet),
+                [&packet]() {
+                    return lmqtt::codec_bench::decode_publish(*packet) == reason_code::SUCCESS;
+                }
+            );
+        }
+    }
+}
+
+void bench_connack(runner& r) {
+    auto packet = lmqtt::codec_bench::make_packet(packet_type::CONNECT, 0x10, make_connect_body(0));
+    if (!packet || lmqtt::codec_bench::decode_connect(*packet) != reason_code::SUCCESS) {
+        std::fprintf(stderr, "create_connack_packet: could not decode the CONNECT\n");
+        return;
+    }
+    // the CONNACK is built from what the CONNECT configured
+    r.run("create_connack_packet", 0, [&packet]() {
+        return lmqtt::codec_bench::create_connack(*packet) == return_code::OK;
+    });
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    options opts;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const std::string_view arg = argv[i];
+        if (arg == "--filter") {
+            opts._filter = argv[i + 1];
+        } else if (arg == "--min-time-ms") {
+            opts._minTimeMs = std::stod(argv[i + 1]);
+        } else if (arg == "--repetitions") {
+            opts._repetitions = std::max<size_t>(1, std::stoul(argv[i + 1]));
+        } else {
+            std::fprintf(stderr, "usage: %s [--filter <substring>] [--min-time-ms <ms>] [--repetitions <n>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // stdout is for the results
+    lmqtt::log::logger::instance().set_output(stderr);
+
+    runner r(opts);
+    bench_variable_int(r);
+    bench_utf8(r);
+    bench_properties(r);
+    bench_connect(r);
+    bench_publish(r);
+    bench_connack(r);
+
+    r.write_json(stdout);
+    return r.has_failed() ? 1 : 0;
+}
@@ -0,0 +1,332 @@
+// Side by side benchmark of the callback connection and the coroutine connection.
+// Both implementations are driven over loopback by the same blocking client:
+//   1 - connect storm: CONNECT -> CONNACK -> DISCONNECT, one connection after the other
+//   2 - publish stream: one connection pushes QoS 0 PUBLISH packets then a DISCONNECT,
+//       the run ends when the server closes the socket (all packets were decoded)
+// The callback connection runs a third time over memory streams: what is left is the
+// CPU cost of the broker itself, the difference with loopback is the kernel's. Two
+// more runs go over a unix socket and over shared memory rings, what co-located
+// clients would use.
+//
+// usage: connection_bench [connections] [publishes]
+#include <iostream>
+#include "lmqtt.h"
+#include "lmqtt_coro_connection.h"
+#include "lmqtt_shm_client.h"
+#include "lmqtt_shm_stream.h"
+
+namespace {
+
+using asio::ip::tcp;
+using unix_socket = asio::local::stream_protocol;
+
+std::vector<uint8_t> make_connect_packet() {
+    return {
+        0x10, 18,                   // CONNECT, remaining length
+        0x00, 0x04, 'M', 'Q', 'T', 'T',
+        0x05,                       // protocol version
+        0x02,                       // clean start
+        0x00, 0x3c,                 // keep alive
+        0x00,                       // no properties
+        0x00, 0x05, 'b', 'e', 'n', 'c', 'h'
+    };
+}
+
+std::vector<uint8_t> make_publish_packet() {
+    return {
+        0x30, 15,                   // PUBLISH QoS 0, remaining length
+        0x00, 0x07, 'b', 'e', 'n', 'c', 'h', '/', 't',
+        0x00,                       // no properties
+        'h', 'e', 'l', 'l', 'o'
+    };
+}
+
+const std::vector<uint8_t> DISCONNECT_PACKET{ 0xe0, 0x00 };
+
+// accepts connections and hands them to either implementation, or takes memory
+// streams, unix sockets and shared memory clients (callback connection only)
+class bench_server {
+public:
+    explicit bench_server(bool useCoroutines)
+        : _acceptor(_context, tcp::endpoint(asio::ip::address_v4::loopback(), 0)),
+          _unixPath("/tmp/connection_bench." + std::to_string(::getpid()) + ".sock"),
+          _unixAcceptor(_context),
+          _shmPath("/tmp/connection_bench." + std::to_string(::getpid()) + ".shm"),
+          _shmAcceptor(_context),
+          _reclaimTimer(_context),
+          _useCoroutines(useCoroutines) {
+        for (auto [path, acceptor] : { std::pair{ &_unixPath, &_unixAcceptor }, std::pair{ &_shmPath, &_shmAcceptor } }) {
+            ::unlink(path->c_str());
+            acceptor->open(unix_socket());
+            acceptor->bind(unix_socket::endpoint(*path));
+            acceptor->listen();
+        }
+        accept();
+        accept_unix();
+        accept_shm();
+        reclaim();
+        _thContext = std::thread([this]() { _context.run(); });
+        _cleanupThread = std::thread([this]() { cleanup(); });
+    }
+
+    ~bench_server() {
+        _context.stop();
+        if (_thContext.joinable()) _thContext.join();
+        _connections.clear();
+        _exit = true;
+        // wake the cleanup thread up
+        _coroDeletionQueue.push_back(nullptr);
+        if (_cleanupThread.joinable()) _cleanupThread.join();
+        ::unlink(_unixPath.c_str());
+        ::unlink(_shmPath.c_str());
+    }
+
+    uint16_t port() const {
+        return _acceptor.local_endpoint().port();
+    }
+
+    const std::string& unix_path() const {
+        return _unixPath;
+    }
+
+    const std::string& shm_path() const {
+        return _shmPath;
+    }
+
+    lmqtt::memory_stream connect_in_memory(asio::io_context& clientContext) {
+        auto [serverEnd, clientEnd] = lmqtt::memory_stream::make_pair(_context.get_executor(), clientContext.get_executor());
+        asio::post(_context, [this, stream = std::move(serverEnd)]() mutable {
+            auto conn = _connections.emplace<lmqtt::basic_connection<lmqtt::memory_stream>>(
+                _context, std::move(stream), _connections, _subscriptions);
+            conn->connect_to_client(100);
+        });
+        return std::move(clientEnd);
+    }
+
+private:
+    void accept() {
+        _acceptor.async_accept(
+            [this](std::error_code ec, tcp::socket socket) {
+                if (!ec) {
+                    socket.set_option(tcp::no_delay(true));
+                    if (_useCoroutines) {
+                        auto conn = std::make_shared<lmqtt::coro_connection>(
+                            _context, std::move(socket), _coroDeletionQueue);
+                        conn->connect_to_client(100);
+                    } else {
+                        auto conn = _connections.emplace<lmqtt::connection>(
+                            _context, std::move(socket), _connections, _subscriptions);
+                        conn->connect_to_client(100);
+                    }
+                }
+                accept();
+            });
+    }
+
+    void accept_unix() {
+        _unixAcceptor.async_accept(
+            [this](std::error_code ec, unix_socket::socket socket) {
+                if (!ec) {
+                    auto conn = _connections.emplace<lmqtt::basic_connection<unix_socket::socket>>(
+                        _context, std::move(socket), _connections, _subscriptions);
+                    conn->connect_to_client(100);
+                }
+                accept_unix();
+            });
+    }
+
+    void accept_shm() {
+        _shmAcceptor.async_accept(
+            [this](std::error_code ec, unix_socket::socket socket) {
+                if (!ec) {
+                    lmqtt::shm_stream::async_accept_region(
+                        std::move(socket),
+                        [this](std::error_code handshakeError, lmqtt::shm_stream stream) {
+                            if (handshakeError) {
+                                return;
+                            }
+                            auto conn = _connections.emplace<lmqtt::basic_connection<lmqtt::shm_stream>>(
+                                _context, std::move(stream), _connections, _subscriptions);
+                            conn->connect_to_client(100);
+                        });
+                }
+                accept_shm();
+            });
+    }
+
+    // destroys the callback connections torn down, like the server does
+    void reclaim() {
+        _reclaimTimer.expires_after(std::chrono::milliseconds(10));
+        _reclaimTimer.async_wait([this](std::error_code ec) {
+            if (!ec) {
+                _connections.quiescent();
+                reclaim();
+            }
+        });
+    }
+
+    // only coroutine connections go through a deletion queue, the others are
+    // torn down on the io thread
+    void cleanup() {
+        while (!_exit) {
+            _coroDeletionQueue.wait();
+            (void)_coroDeletionQueue.pop_front();
+        }
+    }
+
+    // cleared before the context goes
+    lmqtt::connection_table _connections;
+    asio::io_context _context;
+    tcp::acceptor _acceptor;
+    std::string _unixPath;
+    unix_socket::acceptor _unixAcceptor;
+    std::string _shmPath;
+    unix_socket::acceptor _shmAcceptor;
+    asio::steady_timer _reclaimTimer;
+    bool _useCoroutines;
+    std::thread _thContext;
+    std::thread _cleanupThread;
+    std::atomic<bool> _exit{ false };
+    lmqtt::ts_queue<std::shared_ptr<lmqtt::coro_connection>> _coroDeletionQueue;
+    lmqtt::subscription_registry _subscriptions;
+};
+
+template <typename Stream>
+void read_packet(Stream& socket) {
+    uint8_t header[2];
+    asio::read(socket, asio::buffer(header, 2));
+    std::vector<uint8_t> body(header[1] & 0x7f);
+    if (!body.empty()) {
+        asio::read(socket, asio::buffer(body));
+    }
+}
+
+// wait for the server to close the connection
+template <typename Stream>
+void wait_for_close(Stream& socket) {
+    uint8_t byte;
+    std::error_code ec;
+    while (!ec) {
+        socket.read_some(asio::buffer(&byte, 1), ec);
+    }
+}
+
+// connected stream to the server, over loopback
+tcp::socket connect_tcp(asio::io_context& context, uint16_t port) {
+    tcp::socket socket(context);
+    socket.connect(tcp::endpoint(asio::ip::address_v4::loopback(), port));
+    socket.set_option(tcp::no_delay(true));
+    return socket;
+}
+
+unix_socket::socket connect_unix(asio::io_context& context, const std::string& path) {
+    unix_socket::socket socket(context);
+    socket.connect(unix_socket::endpoint(path));
+    return socket;
+}
+
+// the context is not used, shm_client is blocking on its own
+lmqtt::shm_client connect_shm(asio::io_context&, const std::string& path) {
+    lmqtt::shm_client client;
+    if (client.open(path, 1 << 20) != lmqtt::return_code::OK) {
+        throw std::runtime_error("could not open a shared memory session on " + path);
+    }
+    return client;
+}
+
+// connect(context) returns a connected stream
+template <typename Connect>
+double connect_storm(Connect&& connect, size_t connections) {
+    asio::io_context context;
+    const auto connectPacket = make_connect_packet();
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < connections; ++i) {
+        auto socket = connect(context);
+        asio::write(socket, asio::buffer(connectPacket));
+        read_packet(socket);
+        asio::write(socket, asio::buffer(DISCONNECT_PACKET));
+        wait_for_close(socket);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / connections;
+}
+
+template <typename Connect>
+double publish_stream(Connect&& connect, size_t publishes) {
+    asio::io_context context;
+    const auto connectPacket = make_connect_packet();
+    const auto publishPacket = make_publish_packet();
+
+    // send the publishes in batches, as a real client would with Nagle disabled
+    const size_t batchSize = 64;
+    std::vector<uint8_t> batch;
+    for (size_t i = 0; i < batchSize; ++i) {
+        batch.insert(batch.end(), publishPacket.begin(), publishPacket.end());
+    }
+
+    auto socket = connect(context);
+    asio::write(socket, asio::buffer(connectPacket));
+    read_packet(socket);
+
+    auto start = std::chrono::steady_clock::now();
+    size_t sent = 0;
+    while (sent < publishes) {
+        const size_t count = std::min(batchSize, publishes - sent);
+        asio::write(socket, asio::buffer(batch.data(), count * publishPacket.size()));
+        sent += count;
+    }
+    asio::write(socket, asio::buffer(DISCONNECT_PACKET));
+    wait_for_close(socket);
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / publishes;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    const size_t connections = argc > 1 ? std::stoul(argv[1]) : 1000;
+    const size_t publishes = argc > 2 ? std::stoul(argv[2]) : 100000;
+
+    double results[5][2];
+    for (int useCoroutines = 0; useCoroutines < 2; ++useCoroutines) {
+        bench_server server(useCoroutines);
+        auto connect = [&server](asio::io_context& context) { return connect_tcp(context, server.port()); };
+        results[useCoroutines][0] = connect_storm(connect, connections);
+        results[useCoroutines][1] = publish_stream(connect, publishes);
+    }
+    {
+        bench_server server(false);
+        auto connect = [&server](asio::io_context& context) { return server.connect_in_memory(context); };
+        results[2][0] = connect_storm(connect, connections);
+        results[2][1] = publish_stream(connect, publishes);
+    }
+    {
+        bench_server server(false);
+        auto connect = [&server](asio::io_context& context) { return connect_unix(context, server.unix_path()); };
+        results[3][0] = connect_storm(connect, connections);
+        results[3][1] = publish_stream(connect, publishes);
+    }
+    {
+        bench_server server(false);
+        auto connect = [&server](asio::io_context& context) { return connect_shm(context, server.shm_path()); };
+        results[4][0] = connect_storm(connect, connections);
+        results[4][1] = publish_stream(connect, publishes);
+    }
+
+    std::cout << "{\n"
+        << "  \"connections\": " << connections << ",\n"
+        << "  \"publishes\": " << publishes << ",\n"
+        << "  \"callback\": { \"connect_ns_per_op\": " << results[0][0]
+        << ", \"publish_ns_per_op\": " << results[0][1] << " },\n"
+        << "  \"coroutine\": { \"connect_ns_per_op\": " << results[1][0]
+        << ", \"publish_ns_per_op\": " << results[1][1] << " },\n"
+        << "  \"callback_memory\": { \"connect_ns_per_op\": " << results[2][0]
+        << ", \"publish_ns_per_op\": " << results[2][1] << " },\n"
+        << "  \"callback_unix\": { \"connect_ns_per_op\": " << results[3][0]
+        << ", \"publish_ns_per_op\": " << results[3][1] << " },\n"
+        << "  \"callback_shm\": { \"connect_ns_per_op\": " << results[4][0]
+        << ", \"publish_ns_per_op\": " << results[4][1] << " }\n"
+        << "}\n";
+    return 0;
+}
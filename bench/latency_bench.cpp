@@ -0,0 +1,167 @@
+// Round trip latency of one message through the broker, over loopback.
+// An in-process lmqtt_server runs with each io thread setting (see io_thread_config);
+// one client subscribes to a topic and publishes QoS 0 messages to it, one at a
+// time, timing each from the PUBLISH written to the PUBLISH read back:
+//   1 - default: the io thread sleeps in the reactor, the client blocks in recv
+//   2 - busy_poll: the io thread polls for a while before it sleeps
+//   3 - pinned (when cpus are given): as 2, the io thread and the client are pinned
+//       to their own cores and the client spins on a non blocking socket
+// Busy polling only pays off with a core to spare for each spinning thread.
+//
+// usage: latency_bench [samples] [io cpu] [client cpu]
+#include <iostream>
+#include "lmqtt.h"
+
+namespace {
+
+using asio::ip::tcp;
+
+const std::vector<uint8_t> CONNECT_PACKET{
+    0x10, 18,                       // CONNECT, remaining length
+    0x00, 0x04, 'M', 'Q', 'T', 'T',
+    0x05,                           // protocol version
+    0x02,                           // clean start
+    0x00, 0x3c,                     // keep alive
+    0x00,                           // no properties
+    0x00, 0x05, 'b', 'e', 'n', 'c', 'h'
+};
+
+const std::vector<uint8_t> SUBSCRIBE_PACKET{
+    0x82, 11,                       // SUBSCRIBE, remaining length
+    0x00, 0x01,                     // packet identifier
+    0x00,                           // no properties
+    0x00, 0x05, 'l', 'a', 't', '/', 't',
+    0x00                            // QoS 0
+};
+
+const std::vector<uint8_t> PUBLISH_PACKET{
+    0x30, 16,                       // PUBLISH QoS 0, remaining length
+    0x00, 0x05, 'l', 'a', 't', '/', 't',
+    0x00,                           // no properties
+    'l', 'a', 't', 'e', 'n', 'c', 'y', '!'
+};
+
+struct variant {
+    const char* _name;
+    lmqtt::io_thread_config _io;
+    int _clientCpu = -1;
+    bool _clientSpins = false;
+};
+
+// a port nobody listens on, for the server to bind
+uint16_t get_free_port() {
+    asio::io_context context;
+    tcp::acceptor acceptor(context, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    return acceptor.local_endpoint().port();
+}
+
+// exactly size bytes, spinning on a non blocking socket or blocking in recv
+void read_exactly(tcp::socket& socket, uint8_t* data, size_t size, bool spin) {
+    size_t done = 0;
+    while (done < size) {
+        std::error_code ec;
+        done += socket.read_some(asio::buffer(data + done, size - done), ec);
+        if (ec && !(spin && ec == asio::error::would_block)) {
+            throw std::system_error(ec);
+        }
+    }
+}
+
+// every packet here fits a one byte remaining length
+void read_packet(tcp::socket& socket, bool spin) {
+    uint8_t packet[2 + 127];
+    read_exactly(socket, packet, 2, spin);
+    read_exactly(socket, packet + 2, packet[1], spin);
+}
+
+std::vector<double> run(const variant& v, size_t samples) {
+    lmqtt::server_config config;
+    config._port = get_free_port();
+    config._io = v._io;
+    lmqtt::lmqtt_server server(config);
+    if (!server.start()) {
+        throw std::runtime_error("could not start the server");
+    }
+
+    // restored once done, the next variant runs where this one started
+    cpu_set_t affinity;
+    ::pthread_getaffinity_np(::pthread_self(), sizeof(affinity), &affinity);
+    if (v._clientCpu >= 0 && lmqtt::io_thread::pin_current_thread(v._clientCpu) != lmqtt::return_code::OK) {
+        std::cerr << "could not pin the client to cpu " << v._clientCpu << "\n";
+    }
+
+    asio::io_context context;
+    tcp::socket socket(context);
+    socket.connect(tcp::endpoint(asio::ip::address_v4::loopback(), config._port));
+    socket.set_option(tcp::no_delay(true));
+    asio::write(socket, asio::buffer(CONNECT_PACKET));
+    read_packet(socket, false);
+    asio::write(socket, asio::buffer(SUBSCRIBE_PACKET));
+    read_packet(socket, false);
+    socket.non_blocking(v._clientSpins);
+
+    // the first round trips warm the caches and the allocator up
+    const size_t warmup = std::min<size_t>(samples / 10, 1000);
+    std::vector<double> latencies;
+    latencies.reserve(samples);
+    for (size_t i = 0; i < warmup + samples; ++i) {
+        const auto start = std::chrono::steady_clock::now();
+        asio::write(socket, asio::buffer(PUBLISH_PACKET));
+        read_packet(socket, v._clientSpins);
+        const auto end = std::chrono::steady_clock::now();
+        if (i >= warmup) {
+            latencies.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+        }
+    }
+    socket.close();
+    server.stop();
+
+    ::pthread_setaffinity_np(::pthread_self(), sizeof(affinity), &affinity);
+
+    std::sort(latencies.begin(), latencies.end());
+    return latencies;
+}
+
+double percentile(const std::vector<double>& sorted, double p) {
+    const size_t index = std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()));
+    return sorted[index];
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    const size_t samples = argc > 1 ? std::stoul(argv[1]) : 20000;
+    const int ioCpu = argc > 2 ? std::stoi(argv[2]) : -1;
+    const int clientCpu = argc > 3 ? std::stoi(argv[3]) : -1;
+
+    std::vector<variant> variants;
+    variants.push_back({ "default", {} });
+
+    lmqtt::io_thread_config busyPoll;
+    busyPoll._busyPoll = std::chrono::microseconds(50);
+    variants.push_back({ "busy_poll", busyPoll });
+
+    // two threads spinning on one core only take turns
+    if (ioCpu >= 0 && ioCpu == clientCpu) {
+        std::cerr << "the io thread and the client need cores of their own\n";
+        return 1;
+    }
+    if (ioCpu >= 0 && clientCpu >= 0) {
+        lmqtt::io_thread_config pinned = busyPoll;
+        pinned._cpu = ioCpu;
+        variants.push_back({ "pinned", pinned, clientCpu, true });
+    }
+
+    std::cout << "{\n"
+        << "  \"samples\": " << samples << ",\n";
+    for (size_t i = 0; i < variants.size(); ++i) {
+        const auto latencies = run(variants[i], std::max<size_t>(samples, 1));
+        std::cout << "  \"" << variants[i]._name << "\": { \"p50_us\": " << percentile(latencies, 0.5)
+            << ", \"p90_us\": " << percentile(latencies, 0.9)
+            << ", \"p99_us\": " << percentile(latencies, 0.99)
+            << ", \"max_us\": " << latencies.back() << " }"
+            << (i + 1 < variants.size() ? ",\n" : "\n");
+    }
+    std::cout << "}\n";
+    return 0;
+}
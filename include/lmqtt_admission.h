@@ -0,0 +1,164 @@
+#pragma once
+
+#include <ctime>
+
+#include "lmqtt_common.h"
+#include "lmqtt_server_config.h"
+
+namespace lmqtt {
+
+namespace admission {
+
+// what the broker does under load, each level also does what the ones before it do
+enum class level : uint8_t {
+    NORMAL,             // everything is admitted
+    PAUSE_PUBLISHERS,   // the heaviest publishers are not read from
+    REJECT_CONNECTS,    // CONNECT is answered with SERVER_BUSY
+    SHED_QOS0           // QoS 0 PUBLISH packets are read and thrown away
+};
+
+constexpr std::string_view get_level_string(level l) noexcept {
+    switch (l) {
+    case level::NORMAL:             return "normal";
+    case level::PAUSE_PUBLISHERS:   return "pause_publishers";
+    case level::REJECT_CONNECTS:    return "reject_connects";
+    case level::SHED_QOS0:          return "shed_qos0";
+    default:                        return "unknown";
+    }
+    return ""; // keep the compiler happy
+}
+
+// set by the server's controller, read by every connection
+inline std::atomic<level>& current_level() noexcept {
+    static std::atomic<level> instance{ level::NORMAL };
+    return instance;
+}
+
+[[nodiscard]] inline level get_level() noexcept {
+    return current_level().load(std::memory_order_relaxed);
+}
+
+inline void set_level(level l) noexcept {
+    current_level().store(l, std::memory_order_relaxed);
+}
+
+[[nodiscard]] inline bool is_rejecting_connects() noexcept {
+    return get_level() >= level::REJECT_CONNECTS;
+}
+
+[[nodiscard]] inline bool is_shedding() noexcept {
+    return get_level() >= level::SHED_QOS0;
+}
+
+// CPU time of the calling thread, 0 where the platform can not tell
+[[nodiscard]] inline std::chrono::nanoseconds get_thread_cpu_time() noexcept {
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+    timespec ts{};
+    if (::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+        return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+    }
+#endif
+    return std::chrono::nanoseconds(0);
+}
+
+/*
+ * Decides the level from what one io thread goes through, CoDel style. The server
+ * probes the thread with a timer: how late it runs is how long any ready handler
+ * (a read that completed, a write to continue) waits for the thread, its sojourn
+ * time. A burst makes some handlers wait, only a standing backlog makes all of
+ * them wait, so what counts is the minimum over an interval: above the target,
+ * the thread is overloaded. So is a thread that was busy for most of the interval,
+ * before its backlog shows.
+ *
+ * The first overloaded interval raises the level at once. After that, the level
+ * moves by one when HOLD_INTERVALS intervals in a row say so, which gives what
+ * it does time to work: the broker degrades step by step and recovers the same way.
+ */
+class controller {
+public:
+    static constexpr uint32_t HOLD_INTERVALS = 3;
+
+    explicit controller(const overload_config& config) noexcept :
+        _config(config) {}
+
+    // sampling often enough to see a few probes per interval
+    [[nodiscard]] std::chrono::nanoseconds get_probe_period() const noexcept {
+        return std::max<std::chrono::nanoseconds>(_config._interval / 20, std::chrono::milliseconds(1));
+    }
+
+    // from the probed thread
+    void start(std::chrono::steady_clock::time_point now) noexcept {
+        _intervalStart = now;
+        _cpuStart = get_thread_cpu_time();
+        _minSojourn = std::chrono::nanoseconds::max();
+    }
+
+    // from the probed thread: how late the probe ran. Returns true when an interval
+    // is over and the level was reconsidered
+    [[nodiscard]] bool on_probe(std::chrono::steady_clock::time_point now, std::chrono::nanoseconds sojourn) noexcept {
+        _minSojourn = std::min(_minSojourn, sojourn);
+        const auto elapsed = now - _intervalStart;
+        if (elapsed < _config._interval) {
+            return false;
+        }
+
+        const std::chrono::nanoseconds cpu = get_thread_cpu_time();
+        _lastCpuPercent = static_cast<uint32_t>(100 * (cpu - _cpuStart).count()
+            / std::max<int64_t>(1, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+        _lastMinSojourn = _minSojourn;
+        const bool overloaded = (_lastMinSojourn > _config._targetSojourn)
+            || (_config._cpuPercent && _lastCpuPercent >= _config._cpuPercent);
+        _streak = (overloaded == _overloaded) ? _streak + 1 : 1;
+        _overloaded = overloaded;
+
+        if (_streak >= ((_level == level::NORMAL) ? 1 : HOLD_INTERVALS)) {
+            if (_overloaded && _level != level::SHED_QOS0) {
+                _level = static_cast<level>(static_cast<uint8_t>(_level) + 1);
+                _streak = 0;
+            } else if (!_overloaded && _level != level::NORMAL) {
+                _level = static_cast<level>(static_cast<uint8_t>(_level) - 1);
+                _streak = 0;
+            }
+        }
+
+        _intervalStart = now;
+        _cpuStart = cpu;
+        _minSojourn = std::chrono::nanoseconds::max();
+        return true;
+    }
+
+    [[nodiscard]] level get_level() const noexcept {
+        return _level;
+    }
+
+    // about the last interval
+    [[nodiscard]] bool is_overloaded() const noexcept {
+        return _overloaded;
+    }
+
+    [[nodiscard]] std::chrono::nanoseconds get_min_sojourn() const noexcept {
+        return _lastMinSojourn;
+    }
+
+    [[nodiscard]] uint32_t get_cpu_percent() const noexcept {
+        return _lastCpuPercent;
+    }
+
+private:
+    overload_config _config;
+    level _level = level::NORMAL;
+    bool _overloaded = false;
+    // intervals in a row _overloaded was what it is
+    uint32_t _streak = 0;
+
+    std::chrono::steady_clock::time_point _intervalStart;
+    std::chrono::nanoseconds _cpuStart{ 0 };
+    std::chrono::nanoseconds _minSojourn = std::chrono::nanoseconds::max();
+
+    std::chrono::nanoseconds _lastMinSojourn{ 0 };
+    uint32_t _lastCpuPercent = 0;
+};
+
+} // namespace admission
+
+} // namespace lmqtt
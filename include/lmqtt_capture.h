@@ -0,0 +1,339 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "lmqtt_common.h"
+#include "lmqtt_types.h"
+
+namespace lmqtt {
+
+namespace capture {
+
+/*
+ * Capture files: what clients sent to the broker, byte for byte, with the time it
+ * arrived, so the same traffic can be replayed later (see tools/lmqtt_replay.cpp).
+ *
+ *   header : "LMQTTCAP", version (u32), capture start (u64, ns since the unix
+ *            epoch), little endian
+ *   record : kind (1 byte), stream id (varint), ns since the previous record
+ *            (varint), then for DATA only the length (varint) and the bytes
+ *
+ * varints are LEB128 (7 bits per byte, low bits first), not the MQTT ones that
+ * stop at 4 bytes.
+ */
+inline constexpr char FILE_MAGIC[8] = { 'L', 'M', 'Q', 'T', 'T', 'C', 'A', 'P' };
+inline constexpr uint32_t FILE_VERSION = 1;
+inline constexpr size_t FILE_HEADER_SIZE = sizeof(FILE_MAGIC) + sizeof(uint32_t) + sizeof(uint64_t);
+
+enum class record_kind : uint8_t {
+    OPEN    = 1,    // a client connected
+    DATA    = 2,    // bytes read from it
+    CLOSE   = 3,    // it is gone
+    LOST    = 4     // records of the stream were dropped, what was captured is cut there
+};
+
+inline void append_varint(std::vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+[[nodiscard]] inline return_code read_varint(std::FILE* file, uint64_t& value) noexcept {
+    value = 0;
+    for (uint32_t shift = 0; shift < 64; shift += 7) {
+        const int byte = std::fgetc(file);
+        if (byte == EOF) {
+            return return_code::FAIL;
+        }
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return return_code::OK;
+        }
+    }
+    return return_code::FAIL;
+}
+
+/*
+ * Writes the capture file. Connections append their records to a buffer under a
+ * mutex (a memcpy), a writer thread woken by the first of them swaps the buffer
+ * out and writes it, so the io threads never wait for the disk.
+ *
+ * If the disk cannot keep up and MAX_PENDING_BYTES are waiting (the batch being
+ * written included), records are dropped: the connection that lost one is marked LOST and not captured anymore,
+ * so a replay never sends a stream with a hole in it.
+ */
+class recorder {
+public:
+    static constexpr size_t MAX_PENDING_BYTES = 64 << 20;
+
+    static recorder& instance() {
+        static recorder instance;
+        return instance;
+    }
+
+    [[nodiscard]] return_code start(const std::string& path) {
+        std::scoped_lock lock(_mutex);
+        if (_file) {
+            return return_code::FAIL;
+        }
+        _file = std::fopen(path.c_str(), "wb");
+        if (!_file) {
+            return return_code::FAIL;
+        }
+
+        uint8_t header[FILE_HEADER_SIZE];
+        const uint64_t startTime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        std::memcpy(header, FILE_MAGIC, sizeof(FILE_MAGIC));
+        store_le(header + sizeof(FILE_MAGIC), FILE_VERSION, sizeof(uint32_t));
+        store_le(header + sizeof(FILE_MAGIC) + sizeof(uint32_t), startTime, sizeof(uint64_t));
+        std::fwrite(header, 1, sizeof(header), _file);
+
+        _lastRecord = std::chrono::steady_clock::now();
+        _exit = false;
+        _writingBytes = 0;
+        _active.store(true, std::memory_order_release);
+        _writerThread = std::thread([this]() { writer_job(); });
+        return return_code::OK;
+    }
+
+    // writes what is pending and closes the file
+    void stop() {
+        if (!_active.exchange(false, std::memory_order_acq_rel)) {
+            return;
+        }
+        {
+            std::scoped_lock lock(_mutex);
+            _exit = true;
+        }
+        _pendingChanged.notify_one();
+        if (_writerThread.joinable()) {
+            _writerThread.join();
+        }
+        std::scoped_lock lock(_mutex);
+        write_pending();
+        std::fclose(_file);
+        _file = nullptr;
+    }
+
+    [[nodiscard]] bool is_active() const noexcept {
+        return _active.load(std::memory_order_relaxed);
+    }
+
+    // a new connection, 0 if we are not capturing
+    [[nodiscard]] uint32_t open_stream() {
+        if (!is_active()) {
+            return 0;
+        }
+        std::scoped_lock lock(_mutex);
+        const uint32_t stream = ++_streamCounter;
+        return append_record(record_kind::OPEN, stream, nullptr, 0) ? stream : 0;
+    }
+
+    // FAIL if the record was dropped, the stream is then closed as LOST
+    [[nodiscard]] return_code write_data(uint32_t stream, const uint8_t* data, size_t size) {
+        if (!is_active()) {
+            return return_code::FAIL;
+        }
+        std::scoped_lock lock(_mutex);
+        if (append_record(record_kind::DATA, stream, data, size)) {
+            return return_code::OK;
+        }
+        // LOST is tiny, it always finds room past the limit
+        (void)append_record(record_kind::LOST, stream, nullptr, 0, true);
+        return return_code::FAIL;
+    }
+
+    void close_stream(uint32_t stream) {
+        if (!is_active()) {
+            return;
+        }
+        std::scoped_lock lock(_mutex);
+        (void)append_record(record_kind::CLOSE, stream, nullptr, 0, true);
+    }
+
+    // inbound bytes written to the file, and dropped because the disk was too slow
+    [[nodiscard]] uint64_t captured_bytes() const noexcept {
+        return _capturedBytes.load(std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] uint64_t dropped_bytes() const noexcept {
+        return _droppedBytes.load(std::memory_order_relaxed);
+    }
+
+    ~recorder() {
+        stop();
+    }
+
+private:
+    recorder() = default;
+    recorder(const recorder&) = delete;
+    recorder& operator=(const recorder&) = delete;
+
+    static void store_le(uint8_t* out, uint64_t value, size_t size) noexcept {
+        for (size_t i = 0; i < size; ++i) {
+            out[i] = static_cast<uint8_t>(value >> (8 * i));
+        }
+    }
+
+    // called with _mutex held
+    [[nodiscard]] bool append_record(record_kind kind, uint32_t stream, const uint8_t* data, size_t size, bool force = false) {
+        if (!force && _pending.size() + _writingBytes + size > MAX_PENDING_BYTES) {
+            _droppedBytes.fetch_add(size, std::memory_order_relaxed);
+            return false;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - _lastRecord).count();
+        _lastRecord = now;
+
+        // the writer only waits for an empty buffer
+        if (_pending.empty()) {
+            _pendingChanged.notify_one();
+        }
+        _pending.push_back(static_cast<uint8_t>(kind));
+        append_varint(_pending, stream);
+        append_varint(_pending, static_cast<uint64_t>(std::max<int64_t>(elapsed, 0)));
+        if (kind == record_kind::DATA) {
+            append_varint(_pending, size);
+            _pending.insert(_pending.end(), data, data + size);
+            _capturedBytes.fetch_add(size, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // called with _mutex held
+    void write_pending() {
+        if (!_pending.empty()) {
+            std::fwrite(_pending.data(), 1, _pending.size(), _file);
+            _pending.clear();
+        }
+        std::fflush(_file);
+    }
+
+    // what is left when we exit is written by stop()
+    void writer_job() {
+        std::vector<uint8_t> toWrite;
+        std::unique_lock lock(_mutex);
+        while (true) {
+            _pendingChanged.wait(lock, [this]() { return _exit || !_pending.empty(); });
+            if (_exit) {
+                return;
+            }
+            toWrite.swap(_pending);
+            _writingBytes = toWrite.size();
+            lock.unlock();
+            std::fwrite(toWrite.data(), 1, toWrite.size(), _file);
+            toWrite.clear();
+            lock.lock();
+            _writingBytes = 0;
+        }
+    }
+
+    std::mutex _mutex;
+    std::condition_variable _pendingChanged;
+    std::FILE* _file = nullptr;
+    std::vector<uint8_t> _pending;
+    size_t _writingBytes = 0;       // swapped out of _pending, not written yet
+    std::chrono::steady_clock::time_point _lastRecord;
+    uint32_t _streamCounter = 0;
+
+    std::atomic<bool> _active{ false };
+    std::atomic<uint64_t> _capturedBytes{ 0 };
+    std::atomic<uint64_t> _droppedBytes{ 0 };
+    bool _exit = false;
+    std::thread _writerThread;
+};
+
+// one record of a capture file, as read back
+struct record {
+    record_kind _kind = record_kind::OPEN;
+    uint32_t _stream = 0;
+    uint64_t _time = 0;             // ns since the capture started
+    std::vector<uint8_t> _data;     // DATA only
+};
+
+class reader {
+public:
+    reader() = default;
+    reader(const reader&) = delete;
+    reader& operator=(const reader&) = delete;
+
+    ~reader() {
+        if (_file) {
+            std::fclose(_file);
+        }
+    }
+
+    [[nodiscard]] return_code open(const std::string& path) {
+        _file = std::fopen(path.c_str(), "rb");
+        if (!_file) {
+            return return_code::FAIL;
+        }
+        uint8_t header[FILE_HEADER_SIZE];
+        if (std::fread(header, 1, sizeof(header), _file) != sizeof(header)
+            || std::memcmp(header, FILE_MAGIC, sizeof(FILE_MAGIC))
+            || load_le(header + sizeof(FILE_MAGIC), sizeof(uint32_t)) != FILE_VERSION) {
+            return return_code::FAIL;
+        }
+        _startTime = load_le(header + sizeof(FILE_MAGIC) + sizeof(uint32_t), sizeof(uint64_t));
+        return return_code::OK;
+    }
+
+    // ns since the unix epoch
+    [[nodiscard]] uint64_t get_start_time() const noexcept {
+        return _startTime;
+    }
+
+    // FAIL at the end of the file, or on a record cut short (the broker did not
+    // stop cleanly), which is as good as the end
+    [[nodiscard]] return_code next(record& rec) {
+        const int kind = std::fgetc(_file);
+        if (kind == EOF || kind < static_cast<int>(record_kind::OPEN) || kind > static_cast<int>(record_kind::LOST)) {
+            return return_code::FAIL;
+        }
+        uint64_t stream = 0;
+        uint64_t elapsed = 0;
+        if (read_varint(_file, stream) != return_code::OK || read_varint(_file, elapsed) != return_code::OK) {
+            return return_code::FAIL;
+        }
+        rec._kind = static_cast<record_kind>(kind);
+        rec._stream = static_cast<uint32_t>(stream);
+        _time += elapsed;
+        rec._time = _time;
+        rec._data.clear();
+        if (rec._kind == record_kind::DATA) {
+            uint64_t size = 0;
+            if (read_varint(_file, size) != return_code::OK || size > STREAMED_PACKET_SIZE_LIMIT) {
+                return return_code::FAIL;
+            }
+            rec._data.resize(size);
+            if (std::fread(rec._data.data(), 1, size, _file) != size) {
+                return return_code::FAIL;
+            }
+        }
+        return return_code::OK;
+    }
+
+private:
+    static uint64_t load_le(const uint8_t* in, size_t size) noexcept {
+        uint64_t value = 0;
+        for (size_t i = 0; i < size; ++i) {
+            value |= static_cast<uint64_t>(in[i]) << (8 * i);
+        }
+        return value;
+    }
+
+    std::FILE* _file = nullptr;
+    uint64_t _startTime = 0;
+    uint64_t _time = 0;
+};
+
+} // namespace capture
+
+} // namespace lmqtt
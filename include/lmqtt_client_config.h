@@ -1,19 +1,23 @@
 #pragma once
 
 #include "lmqtt_common.h"
+#include "lmqtt_log.h"
 #include "lmqtt_types.h"
 #include "lmqtt_properties.h"
 #include "lmqtt_will_config.h"
+#include "lmqtt_response_cache.h"
 
 namespace lmqtt {
 
 class client_config : public std::enable_shared_from_this<client_config> {
 	friend class lmqtt_packet;
-	friend class connection;
+	template <typename Stream> friend class basic_connection;
+	friend class coro_connection;
+	friend class codec_bench;
 public:
 	client_config() = default;
 	~client_config() {
-		std::cout << "destroyed client config " << this << std::endl;
+		LMQTT_LOG_TRACE("destroyed client config {}", this);
 	}
 
 public:
@@ -21,6 +25,16 @@ public:
 		_clientId = clientId;
 	}
 
+	// the biggest packet the client accepts from us, the broker never sends more
+	[[nodiscard]] uint32_t get_maximum_packet_size() const noexcept {
+		return _maximumPacketSize;
+	}
+
+	// the biggest packet we accept from the client, advertised in the CONNACK
+	void set_broker_maximum_packet_size(uint32_t size) noexcept {
+		_brokerMaximumPacketSize = size;
+	}
+
 	[[nodiscard]] reason_code configure_propriety(std::unique_ptr<property::property_data_proxy>&& property) {
 
 		switch (property->get_property_type()) {
@@ -329,28 +343,47 @@ public:
 			case property_type::USER_PROPERTY:
 			{
 				//TODO: To be removed in the future (unless we need to really sed user properties)
+				if (_userProprieties.empty()) {
+					return 0;
+				}
 				uint32_t totalSize = 1;
 				for (auto& p : _userProprieties) {
 					totalSize += (p.first.size() + 2);
 					totalSize += (p.second.size() + 2);
 				}
-				if (!totalSize) {
-					return 0;
-				} else {
-					return totalSize;
-				}
+				return totalSize;
 			}
 			case property_type::RESPONSE_INFORMATION: return 0; // TODO: Not yet supported
 			case property_type::SERVER_REFERENCE: return 0; // TODO: Not yet supported
 			case property_type::AUTHENTICATION_METHOD: return 0; // TODO: Not yet supported
 			case property_type::AUTHENTICATION_DATA: return 0; // TODO: Not yet supported
 			default:
-				std::cerr << "[WARNING] -- Precomputing size for unknown property " << std::hex << static_cast<int>(ptype) << "\n";
+				LMQTT_LOG_WARNING("Precomputing size for unknown property {}", static_cast<uint8_t>(ptype));
 				return 0;
 			}
 		}
 	}
 
+	// A CONNACK can be served from the template cache when it does not carry
+	// anything specific to this client (assigned client id or user properties)
+	[[nodiscard]] bool is_connack_cacheable() const noexcept {
+		return !_clientId.empty() && _userProprieties.empty();
+	}
+
+	[[nodiscard]] response::connack_profile get_connack_profile() const noexcept {
+		response::connack_profile profile;
+		profile._sessionExpiryInterval = _sessionExpiryInterval;
+		profile._receiveMaximum = _receiveMaximum;
+		profile._maximumQos = _maximumQos;
+		profile._retainAvailable = _retainAvailable;
+		profile._maximumPacketSize = _brokerMaximumPacketSize;
+		profile._topicAliasMaximum = _topicAliasMaximum;
+		profile._wildcardSubscription = _wildcardSubscription;
+		profile._keepAlive = _keepAlive;
+		profile._reasonString = _reasonString;
+		return profile;
+	}
+
 	[[nodiscard]] return_code fill_property(uint8_t* buff, uint32_t buffSize, property::property_type ptype, uint32_t& propertySize) {
 
 		using namespace property;
@@ -419,7 +452,7 @@ public:
 			}
 
 			buff[0] = static_cast<uint8_t>(ptype);
-			if (write_property_to_buffer<uint32_t>(buff + 1, buffSize - 1, _maximumPacketSize) != return_code::OK) {
+			if (write_property_to_buffer<uint32_t>(buff + 1, buffSize - 1, _brokerMaximumPacketSize) != return_code::OK) {
 				return return_code::FAIL;
 			}
 			break;
@@ -573,6 +606,8 @@ private:
 	uint8_t _maximumQos = 1;
 	uint8_t _retainAvailable = 1;
 	uint32_t _maximumPacketSize = 0xFFFFFFFF;
+	// ours, which is what goes in the CONNACK (listener_limits::_maximumPacketSize)
+	uint32_t _brokerMaximumPacketSize = 0xFFFFFFFF;
 	uint16_t _topicAliasMaximum = 0;
 	uint8_t _requestResponseInformation = 0; // only applicable to CONNACK
 	uint8_t _requestProblemInformation = 0; // applicable to other packets if allowed
@@ -9,6 +9,7 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <array>
+#include <cassert>
 
 using namespace std::chrono_literals;
 
@@ -27,4 +28,10 @@ using namespace std::chrono_literals;
 // packet size limit 1 mo
 //#define PACKET_SIZE_LIMIT 1 << 20
 #define PACKET_SIZE_LIMIT 1 << 10 // 1 KO
+
+// PUBLISH packets bigger than PACKET_SIZE_LIMIT are not buffered: their payload is
+// streamed in chunks (see lmqtt_stream_decoder.h), so we can go up to the biggest
+// remaining length MQTT can encode (256 MO)
+#define STREAMED_PACKET_SIZE_LIMIT 0xFFFFFFF
+#define STREAM_CHUNK_SIZE 1 << 12 // 4 KO
 #define GENERATING_DOCUMENTATION
@@ -1,38 +1,392 @@
 #pragma once
 
+#include <queue>
+
 #include "lmqtt_common.h"
+#include "lmqtt_log.h"
 #include "lmqtt_packet.h"
 #include "lmqtt_reason_codes.h"
-#include "lmqtt_timer.h"
 #include "lmqtt_client_config.h"
+#include "lmqtt_stream_decoder.h"
+#include "lmqtt_outbound.h"
+#include "lmqtt_subscriptions.h"
+#include "lmqtt_relay.h"
+#include "lmqtt_histogram.h"
+#include "lmqtt_metrics.h"
+#include "lmqtt_capture.h"
+#include "lmqtt_memory_budget.h"
+#include "lmqtt_server_config.h"
+#include "lmqtt_admission.h"
+#include "lmqtt_slab.h"
+#include "lmqtt_reclaim.h"
+#include "lmqtt_rate_limit.h"
 
 namespace lmqtt {
 
-class connection : public std::enable_shared_from_this<connection> {
-	 // enable_shared_from_this will allow us to create a shared pointer "this" internally
-	 // in other word, a shared this pointer other than a raw pointer
+// for the logs, whatever state the socket is in
+[[nodiscard]] inline std::string get_remote_address(const asio::ip::tcp::socket& socket) {
+	std::error_code ec;
+	const auto endpoint = socket.remote_endpoint(ec);
+	return ec ? std::string("unknown") : endpoint.address().to_string();
+}
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+// who is on the other end of a unix socket, as the kernel saw it at connect time
+struct peer_credentials {
+	uint32_t _pid = 0;
+	uint32_t _uid = 0;
+	uint32_t _gid = 0;
+};
+
+// SO_PEERCRED, FAIL where the platform does not have it
+[[nodiscard]] inline return_code get_peer_credentials(
+	asio::local::stream_protocol::socket& socket,
+	peer_credentials& credentials
+) noexcept {
+#if defined(SO_PEERCRED)
+	ucred cred{};
+	socklen_t length = sizeof(cred);
+	if (::getsockopt(socket.native_handle(), SOL_SOCKET, SO_PEERCRED, &cred, &length) != 0) {
+		return return_code::FAIL;
+	}
+	credentials._pid = static_cast<uint32_t>(cred.pid);
+	credentials._uid = static_cast<uint32_t>(cred.uid);
+	credentials._gid = static_cast<uint32_t>(cred.gid);
+	return return_code::OK;
+#else
+	return return_code::FAIL;
+#endif
+}
+
+// unix sockets have no address worth logging, the peer's credentials are
+[[nodiscard]] inline std::string get_remote_address(const asio::local::stream_protocol::socket& socket) {
+	peer_credentials credentials;
+	// getsockopt does not change the socket
+	if (get_peer_credentials(const_cast<asio::local::stream_protocol::socket&>(socket), credentials) != return_code::OK) {
+		return "unix";
+	}
+	return "unix:uid=" + std::to_string(credentials._uid) + ",pid=" + std::to_string(credentials._pid);
+}
+#endif
+
+// who stopped reading from a client, it is read from again once nobody does
+enum class read_pause : uint8_t {
+	MEMORY      = 1 << 0,   // the memory governor
+	OVERLOAD    = 1 << 1,   // the admission controller
+	RATE        = 1 << 2    // the client's rate limits (see read_scheduler)
+};
+
+// a connection in its server's connection_table. Once the connection is gone, its
+// slot is reused with another generation: an old handle finds nothing, it never
+// finds the next client
+struct connection_handle {
+	uint32_t _index = std::numeric_limits<uint32_t>::max();
+	uint32_t _generation = 0;
+
+	bool operator==(const connection_handle& other) const noexcept {
+		return _index == other._index && _generation == other._generation;
+	}
+};
+
+class connection_table;
+
+// what the server needs from a connection, whatever transport it runs on. Its
+// connection_table owns it, everything else refers to it by pointer or handle
+class connection_base {
+public:
+	virtual ~connection_base() = default;
+
+	virtual void connect_to_client(size_t timeout) noexcept = 0;
+	virtual void disconnect() = 0;
+	virtual void shutdown() = 0;
+	virtual bool is_connected() const noexcept = 0;
+	virtual std::string get_remote_endpoint() const = 0;
+
+	// for the per client metrics, from the io thread
+	virtual std::string_view get_client_id() const noexcept = 0;
+	virtual size_t get_queued_bytes() const noexcept = 0;
+	virtual size_t get_queued_messages() const noexcept = 0;
+
+	// for the memory governor, from the io thread: what we make the broker hold, and
+	// stopping reading from the client (at the next packet) until resumed
+	virtual int64_t get_held_bytes() const noexcept = 0;
+	virtual void pause_reading(read_pause reason) noexcept = 0;
+	virtual void resume_reading(read_pause reason) = 0;
+
+	// for the admission controller, from the io thread: bytes of the packets
+	// received since the last call
+	virtual uint64_t take_received_bytes() noexcept = 0;
+
+	[[nodiscard]] connection_handle get_handle() const noexcept {
+		return _handle;
+	}
+
+protected:
+	friend class connection_table;
+
+	connection_handle _handle;
+	// gives the connection back to the slab it came from
+	reclaim::participant::destroyer _destroy = nullptr;
+};
+
+/*
+ * Every connection of a server, in slots reused from one client to the next. The
+ * connections and their sessions are allocated from the table's slab pool, and
+ * torn down on the io thread as soon as their client is gone.
+ *
+ * Handlers refer to their connection by pointer, without a reference count. A
+ * connection that is torn down is erased (handles to it go stale at once) and,
+ * when its last operation completed, retired: it is destroyed once no handler can
+ * refer to it anymore (see lmqtt_reclaim.h), by quiescent(), which the io thread
+ * calls between handlers. The governor, the admission controller and the read
+ * scheduler keep handles, checked against the slot's generation.
+ * From the io thread
+ */
+class connection_table {
 public:
+	connection_table() = default;
+	connection_table(const connection_table&) = delete;
+	connection_table& operator=(const connection_table&) = delete;
+
+	~connection_table() {
+		clear();
+	}
+
+	// constructs the connection in the slab pool and takes it in
+	template <typename Connection, typename... Args>
+	Connection* emplace(Args&&... args) {
+		slab::allocator<Connection> allocator(_pool);
+		Connection* connection = allocator.allocate(1);
+		try {
+			::new (static_cast<void*>(connection)) Connection(std::forward<Args>(args)...);
+		} catch (...) {
+			allocator.deallocate(connection, 1);
+			throw;
+		}
+		connection->_destroy = [](void* object, void* pool) {
+			Connection* c = static_cast<Connection*>(static_cast<connection_base*>(object));
+			std::destroy_at(c);
+			slab::allocator<Connection>(*static_cast<slab::pool*>(pool)).deallocate(c, 1);
+		};
+
+		uint32_t index = 0;
+		if (!_free.empty()) {
+			index = _free.back();
+			_free.pop_back();
+		} else {
+			index = static_cast<uint32_t>(_slots.size());
+			_slots.emplace_back();
+		}
+		_slots[index]._connection = connection;
+		_slots[index]._live = true;
+		connection->_handle = { index, _slots[index]._generation };
+		++_size;
+		return connection;
+	}
+
+	// nullptr once the connection is erased
+	[[nodiscard]] connection_base* get(connection_handle handle) const noexcept {
+		if (handle._index >= _slots.size()) {
+			return nullptr;
+		}
+		const slot& s = _slots[handle._index];
+		return (s._live && s._generation == handle._generation) ? s._connection : nullptr;
+	}
+
+	// the connection is being torn down: nobody finds it anymore, it still lives
+	// until retired. Does nothing for a handle erased already
+	void erase(connection_handle handle) noexcept {
+		if (!get(handle)) {
+			return;
+		}
+		slot& s = _slots[handle._index];
+		s._live = false;
+		++s._generation;
+		--_size;
+	}
 
-	connection(
+	// once erased, and no operation of the connection is pending anymore: its
+	// slot is free, and it is destroyed when no handler can refer to it
+	void retire(connection_base* connection) {
+		slot& s = _slots[connection->_handle._index];
+		s._connection = nullptr;
+		_free.push_back(connection->_handle._index);
+		_reclaimer.retire(connection, connection->_destroy, &_pool);
+	}
+
+	// between handlers, returns how many connections were destroyed
+	size_t quiescent() {
+		return _reclaimer.quiescent();
+	}
+
+	template <typename Function>
+	void for_each(Function&& function) const {
+		for (const slot& s : _slots) {
+			if (s._live) {
+				function(*s._connection);
+			}
+		}
+	}
+
+	// once the io thread is gone: the connections being torn down too, their
+	// handlers will never run
+	void clear() noexcept {
+		_reclaimer.go_idle();
+		_reclaimer.destroy_all();
+		for (slot& s : _slots) {
+			if (s._connection) {
+				connection_base* connection = std::exchange(s._connection, nullptr);
+				connection->_destroy(connection, &_pool);
+			}
+		}
+		_slots.clear();
+		_free.clear();
+		_size = 0;
+	}
+
+	[[nodiscard]] size_t size() const noexcept {
+		return _size;
+	}
+
+	// retired, not destroyed yet
+	[[nodiscard]] size_t get_retired_count() const noexcept {
+		return _reclaimer.get_retired_count();
+	}
+
+	// for the sessions of the connections
+	[[nodiscard]] slab::pool& get_pool() noexcept {
+		return _pool;
+	}
+
+private:
+	struct slot {
+		// set until retired, erased ones included
+		connection_base* _connection = nullptr;
+		uint32_t _generation = 0;
+		bool _live = false;
+	};
+
+	// first: destroyed last, after whatever was allocated from it
+	slab::pool _pool;
+	reclaim::participant _reclaimer;
+	std::vector<slot> _slots;
+	std::vector<uint32_t> _free;
+	size_t _size = 0;
+};
+
+/*
+ * Reads connections again once their rate limits let them, with one timer for all
+ * of them rather than one per client: throttled connections wait in a heap, the
+ * timer is armed for the earliest. From the io thread
+ */
+class read_scheduler {
+public:
+	read_scheduler(asio::io_context& context, const connection_table& connections) :
+		_timer(context),
+		_connections(connections) {}
+
+	void resume_at(rate::clock::time_point when, connection_handle connection) {
+		_entries.push({ when, connection });
+		if (when < _armedFor) {
+			arm(when);
+		}
+	}
+
+private:
+	struct entry {
+		rate::clock::time_point _when;
+		connection_handle _connection;
+
+		bool operator>(const entry& other) const noexcept {
+			return _when > other._when;
+		}
+	};
+
+	void arm(rate::clock::time_point when) {
+		_armedFor = when;
+		// a wait already pending completes with operation_aborted
+		_timer.expires_at(when);
+		_timer.async_wait([this](std::error_code ec) {
+			if (ec) {
+				return;
+			}
+			resume_due();
+		});
+	}
+
+	void resume_due() {
+		_armedFor = rate::clock::time_point::max();
+		const auto now = rate::clock::now();
+		while (!_entries.empty() && _entries.top()._when <= now) {
+			// gone if the client disconnected in the meantime
+			connection_base* connection = _connections.get(_entries.top()._connection);
+			_entries.pop();
+			if (connection) {
+				connection->resume_reading(read_pause::RATE);
+			}
+		}
+		if (!_entries.empty()) {
+			arm(_entries.top()._when);
+		}
+	}
+
+	std::priority_queue<entry, std::vector<entry>, std::greater<entry>> _entries;
+	asio::steady_timer _timer;
+	const connection_table& _connections;
+	rate::clock::time_point _armedFor = rate::clock::time_point::max();
+};
+
+/*
+ * A client connection over any stream with the interface of a connected
+ * asio::ip::tcp::socket: async_read_some, async_write_some, shutdown, close and
+ * is_open, plus a get_remote_address() overload for the logs. The broker runs on
+ * TCP sockets (connection), memory_stream drives the same pipeline without the
+ * kernel for benchmarks and scale tests.
+ */
+template <typename Stream>
+class basic_connection : public connection_base {
+public:
+
+	basic_connection(
 		asio::io_context& context,
-		asio::ip::tcp::socket socket,
-		ts_queue<std::shared_ptr<connection>>& activeConnections, // all active connections
-		ts_queue<std::shared_ptr<connection>>& deletionQueue // connections scheduled for deletion
+		Stream socket,
+		connection_table& connections, // holds us, and our session's memory
+		subscription_registry& subscriptions, // shared by all connections of the server
+		const listener_limits& limits = listener_limits(), // of the listener that accepted us
+		rate::listener_quota* quota = nullptr, // shared by the clients of that listener
+		read_scheduler* scheduler = nullptr // without one, publishes are not rate limited
 	) :
-		_context(context),
 		_socket(std::move(socket)),
-		_activeConnections(activeConnections),
-		_deletionQueue(deletionQueue),
-		_clientCfg(std::make_shared<client_config>()),
-		_connTimer(nullptr)
+		_context(context),
+		_connections(connections),
+		_limits(limits),
+		_account(slab::make_shared<memory::account>(connections.get_pool())),
+		_limiter(scheduler ? rate::publish_limiter(limits, quota) : rate::publish_limiter()),
+		_scheduler(scheduler),
+		_subscriptions(subscriptions),
+		_relaySink(subscriptions, _account),
+		_connectTimer(context),
+		_clientCfg(slab::make_shared<client_config>(connections.get_pool()))
 	{
 		_inPacket._clientCfg = _clientCfg;
 		_outPacket._clientCfg = _clientCfg;
+		_clientCfg->set_broker_maximum_packet_size(_limits._maximumPacketSize);
+		// the queue wakes us up whenever there is something new to write
+		_outbound = slab::make_shared<outbound_queue>(
+			connections.get_pool(),
+			[this]() { write_next(); },
+			_limits._outboundHighWatermark,
+			_limits._outboundMaxQueuedBytes,
+			_limits._outboundMaxMessages
+		);
+		// 0 unless the server is capturing its traffic
+		_captureStream = capture::recorder::instance().open_stream();
 	}
 
-	virtual ~connection() {
+	virtual ~basic_connection() {
+		memory::charge(memory::pool::INBOUND, -_inboundBytes);
 		//std::chrono::system_clock::time_point timeStart = std::chrono::system_clock::now();
-		std::cout << "[-------] Destroyed client object " << this << std::endl;
+		LMQTT_LOG_TRACE("Destroyed client object {}", this);
 		//std::chrono::system_clock::time_point timeEnd = std::chrono::system_clock::now();
 		//std::cout << "Deletion Took " << std::chrono::duration_cast<std::chrono::microseconds>(timeEnd - timeStart).count() << " us\n";
 	}
@@ -42,30 +396,40 @@ public:
 		return _id;
 	}
 
-	void connect_to_client(size_t timeout) noexcept {
+	void connect_to_client(size_t timeout) noexcept override {
 		if (_socket.is_open()) {
 			//_id = id;
-			_connTimer = std::unique_ptr<lmqtt_timer>(new lmqtt_timer(
-				timeout,
-				[this]() {
-					if (!_receivedData) {
-						shutdown();
-						schedule_for_deletion();
+			// a timer of the io thread, not a thread per client: a reconnect storm
+			// arms thousands of them at once
+			_connectTimer.expires_after(std::chrono::milliseconds(timeout));
+			++_pendingOps;
+			_connectTimer.async_wait(
+				[this](std::error_code ec) {
+					// torn down, or identified in time
+					if (finish_operation() || ec || _receivedData) {
+						return;
 					}
+					// the pending read fails, and schedules our deletion
+					std::error_code ignored;
+					_socket.close(ignored);
 				}
-			));
-				
+			);
+
 			// read availabe messages
 			read_fixed_header();
 		}
 	}
 
-	void disconnect() {
+	void disconnect() override {
 		if (is_connected()) {
 			//the context can close the socket whenever it is available
+			++_pendingOps;
 			asio::post(
 				_context,
 				[this]() {
+					if (finish_operation()) {
+						return;
+					}
 					_socket.close();
 				}
 			);
@@ -75,117 +439,191 @@ public:
 	// close connection immediately without waiting for context.
 	// the socket should never outlive its context, so closing a socket before
 	// deleting the context is mendatory
-	void shutdown() {
+	void shutdown() override {
 		if (is_connected()) {
 			std::error_code ec;
-			_socket.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+			_socket.shutdown(asio::socket_base::shutdown_both, ec);
 			if (ec) {
-				std::cout << "Could not delete client, reason: " << ec.message() << std::endl;
+				LMQTT_LOG_WARNING("[{}] Could not shutdown client, reason: {}", _id, ec.message());
 			}
 		}
 	}
 
-	bool is_connected() const noexcept {
+	bool is_connected() const noexcept override {
 		return _socket.is_open();
 	};
 
+	std::string_view get_client_id() const noexcept override {
+		return _clientCfg->_clientId;
+	}
+
+	size_t get_queued_bytes() const noexcept override {
+		return _outbound->queued_bytes();
+	}
+
+	size_t get_queued_messages() const noexcept override {
+		return _outbound->queued_messages();
+	}
+
+	int64_t get_held_bytes() const noexcept override {
+		return _account->_bytes;
+	}
+
+	void pause_reading(read_pause reason) noexcept override {
+		_pausedBy |= static_cast<uint8_t>(reason);
+	}
+
+	void resume_reading(read_pause reason) override {
+		_pausedBy &= ~static_cast<uint8_t>(reason);
+		// a read on a socket closed in the meantime fails and deletes us as usual
+		if (!_pausedBy && std::exchange(_readPending, false)) {
+			read_fixed_header();
+		}
+	}
+
+	uint64_t take_received_bytes() noexcept override {
+		return std::exchange(_receivedBytes, 0);
+	}
+
 private:
-	// async method: prime the context ready to read a packet header
+	// async method: prime the context ready to read a packet header. Every packet
+	// starts with at least two bytes, the control field and the first byte of the
+	// remaining length, so they are read at once
 	void read_fixed_header() {
+		// the memory governor, the admission controller or our rate limits stopped
+		// reading from us, resume_reading() starts here
+		if (_closing) {
+			return;
+		}
+		if (_pausedBy || throttle()) {
+			_readPending = true;
+			return;
+		}
+		++_pendingOps;
 		asio::async_read(
 			_socket,
-			asio::buffer(
-				&_inPacket._header._controlField,
-				sizeof(uint8_t)
-			),
+			asio::buffer(_fixedHeader.data(), 2),
 			[this](std::error_code ec, size_t length) {
-				if (!ec) {
+				if (finish_operation()) {
+					return;
+				}
+				if (ec) {
+					LMQTT_LOG_DEBUG("[{}] Reading header failed: {}", _id, ec.message());
+					_socket.close();
+					schedule_for_deletion();
+					return;
+				}
+
+				_receivedData = true;
+				_frameStart = latency::now();
+				_inPacket._header._controlField = _fixedHeader[0];
 
-					_receivedData = true;
+				// we identify the packet type
+				const reason_code rcode = _inPacket.create_fixed_header();
 
-					// we identify the packet type
-					const reason_code rcode = _inPacket.create_fixed_header();
+				if (rcode == reason_code::MALFORMED_PACKET
+					|| rcode == reason_code::PROTOCOL_ERROR) {
+					_socket.close();
+					schedule_for_deletion();
+					return;
+				}
 
-					if (rcode == reason_code::MALFORMED_PACKET
-						|| rcode == reason_code::PROTOCOL_ERROR) {
+				// on first connection, only accept CONNECT packets
+				if (_isFirstPacket) {
+					if (_inPacket._type != packet_type::CONNECT) {
 						_socket.close();
+						schedule_for_deletion();
+						return;
 					}
+					_isFirstPacket = false;
+				}
 
-					// on first connection, only accept CONNECT packets
-					if (_isFirstPacket) {
-						if (_inPacket._type != packet_type::CONNECT) {
-							_socket.close();
-							schedule_for_deletion();
-							return;
-						}
-						_isFirstPacket = false;
-					}
+				_fixedHeaderSize = 1;
+				_lengthMultiplier = 1;
+				on_remaining_length_byte();
+			}
+		);
+	}
 
-					// read packet length
-					uint8_t mul = 1;
-					uint32_t packetLenth = 0;
-
-					// the following section is used to decode the packet length, where we use the asio buffer to read
-					// one byte at a time. So if the MSB bit = 1, we read the next byte and so and fourth. If we read 
-					// more than 4 (mul is multiplied 4 times) it means that the packet is malformed.
-					reason_code rCode = reason_code::SUCCESS;
-					for (uint32_t offset = 0; offset < 4; ++offset) {
-						//uint8_t nextByte = read_byte();
-						uint8_t nextByte;
-						_socket.read_some(asio::buffer(&nextByte, 1));
-						_inPacket._header._packetLen += (nextByte & 0x7f) * mul;
-						if (mul > 0x200000) { // 128 * 128 * 128
-							rCode = reason_code::MALFORMED_PACKET;
-						}
-						mul *= 0x80; // prepare for next byte
-						if (!(nextByte & 0x80) || (rCode == reason_code::MALFORMED_PACKET)) break;
-					}
+	// the packet length is a variable byte integer: while the MSB of the last byte is
+	// set, we read the next one (asynchronously, a blocking read would stall every
+	// connection of the io thread). More than 4 bytes means the packet is malformed
+	void on_remaining_length_byte() {
+		const uint8_t nextByte = _fixedHeader[_fixedHeaderSize++];
+		_inPacket._header._packetLen += (nextByte & 0x7f) * _lengthMultiplier;
+		_lengthMultiplier *= 0x80;
 
-					if (rCode == reason_code::MALFORMED_PACKET) {
-						_socket.close();
+		if (nextByte & 0x80) {
+			if (_fixedHeaderSize == _fixedHeader.size()) {
+				capture_inbound(_fixedHeader.data(), _fixedHeaderSize);
+				_socket.close();
+				schedule_for_deletion();
+				return;
+			}
+			++_pendingOps;
+			asio::async_read(
+				_socket,
+				asio::buffer(&_fixedHeader[_fixedHeaderSize], 1),
+				[this](std::error_code ec, size_t /*length*/) {
+					if (finish_operation()) {
 						return;
 					}
-
-					// only allow packets with a certain size
-					if (_inPacket._header._packetLen > PACKET_SIZE_LIMIT) {
-						std::cout << "[" << _id << "] Closed connection. Reason: Packet size limit exceeded: " << _inPacket._header._packetLen << "\n";
+					if (ec) {
+						LMQTT_LOG_DEBUG("[{}] Reading packet length failed: {}", _id, ec.message());
 						_socket.close();
+						schedule_for_deletion();
 						return;
 					}
+					on_remaining_length_byte();
+				}
+			);
+			return;
+		}
 
-					// resize packet body to hold the rest of the data
-					_inPacket._body.resize(_inPacket._header._packetLen);
+		capture_inbound(_fixedHeader.data(), _fixedHeaderSize);
 
-					read_packet_body();
+		// what we advertised in the CONNACK (or would have, for the CONNECT itself)
+		if (get_frame_size(_inPacket._header._packetLen) > _limits._maximumPacketSize) {
+			LMQTT_LOG_INFO("[{}] Closed connection. Reason: Maximum packet size exceeded: {}", _id, _inPacket._header._packetLen);
+			_socket.close();
+			schedule_for_deletion();
+			return;
+		}
 
-				} else {
-					std::cout << "[" << _id << "] Reading Header Failed: " << ec.message() << "\n";
-					_socket.close();
-					schedule_for_deletion();
-				}
-			}
-		);
-	}
+		if (_inPacket._type == packet_type::PUBLISH) {
+			admit_publish();
+		}
 
-	[[nodiscard]] uint8_t read_byte() {
-		uint8_t byte;
-		asio::async_read(
-			_socket,
-			asio::buffer(
-				&byte,
-				sizeof(uint8_t)
-			),
-			[this](std::error_code ec, size_t length) {
-				if (ec) {
-					std::cout << "[" << _id << "] Reading Byte Failed: " << ec.message() << "\n";
-					_socket.close();
-				}
-			}
-		);
-		return byte;
+		// big PUBLISH packets are not buffered, their payload is streamed
+		if (_inPacket._type == packet_type::PUBLISH
+			&& _inPacket._header._packetLen > _limits._bufferedPacketSize
+			&& _inPacket._header._packetLen <= STREAMED_PACKET_SIZE_LIMIT) {
+			_streamDecoder.reset(
+				_inPacket._header._controlField & 0xf,
+				_inPacket._header._packetLen,
+				get_publish_sink()
+			);
+			read_publish_stream();
+			return;
+		}
+
+		// only allow packets with a certain size
+		if (_inPacket._header._packetLen > _limits._bufferedPacketSize) {
+			LMQTT_LOG_INFO("[{}] Closed connection. Reason: Packet size limit exceeded: {}", _id, _inPacket._header._packetLen);
+			_socket.close();
+			schedule_for_deletion();
+			return;
+		}
+
+		// resize packet body to hold the rest of the data
+		_inPacket._body.resize(_inPacket._header._packetLen);
+		charge_inbound_buffer();
+
+		read_packet_body();
 	}
 
 	void read_packet_body() {
+		++_pendingOps;
 		asio::async_read(
 			_socket,
 			asio::buffer(
@@ -193,8 +631,15 @@ private:
 				_inPacket._body.size()
 			),
 			[this](std::error_code ec, size_t length) {
+				if (finish_operation()) {
+					return;
+				}
 				if (!ec) {
-					
+					capture_inbound(_inPacket._body.data(), _inPacket._body.size());
+					latency::record(latency::stage::FRAME_READ, _inPacket._type, _frameStart);
+					metrics::on_packet_received(_inPacket._type, get_frame_size(_inPacket._header._packetLen));
+					_receivedBytes += get_frame_size(_inPacket._header._packetLen);
+
 					reason_code rcode;
 					switch (_inPacket._type) {
 					case packet_type::CONNECT:
@@ -205,8 +650,25 @@ private:
 							schedule_for_deletion();
 							return;
 						}
-						std::cout << "[SESSION] Identified client " << _clientCfg->_clientId << std::endl;
+						LMQTT_LOG_INFO("[SESSION] Identified client {} ({})", _clientCfg->_clientId, get_remote_endpoint());
 						_inPacket.reset();
+						// what we forward is discarded rather than sent bigger than this
+						_outbound->set_maximum_packet_size(_clientCfg->get_maximum_packet_size());
+
+						// the broker is overloaded: the client is told to come back later,
+						// and closed once it was
+						if (admission::is_rejecting_connects()) {
+							if (_outPacket.create_connack_packet(packet_type::CONNACK, reason_code::SERVER_BUSY) != return_code::OK) {
+								_socket.close();
+								schedule_for_deletion();
+								return;
+							}
+							metrics::add(metrics::counters()._connectsBusy);
+							_refused = true;
+							_outbound->push(std::make_shared<const std::vector<uint8_t>>(std::move(_outPacket._body)), _account);
+							_outPacket._body = std::vector<uint8_t>();
+							return;
+						}
 
 						if (_outPacket.create_connack_packet(packet_type::CONNACK, reason_code::SUCCESS) != return_code::OK) {
 							_socket.close();
@@ -219,16 +681,95 @@ private:
 					case packet_type::PUBLISH:
 					{
 						
-						rcode = _inPacket.decode_publish_packet_body();
-						if (rcode != reason_code::SUCCESS) {
+						// the whole body is there, so it is fed to the stream decoder at once:
+						// small and big PUBLISH packets are forwarded the same way
+						_streamDecoder.reset(
+							_inPacket._header._controlField & 0xf,
+							_inPacket._header._packetLen,
+							get_publish_sink()
+						);
+						uint32_t consumed = 0;
+						rcode = _streamDecoder.feed(_inPacket._body.data(), static_cast<uint32_t>(_inPacket._body.size()), consumed);
+						if (rcode != reason_code::SUCCESS
+							|| _streamDecoder.get_state() != publish_stream_decoder::state::DONE) {
 							_socket.close();
 							schedule_for_deletion();
 							return;
 						}
+
+						// QoS 1 is acknowledged with a PUBACK, QoS 2 with a PUBREC
+						const publish_header& header = _streamDecoder.header();
+						if (header._qos) {
+							const packet_type ackType = (header._qos == 1) ? packet_type::PUBACK : packet_type::PUBREC;
+							if (_outPacket.create_ack_packet(ackType, header._packetId, get_publish_reason()) != return_code::OK) {
+								_socket.close();
+								schedule_for_deletion();
+								return;
+							}
+							// a PUBREC with an error ends the exchange
+							if (ackType == packet_type::PUBREC && !_quotaExceeded) {
+								add_inflight(1);
+							}
+							_inPacket.reset();
+							send_packet();
+							break;
+						}
+
 						_inPacket.reset();
 						read_fixed_header();
 						break;
 					}
+					case packet_type::PUBREL:
+					{
+						rcode = _inPacket.decode_ack_packet_body();
+						if (rcode != reason_code::SUCCESS
+							|| _outPacket.create_ack_packet(packet_type::PUBCOMP, _inPacket._packetId, reason_code::SUCCESS) != return_code::OK) {
+							_socket.close();
+							schedule_for_deletion();
+							return;
+						}
+						if (_inflight) {
+							add_inflight(-1);
+						}
+						_inPacket.reset();
+						send_packet();
+						break;
+					}
+					case packet_type::SUBSCRIBE:
+					{
+						rcode = _inPacket.decode_subscribe_packet_body(_subscribeRequests, _limits._overflowPolicy);
+						if (rcode != reason_code::SUCCESS) {
+							_socket.close();
+							schedule_for_deletion();
+							return;
+						}
+
+						// forwarded messages go out with QoS 0 for now, so that is what we grant
+						_subackCodes.clear();
+						for (const auto& request : _subscribeRequests) {
+							_subackCodes.push_back(_subscriptions.subscribe(request._filter, _outbound, 0, request._queueOptions));
+						}
+
+						if (_outPacket.create_suback_packet(_inPacket._packetId, _subackCodes) != return_code::OK) {
+							_socket.close();
+							schedule_for_deletion();
+							return;
+						}
+						_inPacket.reset();
+						send_packet();
+						break;
+					}
+					case packet_type::PINGREQ:
+					{
+						if (_outPacket.create_pingresp_packet() != return_code::OK) {
+							_socket.close();
+							schedule_for_deletion();
+							return;
+						}
+						_inPacket.reset();
+						send_packet();
+						break;
+					}
 					case packet_type::DISCONNECT:
 					{
 						rcode = _inPacket.decode_disconnect_packet_body();
@@ -239,11 +780,18 @@ private:
 						} else {
 							_socket.close();
 							schedule_for_deletion();
-							std::cout << "DISCONNECTING CLIENT: SUCCESS\n";
+							LMQTT_LOG_DEBUG("[{}] Client disconnected", _id);
 							return;
 						}
 						break;
 					}
+					default:
+					{
+						// packet type not supported yet
+						_socket.close();
+						schedule_for_deletion();
+						return;
+					}
 					}
 
 					
@@ -269,40 +817,147 @@ private:
 					//read_fixed_header();
 
 				} else {
-					std::cout << "[" << _id << "] Reading pakcet body Failed: " << ec.message() << "\n";
+					LMQTT_LOG_DEBUG("[{}] Reading packet body failed: {}", _id, ec.message());
 					_socket.close();
+					schedule_for_deletion();
 				}
 			}
 		);
 	}
 
+	// reads the rest of a big PUBLISH chunk by chunk and feeds it to the stream
+	// decoder, which hands the payload to _publishSink as it arrives
+	void read_publish_stream() {
+		const size_t toRead = std::min<size_t>(_chunkBuffer.size(), _streamDecoder.remaining());
+		++_pendingOps;
+		_socket.async_read_some(
+			asio::buffer(_chunkBuffer.data(), toRead),
+			[this](std::error_code ec, size_t length) {
+				if (finish_operation()) {
+					return;
+				}
+				if (ec) {
+					LMQTT_LOG_DEBUG("[{}] Reading publish stream failed: {}", _id, ec.message());
+					_socket.close();
+					schedule_for_deletion();
+					return;
+				}
+
+				capture_inbound(_chunkBuffer.data(), length);
+
+				uint32_t consumed = 0;
+				const reason_code rcode = _streamDecoder.feed(_chunkBuffer.data(), static_cast<uint32_t>(length), consumed);
+				if (rcode != reason_code::SUCCESS) {
+					_socket.close();
+					schedule_for_deletion();
+					return;
+				}
+
+				if (_streamDecoder.get_state() != publish_stream_decoder::state::DONE) {
+					read_publish_stream();
+					return;
+				}
+
+				latency::record(latency::stage::FRAME_READ, packet_type::PUBLISH, _frameStart);
+				metrics::on_packet_received(packet_type::PUBLISH, get_frame_size(_inPacket._header._packetLen));
+				_receivedBytes += get_frame_size(_inPacket._header._packetLen);
+
+				// same acknowledgement as a buffered PUBLISH
+				const publish_header& header = _streamDecoder.header();
+				_inPacket.reset();
+				if (header._qos) {
+					const packet_type ackType = (header._qos == 1) ? packet_type::PUBACK : packet_type::PUBREC;
+					if (_outPacket.create_ack_packet(ackType, header._packetId, get_publish_reason()) != return_code::OK) {
+						_socket.close();
+						schedule_for_deletion();
+						return;
+					}
+					if (ackType == packet_type::PUBREC && !_quotaExceeded) {
+						add_inflight(1);
+					}
+					send_packet();
+					return;
+				}
+				read_fixed_header();
+			}
+		);
+	}
+
+	// queues _outPacket behind whatever is being written to the client (forwarded
+	// messages included) and goes back to reading
 	void send_packet() {
-		asio::post(_context,
-			[this]()
-			{
-				// TODO: handle this
-				bool busy = false;
-				if (!busy)
-				{
-					write_packet();
+		{
+			latency::scoped_timer timer(latency::stage::ENQUEUE, static_cast<packet_type>(_outPacket._body[0] >> 4));
+			_outbound->push(std::make_shared<const std::vector<uint8_t>>(std::move(_outPacket._body)), _account);
+			_outPacket._body = std::vector<uint8_t>();
+		}
+
+		// a client that does not read its responses does not get to send more
+		if (_outbound->is_over_limit()) {
+			// our own queue calls it, from our write handler or our teardown
+			_outbound->on_drained([this]() {
+				if (is_connected()) {
+					read_fixed_header();
 				}
 			});
+			return;
+		}
+		read_fixed_header();
 	}
 
-	void write_packet() {
+	// one write at a time, chunk by chunk, in the order of the outbound queue
+	void write_next() {
+		// we could not keep up with what was forwarded to us. A paused read is
+		// not armed and would not fail, so we do not wait for one
+		if (_outbound->has_overflowed()) {
+			LMQTT_LOG_INFO("[{}] Closed connection. Reason: outbound queue overflow", _id);
+			schedule_for_deletion();
+			return;
+		}
+		if (_writing || _closing) {
+			return;
+		}
+		packet_type type = packet_type::UNKNOWN;
+		shared_bytes chunk = _outbound->next_chunk(type);
+		if (!chunk) {
+			return;
+		}
+
+		_writing = true;
+		++_pendingOps;
+		// before the chunk moves into the handler
+		const asio::const_buffer buffer(chunk->data(), chunk->size());
 		asio::async_write(
 			_socket,
-			asio::buffer(
-				_outPacket._body.data(),
-				_outPacket._body.size()
-			),
-			[this](std::error_code ec, size_t length) {
-				if (!ec) {
-					read_fixed_header();
-				} else {
-					std::cout << "[" << _id << "] writing pakcet body Failed: " << ec.message() << "\n";
-					_socket.close();
+			buffer,
+			[this, chunk = std::move(chunk), type, writeStart = latency::now()](std::error_code ec, size_t /*length*/) {
+				latency::record(latency::stage::WRITE, type, writeStart);
+				_writing = false;
+				if (finish_operation()) {
+					return;
 				}
+				if (ec) {
+					// a read waiting for the queue to drain (see send_packet) is not
+					// armed, it would not fail and tear us down
+					LMQTT_LOG_DEBUG("[{}] Writing packet failed: {}", _id, ec.message());
+					schedule_for_deletion();
+					return;
+				}
+				_outbound->on_written(chunk->size());
+				// the queue only sends one when the client's overflow policy says so
+				if (type == packet_type::DISCONNECT) {
+					LMQTT_LOG_INFO("[{}] Closed connection. Reason: outbound quota exceeded", _id);
+					schedule_for_deletion();
+					return;
+				}
+				// no read is pending after a refused CONNECT, nothing else would
+				// tear us down
+				if (type == packet_type::CONNACK && _refused) {
+					LMQTT_LOG_INFO("[{}] Closed connection. Reason: server busy", _id);
+					schedule_for_deletion();
+					return;
+				}
+				write_next();
 			});
 	}
 
@@ -332,46 +987,221 @@ private:
 		}*/
 	}
 
+	// whole frame: control field, remaining length and body
+	[[nodiscard]] static uint64_t get_frame_size(uint32_t packetLen) noexcept {
+		return 1 + utils::get_variable_int_size(packetLen) + static_cast<uint64_t>(packetLen);
+	}
+
+	// under overload, QoS 0 messages are read and thrown away: nothing was promised
+	// for them, and their subscribers are who the broker can not keep up with
+	[[nodiscard]] publish_sink* get_publish_sink() noexcept {
+		if (_quotaExceeded) {
+			return &_shedSink;
+		}
+		const uint8_t qos = (_inPacket._header._controlField >> 1) & 0x3;
+		if (!qos && admission::is_shedding()) {
+			metrics::add(metrics::counters()._messagesShed);
+			return &_shedSink;
+		}
+		return _publishSink;
+	}
+
+	// every PUBLISH is charged when its header arrives. A QoS 1 or 2 one that finds
+	// the listener's buckets overdrawn by other clients is refused, a QoS 0 one goes
+	// through: either way, the next read waits for the buckets (see throttle)
+	void admit_publish() {
+		_quotaExceeded = false;
+		if (!_scheduler) {
+			return;
+		}
+		const auto now = rate::clock::now();
+		const uint8_t qos = (_inPacket._header._controlField >> 1) & 0x3;
+		if (qos && !_limiter.is_listener_conforming(now)) {
+			_quotaExceeded = true;
+			metrics::add(metrics::counters()._publishesQuotaExceeded);
+			return;
+		}
+		_limiter.charge(get_frame_size(_inPacket._header._packetLen), now);
+	}
+
+	[[nodiscard]] reason_code get_publish_reason() const noexcept {
+		return _quotaExceeded ? reason_code::QUOTA_EXCEEDED : reason_code::SUCCESS;
+	}
+
+	// the client went over one of its rates or its listener's: it is read from
+	// again, by the scheduler, once they let it
+	[[nodiscard]] bool throttle() {
+		if (!_scheduler) {
+			return false;
+		}
+		const auto now = rate::clock::now();
+		const rate::clock::duration wait = _limiter.get_wait(now);
+		if (wait == rate::clock::duration::zero()) {
+			return false;
+		}
+		metrics::add(metrics::counters()._readsThrottled);
+		pause_reading(read_pause::RATE);
+		_scheduler->resume_at(now + wait, _handle);
+		return true;
+	}
+
+	// our QoS 2 messages waiting for their PUBREL, reported to the broker wide gauge
+	void add_inflight(int64_t delta) noexcept {
+		_inflight += delta;
+		metrics::add(metrics::counters()._inflight, delta);
+	}
+
+	// the body buffer only grows (it is reused between packets), so it is charged
+	// when it does, and released by the destructor
+	void charge_inbound_buffer() noexcept {
+		const int64_t delta = static_cast<int64_t>(_inPacket._body.capacity()) - _inboundBytes;
+		if (delta) {
+			_inboundBytes += delta;
+			_account->_bytes += delta;
+			memory::charge(memory::pool::INBOUND, delta);
+		}
+	}
+
+	// raw inbound bytes go to the capture file, if the server is capturing
+	void capture_inbound(const uint8_t* data, size_t size) {
+		if (_captureStream
+			&& capture::recorder::instance().write_data(_captureStream, data, size) != return_code::OK) {
+			// the recorder marked the stream LOST, nothing more of it goes in
+			_captureStream = 0;
+		}
+	}
+
+	// the session is torn down at once, from the handler that found the client gone.
+	// Our pending operations complete with an error, we are retired after the last
+	// one: the handler that called us can still use us until it returns
 	void schedule_for_deletion() {
-		_deletionQueue.push_back(shared_from_this());
+		if (_closing) {
+			return;
+		}
+		_closing = true;
+		if (_captureStream) {
+			capture::recorder::instance().close_stream(_captureStream);
+			_captureStream = 0;
+		}
+		_subscriptions.remove(_outbound.get());
+		_outbound->close();
+		add_inflight(-_inflight);
+		_connectTimer.cancel();
+		std::error_code ignored;
+		_socket.close(ignored);
+		_connections.erase(_handle);
+		retire_if_idle();
+	}
+
+	// first thing in every completion handler. True once we are torn down, the
+	// handler must not go on
+	[[nodiscard]] bool finish_operation() {
+		--_pendingOps;
+		if (!_closing) {
+			return false;
+		}
+		retire_if_idle();
+		return true;
+	}
+
+	void retire_if_idle() {
+		if (!_pendingOps && !std::exchange(_retired, true)) {
+			_connections.retire(this);
+		}
 	}
 
 
 public:
 
-	std::string get_remote_endpoint() const {
-		return _socket.remote_endpoint().address().to_string();
+	std::string get_remote_endpoint() const override {
+		return get_remote_address(_socket);
 	}
 
-	asio::ip::tcp::socket& socket() {
+	Stream& socket() {
 		return _socket;
 	}
 
 protected:
 	// each connection has a unique socket
-	asio::ip::tcp::socket _socket;
+	Stream _socket;
 
 	// context
 	asio::io_context& _context;
 	
-	ts_queue<std::shared_ptr<connection>>& _activeConnections;
-	ts_queue<std::shared_ptr<connection>>& _deletionQueue;
+	connection_table& _connections;
+
+	// what the listener lets us hold, and what we hold (see lmqtt_memory_budget.h)
+	listener_limits _limits;
+	std::shared_ptr<memory::account> _account;
+	int64_t _inboundBytes = 0;
+	// read_pause flags, we read while there are none
+	uint8_t _pausedBy = 0;
+	bool _readPending = false;
+	// since the admission controller last asked
+	uint64_t _receivedBytes = 0;
+	// we answered the CONNECT with SERVER_BUSY
+	bool _refused = false;
+
+	// what we publish is charged to our buckets and our listener's
+	rate::publish_limiter _limiter;
+	read_scheduler* _scheduler = nullptr;
+	// the PUBLISH being read is refused with QUOTA_EXCEEDED
+	bool _quotaExceeded = false;
 	
 	// connection ID
 	uint32_t _id = 0;
 
 	// on connect, we expect a connect packet
 	bool _isFirstPacket = true;
-	std::atomic<bool> _receivedData{false};
+	bool _receivedData = false;
 	std::atomic<bool> _packetSent{ false };
 
 	lmqtt_packet _inPacket;
 	lmqtt_packet _outPacket;
 
-	std::unique_ptr<lmqtt_timer> _connTimer;
+	// control field and up to 4 bytes of packet length, as they came in
+	std::array<uint8_t, 5> _fixedHeader{};
+	uint32_t _fixedHeaderSize = 0;
+	uint32_t _lengthMultiplier = 1;
+
+	// when the fixed header of the current packet arrived
+	latency::ticks _frameStart = 0;
+
+	// PUBLISH packets go through the stream decoder, big ones without being buffered
+	publish_stream_decoder _streamDecoder;
+	std::array<uint8_t, STREAM_CHUNK_SIZE> _chunkBuffer;
+
+	// forwarding: our subscriptions live in the server's registry, messages for us
+	// are queued in _outbound, and what we publish is relayed by _relaySink
+	subscription_registry& _subscriptions;
+	std::shared_ptr<outbound_queue> _outbound;
+	relay_publish_sink _relaySink;
+	publish_sink* _publishSink = &_relaySink;
+	discard_publish_sink _shedSink;
+	bool _writing = false;
+	int64_t _inflight = 0;
+
+	// our stream in the capture file, 0 if we are not captured
+	uint32_t _captureStream = 0;
+
+	// reused between SUBSCRIBE packets
+	std::vector<subscription_request> _subscribeRequests;
+	std::vector<reason_code> _subackCodes;
+
+	// closes the connection if the client sends nothing in time
+	asio::steady_timer _connectTimer;
+
+	// asynchronous operations whose handlers will run and use us, we are only
+	// retired once there are none (see schedule_for_deletion)
+	uint32_t _pendingOps = 0;
+	bool _closing = false;
+	bool _retired = false;
 
 	std::shared_ptr<client_config> _clientCfg;
 
 };
 
+// what the broker accepts from its TCP listener
+using connection = basic_connection<asio::ip::tcp::socket>;
+
 } // namespace lmqtt
@@ -0,0 +1,379 @@
+#pragma once
+
+#include "lmqtt_common.h"
+#include "lmqtt_tsqueue.h"
+#include "lmqtt_packet.h"
+#include "lmqtt_reason_codes.h"
+#include "lmqtt_client_config.h"
+#include "lmqtt_stream_decoder.h"
+#include "lmqtt_histogram.h"
+#include "lmqtt_metrics.h"
+
+// The coroutine connection needs C++20 and an asio built with co_await support.
+// The callback based connection (lmqtt_connection.h) stays the default one.
+#if defined(ASIO_HAS_CO_AWAIT)
+
+namespace lmqtt {
+
+/*
+ * An alternative to the callback based connection. Instead of chaining
+ * read_fixed_header -> read_packet_body -> send_packet -> write_packet, a single
+ * coroutine loops over: read a frame, decode it, dispatch it and await the write.
+ *
+ * The run() frame lives as long as the connection, so there is no allocation
+ * per packet for the state machine itself. asio allocates awaitable frames
+ * (including the short lived fill() frames) and the handlers of the awaited
+ * operations from its per-thread recycling allocator, so they are pooled.
+ */
+class coro_connection : public std::enable_shared_from_this<coro_connection> {
+public:
+
+	coro_connection(
+		asio::io_context& context,
+		asio::ip::tcp::socket socket,
+		ts_queue<std::shared_ptr<coro_connection>>& deletionQueue // connections scheduled for deletion
+	) :
+		_context(context),
+		_socket(std::move(socket)),
+		_deletionQueue(deletionQueue),
+		_connTimer(context),
+		_clientCfg(std::make_shared<client_config>())
+	{
+		_inPacket._clientCfg = _clientCfg;
+		_outPacket._clientCfg = _clientCfg;
+		_readBuffer.resize(READ_BUFFER_SIZE);
+	}
+
+	virtual ~coro_connection() = default;
+
+public:
+	[[nodiscard]] uint32_t get_id() const noexcept {
+		return _id;
+	}
+
+	// timeout (in ms) is the time the client has to send its first packet
+	void connect_to_client(size_t timeout) {
+		if (!_socket.is_open()) {
+			return;
+		}
+
+		_connTimer.expires_after(std::chrono::milliseconds(timeout));
+		_connTimer.async_wait(
+			[self = shared_from_this()](std::error_code ec) {
+				if (!ec && !self->_receivedData) {
+					self->shutdown();
+				}
+			}
+		);
+
+		// the coroutine holds a reference to the connection until it exits
+		asio::co_spawn(
+			_context,
+			[self = shared_from_this()]() { return self->run(); },
+			asio::detached
+		);
+	}
+
+	void disconnect() {
+		if (is_connected()) {
+			asio::post(
+				_context,
+				[self = shared_from_this()]() {
+					self->_socket.close();
+				}
+			);
+		}
+	}
+
+	// close connection immediately, the pending read will complete with an error
+	// and the coroutine will exit
+	void shutdown() {
+		if (is_connected()) {
+			std::error_code ec;
+			_socket.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+		}
+	}
+
+	bool is_connected() const noexcept {
+		return _socket.is_open();
+	}
+
+	std::string get_remote_endpoint() const {
+		return _socket.remote_endpoint().address().to_string();
+	}
+
+	asio::ip::tcp::socket& socket() {
+		return _socket;
+	}
+
+private:
+
+	// what to do after a packet was dispatched
+	enum class packet_action : uint8_t {
+		READ_NEXT,
+		WRITE,
+		CLOSE
+	};
+
+	asio::awaitable<void> run() {
+		try {
+			for (;;) {
+
+				// fixed header: control field + 1 to 4 bytes of remaining length
+				co_await fill(2);
+
+				_receivedData = true;
+				const latency::ticks frameStart = latency::now();
+
+				_inPacket._header._controlField = _readBuffer[_readPos++];
+
+				const reason_code rcode = _inPacket.create_fixed_header();
+				if (rcode == reason_code::MALFORMED_PACKET
+					|| rcode == reason_code::PROTOCOL_ERROR) {
+					break;
+				}
+
+				// on first connection, only accept CONNECT packets
+				if (_isFirstPacket) {
+					if (_inPacket._type != packet_type::CONNECT) {
+						break;
+					}
+					_isFirstPacket = false;
+				}
+
+				// the same decoding as connection::read_fixed_header, except that
+				// we read from our buffer instead of one read syscall per byte
+				uint32_t mul = 1;
+				uint32_t packetLen = 0;
+				bool malformed = true;
+				for (uint32_t offset = 0; offset < 4; ++offset) {
+					co_await fill(1);
+					const uint8_t nextByte = _readBuffer[_readPos++];
+					packetLen += (nextByte & 0x7f) * mul;
+					mul *= 0x80;
+					if (!(nextByte & 0x80)) {
+						malformed = false;
+						break;
+					}
+				}
+
+				if (malformed) {
+					break;
+				}
+
+				// big PUBLISH packets are not buffered, their payload is streamed
+				if (_inPacket._type == packet_type::PUBLISH
+					&& packetLen > PACKET_SIZE_LIMIT
+					&& packetLen <= STREAMED_PACKET_SIZE_LIMIT) {
+					if (!co_await read_publish_stream(packetLen, frameStart)) {
+						break;
+					}
+					_inPacket.reset();
+					continue;
+				}
+
+				// only allow packets with a certain size
+				if (packetLen > PACKET_SIZE_LIMIT) {
+					break;
+				}
+
+				_inPacket._header._packetLen = packetLen;
+				_inPacket._body.resize(packetLen);
+
+				if (packetLen) {
+					co_await fill(packetLen);
+					std::memcpy(_inPacket._body.data(), _readBuffer.data() + _readPos, packetLen);
+					_readPos += packetLen;
+				}
+				latency::record(latency::stage::FRAME_READ, _inPacket._type, frameStart);
+				metrics::on_packet_received(_inPacket._type, 1 + utils::get_variable_int_size(packetLen) + static_cast<uint64_t>(packetLen));
+
+				const packet_action action = dispatch();
+				if (action == packet_action::CLOSE) {
+					break;
+				}
+
+				if (action == packet_action::WRITE) {
+					const latency::ticks writeStart = latency::now();
+					co_await asio::async_write(
+						_socket,
+						asio::buffer(_outPacket._body.data(), _outPacket._body.size()),
+						asio::use_awaitable
+					);
+					latency::record(latency::stage::WRITE, static_cast<packet_type>(_outPacket._body[0] >> 4), writeStart);
+					metrics::on_packet_sent(static_cast<packet_type>(_outPacket._body[0] >> 4));
+					metrics::on_bytes_sent(_outPacket._body.size());
+				}
+
+				_inPacket.reset();
+			}
+		} catch (std::exception&) {
+			// read or write failed, the socket is closed below
+		}
+
+		_connTimer.cancel();
+		std::error_code ec;
+		_socket.close(ec);
+		schedule_for_deletion();
+	}
+
+	// feeds a big PUBLISH to the stream decoder from the read buffer, refilling it
+	// as needed, then acknowledges it. Returns false if the connection must close
+	asio::awaitable<bool> read_publish_stream(uint32_t packetLen, latency::ticks frameStart) {
+		_streamDecoder.reset(_inPacket._header._controlField & 0xf, packetLen, _publishSink);
+
+		while (_streamDecoder.get_state() != publish_stream_decoder::state::DONE) {
+			co_await fill(1);
+			uint32_t consumed = 0;
+			const reason_code rcode = _streamDecoder.feed(
+				_readBuffer.data() + _readPos,
+				static_cast<uint32_t>(_readEnd - _readPos),
+				consumed
+			);
+			if (rcode != reason_code::SUCCESS) {
+				co_return false;
+			}
+			_readPos += consumed;
+		}
+		latency::record(latency::stage::FRAME_READ, packet_type::PUBLISH, frameStart);
+		metrics::on_packet_received(packet_type::PUBLISH, 1 + utils::get_variable_int_size(packetLen) + static_cast<uint64_t>(packetLen));
+
+		const publish_header& header = _streamDecoder.header();
+		if (header._qos) {
+			const packet_type ackType = (header._qos == 1) ? packet_type::PUBACK : packet_type::PUBREC;
+			if (_outPacket.create_ack_packet(ackType, header._packetId, reason_code::SUCCESS) != return_code::OK) {
+				co_return false;
+			}
+			co_await asio::async_write(
+				_socket,
+				asio::buffer(_outPacket._body.data(), _outPacket._body.size()),
+				asio::use_awaitable
+			);
+			metrics::on_packet_sent(ackType);
+			metrics::on_bytes_sent(_outPacket._body.size());
+		}
+		co_return true;
+	}
+
+	// make sure at least `size` unread bytes are in the read buffer. We read as much
+	// as the socket has, so pipelined packets are decoded without extra syscalls
+	asio::awaitable<void> fill(size_t size) {
+		if (_readEnd - _readPos >= size) {
+			co_return;
+		}
+
+		// compact: move unread bytes to the front of the buffer
+		if (_readPos) {
+			std::memmove(_readBuffer.data(), _readBuffer.data() + _readPos, _readEnd - _readPos);
+			_readEnd -= _readPos;
+			_readPos = 0;
+		}
+
+		if (_readBuffer.size() < size) {
+			_readBuffer.resize(size);
+		}
+
+		while (_readEnd < size) {
+			_readEnd += co_await _socket.async_read_some(
+				asio::buffer(_readBuffer.data() + _readEnd, _readBuffer.size() - _readEnd),
+				asio::use_awaitable
+			);
+		}
+	}
+
+	[[nodiscard]] packet_action dispatch() {
+		switch (_inPacket._type) {
+		case packet_type::CONNECT:
+		{
+			if (_inPacket.decode_connect_packet_body() != reason_code::SUCCESS) {
+				return packet_action::CLOSE;
+			}
+			if (_outPacket.create_connack_packet(packet_type::CONNACK, reason_code::SUCCESS) != return_code::OK) {
+				return packet_action::CLOSE;
+			}
+			return packet_action::WRITE;
+		}
+		case packet_type::PUBLISH:
+		{
+			if (_inPacket.decode_publish_packet_body() != reason_code::SUCCESS) {
+				return packet_action::CLOSE;
+			}
+			if (!_clientCfg->_qos) {
+				return packet_action::READ_NEXT;
+			}
+			// QoS 1 is acknowledged with a PUBACK, QoS 2 with a PUBREC
+			const packet_type ackType = (_clientCfg->_qos == 1) ? packet_type::PUBACK : packet_type::PUBREC;
+			if (_outPacket.create_ack_packet(ackType, _inPacket._packetId, reason_code::SUCCESS) != return_code::OK) {
+				return packet_action::CLOSE;
+			}
+			return packet_action::WRITE;
+		}
+		case packet_type::PUBREL:
+		{
+			if (_inPacket.decode_ack_packet_body() != reason_code::SUCCESS
+				|| _outPacket.create_ack_packet(packet_type::PUBCOMP, _inPacket._packetId, reason_code::SUCCESS) != return_code::OK) {
+				return packet_action::CLOSE;
+			}
+			return packet_action::WRITE;
+		}
+		case packet_type::PINGREQ:
+		{
+			if (_outPacket.create_pingresp_packet() != return_code::OK) {
+				return packet_action::CLOSE;
+			}
+			return packet_action::WRITE;
+		}
+		case packet_type::DISCONNECT:
+		{
+			// whatever the reason code is, the client is leaving
+			(void)_inPacket.decode_disconnect_packet_body();
+			return packet_action::CLOSE;
+		}
+		default:
+			return packet_action::CLOSE;
+		}
+	}
+
+	void schedule_for_deletion() {
+		_deletionQueue.push_back(shared_from_this());
+	}
+
+protected:
+	static constexpr size_t READ_BUFFER_SIZE = 4096;
+
+	// context
+	asio::io_context& _context;
+
+	// each connection has a unique socket
+	asio::ip::tcp::socket _socket;
+
+	ts_queue<std::shared_ptr<coro_connection>>& _deletionQueue;
+
+	// connection ID
+	uint32_t _id = 0;
+
+	// on connect, we expect a connect packet
+	bool _isFirstPacket = true;
+	bool _receivedData = false;
+
+	// received bytes are kept here until a full packet is available
+	std::vector<uint8_t> _readBuffer;
+	size_t _readPos = 0;
+	size_t _readEnd = 0;
+
+	lmqtt_packet _inPacket;
+	lmqtt_packet _outPacket;
+
+	// big PUBLISH packets go through the stream decoder instead of _inPacket
+	publish_stream_decoder _streamDecoder;
+	discard_publish_sink _discardSink;
+	publish_sink* _publishSink = &_discardSink;
+
+	asio::steady_timer _connTimer;
+
+	std::shared_ptr<client_config> _clientCfg;
+};
+
+} // namespace lmqtt
+
+#endif // ASIO_HAS_CO_AWAIT
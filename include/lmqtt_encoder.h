@@ -0,0 +1,501 @@
+#pragma once
+
+#include "lmqtt_common.h"
+#include "lmqtt_reason_codes.h"
+#include "lmqtt_types.h"
+#include "lmqtt_utils.h"
+
+namespace lmqtt {
+
+namespace encoder {
+
+// A property to be encoded. Nothing is copied: strings and binary data are views
+// on memory owned by the caller, which must outlive the encode call.
+struct property_view {
+    property::property_type _type = property::property_type::UNKNOWN;
+    uint32_t _value = 0;        // BYTE, TWO_BYTES_INT, FOUR_BYTES_INT and VARIABLE_BYTE_INT
+    std::string_view _data;     // UTF8_STRING, BINARY and the key of a UTF8_STRING_PAIR
+    std::string_view _pairValue;// the value of a UTF8_STRING_PAIR
+
+    static property_view make(property::property_type type, uint32_t value) noexcept {
+        property_view p;
+        p._type = type;
+        p._value = value;
+        return p;
+    }
+
+    static property_view make(property::property_type type, std::string_view data) noexcept {
+        property_view p;
+        p._type = type;
+        p._data = data;
+        return p;
+    }
+
+    static property_view make(property::property_type type, std::string_view key, std::string_view value) noexcept {
+        property_view p;
+        p._type = type;
+        p._data = key;
+        p._pairValue = value;
+        return p;
+    }
+};
+
+struct property_list {
+    const property_view* _data = nullptr;
+    size_t _size = 0;
+
+    property_list() = default;
+    property_list(const property_view* data, size_t size) : _data(data), _size(size) {}
+    property_list(const std::vector<property_view>& properties)
+        : _data(properties.data()), _size(properties.size()) {}
+
+    const property_view* begin() const noexcept { return _data; }
+    const property_view* end() const noexcept { return _data + _size; }
+    bool empty() const noexcept { return !_size; }
+};
+
+// The server-originated packets the encoder knows about. They only describe the
+// packet, the encoder never owns or copies their content until it writes it.
+
+struct publish_message {
+    std::string_view _topic;
+    uint16_t _packetId = 0; // ignored for QoS 0
+    uint8_t _qos = 0;
+    bool _retain = false;
+    bool _dup = false;
+    property_list _properties;
+    // properties that are already encoded (without their length), written as they
+    // are after _properties. A forwarded PUBLISH keeps what its publisher sent
+    std::string_view _encodedProperties;
+    const uint8_t* _payload = nullptr;
+    uint32_t _payloadSize = 0;
+};
+
+// PUBACK, PUBREC, PUBREL and PUBCOMP
+struct ack_message {
+    packet_type _type = packet_type::PUBACK;
+    uint16_t _packetId = 0;
+    reason_code _reasonCode = reason_code::SUCCESS;
+    property_list _properties;
+};
+
+// SUBACK and UNSUBACK: one reason code per topic filter of the request
+struct suback_message {
+    packet_type _type = packet_type::SUBACK;
+    uint16_t _packetId = 0;
+    const reason_code* _reasonCodes = nullptr;
+    size_t _reasonCodeCount = 0;
+    property_list _properties;
+};
+
+struct disconnect_message {
+    reason_code _reasonCode = reason_code::SUCCESS;
+    property_list _properties;
+};
+
+struct auth_message {
+    // SUCCESS, CONTINUE_AUTHENTICATION or RE_AUTHENTICATE
+    reason_code _reasonCode = reason_code::SUCCESS;
+    property_list _properties;
+};
+
+/*
+ * Encodes packets in two steps: get_size() computes the exact number of bytes,
+ * then encode() writes them directly into a caller provided buffer. Nothing is
+ * allocated, so many packets can be written back to back into the same send
+ * buffer (see append()).
+ */
+class packet_encoder {
+public:
+
+    // ********** SIZES ********** //
+
+    [[nodiscard]] static uint32_t get_properties_size(const property_list& properties) noexcept {
+        uint32_t size = 0;
+        for (const auto& p : properties) {
+            size += 1 + get_property_value_size(p);
+        }
+        return size;
+    }
+
+    [[nodiscard]] static uint32_t get_size(const publish_message& msg) noexcept {
+        return get_packet_size(get_remaining_length(msg));
+    }
+
+    // a PUBLISH without its payload, see encode_header()
+    [[nodiscard]] static uint32_t get_header_size(const publish_message& msg) noexcept {
+        const uint32_t size = get_size(msg);
+        return size ? size - msg._payloadSize : 0;
+    }
+
+    [[nodiscard]] static uint32_t get_size(const ack_message& msg) noexcept {
+        return get_packet_size(get_remaining_length(msg));
+    }
+
+    [[nodiscard]] static uint32_t get_size(const suback_message& msg) noexcept {
+        return get_packet_size(get_remaining_length(msg));
+    }
+
+    [[nodiscard]] static uint32_t get_size(const disconnect_message& msg) noexcept {
+        return get_packet_size(get_reason_only_remaining_length(msg._reasonCode, msg._properties));
+    }
+
+    [[nodiscard]] static uint32_t get_size(const auth_message& msg) noexcept {
+        return get_packet_size(get_reason_only_remaining_length(msg._reasonCode, msg._properties));
+    }
+
+    // ********** ENCODING ********** //
+
+    [[nodiscard]] static return_code encode(uint8_t* buff, uint32_t buffSize, const publish_message& msg, uint32_t& written) noexcept {
+        return encode_publish(buff, buffSize, msg, true, written);
+    }
+
+    // Everything up to the payload, for a payload written separately (cut-through
+    // forwarding): the remaining length counts _payloadSize, _payload is not read
+    [[nodiscard]] static return_code encode_header(uint8_t* buff, uint32_t buffSize, const publish_message& msg, uint32_t& written) noexcept {
+        return encode_publish(buff, buffSize, msg, false, written);
+    }
+
+    [[nodiscard]] static return_code encode(uint8_t* buff, uint32_t buffSize, const ack_message& msg, uint32_t& written) noexcept {
+        written = 0;
+        if (!is_ack_type(msg._type) || !msg._packetId) {
+            return return_code::FAIL;
+        }
+        if (!validate_properties(msg._properties, msg._type)) {
+            return return_code::FAIL;
+        }
+
+        const uint32_t remainingLength = get_remaining_length(msg);
+
+        writer w(buff, buffSize);
+        if (!write_fixed_header(w, msg._type, static_cast<uint8_t>(packet::utils::get_packet_flag(msg._type)), remainingLength)) {
+            return return_code::FAIL;
+        }
+        w.write_u16(msg._packetId);
+        // the reason code and the properties can be omitted for a bare success [MQTT-3.4.2.1]
+        if (remainingLength > 2) {
+            w.write_u8(static_cast<uint8_t>(msg._reasonCode));
+            if (remainingLength > 3) {
+                write_properties(w, msg._properties);
+            }
+        }
+
+        if (!w.ok()) {
+            return return_code::FAIL;
+        }
+        written = w.position();
+        return return_code::OK;
+    }
+
+    [[nodiscard]] static return_code encode(uint8_t* buff, uint32_t buffSize, const suback_message& msg, uint32_t& written) noexcept {
+        written = 0;
+        if ((msg._type != packet_type::SUBACK && msg._type != packet_type::UNSUBACK)
+            || !msg._packetId || !msg._reasonCodeCount) {
+            return return_code::FAIL;
+        }
+        if (!validate_properties(msg._properties, msg._type)) {
+            return return_code::FAIL;
+        }
+
+        writer w(buff, buffSize);
+        if (!write_fixed_header(w, msg._type, 0, get_remaining_length(msg))) {
+            return return_code::FAIL;
+        }
+        w.write_u16(msg._packetId);
+        write_properties(w, msg._properties);
+        for (size_t i = 0; i < msg._reasonCodeCount; ++i) {
+            w.write_u8(static_cast<uint8_t>(msg._reasonCodes[i]));
+        }
+
+        if (!w.ok()) {
+            return return_code::FAIL;
+        }
+        written = w.position();
+        return return_code::OK;
+    }
+
+    [[nodiscard]] static return_code encode(uint8_t* buff, uint32_t buffSize, const disconnect_message& msg, uint32_t& written) noexcept {
+        return encode_reason_only(buff, buffSize, packet_type::DISCONNECT, msg._reasonCode, msg._properties, written);
+    }
+
+    [[nodiscard]] static return_code encode(uint8_t* buff, uint32_t buffSize, const auth_message& msg, uint32_t& written) noexcept {
+        return encode_reason_only(buff, buffSize, packet_type::AUTH, msg._reasonCode, msg._properties, written);
+    }
+
+    // Grows the slab by the exact size of the packet and encodes it in place, right
+    // after what is already there. On failure, the slab is left untouched.
+    template <typename Message>
+    [[nodiscard]] static return_code append(std::vector<uint8_t>& slab, const Message& msg) {
+        const size_t start = slab.size();
+        const uint32_t size = get_size(msg);
+        if (!size) {
+            return return_code::FAIL;
+        }
+
+        slab.resize(start + size);
+        uint32_t written = 0;
+        if (encode(slab.data() + start, size, msg, written) != return_code::OK || written != size) {
+            slab.resize(start);
+            return return_code::FAIL;
+        }
+        return return_code::OK;
+    }
+
+private:
+
+    // bounds-checked cursor on the destination buffer. Once a write does not fit,
+    // every following write is ignored and ok() returns false
+    class writer {
+    public:
+        writer(uint8_t* buff, uint32_t buffSize) : _buff(buff), _buffSize(buffSize) {}
+
+        bool ok() const noexcept { return _ok; }
+        uint32_t position() const noexcept { return _pos; }
+
+        void write_u8(uint8_t value) noexcept {
+            if (reserve(1)) {
+                _buff[_pos++] = value;
+            }
+        }
+
+        void write_u16(uint16_t value) noexcept {
+            if (reserve(2)) {
+                _buff[_pos++] = value >> 0x8;
+                _buff[_pos++] = value & 0xFF;
+            }
+        }
+
+        void write_u32(uint32_t value) noexcept {
+            if (reserve(4)) {
+                _buff[_pos++] = value >> 0x18;
+                _buff[_pos++] = (value >> 0x10) & 0xFF;
+                _buff[_pos++] = (value >> 0x8) & 0xFF;
+                _buff[_pos++] = value & 0xFF;
+            }
+        }
+
+        void write_variable_int(uint32_t value) noexcept {
+            if (!_ok) {
+                return;
+            }
+            uint8_t size = 0;
+            if (utils::encode_variable_int(_buff + _pos, _buffSize - _pos, value, size) != return_code::OK) {
+                _ok = false;
+                return;
+            }
+            _pos += size;
+        }
+
+        // two bytes length followed by the data, used by strings and binary data
+        void write_string(std::string_view str) noexcept {
+            if (str.size() > 0xFFFF) {
+                _ok = false;
+                return;
+            }
+            write_u16(static_cast<uint16_t>(str.size()));
+            write_bytes(reinterpret_cast<const uint8_t*>(str.data()), static_cast<uint32_t>(str.size()));
+        }
+
+        void write_bytes(const uint8_t* data, uint32_t size) noexcept {
+            if (size && reserve(size)) {
+                std::memcpy(_buff + _pos, data, size);
+                _pos += size;
+            }
+        }
+
+    private:
+        bool reserve(uint32_t size) noexcept {
+            if (!_ok || (_buffSize - _pos) < size) {
+                _ok = false;
+            }
+            return _ok;
+        }
+
+        uint8_t* _buff;
+        uint32_t _buffSize;
+        uint32_t _pos = 0;
+        bool _ok = true;
+    };
+
+    static constexpr bool is_ack_type(packet_type type) noexcept {
+        return (type == packet_type::PUBACK)
+            || (type == packet_type::PUBREC)
+            || (type == packet_type::PUBREL)
+            || (type == packet_type::PUBCOMP);
+    }
+
+    // 0 means the remaining length cannot be encoded
+    static uint32_t get_packet_size(uint32_t remainingLength) noexcept {
+        if (remainingLength > 0xFFFFFFF) {
+            return 0;
+        }
+        return 1 + utils::get_variable_int_size(remainingLength) + remainingLength;
+    }
+
+    static uint32_t get_property_value_size(const property_view& p) noexcept {
+        switch (property::types_utils::get_property_data_type(p._type)) {
+        case data_type::BYTE:               return 1;
+        case data_type::TWO_BYTES_INT:      return 2;
+        case data_type::FOUR_BYTES_INT:     return 4;
+        case data_type::VARIABLE_BYTE_INT:  return utils::get_variable_int_size(p._value);
+        case data_type::UTF8_STRING:
+        case data_type::BINARY:             return 2 + static_cast<uint32_t>(p._data.size());
+        case data_type::UTF8_STRING_PAIR:   return 4 + static_cast<uint32_t>(p._data.size() + p._pairValue.size());
+        default:                            return 0;
+        }
+    }
+
+    // the properties block: variable int length followed by the properties
+    static uint32_t get_properties_block_size(const property_list& properties, std::string_view encoded = {}) noexcept {
+        const uint32_t size = get_properties_size(properties) + static_cast<uint32_t>(encoded.size());
+        return utils::get_variable_int_size(size) + size;
+    }
+
+    static uint32_t get_remaining_length(const publish_message& msg) noexcept {
+        return 2 + static_cast<uint32_t>(msg._topic.size())
+            + (msg._qos ? 2 : 0)
+            + get_properties_block_size(msg._properties, msg._encodedProperties)
+            + msg._payloadSize;
+    }
+
+    static uint32_t get_remaining_length(const ack_message& msg) noexcept {
+        if (msg._properties.empty()) {
+            return (msg._reasonCode == reason_code::SUCCESS) ? 2 : 3;
+        }
+        return 3 + get_properties_block_size(msg._properties);
+    }
+
+    static uint32_t get_remaining_length(const suback_message& msg) noexcept {
+        return 2 + get_properties_block_size(msg._properties) + static_cast<uint32_t>(msg._reasonCodeCount);
+    }
+
+    // DISCONNECT and AUTH: a bare success has an empty variable header [MQTT-3.14.2.1] [MQTT-3.15.2.1]
+    static uint32_t get_reason_only_remaining_length(reason_code reasonCode, const property_list& properties) noexcept {
+        if (properties.empty()) {
+            return (reasonCode == reason_code::SUCCESS) ? 0 : 1;
+        }
+        return 1 + get_properties_block_size(properties);
+    }
+
+    static bool validate_properties(const property_list& properties, packet_type packetType) noexcept {
+        for (const auto& p : properties) {
+            if (!property::types_utils::validate_packet_property_type(p._type, packetType)) {
+                return false;
+            }
+            const data_type dtype = property::types_utils::get_property_data_type(p._type);
+            if ((dtype == data_type::UTF8_STRING || dtype == data_type::BINARY) && p._data.size() > 0xFFFF) {
+                return false;
+            }
+            if (dtype == data_type::UTF8_STRING_PAIR && (p._data.size() > 0xFFFF || p._pairValue.size() > 0xFFFF)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool write_fixed_header(writer& w, packet_type type, uint8_t flags, uint32_t remainingLength) noexcept {
+        w.write_u8((static_cast<uint8_t>(type) << 4) | (flags & 0xF));
+        w.write_variable_int(remainingLength);
+        return w.ok();
+    }
+
+    static void write_properties(writer& w, const property_list& properties, std::string_view encoded = {}) noexcept {
+        w.write_variable_int(get_properties_size(properties) + static_cast<uint32_t>(encoded.size()));
+        for (const auto& p : properties) {
+            w.write_u8(static_cast<uint8_t>(p._type));
+            switch (property::types_utils::get_property_data_type(p._type)) {
+            case data_type::BYTE:               w.write_u8(static_cast<uint8_t>(p._value)); break;
+            case data_type::TWO_BYTES_INT:      w.write_u16(static_cast<uint16_t>(p._value)); break;
+            case data_type::FOUR_BYTES_INT:     w.write_u32(p._value); break;
+            case data_type::VARIABLE_BYTE_INT:  w.write_variable_int(p._value); break;
+            case data_type::UTF8_STRING:
+            case data_type::BINARY:             w.write_string(p._data); break;
+            case data_type::UTF8_STRING_PAIR:
+                w.write_string(p._data);
+                w.write_string(p._pairValue);
+                break;
+            default:
+                break;
+            }
+        }
+        w.write_bytes(reinterpret_cast<const uint8_t*>(encoded.data()), static_cast<uint32_t>(encoded.size()));
+    }
+
+    static return_code encode_publish(
+        uint8_t* buff,
+        uint32_t buffSize,
+        const publish_message& msg,
+        bool withPayload,
+        uint32_t& written
+    ) noexcept {
+        written = 0;
+        if (msg._qos > 2 || (msg._qos && !msg._packetId) || (msg._dup && !msg._qos)) {
+            return return_code::FAIL;
+        }
+        if (!utf8_utils::is_valid_length(msg._topic) || msg._topic.empty()) {
+            return return_code::FAIL;
+        }
+        if (!validate_properties(msg._properties, packet_type::PUBLISH)) {
+            return return_code::FAIL;
+        }
+
+        const uint32_t remainingLength = get_remaining_length(msg);
+        const uint8_t flags = (msg._dup << 3) | (msg._qos << 1) | static_cast<uint8_t>(msg._retain);
+
+        writer w(buff, buffSize);
+        if (!write_fixed_header(w, packet_type::PUBLISH, flags, remainingLength)) {
+            return return_code::FAIL;
+        }
+        w.write_string(msg._topic);
+        if (msg._qos) {
+            w.write_u16(msg._packetId);
+        }
+        write_properties(w, msg._properties, msg._encodedProperties);
+        if (withPayload) {
+            w.write_bytes(msg._payload, msg._payloadSize);
+        }
+
+        if (!w.ok()) {
+            return return_code::FAIL;
+        }
+        written = w.position();
+        return return_code::OK;
+    }
+
+    static return_code encode_reason_only(
+        uint8_t* buff,
+        uint32_t buffSize,
+        packet_type type,
+        reason_code reasonCode,
+        const property_list& properties,
+        uint32_t& written
+    ) noexcept {
+        written = 0;
+        if (!validate_properties(properties, type)) {
+            return return_code::FAIL;
+        }
+
+        const uint32_t remainingLength = get_reason_only_remaining_length(reasonCode, properties);
+
+        writer w(buff, buffSize);
+        if (!write_fixed_header(w, type, 0, remainingLength)) {
+            return return_code::FAIL;
+        }
+        if (remainingLength) {
+            w.write_u8(static_cast<uint8_t>(reasonCode));
+            if (remainingLength > 1) {
+                write_properties(w, properties);
+            }
+        }
+
+        if (!w.ok()) {
+            return return_code::FAIL;
+        }
+        written = w.position();
+        return return_code::OK;
+    }
+};
+
+} // namespace encoder
+
+} // namespace lmqtt
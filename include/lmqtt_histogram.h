@@ -0,0 +1,331 @@
+#pragma once
+
+#include "lmqtt_common.h"
+#include "lmqtt_types.h"
+
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(LMQTT_NO_TSC)
+#define LMQTT_USE_TSC
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+namespace lmqtt {
+
+namespace latency {
+
+// Where the time of a packet goes, from its first byte to the last byte we write
+enum class stage : uint8_t {
+    FRAME_READ,     // fixed header received -> whole packet received
+    DECODE,         // packet body decoding
+    ROUTE,          // matching a PUBLISH against the subscriptions
+    ENQUEUE,        // queuing a packet (or a relayed chunk), starting the write if the socket is idle
+    WRITE,          // async write issued -> completed
+    COUNT
+};
+
+constexpr std::string_view get_stage_string(stage s) noexcept {
+    switch (s) {
+    case stage::FRAME_READ:     return "frame_read";
+    case stage::DECODE:         return "decode";
+    case stage::ROUTE:          return "route";
+    case stage::ENQUEUE:        return "enqueue";
+    case stage::WRITE:          return "write";
+    default:                    return "unknown";
+    }
+    return ""; // keep the compiler happy
+}
+
+// packet types 0 to 15, plus UNKNOWN for what we could not identify
+inline constexpr size_t PACKET_TYPE_COUNT = static_cast<size_t>(packet_type::UNKNOWN) + 1;
+
+using ticks = uint64_t;
+
+// The cheapest monotonic clock we have: the TSC on x86-64 (assumed invariant, as
+// on any recent CPU), steady_clock elsewhere. Ticks are only converted to ns when
+// the histograms are read.
+[[nodiscard]] inline ticks now() noexcept {
+#ifdef LMQTT_USE_TSC
+    return __rdtsc();
+#else
+    return static_cast<ticks>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+
+// The clocks read together once, so ticks can be converted to ns later
+struct clock_reference {
+    ticks _ticks = now();
+    std::chrono::steady_clock::time_point _time = std::chrono::steady_clock::now();
+
+    // ns per tick, measured between the reference and now, so it gets more precise
+    // as the process runs. It never waits: read too soon, the ratio is only rough
+    [[nodiscard]] double get_ns_per_tick() const noexcept {
+#ifdef LMQTT_USE_TSC
+        const ticks endTicks = now();
+        const auto endTime = std::chrono::steady_clock::now();
+        const double ns = std::chrono::duration<double, std::nano>(endTime - _time).count();
+        return ns / static_cast<double>(std::max<ticks>(endTicks - _ticks, 1));
+#else
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::duration(1)).count();
+#endif
+    }
+};
+
+/*
+ * Log-linear (HDR style) histogram: each power of two is split in 16 linear
+ * sub-buckets, so any recorded value is known within ~6%, from 1 tick up to
+ * 2^40 ticks (minutes), in 608 counters.
+ *
+ * There is a single writer (the thread owning it) so recording is a relaxed load
+ * and store, no atomic read-modify-write. Readers on other threads get a slightly
+ * stale but consistent-enough view.
+ */
+class histogram {
+public:
+    static constexpr uint32_t SUB_BUCKET_BITS = 4;
+    static constexpr uint32_t SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    static constexpr uint32_t MAX_EXPONENT = 40;
+    static constexpr uint32_t BUCKET_COUNT = ((MAX_EXPONENT - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS) + SUB_BUCKET_COUNT;
+
+    [[nodiscard]] static uint32_t get_bucket_index(uint64_t value) noexcept {
+        if (value < SUB_BUCKET_COUNT) {
+            return static_cast<uint32_t>(value);
+        }
+        uint32_t exponent = 63 - count_leading_zeros(value);
+        if (exponent > MAX_EXPONENT) {
+            return BUCKET_COUNT - 1;
+        }
+        const uint32_t shift = exponent - SUB_BUCKET_BITS;
+        return ((shift + 1) << SUB_BUCKET_BITS) + static_cast<uint32_t>((value >> shift) - SUB_BUCKET_COUNT);
+    }
+
+    // highest value that lands in this bucket
+    [[nodiscard]] static uint64_t get_bucket_value(uint32_t index) noexcept {
+        if (index < SUB_BUCKET_COUNT) {
+            return index;
+        }
+        const uint32_t shift = (index >> SUB_BUCKET_BITS) - 1;
+        const uint64_t subBucket = (index & (SUB_BUCKET_COUNT - 1)) + SUB_BUCKET_COUNT;
+        return ((subBucket + 1) << shift) - 1;
+    }
+
+    // value at percentile p (0 to 1) of merged counts (BUCKET_COUNT long), within
+    // the precision of a bucket and never above max
+    [[nodiscard]] static uint64_t get_percentile(const uint64_t* counts, uint64_t total, uint64_t max, double p) noexcept {
+        if (!total) {
+            return 0;
+        }
+        const uint64_t rank = static_cast<uint64_t>(p * static_cast<double>(total - 1)) + 1;
+        uint64_t seen = 0;
+        for (uint32_t i = 0; i < BUCKET_COUNT; ++i) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return std::min(get_bucket_value(i), max);
+            }
+        }
+        return max;
+    }
+
+    void record(uint64_t value) noexcept {
+        auto& counter = _counts[get_bucket_index(value)];
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        _sum.store(_sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        if (value > _max.load(std::memory_order_relaxed)) {
+            _max.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    // adds this histogram's counts to counts (BUCKET_COUNT long)
+    void merge_into(uint64_t* counts, uint64_t& sum, uint64_t& max) const noexcept {
+        for (uint32_t i = 0; i < BUCKET_COUNT; ++i) {
+            counts[i] += _counts[i].load(std::memory_order_relaxed);
+        }
+        sum += _sum.load(std::memory_order_relaxed);
+        max = std::max(max, _max.load(std::memory_order_relaxed));
+    }
+
+private:
+    static uint32_t count_leading_zeros(uint64_t value) noexcept {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse64(&index, value);
+        return 63 - index;
+#else
+        return static_cast<uint32_t>(__builtin_clzll(value));
+#endif
+    }
+
+    std::array<std::atomic<uint64_t>, BUCKET_COUNT> _counts{};
+    std::atomic<uint64_t> _sum{ 0 };
+    std::atomic<uint64_t> _max{ 0 };
+};
+
+// what we publish for a (stage, packet type): values in ns
+struct summary {
+    uint64_t _count = 0;
+    double _p50 = 0;
+    double _p99 = 0;
+    double _p999 = 0;
+    double _max = 0;
+    double _sum = 0;
+};
+
+/*
+ * One histogram per (stage, packet type) and per thread, allocated the first time
+ * the thread records for that pair. Reading merges the histograms of every thread
+ * that ever recorded, so the hot path never shares a cache line with another thread.
+ */
+class registry {
+public:
+    static constexpr size_t MAX_THREADS = 256;
+    static constexpr size_t SLOT_COUNT = static_cast<size_t>(stage::COUNT) * PACKET_TYPE_COUNT;
+
+    static registry& instance() {
+        static registry instance;
+        return instance;
+    }
+
+    void record(stage s, packet_type type, ticks elapsed) noexcept {
+        thread_histograms* local = get_thread_histograms();
+        if (!local) {
+            return;
+        }
+        const size_t slot = get_slot(s, type);
+        histogram* h = local->_slots[slot].load(std::memory_order_relaxed);
+        if (!h) {
+            h = new (std::nothrow) histogram();
+            if (!h) {
+                return;
+            }
+            local->_slots[slot].store(h, std::memory_order_release);
+            _histogramCount.fetch_add(1, std::memory_order_relaxed);
+        }
+        h->record(elapsed);
+    }
+
+    [[nodiscard]] summary summarize(stage s, packet_type type) const {
+        std::vector<uint64_t> counts(histogram::BUCKET_COUNT, 0);
+        uint64_t sumTicks = 0;
+        uint64_t maxTicks = 0;
+        const size_t slot = get_slot(s, type);
+        const size_t threadCount = _threadCount.load(std::memory_order_acquire);
+        for (size_t i = 0; i < threadCount; ++i) {
+            const histogram* h = _threads[i].load(std::memory_order_acquire)->_slots[slot].load(std::memory_order_acquire);
+            if (h) {
+                h->merge_into(counts.data(), sumTicks, maxTicks);
+            }
+        }
+
+        summary result;
+        for (uint64_t count : counts) {
+            result._count += count;
+        }
+        if (!result._count) {
+            return result;
+        }
+
+        const double nsPerTick = _clock.get_ns_per_tick();
+        auto percentile = [&counts, &result, nsPerTick, maxTicks](double p) {
+            return static_cast<double>(histogram::get_percentile(counts.data(), result._count, maxTicks, p)) * nsPerTick;
+        };
+        result._p50 = percentile(0.5);
+        result._p99 = percentile(0.99);
+        result._p999 = percentile(0.999);
+        result._max = static_cast<double>(maxTicks) * nsPerTick;
+        result._sum = static_cast<double>(sumTicks) * nsPerTick;
+        return result;
+    }
+
+    // what the histograms take, in bytes
+    [[nodiscard]] size_t memory_usage() const noexcept {
+        return _threadCount.load(std::memory_order_relaxed) * sizeof(thread_histograms)
+            + _histogramCount.load(std::memory_order_relaxed) * sizeof(histogram);
+    }
+
+private:
+    registry() = default;
+
+    struct thread_histograms {
+        std::array<std::atomic<histogram*>, SLOT_COUNT> _slots{};
+    };
+
+    static constexpr size_t get_slot(stage s, packet_type type) noexcept {
+        return static_cast<size_t>(s) * PACKET_TYPE_COUNT
+            + std::min(static_cast<size_t>(type), PACKET_TYPE_COUNT - 1);
+    }
+
+    // histograms are never freed: threads come and go rarely (the io threads live
+    // as long as the server) and their counts must survive them
+    thread_histograms* get_thread_histograms() noexcept {
+        static thread_local thread_histograms* local = register_thread();
+        return local;
+    }
+
+    thread_histograms* register_thread() noexcept {
+        std::scoped_lock lock(_mutex);
+        const size_t threadCount = _threadCount.load(std::memory_order_relaxed);
+        if (threadCount == MAX_THREADS) {
+            return nullptr;
+        }
+        auto* local = new (std::nothrow) thread_histograms();
+        if (!local) {
+            return nullptr;
+        }
+        _threads[threadCount].store(local, std::memory_order_release);
+        _threadCount.store(threadCount + 1, std::memory_order_release);
+        return local;
+    }
+
+    std::array<std::atomic<thread_histograms*>, MAX_THREADS> _threads{};
+    std::atomic<size_t> _threadCount{ 0 };
+    std::atomic<size_t> _histogramCount{ 0 };
+    std::mutex _mutex;
+    // taken when the registry is created, which the server does as it starts
+    const clock_reference _clock;
+};
+
+inline void record(stage s, packet_type type, ticks start) noexcept {
+    registry::instance().record(s, type, now() - start);
+}
+
+[[nodiscard]] inline summary summarize(stage s, packet_type type) {
+    return registry::instance().summarize(s, type);
+}
+
+// calls fn(stage, packet_type, summary) for every pair that recorded something
+template <typename Fn>
+void for_each_summary(Fn&& fn) {
+    for (size_t s = 0; s < static_cast<size_t>(stage::COUNT); ++s) {
+        for (size_t t = 0; t < PACKET_TYPE_COUNT; ++t) {
+            const summary result = summarize(static_cast<stage>(s), static_cast<packet_type>(t));
+            if (result._count) {
+                fn(static_cast<stage>(s), static_cast<packet_type>(t), result);
+            }
+        }
+    }
+}
+
+// records the time spent in a scope
+class scoped_timer {
+public:
+    scoped_timer(stage s, packet_type type) noexcept :
+        _start(now()), _stage(s), _type(type) {}
+
+    ~scoped_timer() {
+        record(_stage, _type, _start);
+    }
+
+    scoped_timer(const scoped_timer&) = delete;
+    scoped_timer& operator=(const scoped_timer&) = delete;
+
+private:
+    ticks _start;
+    stage _stage;
+    packet_type _type;
+};
+
+} // namespace latency
+
+} // namespace lmqtt
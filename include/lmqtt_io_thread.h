@@ -0,0 +1,107 @@
+#pragma once
+
+#include "lmqtt_common.h"
+#include "lmqtt_log.h"
+
+#include <cctype>
+#include <cstring>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <dirent.h>
+#endif
+
+namespace lmqtt {
+
+namespace io_thread {
+
+// pins the calling thread to one core. What it allocates and writes first from
+// then on (slabs, buffers, outbound queues: the io thread allocates all of them)
+// is placed on that core's NUMA node by the kernel's first touch policy
+[[nodiscard]] inline return_code pin_current_thread(int cpu) {
+#if defined(__linux__)
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return return_code::FAIL;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) != 0) {
+        return return_code::FAIL;
+    }
+    return return_code::OK;
+#else
+    return return_code::FAIL;
+#endif
+}
+
+// NUMA node of a core, -1 if the platform does not say
+[[nodiscard]] inline int get_cpu_node(int cpu) {
+#if defined(__linux__)
+    const std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    DIR* dir = ::opendir(path.c_str());
+    if (!dir) {
+        return -1;
+    }
+    int node = -1;
+    // the core's directory has a nodeN link to its node
+    while (const dirent* entry = ::readdir(dir)) {
+        if (std::strncmp(entry->d_name, "node", 4) == 0 && std::isdigit(static_cast<unsigned char>(entry->d_name[4]))) {
+            node = std::atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    ::closedir(dir);
+    return node;
+#else
+    return -1;
+#endif
+}
+
+// SO_BUSY_POLL: the kernel spins on the device queue for that long before a read or
+// an epoll wait on the socket sleeps (epoll also needs net.core.busy_poll). Raising
+// it takes CAP_NET_ADMIN
+[[nodiscard]] inline return_code set_socket_busy_poll(int fd, uint32_t microseconds) {
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+    const int value = static_cast<int>(microseconds);
+    if (::setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value)) != 0) {
+        return return_code::FAIL;
+    }
+    return return_code::OK;
+#else
+    return return_code::FAIL;
+#endif
+}
+
+/*
+ * Runs the context on the calling thread until it is stopped. With a busy poll
+ * budget, the thread polls the context without sleeping for as long as handlers
+ * keep coming, and for the budget after the last one: a packet arriving meanwhile
+ * is read without waking a sleeping thread up (the scheduler's wakeup latency is
+ * most of a loopback round trip). Past the budget it sleeps in the reactor until
+ * something comes. The core is kept busy either way, give it one of its own.
+ */
+inline void run(asio::io_context& context, std::chrono::microseconds busyPoll) {
+    if (busyPoll.count() <= 0) {
+        context.run();
+        return;
+    }
+    using clock = std::chrono::steady_clock;
+    while (!context.stopped()) {
+        auto deadline = clock::now() + busyPoll;
+        while (!context.stopped() && clock::now() < deadline) {
+            if (context.poll()) {
+                deadline = clock::now() + busyPoll;
+            }
+        }
+        if (context.stopped() || !context.run_one()) {
+            return;
+        }
+    }
+}
+
+} // namespace io_thread
+
+} // namespace lmqtt
@@ -0,0 +1,538 @@
+#pragma once
+
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <type_traits>
+
+#include "lmqtt_common.h"
+
+// Compile time log level: calls below it are removed by the preprocessor, their
+// arguments are not even evaluated.
+#define LMQTT_LOG_LEVEL_TRACE 0
+#define LMQTT_LOG_LEVEL_DEBUG 1
+#define LMQTT_LOG_LEVEL_INFO 2
+#define LMQTT_LOG_LEVEL_WARNING 3
+#define LMQTT_LOG_LEVEL_ERROR 4
+#define LMQTT_LOG_LEVEL_OFF 5
+
+#ifndef LMQTT_LOG_LEVEL
+#define LMQTT_LOG_LEVEL LMQTT_LOG_LEVEL_INFO
+#endif
+
+// how many records a single call site can log per second, the rest is counted
+// and reported with the next record of that site
+#ifndef LMQTT_LOG_RATE_LIMIT
+#define LMQTT_LOG_RATE_LIMIT 100
+#endif
+
+namespace lmqtt {
+
+namespace log {
+
+enum class level : uint8_t {
+    TRACE       = LMQTT_LOG_LEVEL_TRACE,
+    DEBUG       = LMQTT_LOG_LEVEL_DEBUG,
+    INFO        = LMQTT_LOG_LEVEL_INFO,
+    // not WARNING/ERROR, windows headers define ERROR as a macro
+    WARN        = LMQTT_LOG_LEVEL_WARNING,
+    ERR         = LMQTT_LOG_LEVEL_ERROR
+};
+
+constexpr const char* get_level_string(level lvl) noexcept {
+    switch (lvl) {
+    case level::TRACE:      return "TRACE";
+    case level::DEBUG:      return "DEBUG";
+    case level::INFO:       return "INFO ";
+    case level::WARN:       return "WARN ";
+    case level::ERR:        return "ERROR";
+    default:                return "?????";
+    }
+    return ""; // keep the compiler happy
+}
+
+// Everything about a log statement that is known at compile time. There is one
+// static instance per call site, records only point to it.
+struct site {
+    level _level;
+    const char* _file;
+    uint32_t _line;
+    const char* _format; // '{}' is replaced by the next argument
+
+    // rate limiting, approximate on purpose: relaxed atomics and one second windows
+    std::atomic<int64_t> _window{ 0 };
+    std::atomic<uint32_t> _count{ 0 };
+    std::atomic<uint32_t> _suppressed{ 0 };
+
+    site(level lvl, const char* file, uint32_t line, const char* format) noexcept :
+        _level(lvl), _file(file), _line(line), _format(format) {}
+
+    [[nodiscard]] bool allow() noexcept {
+        const int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        if (_window.load(std::memory_order_relaxed) != now) {
+            _window.store(now, std::memory_order_relaxed);
+            _count.store(0, std::memory_order_relaxed);
+        }
+        if (_count.fetch_add(1, std::memory_order_relaxed) < LMQTT_LOG_RATE_LIMIT) {
+            return true;
+        }
+        _suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+};
+
+enum class arg_type : uint8_t {
+    INT,
+    UINT,
+    DOUBLE,
+    BOOL,
+    CHAR,
+    POINTER,
+    STRING
+};
+
+// A log statement as it travels from the calling thread to the writer thread:
+// a fixed size, binary copy of the arguments. Formatting happens on the writer.
+struct record {
+    static constexpr size_t SIZE = 128;
+    static constexpr size_t MAX_ARGS = 8;
+
+    int64_t _timestamp; // ns since epoch
+    const site* _site;
+    uint32_t _suppressed; // records of this site dropped by the rate limit before this one
+    uint8_t _argCount;
+    uint8_t _size; // used bytes of _data
+    arg_type _types[MAX_ARGS];
+    uint8_t _data[SIZE - 8 - sizeof(const site*) - 4 - 2 - MAX_ARGS];
+};
+static_assert(sizeof(record) == record::SIZE, "log records must stay fixed size");
+
+// Lock free single producer (the owning thread) / single consumer (the writer
+// thread) ring of records.
+class ring {
+public:
+    static constexpr size_t CAPACITY = 1024; // 128 KO per thread
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "ring capacity must be a power of 2");
+
+    // a slot to fill, nullptr if the ring is full (the record is dropped)
+    [[nodiscard]] record* reserve() noexcept {
+        const uint64_t head = _head.load(std::memory_order_relaxed);
+        if (head - _tail.load(std::memory_order_acquire) >= CAPACITY) {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        return &_records[head & (CAPACITY - 1)];
+    }
+
+    void commit() noexcept {
+        _head.store(_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    [[nodiscard]] const record* front() const noexcept {
+        const uint64_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail == _head.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return &_records[tail & (CAPACITY - 1)];
+    }
+
+    void pop() noexcept {
+        _tail.store(_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    [[nodiscard]] bool empty() const noexcept {
+        return _tail.load(std::memory_order_acquire) == _head.load(std::memory_order_acquire);
+    }
+
+    [[nodiscard]] uint64_t take_dropped() noexcept {
+        return _dropped.exchange(0, std::memory_order_relaxed);
+    }
+
+    // a ring whose thread exited is given to the next new thread once drained
+    std::atomic<bool> _inUse{ true };
+
+private:
+    std::array<record, CAPACITY> _records;
+    alignas(64) std::atomic<uint64_t> _head{ 0 };
+    alignas(64) std::atomic<uint64_t> _tail{ 0 };
+    std::atomic<uint64_t> _dropped{ 0 };
+};
+
+/*
+ * The logging backend. A call site copies its arguments into a record of its
+ * thread's ring (no lock, no allocation, no syscall) and returns. A background
+ * thread drains the rings, formats the records and writes them in batches.
+ *
+ * If a ring is full the record is dropped and counted, logging never blocks the
+ * caller. Records of one thread are written in order, records of different
+ * threads are not merged by timestamp.
+ */
+class logger {
+public:
+    static constexpr size_t MAX_RINGS = 256;
+
+    static logger& instance() {
+        static logger instance;
+        return instance;
+    }
+
+    template <typename... Args>
+    void push(site& callSite, const Args&... args) noexcept {
+        static_assert(sizeof...(Args) <= record::MAX_ARGS, "too many log arguments");
+
+        ring* threadRing = get_thread_ring();
+        if (!threadRing) {
+            return;
+        }
+        record* rec = threadRing->reserve();
+        if (!rec) {
+            return;
+        }
+
+        rec->_timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        rec->_site = &callSite;
+        rec->_suppressed = callSite._suppressed.exchange(0, std::memory_order_relaxed);
+        rec->_argCount = 0;
+        rec->_size = 0;
+        (encode(*rec, args), ...);
+        threadRing->commit();
+    }
+
+    // where formatted records go, stdout by default
+    void set_output(std::FILE* output) noexcept {
+        _output.store(output, std::memory_order_relaxed);
+    }
+
+    // records lost because a ring was full, since the start
+    [[nodiscard]] uint64_t dropped_count() const noexcept {
+        return _droppedTotal.load(std::memory_order_relaxed);
+    }
+
+    // what the rings take, in bytes
+    [[nodiscard]] size_t memory_usage() const noexcept {
+        return _ringCount.load(std::memory_order_relaxed) * sizeof(ring);
+    }
+
+    // blocks until everything logged before the call is written
+    void flush() {
+        for (;;) {
+            bool empty = true;
+            const size_t ringCount = _ringCount.load(std::memory_order_acquire);
+            for (size_t i = 0; i < ringCount; ++i) {
+                if (!_rings[i].load(std::memory_order_acquire)->empty()) {
+                    empty = false;
+                    break;
+                }
+            }
+            if (empty && !_writing.load(std::memory_order_acquire)) {
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+
+    ~logger() {
+        _exit = true;
+        if (_writerThread.joinable()) {
+            _writerThread.join();
+        }
+        // whatever is left
+        drain();
+        for (size_t i = 0; i < _ringCount.load(); ++i) {
+            delete _rings[i].load();
+        }
+    }
+
+private:
+    logger() {
+        _writerThread = std::thread([this]() { writer_job(); });
+    }
+
+    logger(const logger&) = delete;
+    logger& operator=(const logger&) = delete;
+
+    // releases the thread's ring when the thread exits
+    struct thread_ring {
+        ring* _ring = nullptr;
+        ~thread_ring() {
+            if (_ring) {
+                _ring->_inUse.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    ring* get_thread_ring() noexcept {
+        static thread_local thread_ring threadRing;
+        if (!threadRing._ring) {
+            threadRing._ring = acquire_ring();
+        }
+        return threadRing._ring;
+    }
+
+    // only called once per thread
+    ring* acquire_ring() noexcept {
+        std::scoped_lock lock(_ringsMutex);
+        const size_t ringCount = _ringCount.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < ringCount; ++i) {
+            ring* candidate = _rings[i].load(std::memory_order_relaxed);
+            if (!candidate->_inUse.load(std::memory_order_acquire) && candidate->empty()) {
+                candidate->_inUse.store(true, std::memory_order_relaxed);
+                return candidate;
+            }
+        }
+        if (ringCount == MAX_RINGS) {
+            return nullptr;
+        }
+        ring* newRing = new (std::nothrow) ring();
+        if (!newRing) {
+            return nullptr;
+        }
+        _rings[ringCount].store(newRing, std::memory_order_release);
+        _ringCount.store(ringCount + 1, std::memory_order_release);
+        return newRing;
+    }
+
+    // arguments encoding: a type tag, then the raw bytes (strings are truncated
+    // to what is left in the record)
+    template <typename T>
+    static void encode(record& rec, const T& arg) noexcept {
+        if (rec._argCount == record::MAX_ARGS) {
+            return;
+        }
+
+        using type = std::decay_t<T>;
+        if constexpr (std::is_same_v<type, bool>) {
+            write_scalar(rec, arg_type::BOOL, static_cast<uint64_t>(arg));
+        } else if constexpr (std::is_same_v<type, char>) {
+            write_scalar(rec, arg_type::CHAR, static_cast<uint64_t>(arg));
+        } else if constexpr (std::is_enum_v<type>) {
+            write_scalar(rec, arg_type::UINT, static_cast<uint64_t>(arg));
+        } else if constexpr (std::is_integral_v<type> && std::is_signed_v<type>) {
+            write_scalar(rec, arg_type::INT, static_cast<uint64_t>(static_cast<int64_t>(arg)));
+        } else if constexpr (std::is_integral_v<type>) {
+            write_scalar(rec, arg_type::UINT, static_cast<uint64_t>(arg));
+        } else if constexpr (std::is_floating_point_v<type>) {
+            const double value = static_cast<double>(arg);
+            uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            write_scalar(rec, arg_type::DOUBLE, bits);
+        } else if constexpr (std::is_same_v<type, const char*> || std::is_same_v<type, char*>) {
+            write_string(rec, arg ? std::string_view(arg) : std::string_view("(null)"));
+        } else if constexpr (std::is_convertible_v<const type&, std::string_view>) {
+            write_string(rec, std::string_view(arg));
+        } else if constexpr (std::is_pointer_v<type>) {
+            write_scalar(rec, arg_type::POINTER, reinterpret_cast<uint64_t>(arg));
+        } else {
+            static_assert(sizeof(type) == 0, "unsupported log argument type");
+        }
+    }
+
+    static void write_scalar(record& rec, arg_type type, uint64_t value) noexcept {
+        if (sizeof(rec._data) - rec._size < sizeof(value)) {
+            return;
+        }
+        std::memcpy(rec._data + rec._size, &value, sizeof(value));
+        rec._size += sizeof(value);
+        rec._types[rec._argCount++] = type;
+    }
+
+    static void write_string(record& rec, std::string_view str) noexcept {
+        const size_t available = sizeof(rec._data) - rec._size;
+        if (!available) {
+            return;
+        }
+        const uint8_t length = static_cast<uint8_t>(std::min(str.size(), available - 1));
+        rec._data[rec._size++] = length;
+        std::memcpy(rec._data + rec._size, str.data(), length);
+        rec._size += length;
+        rec._types[rec._argCount++] = arg_type::STRING;
+    }
+
+    // appends the next argument of rec, starting at offset
+    static void format_arg(std::string& out, const record& rec, uint8_t index, size_t& offset) {
+        char buff[32];
+        if (rec._types[index] == arg_type::STRING) {
+            const uint8_t length = rec._data[offset++];
+            out.append(reinterpret_cast<const char*>(rec._data + offset), length);
+            offset += length;
+            return;
+        }
+
+        uint64_t value;
+        std::memcpy(&value, rec._data + offset, sizeof(value));
+        offset += sizeof(value);
+        int length = 0;
+        switch (rec._types[index]) {
+        case arg_type::INT:
+            length = std::snprintf(buff, sizeof(buff), "%lld", static_cast<long long>(static_cast<int64_t>(value)));
+            break;
+        case arg_type::UINT:
+            length = std::snprintf(buff, sizeof(buff), "%llu", static_cast<unsigned long long>(value));
+            break;
+        case arg_type::DOUBLE:
+        {
+            double d;
+            std::memcpy(&d, &value, sizeof(d));
+            length = std::snprintf(buff, sizeof(buff), "%g", d);
+            break;
+        }
+        case arg_type::BOOL:
+            length = std::snprintf(buff, sizeof(buff), "%s", value ? "true" : "false");
+            break;
+        case arg_type::CHAR:
+            buff[0] = static_cast<char>(value);
+            length = 1;
+            break;
+        case arg_type::POINTER:
+            length = std::snprintf(buff, sizeof(buff), "0x%llx", static_cast<unsigned long long>(value));
+            break;
+        default:
+            break;
+        }
+        out.append(buff, length > 0 ? length : 0);
+    }
+
+    static void format(std::string& out, const record& rec) {
+        const site& callSite = *rec._site;
+
+        // 12:34:56.123456 [INFO ]
+        const time_t seconds = static_cast<time_t>(rec._timestamp / 1000000000);
+        std::tm tm{};
+#ifdef _WIN32
+        localtime_s(&tm, &seconds);
+#else
+        localtime_r(&seconds, &tm);
+#endif
+        char prefix[48];
+        const int prefixLength = std::snprintf(
+            prefix, sizeof(prefix), "%02d:%02d:%02d.%06lld [%s] ",
+            tm.tm_hour, tm.tm_min, tm.tm_sec,
+            static_cast<long long>((rec._timestamp / 1000) % 1000000),
+            get_level_string(callSite._level)
+        );
+        out.append(prefix, prefixLength > 0 ? prefixLength : 0);
+
+        size_t offset = 0;
+        uint8_t argIndex = 0;
+        for (const char* c = callSite._format; *c; ++c) {
+            if (c[0] == '{' && c[1] == '}') {
+                if (argIndex < rec._argCount) {
+                    format_arg(out, rec, argIndex++, offset);
+                }
+                ++c;
+                continue;
+            }
+            out.push_back(*c);
+        }
+
+        if (rec._suppressed) {
+            out.append(" (").append(std::to_string(rec._suppressed)).append(" similar records suppressed)");
+        }
+        out.push_back('\n');
+    }
+
+    // formats and writes everything currently in the rings, returns false if
+    // there was nothing to write
+    bool drain() {
+        _writing.store(true, std::memory_order_release);
+        _buffer.clear();
+        const size_t ringCount = _ringCount.load(std::memory_order_acquire);
+        for (size_t i = 0; i < ringCount; ++i) {
+            ring* r = _rings[i].load(std::memory_order_acquire);
+            if (const uint64_t dropped = r->take_dropped()) {
+                _droppedTotal.fetch_add(dropped, std::memory_order_relaxed);
+                _buffer.append("[log] ").append(std::to_string(dropped)).append(" records dropped, ring full\n");
+            }
+            while (const record* rec = r->front()) {
+                format(_buffer, *rec);
+                r->pop();
+            }
+        }
+        if (!_buffer.empty()) {
+            std::FILE* output = _output.load(std::memory_order_relaxed);
+            std::fwrite(_buffer.data(), 1, _buffer.size(), output);
+            std::fflush(output);
+        }
+        _writing.store(false, std::memory_order_release);
+        return !_buffer.empty();
+    }
+
+    void writer_job() {
+        while (!_exit) {
+            if (!drain()) {
+                // nothing to do: do not spin, a millisecond of latency is fine for logs
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+
+    std::array<std::atomic<ring*>, MAX_RINGS> _rings{};
+    std::atomic<size_t> _ringCount{ 0 };
+    std::mutex _ringsMutex;
+
+    std::atomic<std::FILE*> _output{ stdout };
+    std::string _buffer; // only used by the writer thread
+    std::atomic<bool> _writing{ false };
+    std::atomic<uint64_t> _droppedTotal{ 0 };
+    std::atomic<bool> _exit{ false };
+    std::thread _writerThread;
+};
+
+// what a compiled out level does with its arguments: nothing, but they are still
+// referenced so what is only logged does not become unused
+template <typename... Args>
+constexpr void discard(const Args&...) noexcept {}
+
+} // namespace log
+
+} // namespace lmqtt
+
+// one static site per call site, the arguments are copied only if the rate limit
+// lets the record through
+#define LMQTT_LOG(lvl, format, ...) \
+    do { \
+        static ::lmqtt::log::site lmqttLogSite(lvl, __FILE__, __LINE__, format); \
+        if (lmqttLogSite.allow()) { \
+            ::lmqtt::log::logger::instance().push(lmqttLogSite __VA_OPT__(,) __VA_ARGS__); \
+        } \
+    } while (0)
+
+// a compiled out level, its arguments are never evaluated
+#define LMQTT_LOG_DISCARD(...) \
+    do { \
+        if constexpr (false) { \
+            ::lmqtt::log::discard(__VA_ARGS__); \
+        } \
+    } while (0)
+
+#if LMQTT_LOG_LEVEL <= LMQTT_LOG_LEVEL_TRACE
+#define LMQTT_LOG_TRACE(...) LMQTT_LOG(::lmqtt::log::level::TRACE, __VA_ARGS__)
+#else
+#define LMQTT_LOG_TRACE(...) LMQTT_LOG_DISCARD(__VA_ARGS__)
+#endif
+
+#if LMQTT_LOG_LEVEL <= LMQTT_LOG_LEVEL_DEBUG
+#define LMQTT_LOG_DEBUG(...) LMQTT_LOG(::lmqtt::log::level::DEBUG, __VA_ARGS__)
+#else
+#define LMQTT_LOG_DEBUG(...) LMQTT_LOG_DISCARD(__VA_ARGS__)
+#endif
+
+#if LMQTT_LOG_LEVEL <= LMQTT_LOG_LEVEL_INFO
+#define LMQTT_LOG_INFO(...) LMQTT_LOG(::lmqtt::log::level::INFO, __VA_ARGS__)
+#else
+#define LMQTT_LOG_INFO(...) LMQTT_LOG_DISCARD(__VA_ARGS__)
+#endif
+
+#if LMQTT_LOG_LEVEL <= LMQTT_LOG_LEVEL_WARNING
+#define LMQTT_LOG_WARNING(...) LMQTT_LOG(::lmqtt::log::level::WARN, __VA_ARGS__)
+#else
+#define LMQTT_LOG_WARNING(...) LMQTT_LOG_DISCARD(__VA_ARGS__)
+#endif
+
+#if LMQTT_LOG_LEVEL <= LMQTT_LOG_LEVEL_ERROR
+#define LMQTT_LOG_ERROR(...) LMQTT_LOG(::lmqtt::log::level::ERR, __VA_ARGS__)
+#else
+#define LMQTT_LOG_ERROR(...) LMQTT_LOG_DISCARD(__VA_ARGS__)
+#endif
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "lmqtt_common.h"
+
+namespace lmqtt {
+
+namespace memory {
+
+// where the bytes a client makes us hold are
+enum class pool : uint8_t {
+    INBOUND,    // packet bodies being read
+    OUTBOUND,   // outbound queues
+    RETAINED,   // retained messages
+    OFFLINE,    // queued for disconnected sessions
+    COUNT
+};
+
+inline constexpr size_t POOL_COUNT = static_cast<size_t>(pool::COUNT);
+
+// past PAUSE_PERCENT of the budget, the governor stops reading from the clients
+// that hold the most, under RESUME_PERCENT it reads from them again
+inline constexpr uint64_t PAUSE_PERCENT = 90;
+inline constexpr uint64_t RESUME_PERCENT = 75;
+
+/*
+ * Broker wide memory budget. Every pool is charged where its bytes are taken and
+ * released (relaxed atomic adds, like the metrics), and checked before taking
+ * more: once the budget is exhausted, forwarded messages are dropped instead of
+ * queued. The server's governor (lmqtt_server.h) watches used() and pauses the
+ * biggest consumers long before that.
+ *
+ * A limit of 0 means no budget: the pools are still counted, for the exporter.
+ */
+struct budget {
+    std::array<std::atomic<int64_t>, POOL_COUNT> _used{};
+    std::atomic<uint64_t> _limit{ 0 };
+};
+
+// what every pool holds, the same for every file including us
+inline budget& get_budget() noexcept {
+    static budget instance;
+    return instance;
+}
+
+inline void set_limit(uint64_t limit) noexcept {
+    get_budget()._limit.store(limit, std::memory_order_relaxed);
+}
+
+[[nodiscard]] inline uint64_t get_limit() noexcept {
+    return get_budget()._limit.load(std::memory_order_relaxed);
+}
+
+inline void charge(pool p, int64_t delta) noexcept {
+    get_budget()._used[static_cast<size_t>(p)].fetch_add(delta, std::memory_order_relaxed);
+}
+
+[[nodiscard]] inline int64_t used(pool p) noexcept {
+    return get_budget()._used[static_cast<size_t>(p)].load(std::memory_order_relaxed);
+}
+
+[[nodiscard]] inline int64_t used() noexcept {
+    int64_t total = 0;
+    for (const auto& u : get_budget()._used) {
+        total += u.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+[[nodiscard]] inline bool is_exhausted() noexcept {
+    const uint64_t limit = get_limit();
+    return limit && used() >= static_cast<int64_t>(limit);
+}
+
+// what one client makes the broker hold: its inbound buffer, and the messages it
+// published that still wait in outbound queues (its subscribers' or its own).
+// That is what the governor sorts clients by. Io thread only
+struct account {
+    int64_t _bytes = 0;
+};
+
+} // namespace memory
+
+} // namespace lmqtt
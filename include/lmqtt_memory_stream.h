@@ -0,0 +1,389 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "lmqtt_common.h"
+#include "lmqtt_stream_utils.h"
+
+namespace lmqtt {
+
+/*
+ * One end of an in-memory duplex pipe, with the interface of a connected
+ * asio::ip::tcp::socket as far as basic_connection and simple clients use it
+ * (async and blocking reads and writes, shutdown, close). The broker can run its
+ * whole pipeline, framing, decoding, routing and encoding, with no kernel involved
+ * and no file descriptor per connection. Made in pairs by make_pair().
+ *
+ * Each direction is a byte buffer of at most CAPACITY bytes: a write completes once
+ * (some of) its bytes are in it, a read as soon as there are bytes, like a socket.
+ * Completions are posted to the end's executor, never run inline, and blocking
+ * calls wait on a condition variable, so the two ends can live on different threads.
+ */
+class memory_stream {
+public:
+    using executor_type = asio::any_io_executor;
+
+    static constexpr size_t CAPACITY = 1 << 20;
+    // writers waiting on a full direction go on once it is half empty, not for
+    // every byte read: fewer wake ups, bigger writes
+    static constexpr size_t RESUME_WRITE_ROOM = CAPACITY / 2;
+
+    [[nodiscard]] static std::pair<memory_stream, memory_stream> make_pair(
+        const executor_type& first,
+        const executor_type& second) {
+        auto shared = std::make_shared<pipe>();
+        return { memory_stream(shared, 0, first), memory_stream(shared, 1, second) };
+    }
+
+    memory_stream(memory_stream&&) noexcept = default;
+    memory_stream& operator=(memory_stream&& other) noexcept {
+        if (this != &other) {
+            std::error_code ignored;
+            close(ignored);
+            _pipe = std::move(other._pipe);
+            _side = other._side;
+            _executor = std::move(other._executor);
+        }
+        return *this;
+    }
+
+    ~memory_stream() {
+        std::error_code ignored;
+        close(ignored);
+    }
+
+    [[nodiscard]] executor_type get_executor() const noexcept {
+        return _executor;
+    }
+
+    [[nodiscard]] bool is_open() const noexcept {
+        return _pipe && _pipe->_open[_side].load(std::memory_order_acquire);
+    }
+
+    template <typename MutableBufferSequence, typename ReadHandler>
+    auto async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler) {
+        return asio::async_initiate<ReadHandler, void(std::error_code, size_t)>(
+            [this](auto&& completionHandler, asio::mutable_buffer buffer) {
+                start_read(buffer, make_completion(std::move(completionHandler)));
+            },
+            handler,
+            detail::get_first_buffer<asio::mutable_buffer>(buffers)
+        );
+    }
+
+    template <typename ConstBufferSequence, typename WriteHandler>
+    auto async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler) {
+        return asio::async_initiate<WriteHandler, void(std::error_code, size_t)>(
+            [this](auto&& completionHandler, asio::const_buffer buffer) {
+                start_write(buffer, make_completion(std::move(completionHandler)));
+            },
+            handler,
+            detail::get_first_buffer<asio::const_buffer>(buffers)
+        );
+    }
+
+    // blocking, for clients that run on their own thread (never the broker's)
+    template <typename MutableBufferSequence>
+    size_t read_some(const MutableBufferSequence& buffers, std::error_code& ec) {
+        const asio::mutable_buffer buffer = detail::get_first_buffer<asio::mutable_buffer>(buffers);
+        ec = std::error_code();
+        if (!is_open()) {
+            ec = asio::error::bad_descriptor;
+            return 0;
+        }
+        std::unique_lock lock(_pipe->_mutex);
+        channel& in = _pipe->_channels[_side];
+        ++_pipe->_blocked;
+        _pipe->_changed.wait(lock, [&]() { return in.size() || in._writeClosed || in._readClosed; });
+        --_pipe->_blocked;
+        if (in._readClosed) {
+            ec = asio::error::bad_descriptor;
+            return 0;
+        }
+        if (!in.size()) {
+            ec = asio::error::eof;
+            return 0;
+        }
+        const size_t size = in.read(buffer);
+        on_read(in);
+        return size;
+    }
+
+    template <typename MutableBufferSequence>
+    size_t read_some(const MutableBufferSequence& buffers) {
+        std::error_code ec;
+        const size_t size = read_some(buffers, ec);
+        if (ec) {
+            throw asio::system_error(ec);
+        }
+        return size;
+    }
+
+    template <typename ConstBufferSequence>
+    size_t write_some(const ConstBufferSequence& buffers, std::error_code& ec) {
+        const asio::const_buffer buffer = detail::get_first_buffer<asio::const_buffer>(buffers);
+        ec = std::error_code();
+        if (!is_open()) {
+            ec = asio::error::bad_descriptor;
+            return 0;
+        }
+        std::unique_lock lock(_pipe->_mutex);
+        channel& out = _pipe->_channels[1 - _side];
+        ++_pipe->_blocked;
+        _pipe->_changed.wait(lock, [&]() { return out.room() >= RESUME_WRITE_ROOM || out._readClosed || out._writeClosed; });
+        --_pipe->_blocked;
+        if (out._readClosed || out._writeClosed) {
+            ec = asio::error::broken_pipe;
+            return 0;
+        }
+        const size_t size = out.write(buffer);
+        on_written(out);
+        return size;
+    }
+
+    template <typename ConstBufferSequence>
+    size_t write_some(const ConstBufferSequence& buffers) {
+        std::error_code ec;
+        const size_t size = write_some(buffers, ec);
+        if (ec) {
+            throw asio::system_error(ec);
+        }
+        return size;
+    }
+
+    // the peer reads what was written, then gets eof
+    void shutdown(asio::socket_base::shutdown_type what, std::error_code& ec) {
+        ec = std::error_code();
+        if (!is_open()) {
+            ec = asio::error::not_connected;
+            return;
+        }
+        std::scoped_lock lock(_pipe->_mutex);
+        if (what != asio::socket_base::shutdown_receive) {
+            close_write(_pipe->_channels[1 - _side]);
+        }
+        if (what != asio::socket_base::shutdown_send) {
+            close_read(_pipe->_channels[_side]);
+        }
+        notify();
+    }
+
+    // pending operations of this end fail with operation_aborted
+    void close(std::error_code& ec) {
+        ec = std::error_code();
+        if (!is_open()) {
+            return;
+        }
+        std::scoped_lock lock(_pipe->_mutex);
+        _pipe->_open[_side].store(false, std::memory_order_release);
+        channel& in = _pipe->_channels[_side];
+        channel& out = _pipe->_channels[1 - _side];
+        close_read(in);
+        close_write(out);
+        if (in._pendingRead) {
+            std::exchange(in._pendingRead, nullptr)->post(asio::error::operation_aborted, 0);
+        }
+        if (out._pendingWrite) {
+            std::exchange(out._pendingWrite, nullptr)->post(asio::error::operation_aborted, 0);
+        }
+        notify();
+    }
+
+    void close() {
+        std::error_code ignored;
+        close(ignored);
+    }
+
+private:
+    // a completion handler waiting for the other end, type erased
+    class completion {
+    public:
+        virtual ~completion() = default;
+        virtual void post(std::error_code ec, size_t size) = 0;
+    };
+
+    template <typename Handler>
+    class handler_completion : public completion {
+    public:
+        handler_completion(Handler handler, const executor_type& executor) :
+            _handler(std::move(handler)),
+            // keeps run() from returning while we wait
+            _work(asio::prefer(executor, asio::execution::outstanding_work.tracked)) {}
+
+        void post(std::error_code ec, size_t size) override {
+            detail::post_completion(std::move(_handler), _work, ec, size);
+        }
+
+    private:
+        Handler _handler;
+        executor_type _work;
+    };
+
+    // one direction of the pipe, written by one end and read by the other
+    struct channel {
+        std::vector<uint8_t> _data;
+        size_t _readOffset = 0;
+        bool _writeClosed = false;  // the writer shut down: eof once drained
+        bool _readClosed = false;   // the reader is gone: writes fail
+
+        // at most one of each, asio composed operations never overlap them
+        asio::mutable_buffer _readBuffer;
+        std::unique_ptr<completion> _pendingRead;
+        asio::const_buffer _writeBuffer;
+        std::unique_ptr<completion> _pendingWrite;
+
+        [[nodiscard]] size_t size() const noexcept {
+            return _data.size() - _readOffset;
+        }
+
+        [[nodiscard]] size_t room() const noexcept {
+            return CAPACITY - size();
+        }
+
+        size_t read(asio::mutable_buffer buffer) noexcept {
+            const size_t toRead = std::min(size(), buffer.size());
+            std::memcpy(buffer.data(), _data.data() + _readOffset, toRead);
+            _readOffset += toRead;
+            if (_readOffset == _data.size()) {
+                _data.clear();
+                _readOffset = 0;
+            }
+            return toRead;
+        }
+
+        size_t write(asio::const_buffer buffer) {
+            const size_t toWrite = std::min(room(), buffer.size());
+            // what was read goes away once it is most of the buffer
+            if (_readOffset > _data.size() / 2) {
+                _data.erase(_data.begin(), _data.begin() + _readOffset);
+                _readOffset = 0;
+            }
+            const uint8_t* data = static_cast<const uint8_t*>(buffer.data());
+            _data.insert(_data.end(), data, data + toWrite);
+            return toWrite;
+        }
+    };
+
+    struct pipe {
+        std::mutex _mutex;
+        // for blocking calls, only notified when one of them waits
+        std::condition_variable _changed;
+        uint32_t _blocked = 0;
+        // channel i is read by end i
+        std::array<channel, 2> _channels;
+        std::array<std::atomic<bool>, 2> _open{ true, true };
+    };
+
+    memory_stream(std::shared_ptr<pipe> shared, size_t side, executor_type executor) :
+        _pipe(std::move(shared)), _side(side), _executor(std::move(executor)) {}
+
+    template <typename Handler>
+    [[nodiscard]] std::unique_ptr<completion> make_completion(Handler&& handler) {
+        return std::make_unique<handler_completion<std::decay_t<Handler>>>(std::forward<Handler>(handler), _executor);
+    }
+
+    // called with the mutex held: room was made, a waiting writer can go on
+    void on_read(channel& in) {
+        if (in.room() < RESUME_WRITE_ROOM) {
+            return;
+        }
+        if (in._pendingWrite) {
+            const size_t written = in.write(in._writeBuffer);
+            std::exchange(in._pendingWrite, nullptr)->post(std::error_code(), written);
+        }
+        notify();
+    }
+
+    // called with the mutex held
+    void notify() {
+        if (_pipe->_blocked) {
+            _pipe->_changed.notify_all();
+        }
+    }
+
+    // called with the mutex held: there is something to read
+    void on_written(channel& out) {
+        if (out._pendingRead) {
+            const size_t read = out.read(out._readBuffer);
+            std::exchange(out._pendingRead, nullptr)->post(std::error_code(), read);
+            // what that read made room for
+            on_read(out);
+            return;
+        }
+        notify();
+    }
+
+    void start_read(asio::mutable_buffer buffer, std::unique_ptr<completion> handler) {
+        if (!is_open()) {
+            handler->post(asio::error::bad_descriptor, 0);
+            return;
+        }
+        std::scoped_lock lock(_pipe->_mutex);
+        channel& in = _pipe->_channels[_side];
+        if (!buffer.size()) {
+            handler->post(std::error_code(), 0);
+        } else if (in.size()) {
+            const size_t size = in.read(buffer);
+            handler->post(std::error_code(), size);
+            on_read(in);
+        } else if (in._writeClosed || in._readClosed) {
+            handler->post(asio::error::eof, 0);
+        } else {
+            in._readBuffer = buffer;
+            in._pendingRead = std::move(handler);
+        }
+    }
+
+    void start_write(asio::const_buffer buffer, std::unique_ptr<completion> handler) {
+        if (!is_open()) {
+            handler->post(asio::error::bad_descriptor, 0);
+            return;
+        }
+        std::scoped_lock lock(_pipe->_mutex);
+        channel& out = _pipe->_channels[1 - _side];
+        if (out._readClosed || out._writeClosed) {
+            handler->post(asio::error::broken_pipe, 0);
+        } else if (!buffer.size()) {
+            handler->post(std::error_code(), 0);
+        } else if (out.room() >= std::min(buffer.size(), RESUME_WRITE_ROOM)) {
+            const size_t size = out.write(buffer);
+            handler->post(std::error_code(), size);
+            on_written(out);
+        } else {
+            out._writeBuffer = buffer;
+            out._pendingWrite = std::move(handler);
+        }
+    }
+
+    // called with the mutex held
+    static void close_write(channel& out) {
+        out._writeClosed = true;
+        if (out._pendingRead && !out.size()) {
+            std::exchange(out._pendingRead, nullptr)->post(asio::error::eof, 0);
+        }
+    }
+
+    // called with the mutex held
+    static void close_read(channel& in) {
+        in._readClosed = true;
+        in._data.clear();
+        in._readOffset = 0;
+        if (in._pendingWrite) {
+            std::exchange(in._pendingWrite, nullptr)->post(asio::error::broken_pipe, 0);
+        }
+    }
+
+    std::shared_ptr<pipe> _pipe;
+    size_t _side = 0;
+    executor_type _executor;
+};
+
+// for the logs, see get_remote_address(const asio::ip::tcp::socket&)
+[[nodiscard]] inline std::string get_remote_address(const memory_stream&) {
+    return "memory";
+}
+
+} // namespace lmqtt
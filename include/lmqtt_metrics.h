@@ -0,0 +1,108 @@
+#pragma once
+
+#include "lmqtt_common.h"
+#include "lmqtt_types.h"
+
+namespace lmqtt {
+
+namespace metrics {
+
+// packet types 0 to 15, plus UNKNOWN
+inline constexpr size_t PACKET_TYPE_COUNT = static_cast<size_t>(packet_type::UNKNOWN) + 1;
+
+/*
+ * Broker wide counters and gauges. They are bumped where things happen (relaxed
+ * atomic adds, nothing else) and read by the exporter (see lmqtt_metrics_exporter.h).
+ * Gauges that are cheaper to compute when read, like the number of sessions or
+ * subscriptions, are not in here: the server hands them to the exporter.
+ */
+struct broker_counters {
+    std::atomic<uint64_t> _connectionsAccepted{ 0 };
+    std::atomic<uint64_t> _connectionsRejected{ 0 };
+    // of those, closed because the broker held server_config::_maxConnections, or
+    // because their source address connected too often
+    std::atomic<uint64_t> _connectionsOverLimit{ 0 };
+    std::atomic<uint64_t> _connectsRateLimited{ 0 };
+
+    // TLS listeners (see lmqtt_tls.h): handshakes that went through, of those the
+    // ones resumed from a session ticket and the ones the kernel took over, and
+    // handshakes that failed or timed out
+    std::atomic<uint64_t> _tlsHandshakes{ 0 };
+    std::atomic<uint64_t> _tlsResumed{ 0 };
+    std::atomic<uint64_t> _tlsKernelOffloaded{ 0 };
+    std::atomic<uint64_t> _tlsHandshakeFailures{ 0 };
+
+    std::array<std::atomic<uint64_t>, PACKET_TYPE_COUNT> _packetsReceived{};
+    std::array<std::atomic<uint64_t>, PACKET_TYPE_COUNT> _packetsSent{};
+    std::atomic<uint64_t> _bytesReceived{ 0 };
+    std::atomic<uint64_t> _bytesSent{ 0 };
+
+    // outbound queues of every client
+    std::atomic<int64_t> _queuedBytes{ 0 };
+    std::atomic<int64_t> _queuedMessages{ 0 };
+    std::atomic<uint64_t> _messagesDropped{ 0 };
+    std::atomic<uint64_t> _queueOverflows{ 0 };
+    // queued messages replaced by a newer one of their topic
+    std::atomic<uint64_t> _messagesConflated{ 0 };
+    // clients disconnected with QUOTA_EXCEEDED (overflow_policy::DISCONNECT)
+    std::atomic<uint64_t> _quotaDisconnects{ 0 };
+    // forwarded messages bigger than the subscriber's Maximum Packet Size
+    std::atomic<uint64_t> _packetsTooLarge{ 0 };
+
+    // clients the memory governor stopped reading from
+    std::atomic<int64_t> _pausedReaders{ 0 };
+
+    // admission controller (see lmqtt_admission.h): its level, the publishers it
+    // stopped reading from, the CONNECTs answered SERVER_BUSY and the QoS 0
+    // messages thrown away
+    std::atomic<int64_t> _overloadLevel{ 0 };
+    std::atomic<int64_t> _overloadPausedReaders{ 0 };
+    std::atomic<uint64_t> _connectsBusy{ 0 };
+    std::atomic<uint64_t> _messagesShed{ 0 };
+
+    // rate limits (see lmqtt_rate_limit.h): reads put off until a client's buckets
+    // refilled, and QoS 1/2 PUBLISH packets refused with QUOTA_EXCEEDED
+    std::atomic<uint64_t> _readsThrottled{ 0 };
+    std::atomic<uint64_t> _publishesQuotaExceeded{ 0 };
+
+    // QoS 2 PUBLISH packets we sent a PUBREC for and that wait for their PUBREL
+    std::atomic<int64_t> _inflight{ 0 };
+};
+
+// inline: one instance for the whole program, not one per translation unit
+inline broker_counters& counters() noexcept {
+    static broker_counters instance;
+    return instance;
+}
+
+inline void add(std::atomic<uint64_t>& counter, uint64_t value = 1) noexcept {
+    counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+inline void add(std::atomic<int64_t>& gauge, int64_t value) noexcept {
+    gauge.fetch_add(value, std::memory_order_relaxed);
+}
+
+inline size_t get_type_index(packet_type type) noexcept {
+    return std::min(static_cast<size_t>(type), PACKET_TYPE_COUNT - 1);
+}
+
+// a whole packet came in, frameSize counts the fixed header
+inline void on_packet_received(packet_type type, uint64_t frameSize) noexcept {
+    broker_counters& c = counters();
+    add(c._packetsReceived[get_type_index(type)]);
+    add(c._bytesReceived, frameSize);
+}
+
+// the first byte of a packet is about to be written
+inline void on_packet_sent(packet_type type) noexcept {
+    add(counters()._packetsSent[get_type_index(type)]);
+}
+
+inline void on_bytes_sent(uint64_t size) noexcept {
+    add(counters()._bytesSent, size);
+}
+
+} // namespace metrics
+
+} // namespace lmqtt
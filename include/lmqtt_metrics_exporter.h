@@ -0,0 +1,526 @@
+#pragma once
+
+#include "lmqtt_common.h"
+#include "lmqtt_types.h"
+#include "lmqtt_utils.h"
+#include "lmqtt_log.h"
+#include "lmqtt_metrics.h"
+#include "lmqtt_histogram.h"
+#include "lmqtt_encoder.h"
+#include "lmqtt_outbound.h"
+#include "lmqtt_memory_budget.h"
+#include "lmqtt_subscriptions.h"
+#include "lmqtt_server_config.h"
+
+namespace lmqtt {
+
+namespace metrics {
+
+// what only the server knows, read when the metrics are collected
+struct server_gauges {
+    size_t _sessions = 0;
+    size_t _subscriptions = 0;
+    // retained messages are not stored yet, so this stays at 0
+    size_t _retained = 0;
+
+    // outbound queue of the clients furthest behind (server_config::_queueMetricsClients)
+    struct client_queue {
+        std::string _clientId;
+        size_t _bytes = 0;
+        size_t _messages = 0;
+    };
+    std::vector<client_queue> _clientQueues;
+};
+
+enum class metric_type : uint8_t {
+    COUNTER,
+    GAUGE,
+    SUMMARY
+};
+
+constexpr std::string_view get_metric_type_string(metric_type type) noexcept {
+    switch (type) {
+    case metric_type::COUNTER:      return "counter";
+    case metric_type::GAUGE:        return "gauge";
+    case metric_type::SUMMARY:      return "summary";
+    default:                        return "untyped";
+    }
+    return ""; // keep the compiler happy
+}
+
+// Where collect() writes the metrics. Each family is announced once, followed by
+// its samples. A sample has a Prometheus name (the family name, or the family
+// name + _sum/_count for summaries), Prometheus labels without the braces, and
+// the $SYS topic it is published on (empty if it is not published).
+class metrics_writer {
+public:
+    virtual ~metrics_writer() = default;
+
+    virtual void begin_family(std::string_view name, metric_type type, std::string_view help) = 0;
+
+    virtual void add_sample(std::string_view name, std::string_view labels, std::string_view topic, double value) = 0;
+};
+
+// integers are written without decimals, latencies with 3
+inline void append_value(std::string& out, double value) {
+    char buff[32];
+    int size;
+    if (value == static_cast<double>(static_cast<int64_t>(value))) {
+        size = std::snprintf(buff, sizeof(buff), "%lld", static_cast<long long>(value));
+    } else {
+        size = std::snprintf(buff, sizeof(buff), "%.3f", value);
+    }
+    if (size > 0) {
+        out.append(buff, std::min<size_t>(static_cast<size_t>(size), sizeof(buff) - 1));
+    }
+}
+
+// backslashes, double quotes and new lines are escaped in Prometheus label values
+inline void append_label_value(std::string& out, std::string_view value) {
+    for (const char c : value) {
+        switch (c) {
+        case '\\':   out.append("\\\\"); break;
+        case '"':    out.append("\\\""); break;
+        case '\n':   out.append("\\n"); break;
+        default:     out.push_back(c); break;
+        }
+    }
+}
+
+// Every metric of the broker. Names follow the Prometheus conventions, topics
+// follow the usual $SYS/broker/... tree.
+inline void collect(metrics_writer& writer, const server_gauges& gauges, std::chrono::steady_clock::time_point startTime) {
+    const broker_counters& c = counters();
+    auto load = [](const auto& value) {
+        return static_cast<double>(value.load(std::memory_order_relaxed));
+    };
+    // a negative gauge only means its updates were seen out of order
+    auto loadGauge = [](const std::atomic<int64_t>& value) {
+        return static_cast<double>(std::max<int64_t>(0, value.load(std::memory_order_relaxed)));
+    };
+
+    std::string labels;
+    std::string topic;
+
+    writer.begin_family("lmqtt_uptime_seconds", metric_type::GAUGE, "Time since the server started.");
+    writer.add_sample("lmqtt_uptime_seconds", "", "$SYS/broker/uptime",
+        static_cast<double>(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - startTime).count()));
+
+    writer.begin_family("lmqtt_connections_accepted_total", metric_type::COUNTER, "Connections accepted.");
+    writer.add_sample("lmqtt_connections_accepted_total", "", "$SYS/broker/clients/accepted", load(c._connectionsAccepted));
+
+    writer.begin_family("lmqtt_connections_rejected_total", metric_type::COUNTER, "Connections refused by the server.");
+    writer.add_sample("lmqtt_connections_rejected_total", "", "$SYS/broker/clients/rejected", load(c._connectionsRejected));
+
+    writer.begin_family("lmqtt_connections_over_limit_total", metric_type::COUNTER, "Connections closed because the broker held its maximum number of connections.");
+    writer.add_sample("lmqtt_connections_over_limit_total", "", "$SYS/broker/clients/over_limit", load(c._connectionsOverLimit));
+
+    writer.begin_family("lmqtt_connects_rate_limited_total", metric_type::COUNTER, "Connections closed because their source address went over its connect rate.");
+    writer.add_sample("lmqtt_connects_rate_limited_total", "", "$SYS/broker/clients/rate_limited", load(c._connectsRateLimited));
+
+    writer.begin_family("lmqtt_tls_handshakes_total", metric_type::COUNTER, "TLS handshakes that went through.");
+    writer.add_sample("lmqtt_tls_handshakes_total", "", "$SYS/broker/tls/handshakes", load(c._tlsHandshakes));
+
+    writer.begin_family("lmqtt_tls_resumed_total", metric_type::COUNTER, "TLS handshakes that resumed a session.");
+    writer.add_sample("lmqtt_tls_resumed_total", "", "$SYS/broker/tls/resumed", load(c._tlsResumed));
+
+    writer.begin_family("lmqtt_tls_kernel_offloaded_total", metric_type::COUNTER, "TLS connections whose records the kernel encrypts and decrypts.");
+    writer.add_sample("lmqtt_tls_kernel_offloaded_total", "", "$SYS/broker/tls/kernel_offloaded", load(c._tlsKernelOffloaded));
+
+    writer.begin_family("lmqtt_tls_handshake_failures_total", metric_type::COUNTER, "TLS handshakes that failed or timed out.");
+    writer.add_sample("lmqtt_tls_handshake_failures_total", "", "$SYS/broker/tls/handshake_failures", load(c._tlsHandshakeFailures));
+
+    writer.begin_family("lmqtt_sessions", metric_type::GAUGE, "Connected clients.");
+    writer.add_sample("lmqtt_sessions", "", "$SYS/broker/clients/connected", static_cast<double>(gauges._sessions));
+
+    auto packets = [&](std::string_view name, std::string_view help, std::string_view direction,
+        const std::array<std::atomic<uint64_t>, PACKET_TYPE_COUNT>& counts) {
+        writer.begin_family(name, metric_type::COUNTER, help);
+        for (size_t t = 0; t < PACKET_TYPE_COUNT; ++t) {
+            const uint64_t count = counts[t].load(std::memory_order_relaxed);
+            if (!count) {
+                continue;
+            }
+            const std::string_view typeName = to_string(static_cast<packet_type>(t));
+            labels.assign("type=\"").append(typeName).append("\"");
+            topic.assign("$SYS/broker/packets/").append(direction).append("/").append(typeName);
+            writer.add_sample(name, labels, topic, static_cast<double>(count));
+        }
+    };
+    packets("lmqtt_packets_received_total", "Packets received, by type.", "received", c._packetsReceived);
+    packets("lmqtt_packets_sent_total", "Packets sent, by type.", "sent", c._packetsSent);
+
+    writer.begin_family("lmqtt_bytes_received_total", metric_type::COUNTER, "Bytes of every packet received.");
+    writer.add_sample("lmqtt_bytes_received_total", "", "$SYS/broker/bytes/received", load(c._bytesReceived));
+
+    writer.begin_family("lmqtt_bytes_sent_total", metric_type::COUNTER, "Bytes written to the clients.");
+    writer.add_sample("lmqtt_bytes_sent_total", "", "$SYS/broker/bytes/sent", load(c._bytesSent));
+
+    writer.begin_family("lmqtt_queued_bytes", metric_type::GAUGE, "Bytes waiting in the outbound queues.");
+    writer.add_sample("lmqtt_queued_bytes", "", "$SYS/broker/queues/bytes", loadGauge(c._queuedBytes));
+
+    writer.begin_family("lmqtt_queued_messages", metric_type::GAUGE, "Packets waiting in the outbound queues.");
+    writer.add_sample("lmqtt_queued_messages", "", "$SYS/broker/queues/messages", loadGauge(c._queuedMessages));
+
+    writer.begin_family("lmqtt_messages_dropped_total", metric_type::COUNTER, "Messages not forwarded to a client that was too far behind.");
+    writer.add_sample("lmqtt_messages_dropped_total", "", "$SYS/broker/queues/dropped", load(c._messagesDropped));
+
+    writer.begin_family("lmqtt_queue_overflows_total", metric_type::COUNTER, "Clients disconnected because their outbound queue was full.");
+    writer.add_sample("lmqtt_queue_overflows_total", "", "$SYS/broker/queues/overflows", load(c._queueOverflows));
+
+    writer.begin_family("lmqtt_messages_conflated_total", metric_type::COUNTER, "Queued messages replaced by a newer one of their topic.");
+    writer.add_sample("lmqtt_messages_conflated_total", "", "$SYS/broker/queues/conflated", load(c._messagesConflated));
+
+    writer.begin_family("lmqtt_quota_disconnects_total", metric_type::COUNTER, "Clients disconnected with QUOTA_EXCEEDED because their outbound queue was full.");
+    writer.add_sample("lmqtt_quota_disconnects_total", "", "$SYS/broker/queues/quota_disconnects", load(c._quotaDisconnects));
+
+    auto clientQueues = [&](std::string_view name, std::string_view help, std::string_view leaf, size_t server_gauges::client_queue::* value) {
+        writer.begin_family(name, metric_type::GAUGE, help);
+        for (const auto& client : gauges._clientQueues) {
+            labels.assign("client=\"");
+            append_label_value(labels, client._clientId);
+            labels.append("\"");
+            // a client id is not always a valid topic level
+            topic.clear();
+            if (client._clientId.find_first_of("/+#") == std::string::npos) {
+                topic.assign("$SYS/broker/clients/").append(client._clientId).append("/").append(leaf);
+            }
+            writer.add_sample(name, labels, topic, static_cast<double>(client.*value));
+        }
+    };
+    clientQueues("lmqtt_client_queued_bytes", "Bytes waiting in a client's outbound queue, for the clients furthest behind.",
+        "queued_bytes", &server_gauges::client_queue::_bytes);
+    clientQueues("lmqtt_client_queued_messages", "Messages waiting in a client's outbound queue, for the clients furthest behind.",
+        "queued_messages", &server_gauges::client_queue::_messages);
+
+    writer.begin_family("lmqtt_packets_too_large_total", metric_type::COUNTER, "Messages not forwarded because they exceeded the client's Maximum Packet Size.");
+    writer.add_sample("lmqtt_packets_too_large_total", "", "$SYS/broker/queues/too_large", load(c._packetsTooLarge));
+
+    writer.begin_family("lmqtt_inflight_messages", metric_type::GAUGE, "QoS 2 messages waiting for their PUBREL.");
+    writer.add_sample("lmqtt_inflight_messages", "", "$SYS/broker/messages/inflight", loadGauge(c._inflight));
+
+    writer.begin_family("lmqtt_retained_messages", metric_type::GAUGE, "Retained messages.");
+    writer.add_sample("lmqtt_retained_messages", "", "$SYS/broker/retained messages/count", static_cast<double>(gauges._retained));
+
+    writer.begin_family("lmqtt_subscriptions", metric_type::GAUGE, "Topic filters of every client.");
+    writer.add_sample("lmqtt_subscriptions", "", "$SYS/broker/subscriptions/count", static_cast<double>(gauges._subscriptions));
+
+    writer.begin_family("lmqtt_memory_bytes", metric_type::GAUGE, "Memory held by the broker's pools and buffers.");
+    writer.add_sample("lmqtt_memory_bytes", "pool=\"outbound_queues\"", "$SYS/broker/memory/outbound_queues", loadGauge(c._queuedBytes));
+    writer.add_sample("lmqtt_memory_bytes", "pool=\"log_rings\"", "$SYS/broker/memory/log_rings",
+        static_cast<double>(log::logger::instance().memory_usage()));
+    writer.add_sample("lmqtt_memory_bytes", "pool=\"latency_histograms\"", "$SYS/broker/memory/latency_histograms",
+        static_cast<double>(latency::registry::instance().memory_usage()));
+    writer.add_sample("lmqtt_memory_bytes", "pool=\"inbound_buffers\"", "$SYS/broker/memory/inbound_buffers",
+        static_cast<double>(std::max<int64_t>(0, memory::used(memory::pool::INBOUND))));
+
+    writer.begin_family("lmqtt_memory_budget_bytes", metric_type::GAUGE, "Bytes the broker may hold for its clients, 0 if unlimited.");
+    writer.add_sample("lmqtt_memory_budget_bytes", "", "$SYS/broker/memory/budget", static_cast<double>(memory::get_limit()));
+
+    writer.begin_family("lmqtt_memory_budget_used_bytes", metric_type::GAUGE, "Bytes charged to the memory budget: inbound buffers, outbound queues, retained and offline messages.");
+    writer.add_sample("lmqtt_memory_budget_used_bytes", "", "$SYS/broker/memory/budget_used",
+        static_cast<double>(std::max<int64_t>(0, memory::used())));
+
+    writer.begin_family("lmqtt_paused_readers", metric_type::GAUGE, "Clients the broker stopped reading from because memory ran low.");
+    writer.add_sample("lmqtt_paused_readers", "", "$SYS/broker/memory/paused_clients", loadGauge(c._pausedReaders));
+
+    writer.begin_family("lmqtt_overload_level", metric_type::GAUGE, "Load shedding level: 0 normal, 1 pausing publishers, 2 rejecting CONNECT, 3 shedding QoS 0.");
+    writer.add_sample("lmqtt_overload_level", "", "$SYS/broker/load/level", loadGauge(c._overloadLevel));
+
+    writer.begin_family("lmqtt_overload_paused_readers", metric_type::GAUGE, "Publishers the broker stopped reading from because it was overloaded.");
+    writer.add_sample("lmqtt_overload_paused_readers", "", "$SYS/broker/load/paused_clients", loadGauge(c._overloadPausedReaders));
+
+    writer.begin_family("lmqtt_connects_busy_total", metric_type::COUNTER, "CONNECT packets answered with SERVER_BUSY.");
+    writer.add_sample("lmqtt_connects_busy_total", "", "$SYS/broker/load/connects_busy", load(c._connectsBusy));
+
+    writer.begin_family("lmqtt_messages_shed_total", metric_type::COUNTER, "QoS 0 messages not forwarded because the broker was overloaded.");
+    writer.add_sample("lmqtt_messages_shed_total", "", "$SYS/broker/load/shed", load(c._messagesShed));
+
+    writer.begin_family("lmqtt_reads_throttled_total", metric_type::COUNTER, "Reads put off because a client went over its publish rate.");
+    writer.add_sample("lmqtt_reads_throttled_total", "", "$SYS/broker/load/throttled", load(c._readsThrottled));
+
+    writer.begin_family("lmqtt_publishes_quota_exceeded_total", metric_type::COUNTER, "QoS 1 and 2 PUBLISH packets refused with QUOTA_EXCEEDED because their listener was over its rate.");
+    writer.add_sample("lmqtt_publishes_quota_exceeded_total", "", "$SYS/broker/load/quota_exceeded", load(c._publishesQuotaExceeded));
+
+    writer.begin_family("lmqtt_log_records_dropped_total", metric_type::COUNTER, "Log records lost because a log ring was full.");
+    writer.add_sample("lmqtt_log_records_dropped_total", "", "$SYS/broker/log/dropped",
+        static_cast<double>(log::logger::instance().dropped_count()));
+
+    // merging every thread's histograms is the expensive part, done once for both families
+    struct stage_summary {
+        latency::stage _stage;
+        packet_type _type;
+        latency::summary _result;
+    };
+    std::vector<stage_summary> summaries;
+    latency::for_each_summary([&summaries](latency::stage s, packet_type type, const latency::summary& result) {
+        summaries.push_back({ s, type, result });
+    });
+
+    writer.begin_family("lmqtt_stage_latency_ns", metric_type::SUMMARY, "Time spent in each stage, by packet type.");
+    for (const auto& entry : summaries) {
+        const std::string_view stageName = latency::get_stage_string(entry._stage);
+        const std::string_view typeName = to_string(entry._type);
+        const latency::summary& result = entry._result;
+        const std::string prefix = std::string("stage=\"").append(stageName).append("\",type=\"").append(typeName).append("\"");
+        const std::string topicPrefix = std::string("$SYS/broker/latency/").append(stageName).append("/").append(typeName);
+
+        const std::pair<std::string_view, double> quantiles[] = {
+            { "0.5", result._p50 }, { "0.99", result._p99 }, { "0.999", result._p999 }
+        };
+        const std::string_view quantileTopics[] = { "/p50", "/p99", "/p999" };
+        for (size_t i = 0; i < 3; ++i) {
+            labels.assign(prefix).append(",quantile=\"").append(quantiles[i].first).append("\"");
+            topic.assign(topicPrefix).append(quantileTopics[i]);
+            writer.add_sample("lmqtt_stage_latency_ns", labels, topic, quantiles[i].second);
+        }
+        writer.add_sample("lmqtt_stage_latency_ns_sum", prefix, "", result._sum);
+        topic.assign(topicPrefix).append("/count");
+        writer.add_sample("lmqtt_stage_latency_ns_count", prefix, topic, static_cast<double>(result._count));
+    }
+
+    writer.begin_family("lmqtt_stage_latency_max_ns", metric_type::GAUGE, "Slowest time spent in each stage, by packet type.");
+    for (const auto& entry : summaries) {
+        labels.assign("stage=\"").append(latency::get_stage_string(entry._stage)).append("\",type=\"").append(to_string(entry._type)).append("\"");
+        topic.assign("$SYS/broker/latency/").append(latency::get_stage_string(entry._stage)).append("/").append(to_string(entry._type)).append("/max");
+        writer.add_sample("lmqtt_stage_latency_max_ns", labels, topic, entry._result._max);
+    }
+}
+
+// Prometheus text exposition format (version 0.0.4)
+class prometheus_writer : public metrics_writer {
+public:
+    void begin_family(std::string_view name, metric_type type, std::string_view help) override {
+        _text.append("# HELP ").append(name).append(" ").append(help).append("\n");
+        _text.append("# TYPE ").append(name).append(" ").append(get_metric_type_string(type)).append("\n");
+    }
+
+    void add_sample(std::string_view name, std::string_view labels, std::string_view /*topic*/, double value) override {
+        _text.append(name);
+        if (!labels.empty()) {
+            _text.append("{").append(labels).append("}");
+        }
+        _text.append(" ");
+        append_value(_text, value);
+        _text.append("\n");
+    }
+
+    [[nodiscard]] std::string& text() noexcept {
+        return _text;
+    }
+
+private:
+    std::string _text;
+};
+
+// Publishes each sample on its $SYS topic, as a QoS 0 PUBLISH whose payload is
+// the value in text. Topics without subscribers cost a lookup in the registry.
+class sys_writer : public metrics_writer {
+public:
+    explicit sys_writer(subscription_registry& subscriptions) :
+        _subscriptions(subscriptions) {}
+
+    void begin_family(std::string_view /*name*/, metric_type /*type*/, std::string_view /*help*/) override {}
+
+    void add_sample(std::string_view /*name*/, std::string_view /*labels*/, std::string_view topic, double value) override {
+        if (topic.empty()) {
+            return;
+        }
+        _subscriptions.match(topic, _matches);
+        if (_matches.empty()) {
+            return;
+        }
+        _payload.clear();
+        append_value(_payload, value);
+
+        encoder::publish_message msg;
+        msg._topic = topic;
+        msg._payload = reinterpret_cast<const uint8_t*>(_payload.data());
+        msg._payloadSize = static_cast<uint32_t>(_payload.size());
+        auto bytes = std::make_shared<std::vector<uint8_t>>();
+        if (encoder::packet_encoder::append(*bytes, msg) != return_code::OK) {
+            _matches.clear();
+            return;
+        }
+
+        // queued like a forwarded PUBLISH, so a slow $SYS subscriber is held to
+        // its queue bounds, overflow policy and the memory budget
+        const shared_bytes packet = std::move(bytes);
+        for (auto& match : _matches) {
+            auto message = match._queue->open(packet, packet->size(), topic, match._options);
+            if (message) {
+                match._queue->finish(message);
+            }
+        }
+        _matches.clear();
+    }
+
+private:
+    subscription_registry& _subscriptions;
+    std::vector<subscriber_match> _matches;
+    std::string _payload;
+};
+
+/*
+ * Exposes the metrics two ways, both from the io thread:
+ *  - a minimal HTTP/1.1 server on 127.0.0.1:_metricsPort answering GET /metrics
+ *    in Prometheus text format, one request per connection
+ *  - every _sysInterval, a PUBLISH of each value on its $SYS/broker/... topic to
+ *    whoever subscribed to it
+ * Collecting is only done when asked for, so the hot path only pays for the counters.
+ */
+class exporter {
+public:
+    using gauges_callback = std::function<server_gauges()>;
+
+    exporter(
+        asio::io_context& context,
+        subscription_registry& subscriptions,
+        const server_config& config,
+        gauges_callback gauges
+    ) :
+        _context(context),
+        _subscriptions(subscriptions),
+        _config(config),
+        _gauges(std::move(gauges)),
+        _acceptor(context),
+        _sysTimer(context),
+        _startTime(std::chrono::steady_clock::now()) {}
+
+    // throws if the metrics port can not be bound
+    void start() {
+        if (_config._metricsPort) {
+            const asio::ip::tcp::endpoint endpoint(asio::ip::address_v4::loopback(), _config._metricsPort);
+            _acceptor.open(endpoint.protocol());
+            _acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+            _acceptor.bind(endpoint);
+            _acceptor.listen();
+            accept();
+            LMQTT_LOG_INFO("[METRICS] Prometheus endpoint on 127.0.0.1:{}/metrics", _config._metricsPort);
+        }
+        if (_config._sysInterval.count()) {
+            schedule_sys_publish();
+        }
+    }
+
+    // Prometheus text of every metric
+    [[nodiscard]] std::string render() {
+        prometheus_writer writer;
+        collect(writer, _gauges(), _startTime);
+        return std::move(writer.text());
+    }
+
+    void publish_sys() {
+        // nobody subscribed to anything, so nobody subscribed to $SYS
+        if (!_subscriptions.subscriber_count()) {
+            return;
+        }
+        sys_writer writer(_subscriptions);
+        collect(writer, _gauges(), _startTime);
+    }
+
+private:
+    // one request, one response, then the connection is closed
+    class http_session : public std::enable_shared_from_this<http_session> {
+    public:
+        static constexpr size_t MAX_REQUEST_SIZE = 8192;
+
+        http_session(asio::ip::tcp::socket socket, exporter& owner) :
+            _socket(std::move(socket)), _owner(owner), _request(MAX_REQUEST_SIZE) {}
+
+        void start() {
+            asio::async_read_until(
+                _socket,
+                _request,
+                "\r\n\r\n",
+                [self = shared_from_this()](std::error_code ec, size_t /*length*/) {
+                    if (ec) {
+                        // includes requests bigger than MAX_REQUEST_SIZE
+                        std::error_code ignored;
+                        self->_socket.close(ignored);
+                        return;
+                    }
+                    self->respond();
+                }
+            );
+        }
+
+    private:
+        void respond() {
+            const auto data = _request.data();
+            const std::string_view request(static_cast<const char*>(data.data()), data.size());
+            const std::string_view requestLine = request.substr(0, request.find("\r\n"));
+
+            std::string body;
+            std::string_view status;
+            if (requestLine.substr(0, 13) == "GET /metrics "
+                || requestLine.substr(0, 6) == "GET / ") {
+                status = "200 OK";
+                body = _owner.render();
+            } else {
+                status = "404 Not Found";
+                body = "not found\n";
+            }
+
+            _response.assign("HTTP/1.1 ").append(status).append("\r\n");
+            _response.append("Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n");
+            _response.append("Content-Length: ").append(std::to_string(body.size())).append("\r\n");
+            _response.append("Connection: close\r\n\r\n");
+            _response.append(body);
+
+            asio::async_write(
+                _socket,
+                asio::buffer(_response),
+                [self = shared_from_this()](std::error_code /*ec*/, size_t /*length*/) {
+                    std::error_code ignored;
+                    self->_socket.shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+                    self->_socket.close(ignored);
+                }
+            );
+        }
+
+        asio::ip::tcp::socket _socket;
+        exporter& _owner;
+        asio::streambuf _request;
+        std::string _response;
+    };
+
+    void accept() {
+        _acceptor.async_accept(
+            [this](std::error_code ec, asio::ip::tcp::socket socket) {
+                if (ec == asio::error::operation_aborted) {
+                    return;
+                }
+                if (!ec) {
+                    std::make_shared<http_session>(std::move(socket), *this)->start();
+                } else {
+                    LMQTT_LOG_WARNING("[METRICS] Accept failed: {}", ec.message());
+                }
+                accept();
+            }
+        );
+    }
+
+    void schedule_sys_publish() {
+        _sysTimer.expires_after(_config._sysInterval);
+        _sysTimer.async_wait([this](std::error_code ec) {
+            if (ec) {
+                return;
+            }
+            publish_sys();
+            schedule_sys_publish();
+        });
+    }
+
+    asio::io_context& _context;
+    subscription_registry& _subscriptions;
+    server_config _config;
+    gauges_callback _gauges;
+    asio::ip::tcp::acceptor _acceptor;
+    asio::steady_timer _sysTimer;
+    std::chrono::steady_clock::time_point _startTime;
+};
+
+} // namespace metrics
+
+} // namespace lmqtt
@@ -0,0 +1,558 @@
+#pragma once
+
+#include <map>
+
+#include "lmqtt_common.h"
+#include "lmqtt_types.h"
+#include "lmqtt_reason_codes.h"
+#include "lmqtt_encoder.h"
+#include "lmqtt_metrics.h"
+#include "lmqtt_memory_budget.h"
+
+namespace lmqtt {
+
+// Bytes shared between every client a packet is written to: a relayed payload
+// chunk is copied once, whatever the number of subscribers.
+using shared_bytes = std::shared_ptr<const std::vector<uint8_t>>;
+
+// One packet on its way to a client. A relayed PUBLISH is written while it is
+// still being received, so its chunks are appended as they arrive.
+class outbound_message {
+    friend class outbound_queue;
+
+public:
+    [[nodiscard]] bool is_started() const noexcept {
+        return _started;
+    }
+
+    [[nodiscard]] bool is_complete() const noexcept {
+        return _complete;
+    }
+
+    [[nodiscard]] bool is_cancelled() const noexcept {
+        return _cancelled;
+    }
+
+private:
+    std::deque<shared_bytes> _chunks;
+    // whoever the bytes are charged to (see memory::account), nullptr for our own responses
+    std::shared_ptr<memory::account> _owner;
+    // set when the message can be conflated (last value or overflow_policy::CONFLATE)
+    std::string _topic;
+    packet_type _type = packet_type::UNKNOWN;
+    // forwarded from a publisher, only those are dropped to make room
+    bool _forwarded = false;
+    // at least one byte of this packet went to the socket, so it can not be
+    // dropped anymore without breaking the stream
+    bool _started = false;
+    bool _complete = false;
+    bool _cancelled = false;
+};
+
+/*
+ * Everything waiting to be written to one client. The queue does not write
+ * anything itself: the connection pulls chunks with next_chunk() and is woken up
+ * when there is something new to pull.
+ *
+ * Packets wait in one of two lanes, in order within each: CONTROL for our own
+ * responses (CONNACK, SUBACK, PINGRESP, acks, DISCONNECT) and BULK for PUBLISH
+ * packets. Between packets, CONTROL goes first as long as it has credit, so a
+ * PINGRESP never waits behind megabytes of forwarded messages (only behind the
+ * packet being written, which can not be interrupted). Credit is refilled in
+ * proportion to LANE_WEIGHTS once the ready lanes ran out of it, so a client
+ * flooding us with PINGREQs does not starve its own subscriptions either.
+ *
+ * Memory is bounded: once the client is HIGH_WATERMARK bytes or MAX_MESSAGES
+ * messages behind (or the broker's memory budget is exhausted), the overflow
+ * policy of the subscription decides what happens to a new forwarded message:
+ * it is dropped, older messages that did not start are dropped for it, it takes
+ * the place of the queued message of its topic, or the client is disconnected.
+ * A started message can not be dropped without breaking the stream, so it keeps
+ * buffering up to MAX_QUEUED_BYTES, past that the client is too slow and the
+ * queue closes (the connection then drops the client). The limits come from the
+ * listener the client connected to.
+ *
+ * A last value subscription never has more than one queued message per topic:
+ * each new one replaces the content of the queued one, which keeps its place.
+ * A client that falls behind then catches up on as many messages as there are
+ * topics, not as it missed.
+ *
+ * Messages bigger than the client's Maximum Packet Size are never queued: MQTT
+ * says they are discarded as if they had been delivered.
+ *
+ * The queue is only used from the io thread.
+ */
+class outbound_queue {
+public:
+    static constexpr size_t HIGH_WATERMARK = 1 << 20; // 1 MO
+    static constexpr size_t LOW_WATERMARK = HIGH_WATERMARK / 2;
+    static constexpr size_t MAX_QUEUED_BYTES = 1 << 24; // 16 MO
+    static constexpr size_t MAX_MESSAGES = 1 << 16;
+
+    enum class lane : uint8_t {
+        CONTROL,
+        BULK,
+        COUNT
+    };
+    static constexpr size_t LANE_COUNT = static_cast<size_t>(lane::COUNT);
+    // bytes a lane can write each round, weight * LANE_QUANTUM
+    static constexpr std::array<int64_t, LANE_COUNT> LANE_WEIGHTS = { 4, 1 };
+    static constexpr int64_t LANE_QUANTUM = 16 * 1024;
+
+    explicit outbound_queue(
+        std::function<void()> wake,
+        size_t highWatermark = HIGH_WATERMARK,
+        size_t maxQueuedBytes = MAX_QUEUED_BYTES,
+        size_t maxMessages = MAX_MESSAGES
+    ) :
+        _highWatermark(highWatermark),
+        _lowWatermark(highWatermark / 2),
+        _maxQueuedBytes(maxQueuedBytes),
+        _maxMessages(maxMessages),
+        _wake(std::move(wake)) {}
+
+    // the gauges and the budget get back what a queue that was never closed held
+    ~outbound_queue() {
+        if (!_closed) {
+            release_all();
+        }
+    }
+
+    // what the client told us in its CONNECT
+    void set_maximum_packet_size(uint32_t size) noexcept {
+        _maximumPacketSize = size;
+    }
+
+    // a complete packet, the connection's own responses go through here
+    void push(shared_bytes packet, std::shared_ptr<memory::account> owner = nullptr) {
+        if (_closed || _disconnecting) {
+            return;
+        }
+        enqueue(std::move(packet), std::move(owner));
+    }
+
+    // starts a forwarded packet of packetSize bytes whose chunks will come later,
+    // nullptr if the client does not take it: too far behind (see overflow_policy)
+    // or it does not want it that big
+    [[nodiscard]] std::shared_ptr<outbound_message> open(
+        shared_bytes firstChunk,
+        uint64_t packetSize,
+        std::string_view topic = {},
+        const queue_options& options = queue_options(),
+        std::shared_ptr<memory::account> owner = nullptr
+    ) {
+        if (_closed || _disconnecting) {
+            return nullptr;
+        }
+        if (packetSize > _maximumPacketSize) {
+            metrics::add(metrics::counters()._packetsTooLarge);
+            return nullptr;
+        }
+        const overflow_policy policy = options._overflow;
+        const bool conflatable = options._lastValue || (policy == overflow_policy::CONFLATE);
+        if (options._lastValue) {
+            if (auto message = conflate(topic, firstChunk, owner)) {
+                return message;
+            }
+        }
+        if (is_full() || memory::is_exhausted()) {
+            if (policy == overflow_policy::CONFLATE && !options._lastValue) {
+                if (auto message = conflate(topic, firstChunk, owner)) {
+                    return message;
+                }
+            }
+            if (policy == overflow_policy::DISCONNECT) {
+                exceed_quota();
+                return nullptr;
+            }
+            if (policy == overflow_policy::DROP_NEWEST || !make_room()) {
+                metrics::add(metrics::counters()._messagesDropped);
+                return nullptr;
+            }
+        }
+        auto message = std::make_shared<outbound_message>();
+        message->_type = static_cast<packet_type>((*firstChunk)[0] >> 4);
+        message->_owner = std::move(owner);
+        message->_forwarded = true;
+        charge(message->_owner, static_cast<int64_t>(firstChunk->size()));
+        message->_chunks.emplace_back(std::move(firstChunk));
+        if (conflatable) {
+            message->_topic = topic;
+            _conflatable[message->_topic] = message;
+        }
+        add_message(message);
+        wake();
+        return message;
+    }
+
+    // returns false if the message was dropped, no more chunks should be appended
+    [[nodiscard]] bool append(const std::shared_ptr<outbound_message>& message, shared_bytes chunk) {
+        if (_closed || message->_cancelled) {
+            return false;
+        }
+        if (!message->_started && (is_over_limit() || memory::is_exhausted())) {
+            cancel(*message);
+            return false;
+        }
+        if (_queuedBytes + chunk->size() > _maxQueuedBytes) {
+            _overflowed = true;
+            metrics::add(metrics::counters()._queueOverflows);
+            wake();
+            close();
+            return false;
+        }
+        charge(message->_owner, static_cast<int64_t>(chunk->size()));
+        message->_chunks.emplace_back(std::move(chunk));
+        wake();
+        return true;
+    }
+
+    void finish(const std::shared_ptr<outbound_message>& message) {
+        if (message->_cancelled) {
+            return;
+        }
+        message->_complete = true;
+        wake();
+    }
+
+    // next bytes to write, nullptr if there is nothing to write right now.
+    // type is set to the type of the packet the chunk belongs to
+    [[nodiscard]] shared_bytes next_chunk(packet_type& type) {
+        // a started packet is written whole before any other
+        if (_writingLane != lane::COUNT) {
+            lane_state& current = get_lane_state(_writingLane);
+            outbound_message& head = *current._messages.front();
+            if (!head._chunks.empty()) {
+                return take_chunk(current, type);
+            }
+            if (!head._complete && !head._cancelled) {
+                // the producer did not append the next chunk yet
+                return nullptr;
+            }
+            pop_front(current);
+            _writingLane = lane::COUNT;
+        }
+
+        lane_state* next = pick_lane();
+        if (!next) {
+            return nullptr;
+        }
+        outbound_message& head = *next->_messages.front();
+        metrics::on_packet_sent(head._type);
+        forget_topic(head);
+        head._started = true;
+        _writingLane = static_cast<lane>(next - _lanes.data());
+        return take_chunk(*next, type);
+    }
+
+    // must be called with the size of each chunk once it is written
+    void on_written(size_t size) {
+        if (_closed) {
+            return;
+        }
+        metrics::on_bytes_sent(size);
+        charge(std::exchange(_writingOwner, nullptr), -static_cast<int64_t>(size));
+        if (_queuedBytes <= _lowWatermark) {
+            notify_drained();
+        }
+    }
+
+    // callback is called once, when the queue goes under the low watermark (half
+    // the high one) or closes
+    void on_drained(std::function<void()> callback) {
+        if (_closed || _queuedBytes <= _lowWatermark) {
+            callback();
+            return;
+        }
+        _drainCallbacks.emplace_back(std::move(callback));
+    }
+
+    // the client is gone: drop everything and release whoever waits on us
+    void close() {
+        _closed = true;
+        release_all();
+        // _wake is kept, never called again: close() can run from inside it, when
+        // the connection tears itself down from write_next()
+        notify_drained();
+    }
+
+    [[nodiscard]] bool is_over_limit() const noexcept {
+        return _queuedBytes > _highWatermark;
+    }
+
+    // no room for one more forwarded message
+    [[nodiscard]] bool is_full() const noexcept {
+        return is_over_limit() || _messageCount >= _maxMessages;
+    }
+
+    [[nodiscard]] bool is_closed() const noexcept {
+        return _closed;
+    }
+
+    // the client fell more than MAX_QUEUED_BYTES behind
+    [[nodiscard]] bool has_overflowed() const noexcept {
+        return _overflowed;
+    }
+
+    [[nodiscard]] size_t queued_bytes() const noexcept {
+        return _queuedBytes;
+    }
+
+    [[nodiscard]] size_t queued_messages() const noexcept {
+        return _messageCount;
+    }
+
+private:
+    struct lane_state {
+        std::deque<std::shared_ptr<outbound_message>> _messages;
+        // bytes left to write this round
+        int64_t _credit = 0;
+    };
+
+    [[nodiscard]] static lane get_lane(packet_type type) noexcept {
+        return (type == packet_type::PUBLISH) ? lane::BULK : lane::CONTROL;
+    }
+
+    [[nodiscard]] lane_state& get_lane_state(lane l) noexcept {
+        return _lanes[static_cast<size_t>(l)];
+    }
+
+    // the first lane, by priority, with a packet ready and credit left. When the
+    // ready lanes have none left, a new round starts
+    [[nodiscard]] lane_state* pick_lane() {
+        bool anyReady = false;
+        for (lane_state& state : _lanes) {
+            if (!is_ready(state)) {
+                continue;
+            }
+            if (state._credit > 0) {
+                return &state;
+            }
+            anyReady = true;
+        }
+        if (!anyReady) {
+            return nullptr;
+        }
+        for (size_t i = 0; i < LANE_COUNT; ++i) {
+            _lanes[i]._credit = LANE_WEIGHTS[i] * LANE_QUANTUM;
+        }
+        for (lane_state& state : _lanes) {
+            if (is_ready(state)) {
+                return &state;
+            }
+        }
+        return nullptr;
+    }
+
+    // the head of the lane can start. Messages dropped before they did are
+    // popped on the way
+    [[nodiscard]] bool is_ready(lane_state& state) {
+        while (!state._messages.empty()) {
+            const outbound_message& head = *state._messages.front();
+            if (!head._cancelled) {
+                return !head._chunks.empty();
+            }
+            pop_front(state);
+        }
+        return false;
+    }
+
+    [[nodiscard]] shared_bytes take_chunk(lane_state& state, packet_type& type) {
+        outbound_message& head = *state._messages.front();
+        type = head._type;
+        // released by on_written
+        _writingOwner = head._owner;
+        shared_bytes chunk = std::move(head._chunks.front());
+        head._chunks.pop_front();
+        state._credit -= static_cast<int64_t>(chunk->size());
+        return chunk;
+    }
+
+    void pop_front(lane_state& state) {
+        if (!state._messages.front()->_cancelled) {
+            --_messageCount;
+        }
+        state._messages.pop_front();
+        metrics::add(metrics::counters()._queuedMessages, -1);
+    }
+
+    void enqueue(shared_bytes packet, std::shared_ptr<memory::account> owner) {
+        auto message = std::make_shared<outbound_message>();
+        message->_type = static_cast<packet_type>((*packet)[0] >> 4);
+        message->_owner = std::move(owner);
+        charge(message->_owner, static_cast<int64_t>(packet->size()));
+        message->_chunks.emplace_back(std::move(packet));
+        message->_complete = true;
+        add_message(std::move(message));
+        wake();
+    }
+
+    // drops the oldest forwarded messages that did not start until there is room
+    // for a new one, false if there is nothing left to drop
+    [[nodiscard]] bool make_room() {
+        auto& messages = get_lane_state(lane::BULK)._messages;
+        do {
+            auto it = std::find_if(messages.begin(), messages.end(), [](const auto& message) {
+                return message->_forwarded && !message->_started && !message->_cancelled;
+            });
+            if (it == messages.end()) {
+                return false;
+            }
+            cancel(**it);
+            // never started, the writer did not see it
+            messages.erase(it);
+            metrics::add(metrics::counters()._queuedMessages, -1);
+        } while (is_full());
+        return true;
+    }
+
+    // the queued message of this topic takes the new one's content, keeping its
+    // place in the queue. nullptr if there is none, or it is already being written
+    // or received
+    [[nodiscard]] std::shared_ptr<outbound_message> conflate(
+        std::string_view topic,
+        shared_bytes& firstChunk,
+        std::shared_ptr<memory::account>& owner
+    ) {
+        auto it = _conflatable.find(topic);
+        if (it == _conflatable.end() || !it->second->_complete) {
+            return nullptr;
+        }
+        std::shared_ptr<outbound_message> message = it->second;
+        release_chunks(*message);
+        message->_owner = std::move(owner);
+        message->_complete = false;
+        charge(message->_owner, static_cast<int64_t>(firstChunk->size()));
+        message->_chunks.emplace_back(std::move(firstChunk));
+        metrics::add(metrics::counters()._messagesConflated);
+        wake();
+        return message;
+    }
+
+    void forget_topic(const outbound_message& message) {
+        if (message._topic.empty()) {
+            return;
+        }
+        auto it = _conflatable.find(message._topic);
+        if (it != _conflatable.end() && it->second.get() == &message) {
+            _conflatable.erase(it);
+        }
+    }
+
+    // overflow_policy::DISCONNECT: the client gets the packet being written and our
+    // pending responses, then a DISCONNECT with QUOTA_EXCEEDED and nothing more. The
+    // connection closes once it is written
+    void exceed_quota() {
+        _disconnecting = true;
+        metrics::add(metrics::counters()._quotaDisconnects);
+        auto& messages = get_lane_state(lane::BULK)._messages;
+        for (auto it = messages.begin(); it != messages.end();) {
+            if ((*it)->_started) {
+                ++it;
+                continue;
+            }
+            if (!(*it)->_cancelled) {
+                cancel(**it);
+            }
+            it = messages.erase(it);
+            metrics::add(metrics::counters()._queuedMessages, -1);
+        }
+        // the same bytes for every client, encoded once
+        static const shared_bytes disconnect = []() {
+            encoder::disconnect_message msg;
+            msg._reasonCode = reason_code::QUOTA_EXCEEDED;
+            auto bytes = std::make_shared<std::vector<uint8_t>>();
+            (void)encoder::packet_encoder::append(*bytes, msg);
+            return bytes;
+        }();
+        enqueue(disconnect, nullptr);
+    }
+
+    void cancel(outbound_message& message) {
+        message._cancelled = true;
+        --_messageCount;
+        metrics::add(metrics::counters()._messagesDropped);
+        forget_topic(message);
+        release_chunks(message);
+        // the writer skips it when it reaches the head of the queue
+    }
+
+    void release_all() noexcept {
+        for (lane_state& state : _lanes) {
+            for (auto& message : state._messages) {
+                message->_cancelled = true;
+                release_chunks(*message);
+            }
+            metrics::add(metrics::counters()._queuedMessages, -static_cast<int64_t>(state._messages.size()));
+            state._messages.clear();
+        }
+        _writingLane = lane::COUNT;
+        _conflatable.clear();
+        _messageCount = 0;
+        // what is left is the chunk being written
+        charge(std::exchange(_writingOwner, nullptr), -static_cast<int64_t>(_queuedBytes));
+    }
+
+    void release_chunks(outbound_message& message) noexcept {
+        for (const auto& chunk : message._chunks) {
+            charge(message._owner, -static_cast<int64_t>(chunk->size()));
+        }
+        message._chunks.clear();
+    }
+
+    // the broker wide gauges, the memory budget and the account of whoever made
+    // us hold the bytes follow every change of ours
+    void charge(const std::shared_ptr<memory::account>& owner, int64_t delta) noexcept {
+        _queuedBytes += delta;
+        metrics::add(metrics::counters()._queuedBytes, delta);
+        memory::charge(memory::pool::OUTBOUND, delta);
+        if (owner) {
+            owner->_bytes += delta;
+        }
+    }
+
+    void add_message(std::shared_ptr<outbound_message> message) {
+        get_lane_state(get_lane(message->_type))._messages.emplace_back(std::move(message));
+        ++_messageCount;
+        metrics::add(metrics::counters()._queuedMessages, 1);
+    }
+
+    void wake() {
+        if (_wake && !_closed) {
+            _wake();
+        }
+    }
+
+    void notify_drained() {
+        // a callback can register a new one, so swap first
+        std::vector<std::function<void()>> callbacks;
+        callbacks.swap(_drainCallbacks);
+        for (auto& callback : callbacks) {
+            callback();
+        }
+    }
+
+    std::array<lane_state, LANE_COUNT> _lanes;
+    // lane of the packet being written, COUNT between packets
+    lane _writingLane = lane::COUNT;
+    size_t _queuedBytes = 0;
+    // messages that were not cancelled
+    size_t _messageCount = 0;
+    size_t _highWatermark;
+    size_t _lowWatermark;
+    size_t _maxQueuedBytes;
+    size_t _maxMessages;
+    // the latest queued message of each conflatable topic
+    std::map<std::string, std::shared_ptr<outbound_message>, std::less<>> _conflatable;
+    uint32_t _maximumPacketSize = 0xFFFFFFFF;
+    // owner of the chunk being written
+    std::shared_ptr<memory::account> _writingOwner;
+    bool _closed = false;
+    bool _overflowed = false;
+    // a DISCONNECT is on its way, nothing is queued anymore
+    bool _disconnecting = false;
+    std::function<void()> _wake;
+    std::vector<std::function<void()>> _drainCallbacks;
+};
+
+} // namespace lmqtt
@@ -1,12 +1,16 @@
 #pragma once
 
 #include "lmqtt_common.h"
+#include "lmqtt_log.h"
 #include "lmqtt_reason_codes.h"
 #include "lmqtt_types.h"
 #include "lmqtt_properties.h"
 #include "lmqtt_payload.h"
 #include "lmqtt_utils.h"
 #include "lmqtt_client_config.h"
+#include "lmqtt_response_cache.h"
+#include "lmqtt_subscriptions.h"
+#include "lmqtt_histogram.h"
 
 namespace lmqtt {
 
@@ -31,7 +35,9 @@ struct fixed_header {
  * Fixed Header + Variable Header + Payload: CONNECT
  */
 class lmqtt_packet {
-    friend class connection;
+    template <typename Stream> friend class basic_connection;
+    friend class coro_connection;
+    friend class codec_bench;
 
     fixed_header _header {};
     // the following vector is used for the following:
@@ -45,6 +51,7 @@ class lmqtt_packet {
     void reset() noexcept {
         _header.reset();
         _type = packet_type::UNKNOWN;
+        _packetId = 0;
         std::memset(_body.data(), 0, _body.size());
         std::memset(_varIntBuff, 0, 4);
     }
@@ -88,10 +95,18 @@ class lmqtt_packet {
             uint8_t qosLevel = (pflag >> 1) & 0x3;
             uint8_t retain = pflag & 0x1;
 
-            if (qosLevel || dub) {
+            // ~~ [MQTT-3.3.1-4]
+            if (qosLevel == 0x3) {
                 return reason_code::MALFORMED_PACKET;
             }
 
+            // ~~ [MQTT-3.3.1-2]
+            if (dub && !qosLevel) {
+                return reason_code::MALFORMED_PACKET;
+            }
+
+            _clientCfg->_qos = qosLevel;
+
             return reason_code::SUCCESS;
             break;
         }
@@ -107,10 +122,10 @@ class lmqtt_packet {
         case packet_type::PINGRESP:
         case packet_type::DISCONNECT:
         {
-            if ((uint8_t)packet_flag::DISCONNECT != pflag) {
+            _type = static_cast<packet_type>(ptype);
+            if ((uint8_t)packet::utils::get_packet_flag(_type) != pflag) {
                 return reason_code::MALFORMED_PACKET;
             }
-            _type = packet_type::DISCONNECT;
             return reason_code::SUCCESS;
             break;
         }
@@ -136,7 +151,7 @@ class lmqtt_packet {
     }
 
     [[nodiscard]] const reason_code decode_connect_packet_body() {
-        std::chrono::system_clock::time_point timeStart = std::chrono::system_clock::now();
+        latency::scoped_timer timer(latency::stage::DECODE, packet_type::CONNECT);
         // TODO: use a uint8_t* and advance it until we reach uint8_t* + body().size()
         // This way, we can avoid indexed access alltogether.
         // For now, we use an indexed access since we are only decoding CONNECT packet
@@ -269,18 +284,16 @@ class lmqtt_packet {
             return rCode;
         }
 
-        std::chrono::system_clock::time_point timeEnd = std::chrono::system_clock::now();
         //std::chrono::system_clock::time_point timeNow = std::chrono::system_clock::now();
         //std::chrono::system_clock::time_point timeThen;
         //msg >> timeThen;
         //std::cout << "Ping: " << std::chrono::duration<double>(timeNow - timeThen).count() << "\n";
-        std::cout << "[DEBUG] -- FINISHED PARSING CONNACK PACKET (TOOK " << std::chrono::duration_cast<std::chrono::microseconds>(timeEnd - timeStart).count() << "us)\n";
 
         return reason_code::SUCCESS;
     }
 
     [[nodiscard]] const reason_code decode_publish_packet_body() {
-        std::chrono::system_clock::time_point timeStart = std::chrono::system_clock::now();
+        latency::scoped_timer timer(latency::stage::DECODE, packet_type::PUBLISH);
 
         auto it = _body.begin();
 
@@ -289,11 +302,33 @@ class lmqtt_packet {
         // Topic Name
         std::string_view topic;
         uint32_t offset = 0;
-        utils::decode_utf8_str(&(*it), topic, offset);
+        if (_body.size() < 2 || (2U + ((_body[0] << 8) | _body[1])) > _body.size()) {
+            return reason_code::MALFORMED_PACKET;
+        }
+        if (utils::decode_utf8_str(&(*it), topic, offset) != return_code::OK) {
+            return reason_code::MALFORMED_PACKET;
+        }
+        // ~~ [MQTT-3.3.2-2]
+        if (topic.empty() || utf8_utils::has_wildcard(topic)) {
+            return reason_code::MALFORMED_PACKET;
+        }
         _clientCfg->_lastTopic = topic;
 
         it += offset;
 
+        // Packet identifier, only present for QoS 1 and 2
+        if (_clientCfg->_qos) {
+            if (std::distance(it, _body.end()) < 2) {
+                return reason_code::MALFORMED_PACKET;
+            }
+            _packetId = (*it << 8) | *(it + 1);
+            // ~~ [MQTT-2.2.1-3]
+            if (!_packetId) {
+                return reason_code::PROTOCOL_ERROR;
+            }
+            it += 2;
+        }
+
         // now compute the variable
         uint32_t propertyLength = 0;
         uint8_t varSize = 0; // length of the variable in the buffer 
@@ -302,36 +337,28 @@ class lmqtt_packet {
             return reason_code::MALFORMED_PACKET;
         }
 
-        it += varSize;
+        // varSize is the index of the last byte of the variable int
+        it += varSize + 1;
         uint32_t propertyStart = std::distance(_body.begin(), it);
         reason_code rcode = decode_properties(propertyStart, propertyLength);
-
-        it++;
-
-        std::string_view message;
-        uint32_t messageLength = std::distance(it, _body.end());
-        //uint32_t messageOffset = 0;
-        if (messageLength == 0 || messageLength > 0xFF) {
-            return reason_code::MALFORMED_PACKET;
+        if (rcode != reason_code::SUCCESS) {
+            return rcode;
         }
-        
-        if (utils::decode_utf8_str_fixed(&(*it), message, messageLength) != return_code::OK) {
-            return reason_code::MALFORMED_PACKET;
-        }
-        
-        if (utf8_utils::has_wildcard(message)) {
+
+        if (std::distance(it, _body.end()) < propertyLength) {
             return reason_code::MALFORMED_PACKET;
         }
+        it += propertyLength;
 
-        //std::cout << "[" << _clientCfg->_clientId << "] " << _clientCfg->_lastTopic << " : " << message << std::endl;
+        // whatever is left is the payload: it is application data, so it can be
+        // empty and does not have to be UTF-8 (same rules as lmqtt_stream_decoder.h)
 
-        std::chrono::system_clock::time_point timeEnd = std::chrono::system_clock::now();
-        std::cout << "[DEBUG] -- FINISHED PARSING PUBLISH PACKET (TOOK " << std::chrono::duration_cast<std::chrono::microseconds>(timeEnd - timeStart).count() << "us)\n";
+        //std::cout << "[" << _clientCfg->_clientId << "] " << _clientCfg->_lastTopic << " : " << message << std::endl;
         return reason_code::SUCCESS;
     }
 
     [[nodiscard]] const reason_code decode_disconnect_packet_body() {
-        std::chrono::system_clock::time_point timeStart = std::chrono::system_clock::now();
+        latency::scoped_timer timer(latency::stage::DECODE, packet_type::DISCONNECT);
 
         if (_body.empty()) {
             return reason_code::SUCCESS;
@@ -343,12 +370,119 @@ class lmqtt_packet {
 
         if (dReasonCode != reason_code::SUCCESS) {
             // TODO: Add text
-            std::cout << "[SERVER] - Client disconnected with a reason code " << std::hex << static_cast<uint8_t>(dReasonCode) << std::endl;
+            LMQTT_LOG_INFO("[SERVER] Client disconnected with reason code {}", dReasonCode);
             return reason_code::SUCCESS;
         }
+        return reason_code::SUCCESS;
+    }
+
+    // PUBACK, PUBREC, PUBREL and PUBCOMP: we only need the packet id for now
+    [[nodiscard]] const reason_code decode_ack_packet_body() {
+        latency::scoped_timer timer(latency::stage::DECODE, _type);
+        if (_body.size() < 2) {
+            return reason_code::MALFORMED_PACKET;
+        }
+
+        _packetId = (_body[0] << 8) | _body[1];
+        if (!_packetId) {
+            return reason_code::PROTOCOL_ERROR;
+        }
+
+        return reason_code::SUCCESS;
+    }
+
+    // SUBSCRIBE: packet id, properties, then a list of topic filter + options.
+    // The filters point into _body, so they are only valid until the next reset()
+    // overflow is the policy of filters whose SUBSCRIBE does not pick one
+    [[nodiscard]] const reason_code decode_subscribe_packet_body(
+        std::vector<subscription_request>& requests,
+        overflow_policy overflow = overflow_policy::DROP_NEWEST
+    ) {
+        latency::scoped_timer timer(latency::stage::DECODE, packet_type::SUBSCRIBE);
+        requests.clear();
+
+        if (_body.size() < 3) {
+            return reason_code::MALFORMED_PACKET;
+        }
+
+        _packetId = (_body[0] << 8) | _body[1];
+        // ~~ [MQTT-2.2.1-3]
+        if (!_packetId) {
+            return reason_code::PROTOCOL_ERROR;
+        }
+
+        uint8_t* buff = _body.data() + 2;
+        const uint8_t* buffEnd = _body.data() + _body.size();
+
+        uint32_t propertyLength = 0;
+        uint8_t varSize = 0;
+        if (utils::decode_variable_int(buff, propertyLength, varSize, buffEnd - buff) != return_code::OK) {
+            return reason_code::MALFORMED_PACKET;
+        }
+        buff += varSize + 1;
+        if (propertyLength > static_cast<uint32_t>(buffEnd - buff)) {
+            return reason_code::MALFORMED_PACKET;
+        }
+
+        // subscription identifiers and user properties are checked but not used yet,
+        // they do not belong to the client config like the CONNECT properties. The
+        // exceptions are OVERFLOW_PROPERTY and QUEUE_PROPERTY, for every filter of
+        // the packet
+        queue_options queueOptions;
+        queueOptions._overflow = overflow;
+        const uint8_t* propertyEnd = buff + propertyLength;
+        while (buff < propertyEnd) {
+            const property::property_type ptype = static_cast<property::property_type>(*(buff++));
+            if (!property::types_utils::validate_packet_property_type(ptype, packet_type::SUBSCRIBE)) {
+                return reason_code::MALFORMED_PACKET;
+            }
+            reason_code rCode;
+            uint32_t propertySize = 0;
+            auto propertyData = property::get_property_data(ptype, buff, static_cast<uint32_t>(propertyEnd - buff), propertySize, rCode);
+            if (rCode != reason_code::SUCCESS) {
+                return rCode;
+            }
+            if (ptype == property::property_type::USER_PROPERTY) {
+                const auto& userProperty = static_cast<property::property_data<std::pair<std::string_view, std::string_view>>*>(propertyData.get())->get_data();
+                // an unknown value leaves the default
+                if (userProperty.first == OVERFLOW_PROPERTY) {
+                    (void)parse_overflow_policy(userProperty.second, queueOptions._overflow);
+                } else if (userProperty.first == QUEUE_PROPERTY) {
+                    queueOptions._lastValue = (userProperty.second == "last-value");
+                }
+            }
+            buff += propertySize;
+        }
+
+        while (buff < buffEnd) {
+            subscription_request request;
+            uint32_t offset = 0;
+            // the filter has to be followed by its options byte
+            if ((buffEnd - buff) < 2
+                || (2U + ((buff[0] << 8) | buff[1])) >= static_cast<uint32_t>(buffEnd - buff)
+                || utils::decode_utf8_str(buff, request._filter, offset) != return_code::OK) {
+                return reason_code::MALFORMED_PACKET;
+            }
+            buff += offset;
+
+            const uint8_t options = *(buff++);
+            request._maxQos = options & 0x3;
+            request._noLocal = (options >> 2) & 0x1;
+            request._retainAsPublished = (options >> 3) & 0x1;
+            request._retainHandling = (options >> 4) & 0x3;
+            request._queueOptions = queueOptions;
+            // ~~ [MQTT-3.8.3-5]
+            if (request._maxQos == 3 || request._retainHandling == 3 || (options & 0xC0)) {
+                return reason_code::MALFORMED_PACKET;
+            }
+            requests.push_back(request);
+        }
+
+        // ~~ [MQTT-3.8.3-2]
+        if (requests.empty()) {
+            return reason_code::PROTOCOL_ERROR;
+        }
 
-        std::chrono::system_clock::time_point timeEnd = std::chrono::system_clock::now();
-        std::cout << "[DEBUG] -- FINISHED PARSING DISCONNECT PACKET (TOOK " << std::chrono::duration_cast<std::chrono::microseconds>(timeEnd - timeStart).count() << "us)\n";
         return reason_code::SUCCESS;
     }
 
@@ -538,6 +672,19 @@ public:
             return return_code::FAIL;
         }
 
+        // Most clients get the exact same CONNACK, so first try to copy a pre-encoded
+        // one and only patch the reason code
+        const bool isCacheable = _clientCfg->is_connack_cacheable();
+        response::connack_profile profile;
+        if (isCacheable) {
+            profile = _clientCfg->get_connack_profile();
+            if (auto cached = response::connack_cache::local().find(profile)) {
+                _body.assign(cached->_bytes.begin(), cached->_bytes.end());
+                _body[cached->_reasonCodeOffset] = static_cast<uint8_t>(reasonCode);
+                return return_code::OK;
+            }
+        }
+
         // The connack packet size is the following:
         // 1 byte + (1 to 4) bytes + 1 byte + 1 byte + N bytes (properties size)
         
@@ -637,16 +784,42 @@ public:
             uint8_t & offset,
             uint32_t buffSize*/
 
+        if (isCacheable) {
+            response::connack_cache::local().insert(profile, _body, variableHeaderStart + 1);
+        }
+
+        return return_code::OK;
+    }
+
+    // PUBACK, PUBREC, PUBREL and PUBCOMP are copied from a template, only the
+    // packet id and the reason code are patched
+    [[nodiscard]] return_code create_ack_packet(
+        packet_type packetType,
+        uint16_t packetId,
+        reason_code reasonCode
+    ) {
+        _body.resize(response::ACK_PACKET_WITH_REASON_SIZE);
+        const size_t packetSize = response::write_ack(_body.data(), _body.size(), packetType, packetId, reasonCode);
+        if (!packetSize) {
+            return return_code::FAIL;
+        }
+        _body.resize(packetSize);
         return return_code::OK;
     }
 
-    return_code create_short_packet() {
-        _body.resize(4);
+    // one reason code per topic filter of the SUBSCRIBE, in the same order
+    [[nodiscard]] return_code create_suback_packet(uint16_t packetId, const std::vector<reason_code>& reasonCodes) {
+        _body.resize(response::get_suback_size(reasonCodes.size()));
+        const size_t packetSize = response::write_suback(_body.data(), _body.size(), packetId, reasonCodes.data(), reasonCodes.size());
+        if (!packetSize) {
+            return return_code::FAIL;
+        }
+        _body.resize(packetSize);
+        return return_code::OK;
+    }
 
-        _body[0] = 2 << 4;
-        _body[1] = 2;
-        _body[2] = 0;
-        _body[3] = static_cast<uint8_t>(reason_code::SUCCESS);
+    [[nodiscard]] return_code create_pingresp_packet() {
+        _body.assign(response::PINGRESP_PACKET.begin(), response::PINGRESP_PACKET.end());
         return return_code::OK;
     }
 
@@ -702,6 +875,8 @@ private:
 
     uint8_t _varIntBuff[4]; // a buffer to decode variable int
 
+    uint16_t _packetId = 0;
+
 protected:
 
     // order is important and the maximum number of payloads is known so use a container
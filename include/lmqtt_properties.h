@@ -1,6 +1,7 @@
 #pragma once
 
 #include "lmqtt_common.h"
+#include "lmqtt_log.h"
 #include "lmqtt_types.h"
 #include "lmqtt_utils.h"
 
@@ -61,7 +62,7 @@ private:
 std::unique_ptr<property_data_proxy>
 get_property_data(
     property_type ptype,
-    uint8_t* buff,
+    const uint8_t* buff,
     uint32_t remainingSize,
     uint32_t& propertySize,
     reason_code& rCode
@@ -117,7 +118,7 @@ get_property_data(
     case data_type::VARIABLE_BYTE_INT:
     {
         propertySize = 4;
-        std::cout << "NOT SUPPORTED YET\n";
+        LMQTT_LOG_WARNING("Variable byte integer properties are not supported yet");
         rCode = reason_code::MALFORMED_PACKET;
         return std::unique_ptr<property_data_proxy>{};
     }
@@ -235,9 +236,84 @@ get_property_data(
     }    
 }
 
+// The checks of get_property_data, without building the value: what is only
+// validated or skipped costs no allocation. propertySize is set on success
+[[nodiscard]] inline reason_code validate_property_data(
+    property_type ptype,
+    const uint8_t* buff,
+    uint32_t remainingSize,
+    uint32_t& propertySize
+) noexcept {
+    propertySize = 0;
+
+    // two bytes of length then the data, at offset. size is set to both
+    auto get_prefixed_size = [buff, remainingSize](uint32_t offset, uint32_t& size) {
+        if (remainingSize < offset + 2U) {
+            return false;
+        }
+        size = 2U + ((buff[offset] << 0x8) | buff[offset + 1]);
+        return remainingSize >= offset + size;
+    };
+    auto is_valid_string = [buff](uint32_t offset) {
+        std::string_view str;
+        uint32_t end = 0;
+        return utils::decode_utf8_str(buff + offset, str, end) == return_code::OK;
+    };
+
+    switch (types_utils::get_property_data_type(ptype)) {
+    case data_type::BYTE:
+        propertySize = 1;
+        break;
+    case data_type::TWO_BYTES_INT:
+        propertySize = 2;
+        break;
+    case data_type::FOUR_BYTES_INT:
+        propertySize = 4;
+        break;
+    case data_type::UTF8_STRING:
+    {
+        uint32_t size = 0;
+        if (!get_prefixed_size(0, size) || !is_valid_string(0)) {
+            return reason_code::MALFORMED_PACKET;
+        }
+        propertySize = size;
+        return reason_code::SUCCESS;
+    }
+    case data_type::UTF8_STRING_PAIR:
+    {
+        uint32_t keySize = 0;
+        uint32_t valueSize = 0;
+        if (!get_prefixed_size(0, keySize) || !is_valid_string(0)
+            || !get_prefixed_size(keySize, valueSize) || !is_valid_string(keySize)) {
+            return reason_code::MALFORMED_PACKET;
+        }
+        propertySize = keySize + valueSize;
+        return reason_code::SUCCESS;
+    }
+    case data_type::BINARY:
+    {
+        uint32_t size = 0;
+        if (!get_prefixed_size(0, size)) {
+            return reason_code::MALFORMED_PACKET;
+        }
+        propertySize = size;
+        return reason_code::SUCCESS;
+    }
+    default:
+        // variable byte integers are not supported yet either
+        return reason_code::MALFORMED_PACKET;
+    }
+
+    if (remainingSize < propertySize) {
+        propertySize = 0;
+        return reason_code::MALFORMED_PACKET;
+    }
+    return reason_code::SUCCESS;
+}
+
 template<typename T>
 [[nodiscard]] return_code write_property_to_buffer(uint8_t* buffer, uint32_t buffSize, T data) {
-    std::cout << "[WARNING] -- Writing unknown property data type to buffer: " << typeid(T).name();
+    LMQTT_LOG_WARNING("Writing unknown property data type to buffer: {}", typeid(T).name());
     return return_code::FAIL;
 }
 
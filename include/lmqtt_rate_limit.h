@@ -0,0 +1,211 @@
+#pragma once
+
+#include "lmqtt_common.h"
+#include "lmqtt_server_config.h"
+
+namespace lmqtt {
+
+namespace rate {
+
+using clock = std::chrono::steady_clock;
+
+/*
+ * A token bucket kept as its theoretical arrival time (GCRA): the time at which
+ * it would be full again if nothing else was taken. Taking tokens pushes it by
+ * cost / rate, waiting brings it back to now. The bucket holds _burst tokens on
+ * top of the rate, that is the tolerance: as long as the arrival time is less
+ * than that ahead of now, the bucket is not overdrawn.
+ *
+ * One 64 bit atomic and a few integer operations per packet, no timer: a bucket
+ * shared by the clients of a listener costs the same as a client's own.
+ */
+class token_bucket {
+public:
+    token_bucket() = default;
+
+    explicit token_bucket(const rate_limit& limit) noexcept {
+        if (!limit._perSecond) {
+            return;
+        }
+        _rate = limit._perSecond;
+        _tolerance = static_cast<int64_t>(limit._burst * NS_PER_SECOND / _rate);
+    }
+
+    [[nodiscard]] bool is_enabled() const noexcept {
+        return _rate != 0;
+    }
+
+    // the bucket may be charged: it has tokens left, maybe fewer than the cost
+    [[nodiscard]] bool conforms(clock::time_point now) const noexcept {
+        return get_wait(now) == clock::duration::zero();
+    }
+
+    // can go in debt by one charge, get_wait() tells for how long
+    void charge(uint64_t cost, clock::time_point now) noexcept {
+        if (!_rate) {
+            return;
+        }
+        const int64_t increment = static_cast<int64_t>(cost * NS_PER_SECOND / _rate);
+        const int64_t nowNs = to_ns(now);
+        int64_t arrival = _arrival.load(std::memory_order_relaxed);
+        while (!_arrival.compare_exchange_weak(arrival, std::max(arrival, nowNs) + increment, std::memory_order_relaxed)) {}
+    }
+
+    // refilled: the same as a bucket nothing was ever taken from
+    [[nodiscard]] bool is_full(clock::time_point now) const noexcept {
+        return _arrival.load(std::memory_order_relaxed) <= to_ns(now);
+    }
+
+    // until the bucket is not overdrawn anymore, 0 if it is not
+    [[nodiscard]] clock::duration get_wait(clock::time_point now) const noexcept {
+        if (!_rate) {
+            return clock::duration::zero();
+        }
+        const int64_t debt = _arrival.load(std::memory_order_relaxed) - to_ns(now) - _tolerance;
+        return (debt > 0) ? std::chrono::duration_cast<clock::duration>(std::chrono::nanoseconds(debt)) : clock::duration::zero();
+    }
+
+private:
+    static constexpr uint64_t NS_PER_SECOND = 1000000000;
+
+    [[nodiscard]] static int64_t to_ns(clock::time_point now) noexcept {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+    }
+
+    uint64_t _rate = 0;
+    int64_t _tolerance = 0;
+    std::atomic<int64_t> _arrival{ 0 };
+};
+
+// the buckets every client of one listener draws from
+struct listener_quota {
+    listener_quota() = default;
+
+    explicit listener_quota(const listener_limits& limits) noexcept :
+        _publishes(limits._listenerPublishes),
+        _bytes(limits._listenerBytes) {}
+
+    token_bucket _publishes;
+    token_bucket _bytes;
+};
+
+// a client's own buckets and its listener's. Every PUBLISH is charged to the four
+// of them, the client is read from again once none is overdrawn
+class publish_limiter {
+public:
+    publish_limiter() = default;
+
+    publish_limiter(const listener_limits& limits, listener_quota* quota) noexcept :
+        _publishes(limits._clientPublishes),
+        _bytes(limits._clientBytes),
+        _quota(quota) {}
+
+    [[nodiscard]] bool is_enabled() const noexcept {
+        return _publishes.is_enabled() || _bytes.is_enabled() || (_quota && (_quota->_publishes.is_enabled() || _quota->_bytes.is_enabled()));
+    }
+
+    // other clients of the listener did not overdraw it
+    [[nodiscard]] bool is_listener_conforming(clock::time_point now) const noexcept {
+        return !_quota || (_quota->_publishes.conforms(now) && _quota->_bytes.conforms(now));
+    }
+
+    void charge(uint64_t bytes, clock::time_point now) noexcept {
+        _publishes.charge(1, now);
+        _bytes.charge(bytes, now);
+        if (_quota) {
+            _quota->_publishes.charge(1, now);
+            _quota->_bytes.charge(bytes, now);
+        }
+    }
+
+    // until the client may be read from again
+    [[nodiscard]] clock::duration get_wait(clock::time_point now) const noexcept {
+        clock::duration wait = std::max(_publishes.get_wait(now), _bytes.get_wait(now));
+        if (_quota) {
+            wait = std::max({ wait, _quota->_publishes.get_wait(now), _quota->_bytes.get_wait(now) });
+        }
+        return wait;
+    }
+
+private:
+    token_bucket _publishes;
+    token_bucket _bytes;
+    listener_quota* _quota = nullptr;
+};
+
+/*
+ * Connections per source address, for the TCP listener: one bucket per address
+ * that connected recently. Buckets that refilled are forgotten every PRUNE_PERIOD,
+ * so a storm of distinct addresses costs memory only while it lasts. Io thread only
+ */
+class source_limiter {
+public:
+    static constexpr std::chrono::seconds PRUNE_PERIOD{ 1 };
+
+    explicit source_limiter(const rate_limit& limit) noexcept :
+        _limit(limit) {}
+
+    [[nodiscard]] bool is_enabled() const noexcept {
+        return _limit._perSecond != 0;
+    }
+
+    // charges the address for one connection, false if it is over its rate
+    [[nodiscard]] bool admit(const asio::ip::address& address, clock::time_point now) {
+        if (!is_enabled()) {
+            return true;
+        }
+        if (now - _lastPrune >= PRUNE_PERIOD) {
+            prune(now);
+        }
+        auto it = _buckets.find(get_key(address));
+        if (it == _buckets.end()) {
+            it = _buckets.emplace(std::piecewise_construct, std::forward_as_tuple(get_key(address)), std::forward_as_tuple(_limit)).first;
+        }
+        if (!it->second.conforms(now)) {
+            return false;
+        }
+        it->second.charge(1, now);
+        return true;
+    }
+
+    [[nodiscard]] size_t get_source_count() const noexcept {
+        return _buckets.size();
+    }
+
+private:
+    // v4 addresses are kept v4 mapped, one key type for both
+    using key = asio::ip::address_v6::bytes_type;
+
+    struct key_hash {
+        size_t operator()(const key& k) const noexcept {
+            // FNV-1a
+            uint64_t hash = 14695981039346656037ull;
+            for (const uint8_t byte : k) {
+                hash = (hash ^ byte) * 1099511628211ull;
+            }
+            return static_cast<size_t>(hash);
+        }
+    };
+
+    [[nodiscard]] static key get_key(const asio::ip::address& address) noexcept {
+        if (address.is_v4()) {
+            return asio::ip::make_address_v6(asio::ip::v4_mapped, address.to_v4()).to_bytes();
+        }
+        return address.to_v6().to_bytes();
+    }
+
+    void prune(clock::time_point now) {
+        _lastPrune = now;
+        for (auto it = _buckets.begin(); it != _buckets.end();) {
+            it = it->second.is_full(now) ? _buckets.erase(it) : std::next(it);
+        }
+    }
+
+    rate_limit _limit;
+    std::unordered_map<key, token_bucket, key_hash> _buckets;
+    clock::time_point _lastPrune;
+};
+
+} // namespace rate
+
+} // namespace lmqtt
@@ -7,8 +7,13 @@ namespace lmqtt {
 // with REASON_STRING property
 enum class reason_code : uint8_t {
     SUCCESS                                 = 0x00,
+    GRANTED_QOS_1                           = 0x01,
+    GRANTED_QOS_2                           = 0x02,
     DISCONNECT_WITH_WILL_MESSAGE            = 0x04,
+    NO_MATCHING_SUBSCRIBERS                 = 0x10,
     NO_SUBSCRIPTION_EXISTS                  = 0x11,
+    CONTINUE_AUTHENTICATION                 = 0x18,
+    RE_AUTHENTICATE                         = 0x19,
     UNSPECIFIED_ERROR                       = 0x80,
     MALFORMED_PACKET                        = 0x81,
     PROTOCOL_ERROR                          = 0x82,
@@ -19,7 +24,8 @@ enum class reason_code : uint8_t {
     SERVER_SHUTTING_DOWN                    = 0x8B,
     KEEP_ALIVE_TIMEOUT                      = 0x8D,
     SESSION_TAKEN_OVER                      = 0x8E,
-    TOPIC_FILTER_INVALID                    = 0x90,
+    TOPIC_FILTER_INVALID                    = 0x8F,
+    TOPIC_NAME_INVALID                      = 0x90,
     PACKET_ID_IN_USE                        = 0x91,
     RECEIVE_MAXIMUM_EXCEEDED                = 0x93,
     TOPIC_ALIAS_INVALID                     = 0x94,
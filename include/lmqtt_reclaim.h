@@ -0,0 +1,162 @@
+#pragma once
+
+#include "lmqtt_common.h"
+
+namespace lmqtt {
+
+namespace reclaim {
+
+/*
+ * Epoch based reclamation. Handlers of the io threads refer to connections by raw
+ * pointer, without touching a reference count: a connection that is torn down is
+ * retired instead of destroyed, and destroyed once every io thread went through a
+ * quiescent state (between two handlers, where it holds no pointer from earlier
+ * ones) after it was retired.
+ *
+ * Each io thread is a participant. It announces its quiescent states, which
+ * publishes the global epoch it saw; once every participant saw the current epoch,
+ * it moves on. What was retired in epoch e is destroyed from epoch e + 2 on: a
+ * handler that was running when it was retired has returned everywhere by then.
+ * Objects are retired and destroyed by the participant that retired them, nothing
+ * is locked but the list of participants.
+ */
+class domain {
+public:
+    // a participant that is not registered, or not running handlers
+    static constexpr uint64_t IDLE = std::numeric_limits<uint64_t>::max();
+
+    [[nodiscard]] uint64_t get_epoch() const noexcept {
+        return _epoch.load(std::memory_order_acquire);
+    }
+
+    // the slot of a new participant, idle until its first quiescent state
+    [[nodiscard]] std::atomic<uint64_t>* add_participant() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto& slot : _slots) {
+            if (!slot._used) {
+                slot._used = true;
+                return &slot._epoch;
+            }
+        }
+        _slots.emplace_back();
+        _slots.back()._used = true;
+        return &_slots.back()._epoch;
+    }
+
+    void remove_participant(std::atomic<uint64_t>* epoch) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        epoch->store(IDLE, std::memory_order_release);
+        for (auto& slot : _slots) {
+            if (&slot._epoch == epoch) {
+                slot._used = false;
+            }
+        }
+    }
+
+    // moves the epoch on if every participant saw the current one
+    void try_advance() noexcept {
+        uint64_t epoch = get_epoch();
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (const auto& slot : _slots) {
+                const uint64_t seen = slot._epoch.load(std::memory_order_acquire);
+                if (seen != IDLE && seen < epoch) {
+                    return;
+                }
+            }
+        }
+        _epoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_acq_rel);
+    }
+
+private:
+    struct slot {
+        std::atomic<uint64_t> _epoch{ IDLE };
+        bool _used = false;
+    };
+
+    std::atomic<uint64_t> _epoch{ 1 };
+    std::mutex _mutex;
+    // a deque: slots do not move when participants come
+    std::deque<slot> _slots;
+};
+
+// the epoch every io thread sees, wherever it is included from
+inline domain& get_domain() noexcept {
+    static domain instance;
+    return instance;
+}
+
+// one io thread's view of the domain. Only used from that thread (and from the
+// thread that owns it once the io thread is gone)
+class participant {
+public:
+    using destroyer = void (*)(void* object, void* context);
+
+    explicit participant(domain& d = get_domain()) :
+        _domain(d),
+        _epoch(d.add_participant()) {}
+
+    participant(const participant&) = delete;
+    participant& operator=(const participant&) = delete;
+
+    // no io thread runs anymore, whatever is left can go
+    ~participant() {
+        destroy_all();
+        _domain.remove_participant(_epoch);
+    }
+
+    // object is destroyed by destroy(object, context), later
+    void retire(void* object, destroyer destroy, void* context) {
+        _retired.push_back({ object, destroy, context, _domain.get_epoch() });
+    }
+
+    // from the io thread, between handlers: destroys what no handler can refer to
+    // anymore, returns how many
+    size_t quiescent() {
+        _epoch->store(_domain.get_epoch(), std::memory_order_release);
+        _domain.try_advance();
+        const uint64_t epoch = _domain.get_epoch();
+
+        // retired in epoch order, the oldest first
+        size_t destroyed = 0;
+        while (!_retired.empty() && _retired.front()._epoch + 2 <= epoch) {
+            const retired r = _retired.front();
+            _retired.pop_front();
+            r._destroy(r._object, r._context);
+            ++destroyed;
+        }
+        return destroyed;
+    }
+
+    // this participant runs no handlers until its next quiescent state
+    void go_idle() noexcept {
+        _epoch->store(domain::IDLE, std::memory_order_release);
+    }
+
+    void destroy_all() {
+        for (auto& r : _retired) {
+            r._destroy(r._object, r._context);
+        }
+        _retired.clear();
+    }
+
+    [[nodiscard]] size_t get_retired_count() const noexcept {
+        return _retired.size();
+    }
+
+private:
+    struct retired {
+        void* _object;
+        destroyer _destroy;
+        void* _context;
+        uint64_t _epoch;
+    };
+
+    domain& _domain;
+    std::atomic<uint64_t>* _epoch;
+    std::deque<retired> _retired;
+};
+
+} // namespace reclaim
+
+} // namespace lmqtt
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "lmqtt_common.h"
+#include "lmqtt_types.h"
+#include "lmqtt_utils.h"
+#include "lmqtt_properties.h"
+#include "lmqtt_encoder.h"
+#include "lmqtt_stream_decoder.h"
+#include "lmqtt_outbound.h"
+#include "lmqtt_subscriptions.h"
+#include "lmqtt_histogram.h"
+
+namespace lmqtt {
+
+/*
+ * Forwards a PUBLISH to the matching subscribers while it is being received
+ * (cut-through): as soon as the variable header is decoded, the outgoing PUBLISH
+ * header is queued to each subscriber, then every payload chunk is relayed as it
+ * comes off the publisher's socket. A subscriber that keeps up gets the message
+ * after roughly the upload time instead of upload time + send time.
+ *
+ * A subscriber that is slower than the publisher falls back to buffering: the
+ * chunks wait in its outbound queue while the others keep receiving. The queue
+ * is bounded (see outbound_queue), so a slow subscriber never holds more than
+ * MAX_QUEUED_BYTES and never slows the publisher or the other subscribers down.
+ * What happens to the messages it can not take is up to its subscription's
+ * overflow_policy.
+ *
+ * What waits in the subscribers' queues is charged to the publisher's memory
+ * account, so the governor knows who to stop reading from when memory runs low.
+ *
+ * Buffered (small) PUBLISH packets go through the same path in a single chunk.
+ * Messages are delivered with QoS 0, which is what SUBSCRIBE grants for now.
+ */
+class relay_publish_sink : public publish_sink {
+public:
+    explicit relay_publish_sink(
+        subscription_registry& subscriptions,
+        std::shared_ptr<memory::account> publisher = nullptr
+    ) :
+        _subscriptions(subscriptions),
+        _publisher(std::move(publisher)) {}
+
+    void on_publish_begin(const publish_header& header) override {
+        _targets.clear();
+        const latency::ticks routeStart = latency::now();
+        _subscriptions.match(header._topic, _matches);
+        if (_matches.empty()) {
+            latency::record(latency::stage::ROUTE, packet_type::PUBLISH, routeStart);
+            return;
+        }
+
+        shared_bytes publishHeader = encode_publish_header(header);
+        latency::record(latency::stage::ROUTE, packet_type::PUBLISH, routeStart);
+        if (!publishHeader) {
+            _matches.clear();
+            return;
+        }
+
+        latency::scoped_timer timer(latency::stage::ENQUEUE, packet_type::PUBLISH);
+        const uint64_t packetSize = publishHeader->size() + static_cast<uint64_t>(header._payloadSize);
+        for (auto& match : _matches) {
+            auto message = match._queue->open(publishHeader, packetSize, header._topic, match._options, _publisher);
+            if (message) {
+                _targets.push_back({ std::move(match._queue), std::move(message) });
+            }
+        }
+        _matches.clear();
+    }
+
+    void on_payload_chunk(const uint8_t* data, uint32_t size) override {
+        if (_targets.empty()) {
+            return;
+        }
+
+        latency::scoped_timer timer(latency::stage::ENQUEUE, packet_type::PUBLISH);
+
+        // one copy, shared by every subscriber
+        auto chunk = std::make_shared<const std::vector<uint8_t>>(data, data + size);
+        _targets.erase(
+            std::remove_if(_targets.begin(), _targets.end(), [&chunk](target& t) {
+                return !t._queue->append(t._message, chunk);
+            }),
+            _targets.end()
+        );
+    }
+
+    void on_publish_end() override {
+        for (auto& t : _targets) {
+            t._queue->finish(t._message);
+        }
+        _targets.clear();
+    }
+
+private:
+    struct target {
+        std::shared_ptr<outbound_queue> _queue;
+        std::shared_ptr<outbound_message> _message;
+    };
+
+    // fixed header, topic and properties of the forwarded PUBLISH (QoS 0, so no
+    // packet id). The remaining length already counts the payload.
+    [[nodiscard]] shared_bytes encode_publish_header(const publish_header& header) {
+        // a topic alias only means something between the publisher and us
+        _properties.clear();
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(header._properties.data());
+        const uint8_t* propertyEnd = p + header._properties.size();
+        while (p < propertyEnd) {
+            const uint8_t* propertyStart = p;
+            const property::property_type ptype = static_cast<property::property_type>(*(p++));
+            uint32_t propertySize = 0;
+            if (property::validate_property_data(ptype, p, static_cast<uint32_t>(propertyEnd - p), propertySize) != reason_code::SUCCESS) {
+                return nullptr;
+            }
+            p += propertySize;
+            if (ptype != property::property_type::TOPIC_ALIAS) {
+                _properties.append(reinterpret_cast<const char*>(propertyStart), static_cast<size_t>(p - propertyStart));
+            }
+        }
+
+        encoder::publish_message msg;
+        msg._topic = header._topic;
+        msg._encodedProperties = _properties;
+        msg._payloadSize = header._payloadSize;
+        const uint32_t size = encoder::packet_encoder::get_header_size(msg);
+        if (!size) {
+            return nullptr;
+        }
+        auto bytes = std::make_shared<std::vector<uint8_t>>(size);
+        uint32_t written = 0;
+        if (encoder::packet_encoder::encode_header(bytes->data(), size, msg, written) != return_code::OK) {
+            return nullptr;
+        }
+        return bytes;
+    }
+
+    subscription_registry& _subscriptions;
+    std::shared_ptr<memory::account> _publisher;
+    std::vector<target> _targets;
+    // reused between messages
+    std::vector<subscriber_match> _matches;
+    std::string _properties;
+};
+
+} // namespace lmqtt
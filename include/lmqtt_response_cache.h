@@ -0,0 +1,216 @@
+#pragma once
+
+#include "lmqtt_common.h"
+#include "lmqtt_types.h"
+#include "lmqtt_reason_codes.h"
+#include "lmqtt_utils.h"
+
+namespace lmqtt {
+
+namespace response {
+
+// Most of the packets the server answers with are identical from one client to
+// another, except for a packet id or a reason code. Instead of encoding them each
+// time, we keep their bytes and only patch what changes.
+
+// PINGRESP never changes: fixed header with a zero remaining length
+constexpr std::array<uint8_t, 2> PINGRESP_PACKET{ 0xD0, 0x00 };
+
+// PUBACK, PUBREC, PUBREL and PUBCOMP share the same layout:
+// fixed header | remaining length | packet id MSB | packet id LSB | reason code
+// If the reason code is SUCCESS and there are no properties, the reason code can
+// be omitted [MQTT-3.4.2.1], so the packet is only 4 bytes long.
+constexpr size_t ACK_PACKET_SIZE = 4;
+constexpr size_t ACK_PACKET_WITH_REASON_SIZE = 5;
+
+constexpr std::array<uint8_t, ACK_PACKET_WITH_REASON_SIZE> get_ack_template(packet_type type) noexcept {
+    const uint8_t controlField = (static_cast<uint8_t>(type) << 4)
+        | static_cast<uint8_t>(packet::utils::get_packet_flag(type));
+    return { controlField, 0x03, 0x00, 0x00, 0x00 };
+}
+
+constexpr std::array<std::array<uint8_t, ACK_PACKET_WITH_REASON_SIZE>, 4> ACK_TEMPLATES{
+    get_ack_template(packet_type::PUBACK),
+    get_ack_template(packet_type::PUBREC),
+    get_ack_template(packet_type::PUBREL),
+    get_ack_template(packet_type::PUBCOMP)
+};
+
+constexpr bool is_ack_packet(packet_type type) noexcept {
+    return (type == packet_type::PUBACK)
+        || (type == packet_type::PUBREC)
+        || (type == packet_type::PUBREL)
+        || (type == packet_type::PUBCOMP);
+}
+
+// writes an ack packet into buff and returns the number of written bytes,
+// 0 if the buffer is too small or if the packet type is not an ack
+inline size_t write_ack(
+    uint8_t* buff,
+    size_t buffSize,
+    packet_type type,
+    uint16_t packetId,
+    reason_code reasonCode
+) noexcept {
+    if (!is_ack_packet(type)) {
+        return 0;
+    }
+
+    const size_t packetSize = (reasonCode == reason_code::SUCCESS) ? ACK_PACKET_SIZE : ACK_PACKET_WITH_REASON_SIZE;
+    if (buffSize < packetSize) {
+        return 0;
+    }
+
+    const auto& ackTemplate = ACK_TEMPLATES[static_cast<uint8_t>(type) - static_cast<uint8_t>(packet_type::PUBACK)];
+    std::memcpy(buff, ackTemplate.data(), packetSize);
+    buff[1] = static_cast<uint8_t>(packetSize - 2);
+    buff[2] = packetId >> 0x8;
+    buff[3] = packetId & 0xFF;
+    if (packetSize == ACK_PACKET_WITH_REASON_SIZE) {
+        buff[4] = static_cast<uint8_t>(reasonCode);
+    }
+    return packetSize;
+}
+
+// SUBACK: fixed header | remaining length | packet id | properties length (0) | reason codes
+// Only the packet id and the reason codes (one per topic filter) change.
+constexpr std::array<uint8_t, 5> SUBACK_PREFIX{ 0x90, 0x00, 0x00, 0x00, 0x00 };
+
+inline size_t get_suback_size(size_t reasonCodeCount) noexcept {
+    // SUBACK_PREFIX already counts one byte for the remaining length
+    return SUBACK_PREFIX.size() - 1 + reasonCodeCount
+        + utils::get_variable_int_size(static_cast<uint32_t>(3 + reasonCodeCount));
+}
+
+inline size_t write_suback(
+    uint8_t* buff,
+    size_t buffSize,
+    uint16_t packetId,
+    const reason_code* reasonCodes,
+    size_t reasonCodeCount
+) noexcept {
+    const uint32_t remainingLength = static_cast<uint32_t>(3 + reasonCodeCount);
+    if (remainingLength >= 0x200000) {
+        return 0;
+    }
+
+    const size_t packetSize = get_suback_size(reasonCodeCount);
+    if (buffSize < packetSize) {
+        return 0;
+    }
+
+    buff[0] = SUBACK_PREFIX[0];
+
+    // remaining length, at most 3 bytes here
+    uint8_t varSize = 0;
+    if (utils::encode_variable_int(buff + 1, static_cast<uint32_t>(buffSize - 1), remainingLength, varSize) != return_code::OK) {
+        return 0;
+    }
+    size_t pos = 1 + varSize;
+
+    buff[pos++] = packetId >> 0x8;
+    buff[pos++] = packetId & 0xFF;
+    buff[pos++] = 0x00; // no properties
+    for (size_t i = 0; i < reasonCodeCount; ++i) {
+        buff[pos++] = static_cast<uint8_t>(reasonCodes[i]);
+    }
+    return pos;
+}
+
+// Everything that ends up in a CONNACK except the reason code. Two clients with
+// the same profile receive byte-identical CONNACK packets.
+struct connack_profile {
+    uint32_t _sessionExpiryInterval = 0;
+    uint16_t _receiveMaximum = 0;
+    uint8_t _maximumQos = 0;
+    uint8_t _retainAvailable = 0;
+    uint32_t _maximumPacketSize = 0;
+    uint16_t _topicAliasMaximum = 0;
+    uint8_t _wildcardSubscription = 0;
+    uint16_t _keepAlive = 0;
+    std::string_view _reasonString;
+
+    bool operator==(const connack_profile& other) const noexcept {
+        return _sessionExpiryInterval == other._sessionExpiryInterval
+            && _receiveMaximum == other._receiveMaximum
+            && _maximumQos == other._maximumQos
+            && _retainAvailable == other._retainAvailable
+            && _maximumPacketSize == other._maximumPacketSize
+            && _topicAliasMaximum == other._topicAliasMaximum
+            && _wildcardSubscription == other._wildcardSubscription
+            && _keepAlive == other._keepAlive
+            && _reasonString == other._reasonString;
+    }
+
+    struct hash {
+        size_t operator()(const connack_profile& p) const noexcept {
+            size_t h = std::hash<std::string_view>{}(p._reasonString);
+            auto combine = [&h](uint64_t v) {
+                h ^= std::hash<uint64_t>{}(v) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+            };
+            combine((uint64_t(p._sessionExpiryInterval) << 32) | p._maximumPacketSize);
+            combine((uint64_t(p._receiveMaximum) << 48)
+                | (uint64_t(p._topicAliasMaximum) << 32)
+                | (uint64_t(p._keepAlive) << 16)
+                | (uint64_t(p._maximumQos) << 8)
+                | p._retainAvailable);
+            combine(p._wildcardSubscription);
+            return h;
+        }
+    };
+};
+
+// Pre-encoded CONNACK packets keyed by profile. There is one cache per io thread,
+// so lookups do not need any locking.
+class connack_cache {
+public:
+    // a handful of profiles covers the usual fleet, we do not want a client
+    // with unusual properties to grow the cache forever
+    static constexpr size_t MAX_PROFILES = 64;
+
+    struct entry {
+        std::string _reasonString; // the profile key points into this string
+        std::vector<uint8_t> _bytes;
+        uint32_t _reasonCodeOffset = 0;
+    };
+
+    static connack_cache& local() noexcept {
+        static thread_local connack_cache cache;
+        return cache;
+    }
+
+    [[nodiscard]] const entry* find(const connack_profile& profile) const noexcept {
+        auto it = _entries.find(profile);
+        if (it == _entries.end()) {
+            return nullptr;
+        }
+        return it->second.get();
+    }
+
+    void insert(const connack_profile& profile, const std::vector<uint8_t>& bytes, uint32_t reasonCodeOffset) {
+        if (_entries.size() >= MAX_PROFILES) {
+            return;
+        }
+
+        // the key must not point to the client's string, which dies with the client
+        auto newEntry = std::make_unique<entry>();
+        newEntry->_reasonString = std::string(profile._reasonString);
+        newEntry->_bytes = bytes;
+        newEntry->_reasonCodeOffset = reasonCodeOffset;
+
+        connack_profile key = profile;
+        key._reasonString = newEntry->_reasonString;
+        _entries.emplace(key, std::move(newEntry));
+    }
+
+    size_t size() const noexcept {
+        return _entries.size();
+    }
+
+private:
+    std::unordered_map<connack_profile, std::unique_ptr<entry>, connack_profile::hash> _entries;
+};
+
+} // namespace response
+
+} // namespace lmqtt
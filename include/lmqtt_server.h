@@ -1,22 +1,69 @@
 #pragma once
 
 #include "lmqtt_common.h"
+#include "lmqtt_log.h"
 #include "lmqtt_tsqueue.h"
 #include "lmqtt_connection.h"
+#include "lmqtt_memory_stream.h"
+#include "lmqtt_shm_stream.h"
 #include "lmqtt_timer.h"
+#include "lmqtt_server_config.h"
+#include "lmqtt_metrics.h"
+#include "lmqtt_metrics_exporter.h"
+#include "lmqtt_capture.h"
+#include "lmqtt_memory_budget.h"
+#include "lmqtt_admission.h"
+#include "lmqtt_io_thread.h"
+#include "lmqtt_tls.h"
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+#include <sys/stat.h>
+#endif
 
 namespace lmqtt {
 
 class lmqtt_server {
+	// the defaults, listening on port
+	[[nodiscard]] static server_config make_config(uint16_t port) {
+		server_config config;
+		config._port = port;
+		return config;
+	}
+
 public:
 	lmqtt_server(
 		uint16_t port
 	) : 
+		lmqtt_server(make_config(port)) {}
+
+	explicit lmqtt_server(
+		const server_config& config
+	) :
+		_config(config),
 		_acceptor(
 			_context,
-			asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)
+			asio::ip::tcp::endpoint(asio::ip::tcp::v4(), config._port)
+		),
+		_quota(config._limits),
+		_readScheduler(_context, _connections),
+		_sources(config._connectsPerSource),
+		_reclaimTimer(_context),
+		_governorTimer(_context),
+		_admissionTimer(_context),
+		_admission(get_overload_config(config)),
+		_metrics(
+			_context,
+			_subscriptions,
+			config,
+			[this]() {
+				metrics::server_gauges gauges;
+				gauges._sessions = _connections.size();
+				gauges._subscriptions = _subscriptions.subscription_count();
+				collect_client_queues(gauges._clientQueues);
+				return gauges;
+			}
 		),
-		_port(port) {
+		_port(config._port) {
 		// will not use the timer for now
 		/*_timer = std::make_shared<lmqtt_timer>(5000, [this] {
 				std::cout << "Calling function" << std::endl;
@@ -42,19 +89,41 @@ public:
 	[[nodiscard]] bool start() {
 		try {
 
-			wait_for_clients();
+			if (!_config._capturePath.empty()
+				&& capture::recorder::instance().start(_config._capturePath) != return_code::OK) {
+				LMQTT_LOG_ERROR("[SERVER] Could not open capture file {}", _config._capturePath);
+				return false;
+			}
+
+			for (const std::string& filter : _config._lastValueFilters) {
+				if (_subscriptions.add_last_value_rule(filter) != return_code::OK) {
+					throw std::runtime_error("invalid last value filter: " + filter);
+				}
+			}
 
-			_thContext = std::thread([this]() {_context.run(); });
-			_cleanupThread = std::thread([this]() {deleter_job(); });
+			// accept_backlog() polls it
+			_acceptor.non_blocking(true);
+			wait_for_clients();
+			open_unix_listeners();
+			open_tls_listeners();
+			// ticks are converted to ns against the clocks read here, long before
+			// the first scrape
+			(void)latency::registry::instance();
+			_metrics.start();
+			reclaim_connections();
+			start_memory_governor();
+			start_admission_control();
+
+			_thContext = std::thread([this]() { run_io_thread(); });
 
 		} catch (std::exception& e) {
-			std::cerr << "[SERVER] Could Not Start Server. Reason:\n" << e.what() << "\n";
+			LMQTT_LOG_ERROR("[SERVER] Could not start server. Reason: {}", e.what());
 			stop();
 			return false;
 		}
 
-		std::cout << "[SERVER] Successfully Started LMQTT Server\n";
-		std::cout << "[SERVER] Listening on port " << _port << "\n";
+		LMQTT_LOG_INFO("[SERVER] Successfully started LMQTT server");
+		LMQTT_LOG_INFO("[SERVER] Listening on port {}", _port);
 		return true;
 	}
 
@@ -67,17 +136,47 @@ public:
 			_thContext.join();
 		}
 
-		std::cout << "[SERVER] Successfully Stopped LMQTT Server.\n";
-		
-		_exitCleanupThread = true;
-		if (_cleanupThread.joinable()) {
-			_cleanupThread.join();
-		}
+		LMQTT_LOG_INFO("[SERVER] Successfully stopped LMQTT server");
+
+		// before the connections: no handshake hands a client over anymore
+		close_tls_listeners();
 
-		std::cout << "[SERVER] Successfully Stopped connections cleaner\n";
+		// the io thread is gone, their sockets are closed while the context is
+		// still there
+		_connections.clear();
+
+		close_unix_listeners();
+
+		// after the connections, so their last records make it to the file
+		capture::recorder::instance().stop();
 	}
 
 protected:
+	// pinned first, so that everything the io thread allocates is on its node
+	void run_io_thread() {
+		const io_thread_config& io = _config._io;
+		if (io._cpu >= 0) {
+			if (io_thread::pin_current_thread(io._cpu) == return_code::OK) {
+				LMQTT_LOG_INFO("[SERVER] io thread pinned to cpu {} (numa node {})", io._cpu, io_thread::get_cpu_node(io._cpu));
+			} else {
+				LMQTT_LOG_WARNING("[SERVER] Could not pin the io thread to cpu {}", io._cpu);
+			}
+		}
+		if (io._busyPoll.count()) {
+			LMQTT_LOG_INFO("[SERVER] io thread busy polls for {} us", io._busyPoll.count());
+		}
+		io_thread::run(_context, io._busyPoll);
+	}
+
+	// a busy polling io thread is always busy, only its sojourn time tells load
+	[[nodiscard]] static overload_config get_overload_config(const server_config& config) {
+		overload_config overload = config._overload;
+		if (config._io._busyPoll.count()) {
+			overload._cpuPercent = 0;
+		}
+		return overload;
+	}
+
 	// async method: wait for connection
 	// It's here where all the magic happens
 	void wait_for_clients() {
@@ -85,49 +184,366 @@ protected:
 			[this](std::error_code ec, asio::ip::tcp::socket socket) {
 				if (!ec) {
 					// if the connection attempt is successful
-					std::cout << "[SERVER] New Connection: " << socket.remote_endpoint() << "\n";
-
-					// create a new connection object for this specific client
-					// since we used a smart pointer, the new connection will be destroyed
-					// when it falls out of scope, in case the connection was not accepted
-					std::shared_ptr<connection> newConnection =
-						std::make_shared<connection>(
-							_context,
-							std::move(socket),
-							_activeSessions,
-							_deletionQueue
-						);
+					on_tcp_client(std::move(socket));
+					// and the ones that came with it, without going back to the reactor
+					accept_backlog();
+				} else {
+					// error occurred during acceptance
+					LMQTT_LOG_WARNING("[SERVER] New connection error: {}", ec.message());
+				}
 
-					if (on_client_connection(newConnection)) {
+				wait_for_clients();
+			}
+		);
+	}
 
-						// if the connection was accepted, we push it to our connections container.
-						// if the connection was not accepted, the new connection will be destroyed
-						// since we are using a smart pointer
+	// up to _acceptBatch - 1 more connections, as long as the backlog has some:
+	// the acceptor is non blocking
+	void accept_backlog() {
+		for (size_t i = 1; i < _config._acceptBatch; ++i) {
+			std::error_code ec;
+			asio::ip::tcp::socket socket(_context);
+			_acceptor.accept(socket, ec);
+			if (ec) {
+				if (ec != asio::error::would_block && ec != asio::error::try_again) {
+					LMQTT_LOG_WARNING("[SERVER] New connection error: {}", ec.message());
+				}
+				return;
+			}
+			on_tcp_client(std::move(socket));
+		}
+	}
 
-						//newConnection->connect_to_client();
+	// its source's connect rate is checked before anything is allocated for it
+	void on_tcp_client(asio::ip::tcp::socket socket) {
+		if (!is_admitted_source(socket)) {
+			return;
+		}
+		LMQTT_LOG_DEBUG("[SERVER] New connection: {}", get_remote_address(socket));
+		configure_tcp_socket(socket);
+		add_connection(std::move(socket), _config._limits, _quota);
+	}
 
-						_activeSessions.push_back(std::move(newConnection));
+	// server_config::_connectsPerSource
+	[[nodiscard]] bool is_admitted_source(const asio::ip::tcp::socket& socket) {
+		std::error_code ec;
+		const asio::ip::tcp::endpoint endpoint = socket.remote_endpoint(ec);
+		if (ec) {
+			// reset before we got to it
+			return false;
+		}
+		if (!_sources.admit(endpoint.address(), rate::clock::now())) {
+			metrics::add(metrics::counters()._connectionsRejected);
+			metrics::add(metrics::counters()._connectsRateLimited);
+			LMQTT_LOG_DEBUG("[SERVER] Connection to {} denied. Reason: connect rate", endpoint.address().to_string());
+			return false;
+		}
+		return true;
+	}
+
+	// binds every TLS listener of the config and starts its handshake threads,
+	// throws if one cannot be opened
+	void open_tls_listeners() {
+#if defined(LMQTT_HAS_TLS)
+		for (const tls_listener_config& listenerConfig : _config._tlsListeners) {
+			_tlsListeners.push_back(std::make_unique<tls_listener>(_context, listenerConfig));
+			tls_listener& listener = *_tlsListeners.back();
+			listener._handshakes = std::make_unique<tls::handshake_pool>(
+				listener._sslContext.get(),
+				listenerConfig,
+				[this, &listener](tls::handshake_pool::session session) {
+					// from a handshake thread
+					asio::post(
+						_context,
+						[this, &listener, session = std::move(session)]() mutable {
+							on_tls_client(listener, std::move(session));
+						}
+					);
+				}
+			);
+			LMQTT_LOG_INFO("[SERVER] Listening for TLS on port {}", listenerConfig._port);
+			wait_for_tls_clients(listener);
+		}
+#else
+		if (!_config._tlsListeners.empty()) {
+			throw std::runtime_error("TLS is not available in this build (OpenSSL was not found)");
+		}
+#endif
+	}
+
+	// once the io thread is stopped
+	void close_tls_listeners() {
+#if defined(LMQTT_HAS_TLS)
+		for (auto& listener : _tlsListeners) {
+			listener->_handshakes->stop();
+			std::error_code ec;
+			listener->_acceptor.close(ec);
+		}
+		_tlsListeners.clear();
+#endif
+	}
+
+#if defined(LMQTT_HAS_TLS)
+	struct tls_listener {
+		tls_listener(asio::io_context& context, const tls_listener_config& config) :
+			_config(config),
+			_quota(config._limits),
+			_acceptor(context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), config._port)),
+			_sslContext(tls::make_server_context(config)) {}
+
+		tls_listener_config _config;
+		rate::listener_quota _quota;
+		asio::ip::tcp::acceptor _acceptor;
+		tls::ssl_context_ptr _sslContext;
+		std::unique_ptr<tls::handshake_pool> _handshakes;
+	};
+
+	// the handshake does not run here: the socket goes to the listener's handshake
+	// threads, and comes back through on_tls_client
+	void wait_for_tls_clients(tls_listener& listener) {
+		listener._acceptor.async_accept(
+			[this, &listener](std::error_code ec, asio::ip::tcp::socket socket) {
+				if (ec == asio::error::operation_aborted) {
+					// listener closed
+					return;
+				}
+				if (!ec) {
+					// no handshake for a client that would be refused after it
+					if (is_admitted_source(socket) && !is_over_limit(socket)) {
+						configure_tcp_socket(socket);
+						listener._handshakes->submit(std::move(socket));
+					}
+				} else {
+					LMQTT_LOG_WARNING("[SERVER] New connection error: {}", ec.message());
+				}
+
+				wait_for_tls_clients(listener);
+			}
+		);
+	}
+
+	// on the io thread, once the handshake went through
+	void on_tls_client(tls_listener& listener, tls::handshake_pool::session session) {
+		std::error_code ec;
+		asio::ip::tcp::socket socket = session._socket.attach(_context, ec);
+		if (ec) {
+			LMQTT_LOG_WARNING("[SERVER] New connection error: {}", ec.message());
+			return;
+		}
+		if (!session._ssl) {
+			// the kernel encrypts and decrypts: a plain TCP connection for the broker,
+			// sendfile and splice included
+			add_connection(std::move(socket), listener._config._limits, listener._quota);
+			return;
+		}
+		add_connection(tls::stream(std::move(socket), std::move(session._ssl)), listener._config._limits, listener._quota);
+	}
+#endif
+
+	// binds every unix and shared memory listener of the config, throws if one
+	// cannot be opened
+	void open_unix_listeners() {
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+		for (const unix_listener_config& listenerConfig : _config._unixListeners) {
+			_unixListeners.push_back(bind_unix_listener(listenerConfig));
+			LMQTT_LOG_INFO("[SERVER] Listening on unix socket {}", listenerConfig._path);
+			wait_for_unix_clients(*_unixListeners.back());
+		}
+#else
+		if (!_config._unixListeners.empty()) {
+			throw std::runtime_error("unix sockets are not available on this platform");
+		}
+#endif
+#if defined(LMQTT_HAS_SHM_TRANSPORT)
+		for (const unix_listener_config& listenerConfig : _config._shmListeners) {
+			_unixListeners.push_back(bind_unix_listener(listenerConfig));
+			LMQTT_LOG_INFO("[SERVER] Accepting shared memory clients on {}", listenerConfig._path);
+			wait_for_shm_clients(*_unixListeners.back());
+		}
+#else
+		if (!_config._shmListeners.empty()) {
+			throw std::runtime_error("the shared memory transport is not available on this platform");
+		}
+#endif
+	}
 
-						_activeSessions.back()->connect_to_client(100);
+	// once the io thread is stopped
+	void close_unix_listeners() {
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+		for (auto& listener : _unixListeners) {
+			std::error_code ec;
+			listener->_acceptor.close(ec);
+			if (listener->_bound) {
+				::unlink(listener->_config._path.c_str());
+			}
+		}
+		_unixListeners.clear();
+#endif
+	}
 
-						std::cout << "[" << _activeSessions.back()->get_remote_endpoint() << "] Connection Accepted, waiting for identification..\n";
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+	struct unix_listener {
+		unix_listener(asio::io_context& context, const unix_listener_config& config) :
+			_config(config), _quota(config._limits), _acceptor(context) {}
+
+		unix_listener_config _config;
+		rate::listener_quota _quota;
+		asio::local::stream_protocol::acceptor _acceptor;
+		// the socket file is ours, removed on stop
+		bool _bound = false;
+	};
+
+	[[nodiscard]] std::unique_ptr<unix_listener> bind_unix_listener(const unix_listener_config& listenerConfig) {
+		auto listener = std::make_unique<unix_listener>(_context, listenerConfig);
+
+		// a broker that did not stop cleanly leaves its socket behind, bind
+		// would fail on it. Anything that is not a socket is left alone
+		struct stat info {};
+		if (::stat(listenerConfig._path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+			::unlink(listenerConfig._path.c_str());
+		}
 
+		const asio::local::stream_protocol::endpoint endpoint(listenerConfig._path);
+		listener->_acceptor.open(endpoint.protocol());
+		listener->_acceptor.bind(endpoint);
+		listener->_bound = true;
+		if (::chmod(listenerConfig._path.c_str(), static_cast<mode_t>(listenerConfig._permissions)) != 0) {
+			LMQTT_LOG_WARNING("[SERVER] Could not set the permissions of {}", listenerConfig._path);
+		}
+		listener->_acceptor.listen();
+		return listener;
+	}
+
+	void wait_for_unix_clients(unix_listener& listener) {
+		listener._acceptor.async_accept(
+			[this, &listener](std::error_code ec, asio::local::stream_protocol::socket socket) {
+				if (ec == asio::error::operation_aborted) {
+					// listener closed
+					return;
+				}
+				if (!ec) {
+					LMQTT_LOG_DEBUG("[SERVER] New connection: {} on {}", get_remote_address(socket), listener._config._path);
+					if (is_allowed_peer(listener._config, socket)) {
+						add_connection(std::move(socket), listener._config._limits, listener._quota);
 					} else {
-						std::cout << "[SERVER] Connection to " << newConnection->get_remote_endpoint() << " Denied. Reason: Reached maximum number of allowed connections\n";
-						_deletionQueue.push_back(newConnection);
+						metrics::add(metrics::counters()._connectionsRejected);
+						LMQTT_LOG_WARNING("[SERVER] Connection to {} denied. Reason: uid not allowed on {}", get_remote_address(socket), listener._config._path);
 					}
+				} else {
+					LMQTT_LOG_WARNING("[SERVER] New connection error: {}", ec.message());
+				}
+
+				wait_for_unix_clients(listener);
+			}
+		);
+	}
 
+#if defined(LMQTT_HAS_SHM_TRANSPORT)
+	// same as unix sockets, then the client sends its region before the session starts
+	void wait_for_shm_clients(unix_listener& listener) {
+		listener._acceptor.async_accept(
+			[this, &listener](std::error_code ec, asio::local::stream_protocol::socket socket) {
+				if (ec == asio::error::operation_aborted) {
+					return;
+				}
+				if (!ec) {
+					if (is_allowed_peer(listener._config, socket)) {
+						shm_stream::async_accept_region(
+							std::move(socket),
+							[this, &listener](std::error_code handshakeError, shm_stream stream) {
+								if (handshakeError) {
+									LMQTT_LOG_WARNING("[SERVER] Shared memory handshake failed: {}", handshakeError.message());
+									return;
+								}
+								LMQTT_LOG_DEBUG("[SERVER] New connection: {}", get_remote_address(stream));
+								add_connection(std::move(stream), listener._config._limits, listener._quota);
+							}
+						);
+					} else {
+						metrics::add(metrics::counters()._connectionsRejected);
+						LMQTT_LOG_WARNING("[SERVER] Connection to {} denied. Reason: uid not allowed on {}", get_remote_address(socket), listener._config._path);
+					}
 				} else {
-					// error occurred during acceptance
-					std::cout << "[SERVER] New Connection Error: " << ec.message() << "\n";
+					LMQTT_LOG_WARNING("[SERVER] New connection error: {}", ec.message());
 				}
 
-				wait_for_clients();
+				wait_for_shm_clients(listener);
 			}
 		);
 	}
+#endif
+
+	// the uid comes from the kernel, the client cannot lie about it
+	[[nodiscard]] static bool is_allowed_peer(const unix_listener_config& config, asio::local::stream_protocol::socket& socket) {
+		if (config._allowedUids.empty()) {
+			return true;
+		}
+		peer_credentials credentials;
+		if (get_peer_credentials(socket, credentials) != return_code::OK) {
+			return false;
+		}
+		return std::find(config._allowedUids.begin(), config._allowedUids.end(), credentials._uid) != config._allowedUids.end();
+	}
+#endif
+
+	// server_config::_io options of accepted sockets, failures are only logged once
+	void configure_tcp_socket(asio::ip::tcp::socket& socket) {
+		const io_thread_config& io = _config._io;
+		if (io._noDelay) {
+			std::error_code ec;
+			socket.set_option(asio::ip::tcp::no_delay(true), ec);
+		}
+		if (io._socketBusyPoll
+			&& io_thread::set_socket_busy_poll(socket.native_handle(), io._socketBusyPoll) != return_code::OK
+			&& !std::exchange(_busyPollWarned, true)) {
+			LMQTT_LOG_WARNING("[SERVER] Could not set SO_BUSY_POLL on client sockets (needs CAP_NET_ADMIN)");
+		}
+	}
+
+	// any stream basic_connection can run on, from the io thread
+	template <typename Stream>
+	void add_connection(Stream stream, const listener_limits& limits, rate::listener_quota& quota) {
+		// refused before anything is allocated, the stream closes on its way out
+		if (is_over_limit(stream)) {
+			return;
+		}
+
+		// create a new connection object for this specific client, in a slot of the
+		// table and a block of its slab. Even an overloaded broker lets it CONNECT,
+		// to answer SERVER_BUSY (see start_admission_control)
+		connection_base* newConnection =
+			_connections.emplace<basic_connection<Stream>>(
+				_context,
+				std::move(stream),
+				_connections,
+				_subscriptions,
+				limits,
+				&quota,
+				&_readScheduler
+			);
+
+		metrics::add(metrics::counters()._connectionsAccepted);
+
+		newConnection->connect_to_client(100);
+
+		LMQTT_LOG_DEBUG("[{}] Connection accepted, waiting for identification", newConnection->get_remote_endpoint());
+	}
 	
 public:
+	// a client that talks to the broker through memory instead of a socket: the whole
+	// pipeline runs, minus the kernel. The returned end completes on clientExecutor,
+	// or can be used with blocking reads and writes from another thread
+	[[nodiscard]] memory_stream connect_in_memory(const memory_stream::executor_type& clientExecutor) {
+		auto [brokerEnd, clientEnd] = memory_stream::make_pair(_context.get_executor(), clientExecutor);
+		asio::post(
+			_context,
+			[this, stream = std::move(brokerEnd)]() mutable {
+				add_connection(std::move(stream), _config._limits, _quota);
+			}
+		);
+		return std::move(clientEnd);
+	}
+
 	// can be used to change how many messages can be processed at a time
 	void update(size_t maxMessages = -1) {
 
@@ -135,53 +551,259 @@ public:
 
 	}
 
-	void deleter_job() {
-		while (!_exitCleanupThread) {
-			_deletionQueue.wait();
-			//_messages.wait();
+protected:
 
-			if (!_deletionQueue.empty()) {
-				std::chrono::system_clock::time_point timeStart = std::chrono::system_clock::now();
-				//std::cout << "Detected deletion queue not empty\n";
-				auto connection = _deletionQueue.pop_front();
-				connection->shutdown();
-				_activeSessions.find_and_erase(connection);
-				std::chrono::system_clock::time_point timeEnd = std::chrono::system_clock::now();
-				std::cout << "[SERVER] (thread " << std::this_thread::get_id() << ") deleting connection " << connection.get() << std::endl;
-				//std::cout << "Deletion from queue took " << std::chrono::duration_cast<std::chrono::microseconds>(timeEnd - timeStart).count() << " us\n";
+	// server_config::_maxConnections
+	[[nodiscard]] bool is_full() const noexcept {
+		return _config._maxConnections && _connections.size() >= _config._maxConnections;
+	}
+
+	// is_full(), counted as a rejection of this client
+	template <typename Stream>
+	[[nodiscard]] bool is_over_limit(const Stream& stream) {
+		if (!is_full()) {
+			return false;
+		}
+		metrics::add(metrics::counters()._connectionsRejected);
+		metrics::add(metrics::counters()._connectionsOverLimit);
+		LMQTT_LOG_DEBUG("[SERVER] Connection to {} denied. Reason: {} connections already", get_remote_address(stream), _config._maxConnections);
+		return true;
+	}
+
+	// the _queueMetricsClients clients with the most bytes queued, from the io thread
+	void collect_client_queues(std::vector<metrics::server_gauges::client_queue>& queues) {
+		if (!_config._queueMetricsClients) {
+			return;
+		}
+		_connections.for_each([&queues](const connection_base& connection) {
+			if (connection.get_queued_messages()) {
+				queues.push_back({ std::string(connection.get_client_id()), connection.get_queued_bytes(), connection.get_queued_messages() });
+			}
+		});
+		const size_t count = std::min(queues.size(), _config._queueMetricsClients);
+		std::partial_sort(queues.begin(), queues.begin() + count, queues.end(), [](const auto& a, const auto& b) {
+			return a._bytes > b._bytes;
+		});
+		queues.resize(count);
+	}
+
+	// connections torn down are destroyed by the io thread, between two handlers,
+	// once none of them can still refer to them (see connection_table)
+	static constexpr std::chrono::milliseconds RECLAIM_PERIOD{ 10 };
+
+	void reclaim_connections() {
+		_reclaimTimer.expires_after(RECLAIM_PERIOD);
+		_reclaimTimer.async_wait([this](std::error_code ec) {
+			if (ec) {
+				return;
 			}
+			_connections.quiescent();
+			reclaim_connections();
+		});
+	}
+
+	// the memory budget is checked every GOVERNOR_PERIOD from the io thread, where
+	// every connection's account is kept
+	static constexpr std::chrono::milliseconds GOVERNOR_PERIOD{ 10 };
+
+	void start_memory_governor() {
+		memory::set_limit(_config._memoryBudget);
+		if (_config._memoryBudget) {
+			LMQTT_LOG_INFO("[SERVER] Memory budget: {} bytes", _config._memoryBudget);
+			govern_memory();
 		}
 	}
 
-protected:
+	void govern_memory() {
+		_governorTimer.expires_after(GOVERNOR_PERIOD);
+		_governorTimer.async_wait([this](std::error_code ec) {
+			if (ec) {
+				return;
+			}
+			balance_memory();
+			govern_memory();
+		});
+	}
 
-	bool on_client_connection(std::shared_ptr<connection> connection) {
-		if (_activeSessions.size() > 1) {
-			return false;
+	// close to the budget, we stop reading from the clients that hold the most until
+	// what they hold covers the excess: they can not make us hold more, while the
+	// others keep going. They are read from again once we are well under it
+	void balance_memory() {
+		// one signed type for all of them: an over-release must show up as what it
+		// is, not as a huge unsigned value that never lets the readers resume
+		const int64_t limit = static_cast<int64_t>(memory::get_limit());
+		const int64_t used = memory::used();
+		assert(used >= 0);
+		const int64_t resumeAt = limit * static_cast<int64_t>(memory::RESUME_PERCENT) / 100;
+		const int64_t pauseAt = limit * static_cast<int64_t>(memory::PAUSE_PERCENT) / 100;
+
+		if (used <= resumeAt) {
+			if (_pausedReaders.empty()) {
+				return;
+			}
+			LMQTT_LOG_INFO("[SERVER] Memory back to {} bytes, resuming {} clients", used, _pausedReaders.size());
+			for (const connection_handle handle : _pausedReaders) {
+				if (connection_base* connection = _connections.get(handle)) {
+					connection->resume_reading(read_pause::MEMORY);
+				}
+			}
+			metrics::add(metrics::counters()._pausedReaders, -static_cast<int64_t>(_pausedReaders.size()));
+			_pausedReaders.clear();
+			return;
 		}
-		return true;
+		if (used < pauseAt) {
+			return;
+		}
+
+		_consumers.clear();
+		_connections.for_each([this](connection_base& connection) {
+			if (connection.get_held_bytes() > 0) {
+				_consumers.push_back(&connection);
+			}
+		});
+		std::sort(_consumers.begin(), _consumers.end(), [](const auto& a, const auto& b) {
+			return a->get_held_bytes() > b->get_held_bytes();
+		});
+
+		int64_t excess = used - resumeAt;
+		for (connection_base* connection : _consumers) {
+			if (excess <= 0) {
+				break;
+			}
+			excess -= connection->get_held_bytes();
+			// a client paused earlier still counts towards the excess
+			const bool paused = std::find(_pausedReaders.begin(), _pausedReaders.end(), connection->get_handle()) != _pausedReaders.end();
+			if (!paused) {
+				LMQTT_LOG_WARNING("[SERVER] Memory at {} of {} bytes, pausing {} ({} bytes)", used, limit, connection->get_remote_endpoint(), connection->get_held_bytes());
+				connection->pause_reading(read_pause::MEMORY);
+				_pausedReaders.push_back(connection->get_handle());
+				metrics::add(metrics::counters()._pausedReaders, 1);
+			}
+		}
+		_consumers.clear();
+	}
+
+	// the admission controller probes the io thread from the io thread, whose CPU
+	// time it reads, and moves the broker wide level (see lmqtt_admission.h)
+	void start_admission_control() {
+		if (!_config._overload._enabled) {
+			return;
+		}
+		asio::post(_context, [this]() {
+			_admission.start(std::chrono::steady_clock::now());
+			probe_io_thread();
+		});
+	}
+
+	// how late the timer runs is how long any handler waits for the io thread
+	void probe_io_thread() {
+		_admissionTimer.expires_after(_admission.get_probe_period());
+		_admissionTimer.async_wait([this](std::error_code ec) {
+			if (ec) {
+				return;
+			}
+			const auto now = std::chrono::steady_clock::now();
+			if (_admission.on_probe(now, now - _admissionTimer.expiry())) {
+				apply_admission_level();
+			}
+			probe_io_thread();
+		});
+	}
+
+	// once per interval. Connections apply the CONNECT and QoS 0 levels on their
+	// own, the publishers are paused from here
+	void apply_admission_level() {
+		const admission::level previous = admission::get_level();
+		const admission::level next = _admission.get_level();
+		if (next != previous) {
+			LMQTT_LOG_WARNING("[SERVER] Load level {} -> {}. Sojourn {} us, io thread {}% busy",
+				admission::get_level_string(previous),
+				admission::get_level_string(next),
+				std::chrono::duration_cast<std::chrono::microseconds>(_admission.get_min_sojourn()).count(),
+				_admission.get_cpu_percent());
+			admission::set_level(next);
+			metrics::add(metrics::counters()._overloadLevel, static_cast<int64_t>(next) - static_cast<int64_t>(previous));
+		}
+
+		// taken every interval, so they are what was received during the last one
+		_connections.for_each([this](connection_base& connection) {
+			if (const uint64_t bytes = connection.take_received_bytes()) {
+				_publishers.emplace_back(&connection, bytes);
+			}
+		});
+
+		if (_admission.is_overloaded()) {
+			pause_heaviest_publishers();
+		} else {
+			resume_overload_paused();
+		}
+		_publishers.clear();
+	}
+
+	// the fewest publishers that sent half of what was received during the interval.
+	// The others keep going
+	void pause_heaviest_publishers() {
+		uint64_t total = 0;
+		for (const auto& publisher : _publishers) {
+			total += publisher.second;
+		}
+		std::sort(_publishers.begin(), _publishers.end(), [](const auto& a, const auto& b) {
+			return a.second > b.second;
+		});
+
+		uint64_t paused = 0;
+		for (auto& [connection, bytes] : _publishers) {
+			if (paused >= total / 2) {
+				break;
+			}
+			paused += bytes;
+			// already paused by an earlier interval: its bytes still count toward the
+			// half, but it is not queued, nor counted in the gauge, twice
+			const connection_handle handle = connection->get_handle();
+			if (std::find(_overloadPaused.begin(), _overloadPaused.end(), handle) != _overloadPaused.end()) {
+				continue;
+			}
+			LMQTT_LOG_WARNING("[SERVER] Overloaded, pausing {} ({} bytes in the last interval)", connection->get_client_id(), bytes);
+			connection->pause_reading(read_pause::OVERLOAD);
+			_overloadPaused.push_back(handle);
+			metrics::add(metrics::counters()._overloadPausedReaders, 1);
+		}
+	}
+
+	// after a calm interval, a quarter of the paused publishers (the first paused
+	// first): all at once would bring the load right back
+	void resume_overload_paused() {
+		if (_overloadPaused.empty()) {
+			return;
+		}
+		const size_t count = std::max<size_t>(1, _overloadPaused.size() / 4);
+		LMQTT_LOG_INFO("[SERVER] Load easing, resuming {} of {} clients", count, _overloadPaused.size());
+		for (size_t i = 0; i < count; ++i) {
+			if (connection_base* connection = _connections.get(_overloadPaused[i])) {
+				connection->resume_reading(read_pause::OVERLOAD);
+			}
+		}
+		_overloadPaused.erase(_overloadPaused.begin(), _overloadPaused.begin() + count);
+		metrics::add(metrics::counters()._overloadPausedReaders, -static_cast<int64_t>(count));
 	}
 
 	void client_timeout_handler(std::error_code ec) {
 		if (!ec) {
-			std::cout << "This timer for client has expired\n";
+			LMQTT_LOG_DEBUG("This timer for client has expired");
 		}
 	}
 
 protected:
 
-	// container for active connections
-	ts_queue<std::shared_ptr<connection>> _activeSessions;
+	// every connection, with the slab their sessions are allocated from. Cleared by
+	// stop(), their sockets go before the context
+	connection_table _connections;
 
-	// container for connections scheduled for deletion
-	ts_queue<std::shared_ptr<connection>> _deletionQueue;
+	// topic filters of every connected client, only used from the io thread
+	subscription_registry _subscriptions;
 
 	// container for messages to be treated
-	ts_queue<std::pair<std::weak_ptr<connection>, std::string_view>> _messages;
-
-	// thread for cleanup
-	std::thread _cleanupThread;
-	std::atomic<bool> _exitCleanupThread;
+	ts_queue<std::pair<std::weak_ptr<connection_base>, std::string_view>> _messages;
 
 	// timeout
 	std::shared_ptr<lmqtt_timer> _timer;
@@ -190,9 +812,50 @@ protected:
 	asio::io_context _context;
 	std::thread _thContext;
 
+	server_config _config;
+
 	// since we dont need sockets, we need acceptors
 	asio::ip::tcp::acceptor _acceptor;
 
+	// rate limits: what the TCP listener's clients share, and what reads every
+	// throttled client again, on the io thread
+	rate::listener_quota _quota;
+	read_scheduler _readScheduler;
+	// server_config::_connectsPerSource, on the io thread
+	rate::source_limiter _sources;
+	bool _busyPollWarned = false;
+
+	// destroys retired connections (see reclaim_connections), on the io thread
+	asio::steady_timer _reclaimTimer;
+
+	// memory governor (see balance_memory), on the io thread
+	asio::steady_timer _governorTimer;
+	std::vector<connection_handle> _pausedReaders;
+	// reused between checks
+	std::vector<connection_base*> _consumers;
+
+	// admission controller (see apply_admission_level), on the io thread
+	asio::steady_timer _admissionTimer;
+	admission::controller _admission;
+	std::vector<connection_handle> _overloadPaused;
+	// reused between intervals: what each client sent during the last one
+	std::vector<std::pair<connection_base*, uint64_t>> _publishers;
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+	// server_config::_unixListeners and _shmListeners, their acceptors are only
+	// used from the io thread
+	std::vector<std::unique_ptr<unix_listener>> _unixListeners;
+#endif
+
+#if defined(LMQTT_HAS_TLS)
+	// server_config::_tlsListeners, their acceptors are only used from the io
+	// thread. Each has its handshake threads
+	std::vector<std::unique_ptr<tls_listener>> _tlsListeners;
+#endif
+
+	// Prometheus endpoint and $SYS topics, on the io thread
+	metrics::exporter _metrics;
+
 	// Server will identify client by this ID, and use them for reporting.
 	// also, it will help with some data charting later
 	uint32_t _idCounter = 0;
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "lmqtt_common.h"
+#include "lmqtt_types.h"
+
+namespace lmqtt {
+
+// so many per second, and so many more at once (see lmqtt_rate_limit.h). A rate of
+// 0 is unlimited
+struct rate_limit {
+    uint64_t _perSecond = 0;
+    uint64_t _burst = 0;
+};
+
+// what one listener lets each of its clients do with the broker's memory, and how
+// fast they may publish
+struct listener_limits {
+    // biggest packet accepted from a client, fixed header included. Advertised in
+    // the CONNACK, bigger packets close the connection. MQTT can not go past 256 MO
+    uint32_t _maximumPacketSize = 1 + 4 + STREAMED_PACKET_SIZE_LIMIT;
+
+    // packets up to this size are read whole into the connection's buffer, bigger
+    // PUBLISH packets are streamed and anything else bigger is refused
+    uint32_t _bufferedPacketSize = PACKET_SIZE_LIMIT;
+
+    // once a client is that far behind, new messages for it are dropped
+    size_t _outboundHighWatermark = 1 << 20; // 1 MO
+
+    // a client further behind than this is disconnected
+    size_t _outboundMaxQueuedBytes = 1 << 24; // 16 MO
+
+    // a client with that many messages waiting does not get new ones either
+    size_t _outboundMaxMessages = 1 << 16;
+
+    // what happens to forwarded messages a client has no room for, unless its
+    // SUBSCRIBE picks another policy (see OVERFLOW_PROPERTY)
+    overflow_policy _overflowPolicy = overflow_policy::DROP_NEWEST;
+
+    // PUBLISH packets and their bytes each client may send. A client over its rate
+    // is not read from until it is back under it: TCP makes it wait, nothing is
+    // dropped
+    rate_limit _clientPublishes;
+    rate_limit _clientBytes;
+
+    // the same for all the clients of the listener together. A QoS 1 or 2 PUBLISH
+    // that finds them overdrawn gets QUOTA_EXCEEDED
+    rate_limit _listenerPublishes;
+    rate_limit _listenerBytes;
+};
+
+// an AF_UNIX stream listener, for clients running on the same host (gateways,
+// local producers): same pipeline as TCP, without the TCP/IP stack
+struct unix_listener_config {
+    // where the socket file is created, a stale socket left there is replaced
+    std::string _path;
+
+    // mode of the socket file: who can connect at all
+    uint32_t _permissions = 0660;
+
+    // checked against the SO_PEERCRED uid of every client, empty lets any uid in
+    std::vector<uint32_t> _allowedUids;
+
+    listener_limits _limits;
+};
+
+// a TCP listener for MQTT over TLS (see lmqtt_tls.h), builds with OpenSSL only
+struct tls_listener_config {
+    uint16_t _port = 8883;
+
+    // PEM files: the server certificate followed by its intermediates, and its key
+    std::string _certificateFile;
+    std::string _privateKeyFile;
+
+    // records are encrypted and decrypted by the kernel once the handshake is done,
+    // when it has the tls module. Otherwise OpenSSL does it on the io thread
+    bool _kernelTls = true;
+
+    // TLS 1.3 session tickets sent after a full handshake: a client that comes back
+    // with one skips the certificate and the key exchange. 0 disables resumption
+    uint32_t _sessionTickets = 2;
+    std::chrono::seconds _sessionLifetime{ 7200 };
+
+    // threads running handshakes, so that a reconnect storm does not take the io
+    // thread from the clients already connected
+    size_t _handshakeThreads = 2;
+
+    // a client that did not finish its handshake by then is closed
+    std::chrono::milliseconds _handshakeTimeout{ 10000 };
+
+    listener_limits _limits;
+};
+
+// when the io thread counts as overloaded (see lmqtt_admission.h)
+struct overload_config {
+    // false: the broker takes whatever comes until it can not
+    bool _enabled = true;
+
+    // handlers waiting longer than this for the io thread, during a whole
+    // interval, is overload
+    std::chrono::microseconds _targetSojourn{ 5000 };
+
+    // how often the level is reconsidered, it moves by one level at a time
+    std::chrono::milliseconds _interval{ 100 };
+
+    // so is an io thread busy for this share of an interval. 0 only looks at the
+    // sojourn time (a busy polling io thread is always busy)
+    uint32_t _cpuPercent = 95;
+};
+
+// how the io thread runs (see lmqtt_io_thread.h), for latency sensitive deployments
+struct io_thread_config {
+    // core the io thread is pinned to, what it allocates lands on that core's NUMA
+    // node. -1 lets the scheduler move it
+    int _cpu = -1;
+
+    // the io thread polls for this long after its last handler before it sleeps:
+    // no wakeup for a packet that comes meanwhile, at the cost of a busy core.
+    // 0 always sleeps when there is nothing to do
+    std::chrono::microseconds _busyPoll{ 0 };
+
+    // SO_BUSY_POLL on accepted TCP sockets, in microseconds (0 leaves it alone)
+    uint32_t _socketBusyPoll = 0;
+
+    // TCP_NODELAY on accepted TCP sockets. Without it, a forwarded message written
+    // while the previous one is not acknowledged waits for the client's delayed ACK
+    // (40 ms on Linux)
+    bool _noDelay = true;
+};
+
+// everything the server can be tuned with, the defaults are what lmqtt_server(port) runs with
+struct server_config {
+    // MQTT listener, on every interface
+    uint16_t _port = 1883;
+
+    // limits of the TCP listener's clients
+    listener_limits _limits;
+
+    // bytes the broker may hold for its clients overall: inbound buffers, outbound
+    // queues, retained and offline messages (see lmqtt_memory_budget.h). 0 is no budget
+    uint64_t _memoryBudget = 0;
+
+    // load shedding when the io thread can not keep up
+    overload_config _overload;
+
+    // io thread placement and busy polling
+    io_thread_config _io;
+
+    // connections the broker holds at once, over every listener. Past that, new
+    // ones are closed as soon as they are accepted. 0 is unlimited
+    size_t _maxConnections = 0;
+
+    // TCP connections each source address may open. Over its rate, a connection is
+    // closed before anything is allocated for it
+    rate_limit _connectsPerSource;
+
+    // connections taken from the TCP listen backlog each time the io thread wakes
+    // up for one: a reconnect storm costs one wakeup per batch, not per client
+    size_t _acceptBatch = 64;
+
+    // Prometheus text endpoint (GET /metrics), only bound to 127.0.0.1. 0 disables it
+    uint16_t _metricsPort = 0;
+
+    // how often the broker statistics are published under $SYS/broker/. 0 disables it
+    std::chrono::seconds _sysInterval{ 10 };
+
+    // outbound queue depth is reported per client for this many clients, the
+    // furthest behind first
+    size_t _queueMetricsClients = 100;
+
+    // topic filters whose messages are queued last value for every subscriber,
+    // whatever its SUBSCRIBE asked for (device states, gauges...)
+    std::vector<std::string> _lastValueFilters;
+
+    // records every byte clients send, with its arrival time, to this file for
+    // tools/lmqtt_replay (see lmqtt_capture.h). Empty disables it
+    std::string _capturePath;
+
+    // extra listeners on unix sockets, next to the TCP one (Linux and BSDs)
+    std::vector<unix_listener_config> _unixListeners;
+
+    // unix sockets where local clients hand over a shared memory region, the session
+    // then runs over the rings (see lmqtt_shm_ring.h, Linux only)
+    std::vector<unix_listener_config> _shmListeners;
+
+    // extra TCP listeners speaking TLS, 8883 being the usual port
+    std::vector<tls_listener_config> _tlsListeners;
+};
+
+} // namespace lmqtt
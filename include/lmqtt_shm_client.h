@@ -0,0 +1,292 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "lmqtt_common.h"
+#include "lmqtt_shm_ring.h"
+#include "lmqtt_encoder.h"
+#include "lmqtt_utils.h"
+
+#if defined(LMQTT_HAS_SHM_TRANSPORT)
+
+namespace lmqtt {
+
+/*
+ * Client side of the shared memory transport, for processes on the broker's host
+ * that publish at high rates. Blocking, one thread at a time.
+ *
+ * It has read_some and write_some like a socket, so asio::read / asio::write work
+ * with it, and a few MQTT helpers on top: connect() the session, then publish()
+ * encodes each message straight into the ring. Nothing enters the kernel while
+ * the broker keeps up with the ring.
+ *
+ *   shm_client client;
+ *   client.open("/run/lmqtt.shm");
+ *   client.connect("aggregator");
+ *   client.publish(msg);
+ */
+class shm_client {
+public:
+    shm_client() = default;
+    shm_client(const shm_client&) = delete;
+    shm_client& operator=(const shm_client&) = delete;
+
+    shm_client(shm_client&& other) noexcept {
+        *this = std::move(other);
+    }
+
+    shm_client& operator=(shm_client&& other) noexcept {
+        if (this != &other) {
+            close();
+            _region = std::move(other._region);
+            _socket = std::exchange(other._socket, -1);
+            _brokerGone = std::exchange(other._brokerGone, false);
+            _scratch = std::move(other._scratch);
+        }
+        return *this;
+    }
+
+    ~shm_client() {
+        close();
+    }
+
+    // maps a new region and hands it to the broker listening on path
+    [[nodiscard]] return_code open(const std::string& path, size_t ringSize = shm::DEFAULT_RING_SIZE) {
+        close();
+        if (_region.create(ringSize) != return_code::OK) {
+            return return_code::FAIL;
+        }
+        _socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (_socket < 0 || path.size() >= sizeof(address.sun_path)) {
+            close();
+            return return_code::FAIL;
+        }
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        if (::connect(_socket, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+            || shm::send_region(_socket, _region) != return_code::OK) {
+            close();
+            return return_code::FAIL;
+        }
+        return return_code::OK;
+    }
+
+    [[nodiscard]] bool is_open() const noexcept {
+        return _region.is_mapped();
+    }
+
+    // ********** STREAM ********** //
+
+    // blocks until there is something to read, eof once the broker closed
+    template <typename MutableBufferSequence>
+    size_t read_some(const MutableBufferSequence& buffers, std::error_code& ec) {
+        const asio::mutable_buffer buffer = *asio::buffer_sequence_begin(buffers);
+        ec = std::error_code();
+        if (!is_open()) {
+            ec = asio::error::bad_descriptor;
+            return 0;
+        }
+        for (;;) {
+            const size_t size = _region.read(static_cast<uint8_t*>(buffer.data()), buffer.size());
+            if (size || !buffer.size()) {
+                _region.notify_peer_of_room();
+                return size;
+            }
+            if ((_region.is_peer_closed() || _brokerGone) && !_region.readable()) {
+                ec = asio::error::eof;
+                return 0;
+            }
+            wait([this]() { return _region.readable() || _region.is_peer_closed(); });
+        }
+    }
+
+    template <typename MutableBufferSequence>
+    size_t read_some(const MutableBufferSequence& buffers) {
+        std::error_code ec;
+        const size_t size = read_some(buffers, ec);
+        if (ec) {
+            throw asio::system_error(ec);
+        }
+        return size;
+    }
+
+    // blocks until some of the bytes fit in the ring
+    template <typename ConstBufferSequence>
+    size_t write_some(const ConstBufferSequence& buffers, std::error_code& ec) {
+        const asio::const_buffer buffer = *asio::buffer_sequence_begin(buffers);
+        ec = std::error_code();
+        if (!is_open()) {
+            ec = asio::error::bad_descriptor;
+            return 0;
+        }
+        for (;;) {
+            if (_region.is_write_closed() || _region.is_peer_closed() || _brokerGone) {
+                ec = asio::error::broken_pipe;
+                return 0;
+            }
+            const size_t size = _region.write(static_cast<const uint8_t*>(buffer.data()), buffer.size());
+            if (size || !buffer.size()) {
+                _region.notify_peer();
+                return size;
+            }
+            wait([this]() { return _region.writable() > 0 || _region.is_peer_closed(); });
+        }
+    }
+
+    template <typename ConstBufferSequence>
+    size_t write_some(const ConstBufferSequence& buffers) {
+        std::error_code ec;
+        const size_t size = write_some(buffers, ec);
+        if (ec) {
+            throw asio::system_error(ec);
+        }
+        return size;
+    }
+
+    // the broker reads what was written, then gets eof
+    void shutdown(asio::socket_base::shutdown_type what, std::error_code& ec) {
+        ec = is_open() ? std::error_code() : asio::error::not_connected;
+        if (!ec && what != asio::socket_base::shutdown_receive) {
+            _region.close_write();
+        }
+    }
+
+    void close() {
+        if (_region.is_mapped()) {
+            _region.close_write();
+        }
+        _region.reset();
+        if (_socket >= 0) {
+            ::close(_socket);
+            _socket = -1;
+        }
+        _brokerGone = false;
+    }
+
+    // ********** MQTT ********** //
+
+    // sends CONNECT and waits for the CONNACK, its reason code (or MALFORMED_PACKET
+    // if the broker closed instead)
+    [[nodiscard]] reason_code connect(std::string_view clientId, uint16_t keepAlive = 0) {
+        std::vector<uint8_t> body;
+        append_string(body, "MQTT");
+        body.push_back(0x05);                   // protocol version
+        body.push_back(0x02);                   // clean start
+        body.push_back(static_cast<uint8_t>(keepAlive >> 8));
+        body.push_back(static_cast<uint8_t>(keepAlive & 0xff));
+        body.push_back(0x00);                   // no properties
+        append_string(body, clientId);
+        if (write_packet(0x10, body) != return_code::OK) {
+            return reason_code::MALFORMED_PACKET;
+        }
+
+        // CONNACK: control field, remaining length, flags, reason code, properties
+        std::error_code ec;
+        uint8_t header[5] = {};
+        uint8_t lengthBytes = 1;
+        asio::read(*this, asio::buffer(header, 2), ec);
+        for (; !ec && (header[lengthBytes] & 0x80) && lengthBytes < 4; ++lengthBytes) {
+            asio::read(*this, asio::buffer(header + lengthBytes + 1, 1), ec);
+        }
+        uint32_t remaining = 0;
+        uint8_t offset = 0;
+        if (ec || (header[0] >> 4) != static_cast<uint8_t>(packet_type::CONNACK)
+            || utils::decode_variable_int(header + 1, remaining, offset, lengthBytes) != return_code::OK
+            || remaining < 2) {
+            return reason_code::MALFORMED_PACKET;
+        }
+        _scratch.resize(remaining);
+        asio::read(*this, asio::buffer(_scratch), ec);
+        if (ec) {
+            return reason_code::MALFORMED_PACKET;
+        }
+        return static_cast<reason_code>(_scratch[1]);
+    }
+
+    // encoded straight into the ring when it has room before its end, through a
+    // reused buffer otherwise
+    [[nodiscard]] return_code publish(const encoder::publish_message& msg) {
+        if (!is_open() || _region.is_peer_closed() || _brokerGone) {
+            return return_code::FAIL;
+        }
+        const uint32_t size = encoder::packet_encoder::get_size(msg);
+        if (uint8_t* inPlace = _region.reserve(size)) {
+            uint32_t written = 0;
+            if (encoder::packet_encoder::encode(inPlace, size, msg, written) != return_code::OK) {
+                return return_code::FAIL;
+            }
+            _region.commit(written);
+            _region.notify_peer();
+            return return_code::OK;
+        }
+        _scratch.resize(size);
+        uint32_t written = 0;
+        if (encoder::packet_encoder::encode(_scratch.data(), size, msg, written) != return_code::OK) {
+            return return_code::FAIL;
+        }
+        return write_all(_scratch.data(), written);
+    }
+
+    [[nodiscard]] return_code disconnect() {
+        const uint8_t packet[2] = { 0xe0, 0x00 };
+        return write_all(packet, sizeof(packet));
+    }
+
+private:
+    static void append_string(std::vector<uint8_t>& out, std::string_view str) {
+        out.push_back(static_cast<uint8_t>(str.size() >> 8));
+        out.push_back(static_cast<uint8_t>(str.size() & 0xff));
+        out.insert(out.end(), str.begin(), str.end());
+    }
+
+    [[nodiscard]] return_code write_packet(uint8_t controlField, const std::vector<uint8_t>& body) {
+        uint8_t header[5] = { controlField };
+        uint8_t lengthSize = 0;
+        if (utils::encode_variable_int(header + 1, 4, static_cast<uint32_t>(body.size()), lengthSize) != return_code::OK
+            || write_all(header, 1u + lengthSize) != return_code::OK) {
+            return return_code::FAIL;
+        }
+        return write_all(body.data(), body.size());
+    }
+
+    [[nodiscard]] return_code write_all(const uint8_t* data, size_t size) {
+        std::error_code ec;
+        asio::write(*this, asio::buffer(data, size), ec);
+        return ec ? return_code::FAIL : return_code::OK;
+    }
+
+    // sleeps until ready() or the broker is gone
+    template <typename Ready>
+    void wait(Ready&& ready) {
+        _region.prepare_wait();
+        if (ready()) {
+            _region.cancel_wait();
+            return;
+        }
+        pollfd fds[2] = {
+            { _region.get_event_fd(shm::side::CLIENT), POLLIN, 0 },
+            { _socket, POLLIN, 0 }
+        };
+        if (::poll(fds, 2, -1) > 0) {
+            if (fds[0].revents & POLLIN) {
+                _region.consume_event();
+            }
+            // the broker never writes on the socket, readable means closed
+            if (fds[1].revents) {
+                _brokerGone = true;
+            }
+        }
+        _region.cancel_wait();
+    }
+
+    shm::channel _region;
+    int _socket = -1;
+    bool _brokerGone = false;
+    std::vector<uint8_t> _scratch;
+};
+
+} // namespace lmqtt
+
+#endif // LMQTT_HAS_SHM_TRANSPORT
@@ -0,0 +1,450 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+
+#include "lmqtt_common.h"
+#include "lmqtt_reason_codes.h"
+
+#if defined(__linux__) && defined(ASIO_HAS_LOCAL_SOCKETS)
+#define LMQTT_HAS_SHM_TRANSPORT 1
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#if defined(LMQTT_HAS_SHM_TRANSPORT)
+
+namespace lmqtt {
+
+namespace shm {
+
+/*
+ * Shared memory transport for clients on the same host: the client maps a memfd
+ * holding two single producer, single consumer byte rings (one per direction) and
+ * hands it to the broker over a unix socket, with two eventfds (SCM_RIGHTS). MQTT
+ * packets then go through the rings as they would through a socket, without a
+ * system call per read or write.
+ *
+ * A side only sleeps on its eventfd once it has nothing to do, after raising its
+ * _sleeping flag, and is only signaled when that flag is up: as long as both sides
+ * keep up, nobody enters the kernel. The unix socket stays open for the whole
+ * session, closing it (or dying) is how a side learns the other one is gone.
+ *
+ *   memfd  : region_header, ring read by the broker, ring read by the client
+ */
+inline constexpr uint64_t REGION_MAGIC = 0x5248535454514d4c; // "LMQTTSHR"
+inline constexpr uint32_t REGION_VERSION = 1;
+inline constexpr size_t MIN_RING_SIZE = 1 << 12;
+inline constexpr size_t MAX_RING_SIZE = 1 << 30;
+inline constexpr size_t DEFAULT_RING_SIZE = 1 << 22;
+
+// ring i is read by side i and written by the other one
+enum class side : uint8_t {
+    BROKER  = 0,
+    CLIENT  = 1
+};
+
+// the header is shared by two processes, nothing in it can need a lock
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+static_assert(std::atomic<uint32_t>::is_always_lock_free);
+
+// positions only grow, their difference is what the ring holds. Each on its own
+// cache line, the producer and the consumer do not share one
+struct ring_state {
+    alignas(64) std::atomic<uint64_t> _written{ 0 };
+    alignas(64) std::atomic<uint64_t> _read{ 0 };
+};
+
+struct region_header {
+    uint64_t _magic = REGION_MAGIC;
+    uint32_t _version = REGION_VERSION;
+    uint32_t _ringSize = 0;     // bytes per direction, a power of 2
+    ring_state _rings[2];
+    // side i waits (or is about to) on its eventfd and has to be signaled
+    alignas(64) std::atomic<uint32_t> _sleeping[2]{ 0, 0 };
+    // side i will not write anymore: its peer reads what is left, then eof
+    std::atomic<uint32_t> _closed[2]{ 0, 0 };
+};
+
+// the rings start on their own page
+inline constexpr size_t HEADER_SIZE = 4096;
+static_assert(sizeof(region_header) <= HEADER_SIZE);
+
+/*
+ * One side's view of a mapped region: reads its ring, writes the other one, and
+ * signals the other side when it made progress the other side may wait for. Not
+ * thread safe, one thread (or strand) per side.
+ */
+class channel {
+public:
+    channel() = default;
+    channel(const channel&) = delete;
+    channel& operator=(const channel&) = delete;
+
+    channel(channel&& other) noexcept {
+        *this = std::move(other);
+    }
+
+    channel& operator=(channel&& other) noexcept {
+        if (this != &other) {
+            reset();
+            _header = std::exchange(other._header, nullptr);
+            _mapSize = std::exchange(other._mapSize, 0);
+            _ringSize = std::exchange(other._ringSize, 0);
+            _side = other._side;
+            _memfd = std::exchange(other._memfd, -1);
+            _events[0] = std::exchange(other._events[0], -1);
+            _events[1] = std::exchange(other._events[1], -1);
+        }
+        return *this;
+    }
+
+    ~channel() {
+        reset();
+    }
+
+    // client side: a new region, ringSize is rounded up to a power of 2
+    [[nodiscard]] return_code create(size_t ringSize) noexcept {
+        reset();
+        size_t size = MIN_RING_SIZE;
+        while (size < ringSize && size < MAX_RING_SIZE) {
+            size <<= 1;
+        }
+        _side = side::CLIENT;
+        _memfd = ::memfd_create("lmqtt_shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        _events[0] = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        _events[1] = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (_memfd < 0 || _events[0] < 0 || _events[1] < 0
+            || ::ftruncate(_memfd, static_cast<off_t>(HEADER_SIZE + 2 * size)) != 0
+            || ::fcntl(_memfd, F_ADD_SEALS, REQUIRED_SEALS) != 0
+            || map(HEADER_SIZE + 2 * size) != return_code::OK) {
+            reset();
+            return return_code::FAIL;
+        }
+        new (_header) region_header();
+        _header->_ringSize = static_cast<uint32_t>(size);
+        _ringSize = size;
+        return return_code::OK;
+    }
+
+    // broker side: the region a client sent, the descriptors are ours from now on
+    [[nodiscard]] return_code attach(int memfd, int brokerEvent, int clientEvent) noexcept {
+        reset();
+        _side = side::BROKER;
+        _memfd = memfd;
+        _events[0] = brokerEvent;
+        _events[1] = clientEvent;
+        // a region that could be resized under us would fault on our next access
+        // (SIGBUS), and a descriptor that can block would stall the io thread
+        const int seals = ::fcntl(_memfd, F_GET_SEALS);
+        if (seals < 0 || (seals & REQUIRED_SEALS) != REQUIRED_SEALS
+            || !is_event_fd(_events[0]) || !is_event_fd(_events[1])
+            || set_non_blocking(_events[0]) != return_code::OK
+            || set_non_blocking(_events[1]) != return_code::OK) {
+            reset();
+            return return_code::FAIL;
+        }
+        struct stat info {};
+        if (::fstat(_memfd, &info) != 0
+            || static_cast<size_t>(info.st_size) < HEADER_SIZE + 2 * MIN_RING_SIZE
+            || static_cast<size_t>(info.st_size) > HEADER_SIZE + 2 * MAX_RING_SIZE
+            || map(static_cast<size_t>(info.st_size)) != return_code::OK) {
+            reset();
+            return return_code::FAIL;
+        }
+        // the client could send anything, nothing is used before it is checked
+        const size_t ringSize = _header->_ringSize;
+        if (_header->_magic != REGION_MAGIC || _header->_version != REGION_VERSION
+            || ringSize < MIN_RING_SIZE || (ringSize & (ringSize - 1))
+            || HEADER_SIZE + 2 * ringSize != _mapSize) {
+            reset();
+            return return_code::FAIL;
+        }
+        // the header stays writable by the client: what it holds is never trusted
+        // for more than the bytes it points at, and the size is read once
+        _ringSize = ringSize;
+        return return_code::OK;
+    }
+
+    [[nodiscard]] bool is_mapped() const noexcept {
+        return _header != nullptr;
+    }
+
+    [[nodiscard]] side get_side() const noexcept {
+        return _side;
+    }
+
+    [[nodiscard]] int get_memfd() const noexcept {
+        return _memfd;
+    }
+
+    [[nodiscard]] int get_event_fd(side s) const noexcept {
+        return _events[static_cast<size_t>(s)];
+    }
+
+    // what we can read now
+    [[nodiscard]] size_t readable() const noexcept {
+        const ring_state& in = _header->_rings[index()];
+        return std::min(static_cast<size_t>(in._written.load(std::memory_order_acquire) - in._read.load(std::memory_order_relaxed)), _ringSize);
+    }
+
+    // copies up to size bytes out of our ring
+    size_t read(uint8_t* out, size_t size) noexcept {
+        ring_state& in = _header->_rings[index()];
+        const uint64_t readPos = in._read.load(std::memory_order_relaxed);
+        const size_t available = static_cast<size_t>(in._written.load(std::memory_order_acquire) - readPos);
+        const size_t toRead = std::min({ available, size, _ringSize });
+        if (toRead) {
+            copy_out(ring_data(index()), readPos, out, toRead);
+            in._read.store(readPos + toRead, std::memory_order_release);
+        }
+        return toRead;
+    }
+
+    // copies up to size bytes into the peer's ring
+    size_t write(const uint8_t* data, size_t size) noexcept {
+        ring_state& out = _header->_rings[peer_index()];
+        const uint64_t writePos = out._written.load(std::memory_order_relaxed);
+        const size_t toWrite = std::min(writable(), size);
+        if (toWrite) {
+            copy_in(ring_data(peer_index()), writePos, data, toWrite);
+            out._written.store(writePos + toWrite, std::memory_order_release);
+        }
+        return toWrite;
+    }
+
+    // size contiguous bytes of the peer's ring to write into in place, nullptr if
+    // there is not that much room before the end of the ring. Nothing is visible
+    // to the peer before commit()
+    [[nodiscard]] uint8_t* reserve(size_t size) noexcept {
+        ring_state& out = _header->_rings[peer_index()];
+        const uint64_t writePos = out._written.load(std::memory_order_relaxed);
+        const size_t offset = static_cast<size_t>(writePos & (_ringSize - 1));
+        if (writable() < size || _ringSize - offset < size) {
+            return nullptr;
+        }
+        return ring_data(peer_index()) + offset;
+    }
+
+    void commit(size_t size) noexcept {
+        ring_state& out = _header->_rings[peer_index()];
+        out._written.store(out._written.load(std::memory_order_relaxed) + size, std::memory_order_release);
+    }
+
+    // room left in the peer's ring
+    [[nodiscard]] size_t writable() const noexcept {
+        const ring_state& out = _header->_rings[peer_index()];
+        const size_t used = static_cast<size_t>(out._written.load(std::memory_order_relaxed) - out._read.load(std::memory_order_acquire));
+        return used < _ringSize ? _ringSize - used : 0;
+    }
+
+    // after a read or a write: the peer may be waiting for it
+    void notify_peer() noexcept {
+        // pairs with the fence of prepare_wait: either the peer sees our progress,
+        // or we see its flag
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::atomic<uint32_t>& sleeping = _header->_sleeping[peer_index()];
+        if (sleeping.load(std::memory_order_relaxed) && sleeping.exchange(0, std::memory_order_relaxed)) {
+            signal(_events[peer_index()]);
+        }
+    }
+
+    // after a read: a writer waiting for room is only woken once the ring is half
+    // empty, not for every few bytes we take out
+    void notify_peer_of_room() noexcept {
+        if (readable() > _ringSize / 2) {
+            return;
+        }
+        notify_peer();
+    }
+
+    // before sleeping on our eventfd: the caller checks again what it waits for
+    // after this, and calls cancel_wait() if it does not have to sleep anymore
+    void prepare_wait() noexcept {
+        _header->_sleeping[index()].store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void cancel_wait() noexcept {
+        _header->_sleeping[index()].store(0, std::memory_order_relaxed);
+    }
+
+    // after waking up: clears the eventfd
+    void consume_event() noexcept {
+        uint64_t value;
+        (void)!::read(_events[index()], &value, sizeof(value));
+    }
+
+    // we write nothing more, the peer gets eof once it read the rest
+    void close_write() noexcept {
+        if (_header && !_header->_closed[index()].exchange(1, std::memory_order_acq_rel)) {
+            notify_peer();
+        }
+    }
+
+    [[nodiscard]] bool is_peer_closed() const noexcept {
+        return _header->_closed[peer_index()].load(std::memory_order_acquire) != 0;
+    }
+
+    [[nodiscard]] bool is_write_closed() const noexcept {
+        return _header->_closed[index()].load(std::memory_order_acquire) != 0;
+    }
+
+    // wakes our own waits up, when something the ring does not tell happened
+    void signal_self() noexcept {
+        signal(_events[index()]);
+    }
+
+    void reset() noexcept {
+        if (_header) {
+            ::munmap(_header, _mapSize);
+            _header = nullptr;
+            _mapSize = 0;
+            _ringSize = 0;
+        }
+        for (int* fd : { &_memfd, &_events[0], &_events[1] }) {
+            if (*fd >= 0) {
+                ::close(*fd);
+                *fd = -1;
+            }
+        }
+    }
+
+private:
+    // what a region has to be sealed with before the broker maps it
+    static constexpr int REQUIRED_SEALS = F_SEAL_SHRINK | F_SEAL_GROW;
+
+    // the kernel names the inode of an eventfd "anon_inode:[eventfd]"
+    [[nodiscard]] static bool is_event_fd(int fd) noexcept {
+        static constexpr std::string_view EVENTFD_LINK = "anon_inode:[eventfd]";
+        char path[32];
+        std::snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        char link[64];
+        const ssize_t size = ::readlink(path, link, sizeof(link));
+        return size > 0 && std::string_view(link, static_cast<size_t>(size)) == EVENTFD_LINK;
+    }
+
+    [[nodiscard]] static return_code set_non_blocking(int fd) noexcept {
+        const int flags = ::fcntl(fd, F_GETFL);
+        if (flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+            return return_code::FAIL;
+        }
+        return return_code::OK;
+    }
+
+    [[nodiscard]] return_code map(size_t size) noexcept {
+        void* address = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _memfd, 0);
+        if (address == MAP_FAILED) {
+            return return_code::FAIL;
+        }
+        _header = static_cast<region_header*>(address);
+        _mapSize = size;
+        return return_code::OK;
+    }
+
+    [[nodiscard]] size_t index() const noexcept {
+        return static_cast<size_t>(_side);
+    }
+
+    [[nodiscard]] size_t peer_index() const noexcept {
+        return 1 - static_cast<size_t>(_side);
+    }
+
+    [[nodiscard]] uint8_t* ring_data(size_t ring) const noexcept {
+        return reinterpret_cast<uint8_t*>(_header) + HEADER_SIZE + ring * _ringSize;
+    }
+
+    // both in two pieces when the bytes wrap around the end of the ring
+    void copy_out(const uint8_t* ring, uint64_t position, uint8_t* out, size_t size) const noexcept {
+        const size_t offset = static_cast<size_t>(position & (_ringSize - 1));
+        const size_t first = std::min(size, _ringSize - offset);
+        std::memcpy(out, ring + offset, first);
+        std::memcpy(out + first, ring, size - first);
+    }
+
+    void copy_in(uint8_t* ring, uint64_t position, const uint8_t* data, size_t size) const noexcept {
+        const size_t offset = static_cast<size_t>(position & (_ringSize - 1));
+        const size_t first = std::min(size, _ringSize - offset);
+        std::memcpy(ring + offset, data, first);
+        std::memcpy(ring, data + first, size - first);
+    }
+
+    static void signal(int eventFd) noexcept {
+        const uint64_t one = 1;
+        (void)!::write(eventFd, &one, sizeof(one));
+    }
+
+    region_header* _header = nullptr;
+    size_t _mapSize = 0;
+    size_t _ringSize = 0;
+    side _side = side::CLIENT;
+    int _memfd = -1;
+    int _events[2] = { -1, -1 };
+};
+
+// the handshake: one byte (REGION_VERSION) carrying the memfd and both eventfds
+inline constexpr size_t HANDSHAKE_FD_COUNT = 3;
+
+[[nodiscard]] inline return_code send_region(int socket, const channel& region) noexcept {
+    uint8_t version = static_cast<uint8_t>(REGION_VERSION);
+    iovec data{ &version, sizeof(version) };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * HANDSHAKE_FD_COUNT)] = {};
+    msghdr message{};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * HANDSHAKE_FD_COUNT);
+    const int fds[HANDSHAKE_FD_COUNT] = {
+        region.get_memfd(), region.get_event_fd(side::BROKER), region.get_event_fd(side::CLIENT)
+    };
+    std::memcpy(CMSG_DATA(header), fds, sizeof(fds));
+    return ::sendmsg(socket, &message, MSG_NOSIGNAL) == 1 ? return_code::OK : return_code::FAIL;
+}
+
+// FAIL on anything but a handshake, the descriptors that came with it are closed
+[[nodiscard]] inline return_code receive_region(int socket, channel& region) noexcept {
+    uint8_t version = 0;
+    iovec data{ &version, sizeof(version) };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * HANDSHAKE_FD_COUNT)] = {};
+    msghdr message{};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    if (::recvmsg(socket, &message, MSG_CMSG_CLOEXEC | MSG_DONTWAIT) != 1) {
+        return return_code::FAIL;
+    }
+    int fds[HANDSHAKE_FD_COUNT] = { -1, -1, -1 };
+    size_t received = 0;
+    for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            std::memcpy(fds, CMSG_DATA(header), std::min(received, HANDSHAKE_FD_COUNT) * sizeof(int));
+        }
+    }
+    if (version != REGION_VERSION || received != HANDSHAKE_FD_COUNT || (message.msg_flags & MSG_CTRUNC)) {
+        for (int fd : fds) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+        return return_code::FAIL;
+    }
+    return region.attach(fds[0], fds[1], fds[2]);
+}
+
+} // namespace shm
+
+} // namespace lmqtt
+
+#endif // LMQTT_HAS_SHM_TRANSPORT
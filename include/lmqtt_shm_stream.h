@@ -0,0 +1,295 @@
+#pragma once
+
+#include "lmqtt_common.h"
+#include "lmqtt_shm_ring.h"
+#include "lmqtt_connection.h"
+#include "lmqtt_stream_utils.h"
+
+#if defined(LMQTT_HAS_SHM_TRANSPORT)
+
+namespace lmqtt {
+
+/*
+ * The broker's end of a shared memory session (see lmqtt_shm_ring.h), with the
+ * interface of a connected asio::ip::tcp::socket as far as basic_connection uses
+ * it. Reads and writes copy straight between the rings and the connection's
+ * buffers; only when a ring is empty (or full) do we wait for the eventfd, in the
+ * io_context like any socket.
+ *
+ * The unix socket of the handshake is kept: the client closing it, or dying, fails
+ * the pending operations like a reset connection would.
+ */
+class shm_stream {
+public:
+    using executor_type = asio::any_io_executor;
+    using control_socket = asio::local::stream_protocol::socket;
+
+    // as long as a TCP client has to send its CONNECT
+    static constexpr std::chrono::milliseconds HANDSHAKE_TIMEOUT{ 100 };
+
+    // reads the region a client sent on a freshly accepted socket, then calls
+    // handler(error_code, shm_stream) on the socket's executor. A client that has
+    // not sent it within timeout is dropped with timed_out
+    template <typename Handler>
+    static void async_accept_region(control_socket socket, Handler&& handler, std::chrono::milliseconds timeout = HANDSHAKE_TIMEOUT) {
+        auto shared = std::make_shared<control_socket>(std::move(socket));
+        auto deadline = std::make_shared<asio::steady_timer>(shared->get_executor(), timeout);
+        deadline->async_wait(
+            [shared](std::error_code ec) {
+                if (!ec) {
+                    // fails the wait below
+                    std::error_code ignored;
+                    shared->close(ignored);
+                }
+            }
+        );
+        shared->async_wait(
+            control_socket::wait_read,
+            [shared, deadline, handler = std::forward<Handler>(handler)](std::error_code ec) mutable {
+                deadline->cancel();
+                if (ec == asio::error::operation_aborted) {
+                    ec = asio::error::timed_out;
+                }
+                shm::channel region;
+                if (!ec && shm::receive_region(shared->native_handle(), region) != return_code::OK) {
+                    ec = asio::error::invalid_argument;
+                }
+                if (ec) {
+                    handler(ec, shm_stream());
+                    return;
+                }
+                handler(ec, shm_stream(std::move(*shared), std::move(region)));
+            }
+        );
+    }
+
+    shm_stream() = default;
+
+    shm_stream(control_socket control, shm::channel region) :
+        _control(std::make_unique<control_socket>(std::move(control))),
+        _region(std::move(region)),
+        _event(std::make_unique<asio::posix::stream_descriptor>(_control->get_executor(), ::dup(_region.get_event_fd(shm::side::BROKER)))) {}
+
+    shm_stream(shm_stream&&) noexcept = default;
+    shm_stream& operator=(shm_stream&& other) noexcept {
+        if (this != &other) {
+            close();
+            _control = std::move(other._control);
+            _region = std::move(other._region);
+            _event = std::move(other._event);
+            _watching = other._watching;
+            _peerGone = std::move(other._peerGone);
+        }
+        return *this;
+    }
+
+    ~shm_stream() {
+        close();
+    }
+
+    [[nodiscard]] executor_type get_executor() noexcept {
+        return _control->get_executor();
+    }
+
+    [[nodiscard]] bool is_open() const noexcept {
+        return _region.is_mapped();
+    }
+
+    [[nodiscard]] const control_socket& get_control_socket() const noexcept {
+        return *_control;
+    }
+
+    template <typename MutableBufferSequence, typename ReadHandler>
+    auto async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler) {
+        return asio::async_initiate<ReadHandler, void(std::error_code, size_t)>(
+            [this](auto&& completionHandler, asio::mutable_buffer buffer) {
+                watch_peer();
+                start_read(buffer, std::move(completionHandler));
+            },
+            handler,
+            detail::get_first_buffer<asio::mutable_buffer>(buffers)
+        );
+    }
+
+    template <typename ConstBufferSequence, typename WriteHandler>
+    auto async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler) {
+        return asio::async_initiate<WriteHandler, void(std::error_code, size_t)>(
+            [this](auto&& completionHandler, asio::const_buffer buffer) {
+                start_write(buffer, std::move(completionHandler));
+            },
+            handler,
+            detail::get_first_buffer<asio::const_buffer>(buffers)
+        );
+    }
+
+    // the client reads what was written, then gets eof
+    void shutdown(asio::socket_base::shutdown_type what, std::error_code& ec) {
+        ec = std::error_code();
+        if (!is_open()) {
+            ec = asio::error::not_connected;
+            return;
+        }
+        if (what != asio::socket_base::shutdown_receive) {
+            _region.close_write();
+        }
+    }
+
+    // pending operations fail with operation_aborted
+    void close(std::error_code& ec) {
+        ec = std::error_code();
+        if (!is_open()) {
+            return;
+        }
+        _region.close_write();
+        std::error_code ignored;
+        _event->close(ignored);
+        _control->close(ignored);
+        _region.reset();
+    }
+
+    void close() {
+        std::error_code ignored;
+        close(ignored);
+    }
+
+private:
+    // the client closing its socket is the only sign it died, from the first read on
+    void watch_peer() {
+        if (_watching || !is_open()) {
+            return;
+        }
+        _watching = true;
+        _control->async_wait(
+            control_socket::wait_read,
+            [this, peerGone = _peerGone](std::error_code ec) {
+                if (ec == asio::error::operation_aborted) {
+                    return;
+                }
+                // the client never writes on it again, readable means closed
+                peerGone->store(true, std::memory_order_release);
+                // only we hold it: the stream is gone already
+                if (peerGone.use_count() > 1 && is_open()) {
+                    _region.signal_self();
+                }
+            }
+        );
+    }
+
+    [[nodiscard]] bool is_peer_gone() const noexcept {
+        return _peerGone->load(std::memory_order_acquire);
+    }
+
+    template <typename Handler>
+    void start_read(asio::mutable_buffer buffer, Handler&& handler) {
+        if (!is_open()) {
+            detail::post_completion(std::forward<Handler>(handler), get_executor(), asio::error::bad_descriptor, 0);
+            return;
+        }
+        if (!buffer.size()) {
+            detail::post_completion(std::forward<Handler>(handler), get_executor(), std::error_code(), 0);
+            return;
+        }
+        const size_t size = _region.read(static_cast<uint8_t*>(buffer.data()), buffer.size());
+        if (size) {
+            // the client may wait for room
+            _region.notify_peer_of_room();
+            detail::post_completion(std::forward<Handler>(handler), get_executor(), std::error_code(), size);
+            return;
+        }
+        if (_region.is_peer_closed() || is_peer_gone()) {
+            // what it wrote before closing was read first
+            if (!_region.readable()) {
+                detail::post_completion(std::forward<Handler>(handler), get_executor(), asio::error::eof, 0);
+                return;
+            }
+        }
+        _region.prepare_wait();
+        if (_region.readable() || _region.is_peer_closed() || is_peer_gone()) {
+            _region.cancel_wait();
+            start_read(buffer, std::forward<Handler>(handler));
+            return;
+        }
+        wait_event(
+            [this, buffer, handler = std::forward<Handler>(handler)](std::error_code ec) mutable {
+                if (ec) {
+                    handler(ec, 0);
+                    return;
+                }
+                start_read(buffer, std::move(handler));
+            }
+        );
+    }
+
+    template <typename Handler>
+    void start_write(asio::const_buffer buffer, Handler&& handler) {
+        if (!is_open()) {
+            detail::post_completion(std::forward<Handler>(handler), get_executor(), asio::error::bad_descriptor, 0);
+            return;
+        }
+        if (_region.is_write_closed() || is_peer_gone()) {
+            detail::post_completion(std::forward<Handler>(handler), get_executor(), asio::error::broken_pipe, 0);
+            return;
+        }
+        if (!buffer.size()) {
+            detail::post_completion(std::forward<Handler>(handler), get_executor(), std::error_code(), 0);
+            return;
+        }
+        const size_t size = _region.write(static_cast<const uint8_t*>(buffer.data()), buffer.size());
+        if (size) {
+            _region.notify_peer();
+            detail::post_completion(std::forward<Handler>(handler), get_executor(), std::error_code(), size);
+            return;
+        }
+        // the client does not read fast enough
+        _region.prepare_wait();
+        if (_region.writable() || is_peer_gone()) {
+            _region.cancel_wait();
+            start_write(buffer, std::forward<Handler>(handler));
+            return;
+        }
+        wait_event(
+            [this, buffer, handler = std::forward<Handler>(handler)](std::error_code ec) mutable {
+                if (ec) {
+                    handler(ec, 0);
+                    return;
+                }
+                start_write(buffer, std::move(handler));
+            }
+        );
+    }
+
+    // a read and a write can wait at the same time, both wake up on the event
+    template <typename Retry>
+    void wait_event(Retry&& retry) {
+        _event->async_wait(
+            asio::posix::stream_descriptor::wait_read,
+            [this, retry = std::forward<Retry>(retry)](std::error_code ec) mutable {
+                if (!ec) {
+                    _region.consume_event();
+                }
+                retry(ec);
+            }
+        );
+    }
+
+    std::unique_ptr<control_socket> _control;
+    shm::channel _region;
+    std::unique_ptr<asio::posix::stream_descriptor> _event;
+    bool _watching = false;
+    // shared with the watch, which can complete after we were closed
+    std::shared_ptr<std::atomic<bool>> _peerGone = std::make_shared<std::atomic<bool>>(false);
+};
+
+// for the logs: who the client is, as for unix sockets
+[[nodiscard]] inline std::string get_remote_address(const shm_stream& stream) {
+    peer_credentials credentials;
+    if (!stream.is_open()
+        || get_peer_credentials(const_cast<shm_stream::control_socket&>(stream.get_control_socket()), credentials) != return_code::OK) {
+        return "shm";
+    }
+    return "shm:uid=" + std::to_string(credentials._uid) + ",pid=" + std::to_string(credentials._pid);
+}
+
+} // namespace lmqtt
+
+#endif // LMQTT_HAS_SHM_TRANSPORT
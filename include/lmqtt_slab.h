@@ -0,0 +1,154 @@
+#pragma once
+
+#include <new>
+
+#include "lmqtt_common.h"
+
+namespace lmqtt {
+
+namespace slab {
+
+// blocks come in size classes CLASS_SIZE bytes apart, up to CLASS_SIZE * CLASS_COUNT.
+// Bigger ones go to the global allocator
+inline constexpr size_t CLASS_SIZE = 64;
+inline constexpr size_t CLASS_COUNT = 128;
+// blocks taken from the global allocator at once, when a class runs out
+inline constexpr size_t BLOCKS_PER_SLAB = 64;
+
+/*
+ * Free lists of fixed size blocks, carved from slabs that are only given back when
+ * the pool is destroyed. Whatever is allocated often and lives as long as a client
+ * (its connection, with its shared_ptr control block, its session, its outbound
+ * queue) is freed into here and reused by the next client: once a reconnect storm
+ * went through, the next one does not touch the global allocator.
+ *
+ * Not thread safe: a pool belongs to the io thread, and must outlive whatever was
+ * allocated from it.
+ */
+class pool {
+public:
+    pool() = default;
+    pool(const pool&) = delete;
+    pool& operator=(const pool&) = delete;
+
+    ~pool() {
+        for (void* slab : _slabs) {
+            ::operator delete(slab, std::align_val_t(CLASS_SIZE));
+        }
+    }
+
+    [[nodiscard]] void* allocate(size_t size, size_t alignment) {
+        if (!is_pooled(size, alignment)) {
+            return ::operator new(size, std::align_val_t(std::max(alignment, alignof(std::max_align_t))));
+        }
+        const size_t index = get_class(size);
+        if (!_free[index]) {
+            grow(index);
+        }
+        free_block* block = _free[index];
+        _free[index] = block->_next;
+        ++_inUse;
+        return block;
+    }
+
+    void deallocate(void* p, size_t size, size_t alignment) noexcept {
+        if (!is_pooled(size, alignment)) {
+            ::operator delete(p, std::align_val_t(std::max(alignment, alignof(std::max_align_t))));
+            return;
+        }
+        const size_t index = get_class(size);
+        free_block* block = static_cast<free_block*>(p);
+        block->_next = _free[index];
+        _free[index] = block;
+        --_inUse;
+    }
+
+    // blocks handed out and not given back
+    [[nodiscard]] size_t get_blocks_in_use() const noexcept {
+        return _inUse;
+    }
+
+    // taken from the global allocator, in use or not
+    [[nodiscard]] size_t get_slab_bytes() const noexcept {
+        return _slabBytes;
+    }
+
+private:
+    struct free_block {
+        free_block* _next;
+    };
+
+    [[nodiscard]] static bool is_pooled(size_t size, size_t alignment) noexcept {
+        return size && size <= CLASS_SIZE * CLASS_COUNT && alignment <= CLASS_SIZE;
+    }
+
+    // class i holds blocks of (i + 1) * CLASS_SIZE bytes
+    [[nodiscard]] static size_t get_class(size_t size) noexcept {
+        return (size - 1) / CLASS_SIZE;
+    }
+
+    void grow(size_t index) {
+        const size_t blockSize = (index + 1) * CLASS_SIZE;
+        uint8_t* slab = static_cast<uint8_t*>(::operator new(blockSize * BLOCKS_PER_SLAB, std::align_val_t(CLASS_SIZE)));
+        _slabs.push_back(slab);
+        _slabBytes += blockSize * BLOCKS_PER_SLAB;
+        // threaded back to front, so blocks are handed out in address order
+        for (size_t i = BLOCKS_PER_SLAB; i-- > 0;) {
+            free_block* block = reinterpret_cast<free_block*>(slab + i * blockSize);
+            block->_next = _free[index];
+            _free[index] = block;
+        }
+    }
+
+    std::array<free_block*, CLASS_COUNT> _free{};
+    std::vector<void*> _slabs;
+    size_t _inUse = 0;
+    size_t _slabBytes = 0;
+};
+
+// for std::allocate_shared: the object and its control block take one block
+template <typename T>
+class allocator {
+public:
+    using value_type = T;
+
+    explicit allocator(pool& p) noexcept :
+        _pool(&p) {}
+
+    template <typename U>
+    allocator(const allocator<U>& other) noexcept :
+        _pool(other._pool) {}
+
+    [[nodiscard]] T* allocate(size_t n) {
+        return static_cast<T*>(_pool->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        _pool->deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    template <typename U>
+    bool operator==(const allocator<U>& other) const noexcept {
+        return _pool == other._pool;
+    }
+
+    template <typename U>
+    bool operator!=(const allocator<U>& other) const noexcept {
+        return _pool != other._pool;
+    }
+
+private:
+    template <typename U>
+    friend class allocator;
+
+    pool* _pool;
+};
+
+template <typename T, typename... Args>
+[[nodiscard]] std::shared_ptr<T> make_shared(pool& p, Args&&... args) {
+    return std::allocate_shared<T>(allocator<T>(p), std::forward<Args>(args)...);
+}
+
+} // namespace slab
+
+} // namespace lmqtt
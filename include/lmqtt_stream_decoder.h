@@ -0,0 +1,277 @@
+#pragma once
+
+#include "lmqtt_common.h"
+#include "lmqtt_reason_codes.h"
+#include "lmqtt_types.h"
+#include "lmqtt_utils.h"
+#include "lmqtt_properties.h"
+#include "lmqtt_histogram.h"
+
+namespace lmqtt {
+
+// What we know about a PUBLISH once its variable header has been decoded.
+// The views point into the decoder and stay valid until the publish ends.
+struct publish_header {
+    std::string_view _topic;
+    uint16_t _packetId = 0;
+    uint8_t _qos = 0;
+    bool _retain = false;
+    bool _dup = false;
+    // raw properties block (without its length), so it can be forwarded as is
+    std::string_view _properties;
+    // the payload size is known from the remaining length before any payload byte arrives
+    uint32_t _payloadSize = 0;
+};
+
+// Receives a streamed PUBLISH: one begin, any number of chunks, then one end.
+class publish_sink {
+public:
+    virtual ~publish_sink() = default;
+    virtual void on_publish_begin(const publish_header& header) = 0;
+    // the chunk is only valid during the call
+    virtual void on_payload_chunk(const uint8_t* data, uint32_t size) = 0;
+    virtual void on_publish_end() = 0;
+};
+
+// used when nobody is interested in the payload
+class discard_publish_sink : public publish_sink {
+public:
+    void on_publish_begin(const publish_header&) override {}
+    void on_payload_chunk(const uint8_t*, uint32_t) override {}
+    void on_publish_end() override {}
+};
+
+/*
+ * Decodes the body of a PUBLISH (everything after the fixed header) from
+ * whatever pieces the socket hands us. The variable header is buffered until it
+ * is complete, which is small and bounded. The payload is never buffered: each
+ * piece is handed to the sink as soon as it is fed.
+ *
+ * This is what lets us accept packets up to STREAMED_PACKET_SIZE_LIMIT without
+ * holding them in memory.
+ */
+class publish_stream_decoder {
+public:
+
+    enum class state : uint8_t {
+        VARIABLE_HEADER,
+        PAYLOAD,
+        DONE
+    };
+
+    // the variable header is buffered, so it has to stay small
+    static constexpr uint32_t VARIABLE_HEADER_LIMIT = PACKET_SIZE_LIMIT;
+
+    // flags are the 4 lower bits of the fixed header, remainingLength the decoded
+    // remaining length of the packet
+    void reset(uint8_t flags, uint32_t remainingLength, publish_sink* sink) noexcept {
+        _state = state::VARIABLE_HEADER;
+        _header = publish_header{};
+        _header._dup = flags >> 3;
+        _header._qos = (flags >> 1) & 0x3;
+        _header._retain = flags & 0x1;
+        _remaining = remainingLength;
+        _headerBuffer.clear();
+        _sink = sink;
+    }
+
+    [[nodiscard]] state get_state() const noexcept {
+        return _state;
+    }
+
+    // bytes of this packet we did not receive yet
+    [[nodiscard]] uint32_t remaining() const noexcept {
+        return _remaining;
+    }
+
+    [[nodiscard]] const publish_header& header() const noexcept {
+        return _header;
+    }
+
+    // Feeds the next bytes received from the socket. consumed is set to the
+    // number of bytes that belong to this packet, the rest is the next packet.
+    [[nodiscard]] reason_code feed(const uint8_t* data, uint32_t size, uint32_t& consumed) {
+        consumed = 0;
+
+        if (_state == state::VARIABLE_HEADER) {
+            // the sink is called outside of the timed part, it has its own stages
+            const latency::ticks decodeStart = latency::now();
+
+            // only buffer what can belong to this packet's header: one byte past the
+            // limit is enough to tell it is too large, the payload is not copied
+            const uint32_t buffered = static_cast<uint32_t>(_headerBuffer.size());
+            const uint32_t toCopy = std::min({ size, _remaining, VARIABLE_HEADER_LIMIT + 1 - buffered });
+            _headerBuffer.insert(_headerBuffer.end(), data, data + toCopy);
+            _remaining -= toCopy;
+
+            uint32_t headerSize = 0;
+            const reason_code rCode = try_decode_variable_header(headerSize);
+            if (rCode != reason_code::SUCCESS) {
+                return rCode;
+            }
+
+            if (!headerSize) {
+                // not there yet, everything we got was buffered
+                consumed = toCopy;
+                return reason_code::SUCCESS;
+            }
+
+            // Previous feeds only held header bytes, so whatever we buffered past the
+            // header comes from this feed: give it back to be handed out as payload
+            const uint32_t payloadInBuffer = static_cast<uint32_t>(_headerBuffer.size()) - headerSize;
+            consumed = toCopy - payloadInBuffer;
+            _remaining += payloadInBuffer;
+
+            // shrinking does not reallocate, so the views in _header stay valid
+            _headerBuffer.resize(headerSize);
+            const reason_code viewCode = decode_views();
+            if (viewCode != reason_code::SUCCESS) {
+                return viewCode;
+            }
+            _header._payloadSize = _remaining;
+            latency::record(latency::stage::DECODE, packet_type::PUBLISH, decodeStart);
+
+            _state = state::PAYLOAD;
+            _sink->on_publish_begin(_header);
+
+            data += consumed;
+            size -= consumed;
+        }
+
+        if (_state == state::PAYLOAD) {
+            const uint32_t chunkSize = std::min(size, _remaining);
+            if (chunkSize) {
+                _sink->on_payload_chunk(data, chunkSize);
+                _remaining -= chunkSize;
+                consumed += chunkSize;
+            }
+            if (!_remaining) {
+                _state = state::DONE;
+                _sink->on_publish_end();
+            }
+        }
+
+        return reason_code::SUCCESS;
+    }
+
+private:
+
+    // Sets headerSize to the size of the complete variable header, or to 0 if we
+    // need more bytes to know it
+    [[nodiscard]] reason_code try_decode_variable_header(uint32_t& headerSize) const {
+        headerSize = 0;
+        const uint32_t buffered = static_cast<uint32_t>(_headerBuffer.size());
+
+        // topic length
+        if (buffered < 2) {
+            return check_header_limit(buffered);
+        }
+        uint32_t pos = 2 + ((_headerBuffer[0] << 8) | _headerBuffer[1]);
+
+        // packet identifier, only present for QoS 1 and 2
+        if (_header._qos) {
+            pos += 2;
+        }
+
+        // properties length, a variable int of 1 to 4 bytes
+        uint32_t propertyLength = 0;
+        uint32_t mul = 1;
+        for (uint32_t i = 0; ; ++i) {
+            if (i == 4) {
+                return reason_code::MALFORMED_PACKET;
+            }
+            if (pos >= buffered) {
+                return check_header_limit(buffered);
+            }
+            const uint8_t byte = _headerBuffer[pos++];
+            propertyLength += (byte & 0x7f) * mul;
+            mul *= 0x80;
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+
+        pos += propertyLength;
+        if (pos > VARIABLE_HEADER_LIMIT) {
+            return reason_code::PACKET_TOO_LARGE;
+        }
+        if (pos > buffered) {
+            // the header does not fit in the packet
+            if (static_cast<uint64_t>(pos) > static_cast<uint64_t>(buffered) + _remaining) {
+                return reason_code::MALFORMED_PACKET;
+            }
+            return reason_code::SUCCESS;
+        }
+
+        headerSize = pos;
+        return reason_code::SUCCESS;
+    }
+
+    [[nodiscard]] reason_code check_header_limit(uint32_t buffered) const noexcept {
+        // the packet ended before its header did
+        if (!_remaining) {
+            return reason_code::MALFORMED_PACKET;
+        }
+        if (buffered > VARIABLE_HEADER_LIMIT) {
+            return reason_code::PACKET_TOO_LARGE;
+        }
+        return reason_code::SUCCESS;
+    }
+
+    // called once the header is complete, so no bound checks on the layout itself
+    [[nodiscard]] reason_code decode_views() {
+        uint8_t* buff = _headerBuffer.data();
+        const uint32_t size = static_cast<uint32_t>(_headerBuffer.size());
+
+        uint32_t offset = 0;
+        if (utils::decode_utf8_str(buff, _header._topic, offset) != return_code::OK) {
+            return reason_code::MALFORMED_PACKET;
+        }
+        // ~~ [MQTT-3.3.2-2]
+        if (_header._topic.empty() || utf8_utils::has_wildcard(_header._topic)) {
+            return reason_code::MALFORMED_PACKET;
+        }
+
+        if (_header._qos) {
+            _header._packetId = (buff[offset] << 8) | buff[offset + 1];
+            if (!_header._packetId) {
+                return reason_code::PROTOCOL_ERROR;
+            }
+            offset += 2;
+        }
+
+        uint32_t propertyLength = 0;
+        uint8_t varSize = 0;
+        if (utils::decode_variable_int(buff + offset, propertyLength, varSize, size - offset) != return_code::OK) {
+            return reason_code::MALFORMED_PACKET;
+        }
+        offset += varSize + 1;
+
+        // check each property is allowed in a PUBLISH and is well formed
+        const uint8_t* propertyEnd = buff + offset + propertyLength;
+        uint8_t* p = buff + offset;
+        while (p < propertyEnd) {
+            const property::property_type ptype = static_cast<property::property_type>(*(p++));
+            if (!property::types_utils::validate_packet_property_type(ptype, packet_type::PUBLISH)) {
+                return reason_code::MALFORMED_PACKET;
+            }
+            uint32_t propertySize = 0;
+            const reason_code rCode = property::validate_property_data(ptype, p, static_cast<uint32_t>(propertyEnd - p), propertySize);
+            if (rCode != reason_code::SUCCESS) {
+                return rCode;
+            }
+            p += propertySize;
+        }
+
+        _header._properties = std::string_view(reinterpret_cast<const char*>(buff + offset), propertyLength);
+        return reason_code::SUCCESS;
+    }
+
+    state _state = state::DONE;
+    publish_header _header;
+    uint32_t _remaining = 0;
+    std::vector<uint8_t> _headerBuffer;
+    publish_sink* _sink = nullptr;
+};
+
+} // namespace lmqtt
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "lmqtt_common.h"
+
+namespace lmqtt {
+
+// what the streams standing in for a socket (memory, shared memory, TLS) share
+namespace detail {
+
+// the first buffer of the sequence that is not empty, as read_some/write_some
+// only ever fill or send one
+template <typename Buffer, typename BufferSequence>
+[[nodiscard]] Buffer get_first_buffer(const BufferSequence& buffers) noexcept {
+    for (auto it = asio::buffer_sequence_begin(buffers); it != asio::buffer_sequence_end(buffers); ++it) {
+        const Buffer buffer(*it);
+        if (buffer.size()) {
+            return buffer;
+        }
+    }
+    return Buffer();
+}
+
+// calls handler(ec, size) on its associated executor (or on executor), never
+// inside the call that started the operation
+template <typename Handler, typename Executor>
+void post_completion(Handler&& handler, const Executor& executor, std::error_code ec, size_t size) {
+    auto associated = asio::get_associated_executor(handler, executor);
+    asio::post(
+        associated,
+        [handler = std::forward<Handler>(handler), ec, size]() mutable {
+            handler(ec, size);
+        }
+    );
+}
+
+} // namespace detail
+
+} // namespace lmqtt
@@ -0,0 +1,339 @@
+#pragma once
+
+#include <map>
+
+#include "lmqtt_common.h"
+#include "lmqtt_reason_codes.h"
+#include "lmqtt_outbound.h"
+
+namespace lmqtt {
+
+// one topic filter of a SUBSCRIBE packet
+struct subscription_request {
+    std::string_view _filter;
+    uint8_t _maxQos = 0;
+    bool _noLocal = false;
+    bool _retainAsPublished = false;
+    uint8_t _retainHandling = 0;
+    // from the OVERFLOW_PROPERTY and QUEUE_PROPERTY user properties
+    queue_options _queueOptions;
+};
+
+// a client with a subscription matching a topic
+struct subscriber_match {
+    std::shared_ptr<outbound_queue> _queue;
+    queue_options _options;
+};
+
+namespace topic {
+
+// '+' and '#' must take a whole level, and '#' must be the last one [MQTT-4.7.1-1]
+[[nodiscard]] inline bool is_valid_filter(std::string_view filter) noexcept {
+    if (filter.empty()) {
+        return false;
+    }
+    for (size_t i = 0; i < filter.size(); ++i) {
+        const char c = filter[i];
+        if (c != '+' && c != '#') {
+            continue;
+        }
+        const bool levelStart = (i == 0) || (filter[i - 1] == '/');
+        const bool levelEnd = (i + 1 == filter.size()) || (filter[i + 1] == '/');
+        if (!levelStart || !levelEnd) {
+            return false;
+        }
+        if (c == '#' && (i + 1 != filter.size())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the same rules as the registry: '+' takes one level, '#' the rest (parent
+// included) and wildcards do not match '$' topics at the first level
+[[nodiscard]] inline bool matches(std::string_view filter, std::string_view topicName) noexcept {
+    if (!topicName.empty() && topicName[0] == '$' && !filter.empty() && (filter[0] == '+' || filter[0] == '#')) {
+        return false;
+    }
+    size_t f = 0;
+    size_t t = 0;
+    for (;;) {
+        const size_t fEnd = filter.find('/', f);
+        const std::string_view fLevel = filter.substr(f, fEnd == std::string_view::npos ? fEnd : fEnd - f);
+        if (fLevel == "#") {
+            return true;
+        }
+        const size_t tEnd = topicName.find('/', t);
+        const std::string_view tLevel = topicName.substr(t, tEnd == std::string_view::npos ? tEnd : tEnd - t);
+        if (fLevel != "+" && fLevel != tLevel) {
+            return false;
+        }
+        if (fEnd == std::string_view::npos || tEnd == std::string_view::npos) {
+            // "a/#" also matches "a"
+            return (fEnd == tEnd) || (tEnd == std::string_view::npos && filter.substr(fEnd + 1) == "#");
+        }
+        f = fEnd + 1;
+        t = tEnd + 1;
+    }
+}
+
+// $share/{group}/{filter}
+[[nodiscard]] inline bool is_shared_filter(std::string_view filter) noexcept {
+    return filter.substr(0, 7) == "$share/";
+}
+
+} // namespace topic
+
+/*
+ * Topic filters stored as a tree, one node per level. A topic is matched by
+ * walking its levels, so the cost does not depend on how many filters exist.
+ * '+' children and '#' subscribers are kept apart to be checked at each level.
+ *
+ * Subscribers are the outbound queues of the connections. The registry is only
+ * used from the io thread.
+ */
+class subscription_registry {
+public:
+
+    [[nodiscard]] reason_code subscribe(
+        std::string_view filter,
+        const std::shared_ptr<outbound_queue>& queue,
+        uint8_t maxQos,
+        const queue_options& options = queue_options()
+    ) {
+        if (topic::is_shared_filter(filter)) {
+            return reason_code::UNSUPPORTED_SHARED_SUBSCRIPTIONS;
+        }
+        if (!topic::is_valid_filter(filter)) {
+            return reason_code::TOPIC_FILTER_INVALID;
+        }
+
+        node* current = &_root;
+        bool multiLevel = false;
+        for_each_level(filter, [&current, &multiLevel](std::string_view level) {
+            if (level == "#") {
+                multiLevel = true;
+                return;
+            }
+            auto it = current->_children.find(level);
+            if (it == current->_children.end()) {
+                it = current->_children.emplace(std::string(level), std::make_unique<node>()).first;
+            }
+            current = it->second.get();
+        });
+
+        auto& subscribers = multiLevel ? current->_multiLevel : current->_subscribers;
+        // subscribing twice to the same filter replaces the subscription [MQTT-3.8.4-3]
+        for (auto& entry : subscribers) {
+            if (entry._queue.lock() == queue) {
+                entry._maxQos = maxQos;
+                entry._options = options;
+                return reason_code::SUCCESS;
+            }
+        }
+        subscribers.push_back({ queue, maxQos, options });
+        _filters[queue.get()].emplace_back(filter);
+        ++_subscriptionCount;
+        return reason_code::SUCCESS;
+    }
+
+    // drops every subscription of a client, called when it goes away
+    void remove(const outbound_queue* queue) {
+        auto it = _filters.find(queue);
+        if (it == _filters.end()) {
+            return;
+        }
+        for (const auto& filter : it->second) {
+            erase(filter, queue);
+        }
+        _subscriptionCount -= it->second.size();
+        _filters.erase(it);
+    }
+
+    // topics matching filter are queued last value for every subscriber, FAIL if
+    // the filter is not valid
+    [[nodiscard]] return_code add_last_value_rule(std::string_view filter) {
+        if (!topic::is_valid_filter(filter) || topic::is_shared_filter(filter)) {
+            return return_code::FAIL;
+        }
+        _lastValueRules.emplace_back(filter);
+        return return_code::OK;
+    }
+
+    // fills matches with the queues of every client subscribed to topic, each
+    // client once even if several of its filters match: the highest overflow
+    // policy of those applies, and last value only if they all ask for it
+    void match(std::string_view topicName, std::vector<subscriber_match>& matches) {
+        matches.clear();
+        _levels.clear();
+        for_each_level(topicName, [this](std::string_view level) {
+            _levels.push_back(level);
+        });
+
+        // wildcards do not match topics starting with '$' at the first level [MQTT-4.7.2-1]
+        const bool systemTopic = !topicName.empty() && topicName[0] == '$';
+        match_node(_root, 0, systemTopic, matches);
+
+        std::sort(matches.begin(), matches.end(), [](const subscriber_match& a, const subscriber_match& b) {
+            return a._queue < b._queue;
+        });
+        size_t kept = 0;
+        for (size_t i = 0; i < matches.size(); ++i) {
+            if (kept && matches[kept - 1]._queue == matches[i]._queue) {
+                queue_options& options = matches[kept - 1]._options;
+                options._overflow = std::max(options._overflow, matches[i]._options._overflow);
+                options._lastValue = options._lastValue && matches[i]._options._lastValue;
+                continue;
+            }
+            if (kept != i) {
+                matches[kept] = std::move(matches[i]);
+            }
+            ++kept;
+        }
+        matches.resize(kept);
+
+        if (!matches.empty() && is_last_value_topic(topicName)) {
+            for (auto& match : matches) {
+                match._options._lastValue = true;
+            }
+        }
+    }
+
+    [[nodiscard]] size_t subscriber_count() const noexcept {
+        return _filters.size();
+    }
+
+    // topic filters of every client
+    [[nodiscard]] size_t subscription_count() const noexcept {
+        return _subscriptionCount;
+    }
+
+private:
+    struct subscription {
+        std::weak_ptr<outbound_queue> _queue;
+        uint8_t _maxQos = 0;
+        queue_options _options;
+    };
+
+    struct node {
+        // std::less<> lets us look a level up with a string_view
+        std::map<std::string, std::unique_ptr<node>, std::less<>> _children;
+        // filters ending at this level
+        std::vector<subscription> _subscribers;
+        // filters ending with '#' right after this level
+        std::vector<subscription> _multiLevel;
+    };
+
+    template <typename Fn>
+    static void for_each_level(std::string_view str, Fn&& fn) {
+        size_t start = 0;
+        for (;;) {
+            const size_t end = str.find('/', start);
+            if (end == std::string_view::npos) {
+                fn(str.substr(start));
+                return;
+            }
+            fn(str.substr(start, end - start));
+            start = end + 1;
+        }
+    }
+
+    static void collect(std::vector<subscription>& subscribers, std::vector<subscriber_match>& matches) {
+        for (const auto& entry : subscribers) {
+            auto queue = entry._queue.lock();
+            if (queue && !queue->is_closed()) {
+                matches.push_back({ std::move(queue), entry._options });
+            }
+        }
+    }
+
+    [[nodiscard]] bool is_last_value_topic(std::string_view topicName) const noexcept {
+        return std::any_of(_lastValueRules.begin(), _lastValueRules.end(), [topicName](const std::string& filter) {
+            return topic::matches(filter, topicName);
+        });
+    }
+
+    void match_node(node& current, size_t depth, bool systemTopic, std::vector<subscriber_match>& matches) {
+        const bool wildcardsAllowed = !(systemTopic && depth == 0);
+
+        // "a/#" also matches "a" [MQTT-4.7.1-2]
+        if (wildcardsAllowed) {
+            collect(current._multiLevel, matches);
+        }
+
+        if (depth == _levels.size()) {
+            collect(current._subscribers, matches);
+            return;
+        }
+
+        auto it = current._children.find(_levels[depth]);
+        if (it != current._children.end()) {
+            match_node(*it->second, depth + 1, systemTopic, matches);
+        }
+
+        if (wildcardsAllowed) {
+            auto plus = current._children.find("+");
+            if (plus != current._children.end()) {
+                match_node(*plus->second, depth + 1, systemTopic, matches);
+            }
+        }
+    }
+
+    void erase(std::string_view filter, const outbound_queue* queue) {
+        // remember the path so empty nodes can be pruned on the way back
+        std::vector<std::pair<node*, std::string_view>> path;
+        node* current = &_root;
+        bool multiLevel = false;
+        bool found = true;
+        for_each_level(filter, [&](std::string_view level) {
+            if (!found) {
+                return;
+            }
+            if (level == "#") {
+                multiLevel = true;
+                return;
+            }
+            auto it = current->_children.find(level);
+            if (it == current->_children.end()) {
+                found = false;
+                return;
+            }
+            path.emplace_back(current, level);
+            current = it->second.get();
+        });
+        if (!found) {
+            return;
+        }
+
+        auto& subscribers = multiLevel ? current->_multiLevel : current->_subscribers;
+        subscribers.erase(
+            std::remove_if(subscribers.begin(), subscribers.end(), [queue](const subscription& entry) {
+                auto locked = entry._queue.lock();
+                return !locked || locked.get() == queue;
+            }),
+            subscribers.end()
+        );
+
+        while (!path.empty()) {
+            node* child = current;
+            if (!child->_children.empty() || !child->_subscribers.empty() || !child->_multiLevel.empty()) {
+                break;
+            }
+            auto [parent, level] = path.back();
+            path.pop_back();
+            parent->_children.erase(parent->_children.find(level));
+            current = parent;
+        }
+    }
+
+    node _root;
+    // filters of each client, so remove() does not walk the whole tree
+    std::unordered_map<const outbound_queue*, std::vector<std::string>> _filters;
+    // levels of the topic being matched, kept to avoid an allocation per match
+    std::vector<std::string_view> _levels;
+    size_t _subscriptionCount = 0;
+    // server side last value filters, a handful at most
+    std::vector<std::string> _lastValueRules;
+};
+
+} // namespace lmqtt
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "lmqtt_common.h"
+#include "lmqtt_log.h"
 
 namespace lmqtt {
 
@@ -10,6 +11,12 @@ public:
         : _time(std::chrono::milliseconds(time)), _f(f) {}
 
     ~lmqtt_timer() {
+        // do not wait for the timeout, and do not call _f on an owner being destroyed
+        {
+            std::scoped_lock lock(mtx);
+            _exit = true;
+        }
+        cv.notify_all();
         worker.join();
     }
 
@@ -23,14 +30,14 @@ public:
         while (!_exit) {
             std::unique_lock<std::mutex> lock(mtx);
             //cv.wait(lock, [this] {return has_work || exiting; });
-            std::cout << "Thread " << worker.get_id() << " WAITING FOR " << std::chrono::duration_cast<std::chrono::milliseconds>(_time).count() << std::endl;
+            LMQTT_LOG_TRACE("Timer waiting for {} ms", static_cast<int64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(_time).count()));
             if (!_work) {
                 cv.wait(lock, [this] {return _work || _exit; });
             } else {
                 cv.wait_for(lock, _time, [this] { return _exit; });
             }
             if (_exit) {
-                std::cout << "exiting from loop\n";
+                LMQTT_LOG_TRACE("Timer exiting from loop");
                 break;
             }
             _f();
@@ -65,7 +72,9 @@ private:
         }*/
 
         std::unique_lock<std::mutex> ul{mtx};
-        cv.wait_for(ul, _time);
+        if (cv.wait_for(ul, _time, [this] { return _exit; })) {
+            return;
+        }
         _f();
     }
 
@@ -1,7 +1,9 @@
 #pragma once
 
-//#include "lmqtt_tspqueue.h"
+#include <queue>
+
 #include "lmqtt_common.h"
+#include "lmqtt_log.h"
 
 namespace lmqtt {
 
@@ -29,7 +31,7 @@ public:
             size_t time = _queue.top();
             _queue.pop();
 
-            std::cout << "Thread " << std::this_thread::get_id() << " will sleep for " << time << " ms\n";
+            LMQTT_LOG_TRACE("Timer queue will sleep for {} ms", time);
 
             std::this_thread::sleep_for(std::chrono::milliseconds(time));
         }
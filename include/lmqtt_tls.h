@@ -0,0 +1,518 @@
+#pragma once
+
+#include "lmqtt_common.h"
+#include "lmqtt_log.h"
+#include "lmqtt_metrics.h"
+#include "lmqtt_server_config.h"
+#include "lmqtt_connection.h"
+#include "lmqtt_stream_utils.h"
+
+#if defined(LMQTT_HAS_TLS)
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+namespace lmqtt {
+
+namespace tls {
+
+struct ssl_deleter {
+    void operator()(SSL* ssl) const noexcept {
+        SSL_free(ssl);
+    }
+};
+
+struct ssl_context_deleter {
+    void operator()(SSL_CTX* context) const noexcept {
+        SSL_CTX_free(context);
+    }
+};
+
+using ssl_ptr = std::unique_ptr<SSL, ssl_deleter>;
+using ssl_context_ptr = std::unique_ptr<SSL_CTX, ssl_context_deleter>;
+
+// the oldest error OpenSSL queued on this thread, for the logs. Clears the queue
+[[nodiscard]] inline std::string get_last_error() {
+    const unsigned long code = ERR_get_error();
+    ERR_clear_error();
+    if (!code) {
+        return "unknown error";
+    }
+    char buffer[256];
+    ERR_error_string_n(code, buffer, sizeof(buffer));
+    return buffer;
+}
+
+// the certificate and session settings of a listener, shared by its handshake
+// threads. Throws if the certificate or the key can not be loaded
+[[nodiscard]] inline ssl_context_ptr make_server_context(const tls_listener_config& config) {
+    ssl_context_ptr context(SSL_CTX_new(TLS_server_method()));
+    if (!context) {
+        throw std::runtime_error("could not create a TLS context: " + get_last_error());
+    }
+    SSL_CTX* ctx = context.get();
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(ctx, config._certificateFile.c_str()) != 1) {
+        throw std::runtime_error("could not load certificate " + config._certificateFile + ": " + get_last_error());
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, config._privateKeyFile.c_str(), SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx) != 1) {
+        throw std::runtime_error("could not load private key " + config._privateKeyFile + ": " + get_last_error());
+    }
+
+    uint64_t options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+#if defined(SSL_OP_IGNORE_UNEXPECTED_EOF)
+    // most clients close the socket without a close_notify, that is an eof
+    options |= SSL_OP_IGNORE_UNEXPECTED_EOF;
+#endif
+    if (config._kernelTls) {
+        // OpenSSL hands the record keys to the kernel when the handshake is done,
+        // if the kernel takes them
+        options |= SSL_OP_ENABLE_KTLS;
+    }
+    if (!config._sessionTickets) {
+        options |= SSL_OP_NO_TICKET;
+    }
+    SSL_CTX_set_options(ctx, options);
+
+    // an idle client does not hold on to its record buffers (34 KO)
+    SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS | SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    // TLS 1.3 tickets are encrypted with a key of the context: any handshake thread
+    // can resume any client, nothing is stored per client. TLS 1.2 clients resume
+    // from the context's session cache
+    SSL_CTX_set_num_tickets(ctx, config._sessionTickets);
+    SSL_CTX_set_timeout(ctx, static_cast<long>(config._sessionLifetime.count()));
+    SSL_CTX_set_session_cache_mode(ctx, config._sessionTickets ? SSL_SESS_CACHE_SERVER : SSL_SESS_CACHE_OFF);
+    static constexpr unsigned char SESSION_ID_CONTEXT[] = "lmqtt";
+    SSL_CTX_set_session_id_context(ctx, SESSION_ID_CONTEXT, sizeof(SESSION_ID_CONTEXT) - 1);
+    return context;
+}
+
+// the kernel encrypts and decrypts the records of this connection both ways, and
+// OpenSSL holds nothing that was read ahead: the socket is plain TCP from now on
+[[nodiscard]] inline bool is_kernel_offloaded(SSL* ssl) noexcept {
+#if !defined(OPENSSL_NO_KTLS)
+    return BIO_get_ktls_send(SSL_get_wbio(ssl))
+        && BIO_get_ktls_recv(SSL_get_rbio(ssl))
+        && !SSL_has_pending(ssl);
+#else
+    return false;
+#endif
+}
+
+// a connected socket on its way from one io_context to another
+class detached_socket {
+public:
+    detached_socket() = default;
+
+    // the socket does not belong to its io_context anymore, it must be idle
+    explicit detached_socket(asio::ip::tcp::socket& socket) {
+        std::error_code ec;
+        const auto endpoint = socket.local_endpoint(ec);
+        if (ec) {
+            return;
+        }
+        _protocol = endpoint.protocol();
+        _fd = socket.release(ec);
+        if (ec) {
+            _fd = -1;
+        }
+    }
+
+    detached_socket(detached_socket&& other) noexcept :
+        _protocol(other._protocol),
+        _fd(std::exchange(other._fd, -1)) {}
+
+    detached_socket& operator=(detached_socket&& other) noexcept {
+        if (this != &other) {
+            reset();
+            _protocol = other._protocol;
+            _fd = std::exchange(other._fd, -1);
+        }
+        return *this;
+    }
+
+    ~detached_socket() {
+        reset();
+    }
+
+    explicit operator bool() const noexcept {
+        return _fd != -1;
+    }
+
+    // the socket, on context from now on
+    [[nodiscard]] asio::ip::tcp::socket attach(asio::io_context& context, std::error_code& ec) {
+        asio::ip::tcp::socket socket(context);
+        socket.assign(_protocol, _fd, ec);
+        if (!ec) {
+            _fd = -1;
+        }
+        return socket;
+    }
+
+private:
+    void reset() noexcept {
+        if (_fd != -1) {
+            ::close(_fd);
+            _fd = -1;
+        }
+    }
+
+    asio::ip::tcp _protocol = asio::ip::tcp::v4();
+    asio::ip::tcp::socket::native_handle_type _fd = -1;
+};
+
+/*
+ * A TLS session that OpenSSL runs in userspace, over a non blocking TCP socket, with
+ * the interface basic_connection expects (see shm_stream). SSL_read and SSL_write go
+ * straight to the socket; when they can not go on, we wait for it in the io_context
+ * and try again. If the kernel took the sending side over, SSL_write is a plain
+ * write already.
+ *
+ * Used when the kernel does not encrypt the records both ways: without its tls
+ * module, with a cipher it does not know, or with _kernelTls off.
+ */
+class stream {
+public:
+    using executor_type = asio::ip::tcp::socket::executor_type;
+
+    // ssl went through its handshake on socket's file descriptor
+    stream(asio::ip::tcp::socket socket, ssl_ptr ssl) :
+        _socket(std::move(socket)),
+        _ssl(std::move(ssl)) {
+        std::error_code ignored;
+        _socket.non_blocking(true, ignored);
+    }
+
+    stream(stream&&) noexcept = default;
+    stream& operator=(stream&&) noexcept = default;
+
+    ~stream() {
+        close();
+    }
+
+    [[nodiscard]] executor_type get_executor() noexcept {
+        return _socket.get_executor();
+    }
+
+    [[nodiscard]] bool is_open() const noexcept {
+        return _socket.is_open() && _ssl;
+    }
+
+    [[nodiscard]] const asio::ip::tcp::socket& get_socket() const noexcept {
+        return _socket;
+    }
+
+    template <typename MutableBufferSequence, typename ReadHandler>
+    auto async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler) {
+        return asio::async_initiate<ReadHandler, void(std::error_code, size_t)>(
+            [this](auto&& completionHandler, asio::mutable_buffer buffer) {
+                run(
+                    [buffer](SSL* ssl, size_t* size) {
+                        return SSL_read_ex(ssl, buffer.data(), buffer.size(), size);
+                    },
+                    buffer.size(),
+                    std::move(completionHandler)
+                );
+            },
+            handler,
+            detail::get_first_buffer<asio::mutable_buffer>(buffers)
+        );
+    }
+
+    template <typename ConstBufferSequence, typename WriteHandler>
+    auto async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler) {
+        return asio::async_initiate<WriteHandler, void(std::error_code, size_t)>(
+            [this](auto&& completionHandler, asio::const_buffer buffer) {
+                run(
+                    [buffer](SSL* ssl, size_t* size) {
+                        return SSL_write_ex(ssl, buffer.data(), buffer.size(), size);
+                    },
+                    buffer.size(),
+                    std::move(completionHandler)
+                );
+            },
+            handler,
+            detail::get_first_buffer<asio::const_buffer>(buffers)
+        );
+    }
+
+    // sends a close_notify if the socket takes it right away, then shuts TCP down
+    void shutdown(asio::socket_base::shutdown_type what, std::error_code& ec) {
+        if (is_open() && !_failed && what != asio::socket_base::shutdown_receive) {
+            ERR_clear_error();
+            SSL_shutdown(_ssl.get());
+            ERR_clear_error();
+        }
+        _socket.shutdown(what, ec);
+    }
+
+    // pending operations fail with operation_aborted
+    void close(std::error_code& ec) {
+        ec = std::error_code();
+        // the socket BIO does not close the descriptor
+        _ssl.reset();
+        if (_socket.is_open()) {
+            _socket.close(ec);
+        }
+    }
+
+    void close() {
+        std::error_code ignored;
+        close(ignored);
+    }
+
+private:
+    // operation(ssl, &size) is SSL_read_ex or SSL_write_ex, retried until it went
+    // through. Either can need the socket to be readable or writable: a read may
+    // have to answer a key update, a write may wait for room
+    template <typename Operation, typename Handler>
+    void run(Operation&& operation, size_t requested, Handler&& handler) {
+        if (!is_open()) {
+            detail::post_completion(std::forward<Handler>(handler), get_executor(), asio::error::bad_descriptor, 0);
+            return;
+        }
+        if (!requested) {
+            detail::post_completion(std::forward<Handler>(handler), get_executor(), std::error_code(), 0);
+            return;
+        }
+        // SSL_get_error looks at this thread's queue, nothing from before must be in it
+        ERR_clear_error();
+        size_t size = 0;
+        const int result = operation(_ssl.get(), &size);
+        if (result == 1) {
+            detail::post_completion(std::forward<Handler>(handler), get_executor(), std::error_code(), size);
+            return;
+        }
+        switch (SSL_get_error(_ssl.get(), result)) {
+        case SSL_ERROR_WANT_READ:
+            wait(asio::socket_base::wait_read, std::forward<Operation>(operation), requested, std::forward<Handler>(handler));
+            return;
+        case SSL_ERROR_WANT_WRITE:
+            wait(asio::socket_base::wait_write, std::forward<Operation>(operation), requested, std::forward<Handler>(handler));
+            return;
+        case SSL_ERROR_ZERO_RETURN:
+            // close_notify, or the socket closed without one
+            detail::post_completion(std::forward<Handler>(handler), get_executor(), asio::error::eof, 0);
+            return;
+        default:
+            // the session can not be used anymore, not even for a close_notify
+            _failed = true;
+            LMQTT_LOG_DEBUG("[TLS] {}: {}", lmqtt::get_remote_address(_socket), get_last_error());
+            detail::post_completion(std::forward<Handler>(handler), get_executor(), asio::error::connection_reset, 0);
+            return;
+        }
+    }
+
+    template <typename Operation, typename Handler>
+    void wait(asio::socket_base::wait_type type, Operation&& operation, size_t requested, Handler&& handler) {
+        _socket.async_wait(
+            type,
+            [this, operation = std::forward<Operation>(operation), requested, handler = std::forward<Handler>(handler)](std::error_code ec) mutable {
+                if (ec) {
+                    handler(ec, 0);
+                    return;
+                }
+                run(std::move(operation), requested, std::move(handler));
+            }
+        );
+    }
+
+    asio::ip::tcp::socket _socket;
+    ssl_ptr _ssl;
+    bool _failed = false;
+};
+
+// for the logs, the address of the TCP peer
+[[nodiscard]] inline std::string get_remote_address(const stream& s) {
+    return lmqtt::get_remote_address(s.get_socket());
+}
+
+/*
+ * Threads running the handshakes of one listener, each with its own io_context. A
+ * full handshake costs about a millisecond of CPU (signature and key exchange): a
+ * reconnect storm of thousands of clients would hold the io thread, and every
+ * client already connected, for seconds. Accepted sockets are detached from the
+ * io thread, go through their handshake on one of these threads, and are handed
+ * back once it went through; clients that fail it or take too long are closed
+ * where they are.
+ */
+class handshake_pool {
+public:
+    // a client that went through its handshake
+    struct session {
+        detached_socket _socket;
+        // null when the kernel took the records over both ways (see is_kernel_offloaded)
+        ssl_ptr _ssl;
+        bool _resumed = false;
+    };
+
+    // called from a handshake thread
+    using established_handler = std::function<void(session)>;
+
+    handshake_pool(SSL_CTX* context, const tls_listener_config& config, established_handler onEstablished) :
+        _sslContext(context),
+        _timeout(config._handshakeTimeout),
+        _kernelTls(config._kernelTls),
+        _onEstablished(std::move(onEstablished)) {
+        const size_t threads = std::max<size_t>(1, config._handshakeThreads);
+        for (size_t i = 0; i < threads; ++i) {
+            _workers.push_back(std::make_unique<worker>());
+        }
+        for (auto& w : _workers) {
+            w->_thread = std::thread([&context = w->_context]() { context.run(); });
+        }
+    }
+
+    handshake_pool(const handshake_pool&) = delete;
+    handshake_pool& operator=(const handshake_pool&) = delete;
+
+    ~handshake_pool() {
+        stop();
+    }
+
+    // handshakes that did not finish are dropped with their sockets
+    void stop() {
+        for (auto& w : _workers) {
+            w->_context.stop();
+        }
+        for (auto& w : _workers) {
+            if (w->_thread.joinable()) {
+                w->_thread.join();
+            }
+        }
+        _workers.clear();
+    }
+
+    // from the io thread, right after accept: the socket moves to the next thread
+    void submit(asio::ip::tcp::socket socket) {
+        detached_socket detached(socket);
+        if (!detached || _workers.empty()) {
+            return;
+        }
+        worker& w = *_workers[_next++ % _workers.size()];
+        asio::post(
+            w._context,
+            [this, &w, detached = std::move(detached)]() mutable {
+                start_handshake(w, std::move(detached));
+            }
+        );
+    }
+
+private:
+    struct worker {
+        asio::io_context _context;
+        asio::executor_work_guard<asio::io_context::executor_type> _work{ asio::make_work_guard(_context) };
+        std::thread _thread;
+    };
+
+    // shared by the handlers of one handshake
+    struct handshake {
+        handshake(asio::io_context& context, asio::ip::tcp::socket socket) :
+            _socket(std::move(socket)), _timer(context) {}
+
+        asio::ip::tcp::socket _socket;
+        ssl_ptr _ssl;
+        asio::steady_timer _timer;
+        bool _timedOut = false;
+    };
+
+    void start_handshake(worker& w, detached_socket detached) {
+        std::error_code ec;
+        asio::ip::tcp::socket socket = detached.attach(w._context, ec);
+        if (ec) {
+            return;
+        }
+        auto h = std::make_shared<handshake>(w._context, std::move(socket));
+        h->_socket.non_blocking(true, ec);
+        h->_ssl.reset(SSL_new(_sslContext));
+        // OpenSSL reads and writes the socket itself: that is what lets it hand the
+        // session to the kernel afterwards
+        if (ec || !h->_ssl || SSL_set_fd(h->_ssl.get(), static_cast<int>(h->_socket.native_handle())) != 1) {
+            fail(*h, ec ? ec.message() : get_last_error());
+            return;
+        }
+        SSL_set_accept_state(h->_ssl.get());
+
+        h->_timer.expires_after(_timeout);
+        h->_timer.async_wait(
+            [h](std::error_code ec) {
+                if (ec) {
+                    return;
+                }
+                h->_timedOut = true;
+                std::error_code ignored;
+                h->_socket.cancel(ignored);
+            }
+        );
+        continue_handshake(h);
+    }
+
+    void continue_handshake(const std::shared_ptr<handshake>& h) {
+        ERR_clear_error();
+        const int result = SSL_do_handshake(h->_ssl.get());
+        if (result == 1) {
+            finish_handshake(*h);
+            return;
+        }
+        const int error = SSL_get_error(h->_ssl.get(), result);
+        if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+            fail(*h, get_last_error());
+            return;
+        }
+        h->_socket.async_wait(
+            error == SSL_ERROR_WANT_READ ? asio::socket_base::wait_read : asio::socket_base::wait_write,
+            [this, h](std::error_code ec) {
+                if (ec) {
+                    fail(*h, h->_timedOut ? "timed out" : ec.message());
+                    return;
+                }
+                continue_handshake(h);
+            }
+        );
+    }
+
+    void finish_handshake(handshake& h) {
+        h._timer.cancel();
+        session s;
+        s._resumed = SSL_session_reused(h._ssl.get()) == 1;
+        metrics::add(metrics::counters()._tlsHandshakes);
+        if (s._resumed) {
+            metrics::add(metrics::counters()._tlsResumed);
+        }
+        if (is_kernel_offloaded(h._ssl.get())) {
+            metrics::add(metrics::counters()._tlsKernelOffloaded);
+        } else {
+            if (_kernelTls && !_kernelTlsWarned.exchange(true)) {
+                LMQTT_LOG_WARNING("[TLS] Kernel TLS is not available for {} (is the tls module loaded?), records are encrypted in userspace", SSL_get_cipher_name(h._ssl.get()));
+            }
+            s._ssl = std::move(h._ssl);
+        }
+        LMQTT_LOG_DEBUG("[TLS] Handshake with {} done ({}{})", lmqtt::get_remote_address(h._socket), SSL_get_version(s._ssl ? s._ssl.get() : h._ssl.get()), s._resumed ? ", resumed" : "");
+        s._socket = detached_socket(h._socket);
+        _onEstablished(std::move(s));
+    }
+
+    void fail(handshake& h, const std::string& reason) {
+        h._timer.cancel();
+        metrics::add(metrics::counters()._tlsHandshakeFailures);
+        LMQTT_LOG_DEBUG("[TLS] Handshake with {} failed: {}", lmqtt::get_remote_address(h._socket), reason);
+        // the socket closes with the last handler holding h
+    }
+
+    SSL_CTX* _sslContext;
+    std::chrono::milliseconds _timeout;
+    bool _kernelTls;
+    established_handler _onEstablished;
+    std::atomic<bool> _kernelTlsWarned{ false };
+    std::vector<std::unique_ptr<worker>> _workers;
+    // only used from the io thread
+    size_t _next = 0;
+};
+
+} // namespace tls
+
+} // namespace lmqtt
+
+#endif // LMQTT_HAS_TLS
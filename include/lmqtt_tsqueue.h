@@ -90,6 +90,15 @@ namespace lmqtt {
 			_deq.clear();
 		}
 
+		// f is called on every item with the queue locked, it must not use the queue
+		template <typename F>
+		void for_each(F&& f) {
+			std::scoped_lock lock(_mxq);
+			for (auto& item : _deq) {
+				f(item);
+			}
+		}
+
 		void find_and_erase(const T& item) {
 			std::scoped_lock lock(_mxq);
 			auto it = std::find(
@@ -51,6 +51,47 @@ const std::string_view to_string(packet_type type) noexcept {
     return ""; // keep the compiler happy
 }
 
+// what is done with a forwarded message when the subscriber's outbound queue is
+// full (see outbound_queue). If several subscriptions of a client match a topic,
+// the one listed last here wins
+enum class overflow_policy : uint8_t {
+    DROP_NEWEST,    // the new message is not queued
+    DROP_OLDEST,    // queued messages that did not start are dropped to make room
+    CONFLATE,       // replaces the queued message of the same topic, else drops the oldest
+    DISCONNECT      // the client gets a DISCONNECT with QUOTA_EXCEEDED
+};
+
+// how a subscription wants the messages it matches queued for its client
+struct queue_options {
+    overflow_policy _overflow = overflow_policy::DROP_NEWEST;
+    // last value: at most one queued message per topic, a newer one takes the
+    // place of the older one in the queue
+    bool _lastValue = false;
+};
+
+// a SUBSCRIBE picks the policy of its filters with this user property, the
+// listener's default applies otherwise
+inline constexpr std::string_view OVERFLOW_PROPERTY = "lmqtt-overflow";
+
+// and asks for last value queueing with this one set to "last-value", which the
+// server can also enforce on some topics (server_config::_lastValueFilters)
+inline constexpr std::string_view QUEUE_PROPERTY = "lmqtt-queue";
+
+[[nodiscard]] inline bool parse_overflow_policy(std::string_view str, overflow_policy& policy) noexcept {
+    if (str == "drop-newest") {
+        policy = overflow_policy::DROP_NEWEST;
+    } else if (str == "drop-oldest") {
+        policy = overflow_policy::DROP_OLDEST;
+    } else if (str == "conflate") {
+        policy = overflow_policy::CONFLATE;
+    } else if (str == "disconnect") {
+        policy = overflow_policy::DISCONNECT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 enum class packet_owner : uint8_t {
     SERVER,
     CLIENT,
@@ -109,6 +150,18 @@ public:
         }
     }
 
+    // the reserved flags (lower 4 bits of the control field) each packet type must carry.
+    // PUBLISH flags are not fixed, so the returned value is only a mask
+    static constexpr const packet_flag get_packet_flag(packet_type ptype) noexcept {
+        switch (ptype) {
+        case packet_type::PUBLISH:          return packet_flag::PUBLISH;
+        case packet_type::PUBREL:           return packet_flag::PUBREL;
+        case packet_type::SUBSCRIBE:        return packet_flag::SUBSCRIBE;
+        case packet_type::UNSUBSCRIBE:      return packet_flag::UNSUBSCRIBE;
+        default:                            return packet_flag::RESERVED;
+        }
+    }
+
     static constexpr const bool is_server_packet(packet_type ptype) noexcept {
         return (get_packet_owner(ptype) == packet_owner::SERVER)
             || (get_packet_owner(ptype) == packet_owner::BOTH);
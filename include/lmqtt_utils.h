@@ -13,13 +13,13 @@ public:
     // The offset will be used to know from where to start the next reading after
     // decoding the variable.
     static const return_code decode_variable_int(
-        uint8_t* buffer,
+        const uint8_t* buffer,
         uint32_t& decodedValue,
         uint8_t& offset,
         uint32_t buffSize
     ) noexcept {
         decodedValue = 0;
-        uint8_t mul = 1;
+        uint32_t mul = 1;
 
         for (offset = 0; offset < 4; ++offset) {
             if (offset >= buffSize) {
@@ -44,6 +44,8 @@ public:
         else return 1;
     }
 
+    // Encodes valueToEncode as a variable byte integer. On success, offset holds
+    // the number of written bytes (same as get_variable_int_size(valueToEncode))
     static const return_code encode_variable_int(
         uint8_t* buffer,
         uint32_t buffSize,
@@ -52,30 +54,32 @@ public:
     ) noexcept {
         offset = 0;
 
-        if (buffSize < 4) {
+        // 268'435'455 is the biggest value a variable byte integer can hold
+        if (valueToEncode > 0xFFFFFFF) {
+            return return_code::FAIL;
+        }
+
+        if (buffSize < get_variable_int_size(valueToEncode)) {
             return return_code::FAIL;
         }
 
-        while (valueToEncode) {
-            uint8_t byte = valueToEncode % 0x7f;
-            valueToEncode /= 0x7f;
+        // a zero still takes one byte, so do at least one iteration
+        do {
+            uint8_t byte = valueToEncode % 0x80;
+            valueToEncode /= 0x80;
 
             // if there's more data, set the top bit of this byte
             if (valueToEncode) {
-                byte |= 0x7f;
+                byte |= 0x80;
             }
 
             buffer[offset++] = byte;
-
-            if (offset > 4) {
-                return return_code::FAIL;
-            }
-        }
+        } while (valueToEncode);
 
         return return_code::OK;
     }
 
-    static const return_code decode_utf8_str(uint8_t* buffer,
+    static const return_code decode_utf8_str(const uint8_t* buffer,
         std::string_view& decodedString,
         uint32_t& offset,
         bool isAlphaNum = false
@@ -99,7 +103,7 @@ public:
             }
         }*/
 
-        decodedString = std::string_view((char*)(buffer + 2), strLen);
+        decodedString = std::string_view((const char*)(buffer + 2), strLen);
         if (!utf8_utils::is_valid_length(decodedString)) {
             return return_code::FAIL;
         }
@@ -112,13 +116,13 @@ public:
         return return_code::OK;
     }
 
-    static const return_code decode_utf8_str_fixed(uint8_t* buffer,
+    static const return_code decode_utf8_str_fixed(const uint8_t* buffer,
         std::string_view& decodedString,
         uint32_t length,
         bool isAlphaNum = false
     ) noexcept {
 
-        decodedString = std::string_view((char*)(buffer), length);
+        decodedString = std::string_view((const char*)(buffer), length);
         if (!utf8_utils::is_valid_length(decodedString)) {
             return return_code::FAIL;
         }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "lmqtt_common.h"
+#include "lmqtt_log.h"
 #include "lmqtt_types.h"
 #include "lmqtt_properties.h"
 
@@ -11,7 +12,7 @@ class will_config {
 public:
 	will_config() = default;
 	~will_config() {
-		std::cout << "destroyed will config " << this << std::endl;
+		LMQTT_LOG_TRACE("destroyed will config {}", this);
 	}
 
 private:
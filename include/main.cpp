@@ -9,7 +9,10 @@ int main() {
 	}
 
 
-	lmqtt::lmqtt_server lmqtt_server(1883);
+	lmqtt::server_config config;
+	config._port = 1883;
+	config._metricsPort = 9883;
+	lmqtt::lmqtt_server lmqtt_server(config);
 	if (!lmqtt_server.start()) {
 		std::cout << "Error starting server...\n";
 		return 0;
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdio>
+
+// No test framework: a failed CHECK prints where it is and the test goes on, the
+// test then exits with test::result() (1 if anything failed).
+namespace test {
+
+inline int failures = 0;
+
+inline void check(bool ok, const char* what, const char* file, int line) {
+    if (!ok) {
+        std::fprintf(stderr, "%s:%d: failed: %s\n", file, line, what);
+        ++failures;
+    }
+}
+
+[[nodiscard]] inline int result() {
+    if (failures) {
+        std::fprintf(stderr, "%d check(s) failed\n", failures);
+    }
+    return failures ? 1 : 0;
+}
+
+} // namespace test
+
+#define CHECK(condition) ::test::check((condition), #condition, __FILE__, __LINE__)
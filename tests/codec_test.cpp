@@ -0,0 +1,164 @@
+// PUBLISH packets written by encoder::packet_encoder are read back by the
+// publish_stream_decoder, whole or one byte at a time, with and without
+// properties, at every QoS.
+#include <string>
+#include <vector>
+#include "lmqtt.h"
+#include "check.h"
+
+namespace {
+
+using lmqtt::reason_code;
+using lmqtt::return_code;
+
+// keeps what the decoder hands out
+class collecting_sink : public lmqtt::publish_sink {
+public:
+    void on_publish_begin(const lmqtt::publish_header& header) override {
+        _topic = header._topic;
+        _packetId = header._packetId;
+        _qos = header._qos;
+        _retain = header._retain;
+        _properties = header._properties;
+        _payloadSize = header._payloadSize;
+        ++_begins;
+    }
+
+    void on_payload_chunk(const uint8_t* data, uint32_t size) override {
+        _payload.insert(_payload.end(), data, data + size);
+    }
+
+    void on_publish_end() override {
+        ++_ends;
+    }
+
+    std::string _topic;
+    uint16_t _packetId = 0;
+    uint8_t _qos = 0;
+    bool _retain = false;
+    std::string _properties;
+    uint32_t _payloadSize = 0;
+    std::vector<uint8_t> _payload;
+    int _begins = 0;
+    int _ends = 0;
+};
+
+// feeds the packet by pieces of at most step bytes, false if the decoder failed
+// or did not take everything
+bool decode(const std::vector<uint8_t>& packet, size_t step, collecting_sink& sink) {
+    uint32_t remainingLength = 0;
+    uint8_t varSize = 0;
+    if (lmqtt::utils::decode_variable_int(packet.data() + 1, remainingLength, varSize, static_cast<uint32_t>(packet.size() - 1)) != return_code::OK) {
+        return false;
+    }
+    // varSize is the offset of the last byte of the remaining length
+    const size_t bodyStart = 1 + varSize + 1;
+    if (bodyStart + remainingLength != packet.size()) {
+        return false;
+    }
+
+    lmqtt::publish_stream_decoder decoder;
+    decoder.reset(packet[0] & 0x0F, remainingLength, &sink);
+    size_t pos = bodyStart;
+    while (pos < packet.size()) {
+        const uint32_t size = static_cast<uint32_t>(std::min(step, packet.size() - pos));
+        uint32_t consumed = 0;
+        if (decoder.feed(packet.data() + pos, size, consumed) != reason_code::SUCCESS) {
+            return false;
+        }
+        // one packet, every byte belongs to it
+        if (consumed != size) {
+            return false;
+        }
+        pos += consumed;
+    }
+    return decoder.get_state() == lmqtt::publish_stream_decoder::state::DONE;
+}
+
+void round_trip(uint8_t qos, bool withProperties, size_t payloadSize) {
+    std::vector<uint8_t> payload(payloadSize);
+    for (size_t i = 0; i < payloadSize; ++i) {
+        payload[i] = static_cast<uint8_t>(i * 31);
+    }
+    std::vector<lmqtt::encoder::property_view> properties;
+    if (withProperties) {
+        using lmqtt::property::property_type;
+        properties.push_back(lmqtt::encoder::property_view::make(property_type::MESSAGE_EXPIRY_INTERVAL, 3600));
+        properties.push_back(lmqtt::encoder::property_view::make(property_type::CONTENT_TYPE, "text/plain"));
+        properties.push_back(lmqtt::encoder::property_view::make(property_type::USER_PROPERTY, "key", "value"));
+    }
+
+    lmqtt::encoder::publish_message msg;
+    msg._topic = "sensors/kitchen/temperature";
+    msg._packetId = qos ? 4242 : 0;
+    msg._qos = qos;
+    msg._retain = true;
+    msg._properties = properties;
+    msg._payload = payload.data();
+    msg._payloadSize = static_cast<uint32_t>(payload.size());
+
+    std::vector<uint8_t> packet;
+    CHECK(lmqtt::encoder::packet_encoder::append(packet, msg) == return_code::OK);
+    CHECK(packet.size() == lmqtt::encoder::packet_encoder::get_size(msg));
+    CHECK((packet[0] >> 4) == static_cast<uint8_t>(lmqtt::packet_type::PUBLISH));
+
+    for (const size_t step : { packet.size(), size_t(1), size_t(7) }) {
+        collecting_sink sink;
+        CHECK(decode(packet, step, sink));
+        CHECK(sink._begins == 1 && sink._ends == 1);
+        CHECK(sink._topic == msg._topic);
+        CHECK(sink._packetId == msg._packetId);
+        CHECK(sink._qos == qos);
+        CHECK(sink._retain);
+        CHECK(sink._payloadSize == payload.size());
+        CHECK(sink._payload == payload);
+        CHECK(sink._properties.empty() != withProperties);
+    }
+
+    // the header alone, as a relay writes it before the payload it forwards
+    std::vector<uint8_t> header(lmqtt::encoder::packet_encoder::get_header_size(msg));
+    uint32_t written = 0;
+    CHECK(lmqtt::encoder::packet_encoder::encode_header(header.data(), static_cast<uint32_t>(header.size()), msg, written) == return_code::OK);
+    CHECK(written == header.size());
+    CHECK(header.size() + payload.size() == packet.size());
+    CHECK(std::equal(header.begin(), header.end(), packet.begin()));
+
+    // forwarded with its properties as received, the packet is the same
+    if (withProperties) {
+        collecting_sink sink;
+        CHECK(decode(packet, packet.size(), sink));
+        lmqtt::encoder::publish_message forwarded = msg;
+        forwarded._properties = {};
+        forwarded._encodedProperties = sink._properties;
+        std::vector<uint8_t> again;
+        CHECK(lmqtt::encoder::packet_encoder::append(again, forwarded) == return_code::OK);
+        CHECK(again == packet);
+    }
+}
+
+// a variable header bigger than the decoder buffers is refused, not buffered
+void oversized_header() {
+    const std::string topic(lmqtt::publish_stream_decoder::VARIABLE_HEADER_LIMIT + 16, 't');
+    lmqtt::encoder::publish_message msg;
+    msg._topic = topic;
+    std::vector<uint8_t> packet;
+    CHECK(lmqtt::encoder::packet_encoder::append(packet, msg) == return_code::OK);
+    collecting_sink sink;
+    CHECK(!decode(packet, packet.size(), sink));
+    CHECK(sink._begins == 0);
+}
+
+} // namespace
+
+int main() {
+    for (const uint8_t qos : { 0, 1, 2 }) {
+        for (const bool withProperties : { false, true }) {
+            // empty, in the fixed header's one byte remaining length, and past it
+            for (const size_t payloadSize : { size_t(0), size_t(10), size_t(300), size_t(70000) }) {
+                round_trip(qos, withProperties, payloadSize);
+            }
+        }
+    }
+    oversized_header();
+    return test::result();
+}
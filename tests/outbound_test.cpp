@@ -0,0 +1,127 @@
+// What each overflow_policy does to a new forwarded message once the
+// outbound_queue of a client is full.
+#include <string>
+#include <vector>
+#include "lmqtt.h"
+#include "check.h"
+
+namespace {
+
+using lmqtt::outbound_queue;
+using lmqtt::overflow_policy;
+using lmqtt::packet_type;
+using lmqtt::shared_bytes;
+
+// room for two messages, whatever their size
+constexpr size_t MAX_MESSAGES = 2;
+
+// a fake PUBLISH, only its first byte (the packet type) and its tag matter to the queue
+shared_bytes make_packet(uint8_t tag) {
+    return std::make_shared<const std::vector<uint8_t>>(std::vector<uint8_t>{ 0x30, 1, tag });
+}
+
+// forwards a whole packet, false if the queue did not take it
+bool forward(outbound_queue& queue, uint8_t tag, std::string_view topic, overflow_policy policy) {
+    lmqtt::queue_options options;
+    options._overflow = policy;
+    const shared_bytes packet = make_packet(tag);
+    auto message = queue.open(packet, packet->size(), topic, options);
+    if (!message) {
+        return false;
+    }
+    queue.finish(message);
+    return true;
+}
+
+// the tags of the forwarded packets, and the types of the others, in write order
+std::vector<int> drain(outbound_queue& queue) {
+    std::vector<int> written;
+    packet_type type;
+    while (shared_bytes chunk = queue.next_chunk(type)) {
+        written.push_back(type == packet_type::PUBLISH ? (*chunk)[2] : -static_cast<int>(type));
+        queue.on_written(chunk->size());
+    }
+    return written;
+}
+
+outbound_queue make_queue(int& wakes) {
+    return outbound_queue([&wakes]() { ++wakes; }, outbound_queue::HIGH_WATERMARK, outbound_queue::MAX_QUEUED_BYTES, MAX_MESSAGES);
+}
+
+void drop_newest() {
+    int wakes = 0;
+    outbound_queue queue = make_queue(wakes);
+    CHECK(forward(queue, 1, "a", overflow_policy::DROP_NEWEST));
+    CHECK(forward(queue, 2, "b", overflow_policy::DROP_NEWEST));
+    CHECK(queue.is_full());
+    CHECK(!forward(queue, 3, "c", overflow_policy::DROP_NEWEST));
+    CHECK(drain(queue) == std::vector<int>({ 1, 2 }));
+    CHECK(wakes > 0);
+}
+
+void drop_oldest() {
+    int wakes = 0;
+    outbound_queue queue = make_queue(wakes);
+    CHECK(forward(queue, 1, "a", overflow_policy::DROP_OLDEST));
+    CHECK(forward(queue, 2, "b", overflow_policy::DROP_OLDEST));
+    CHECK(forward(queue, 3, "c", overflow_policy::DROP_OLDEST));
+    CHECK(queue.queued_messages() == MAX_MESSAGES);
+    CHECK(drain(queue) == std::vector<int>({ 2, 3 }));
+}
+
+// a started message can not be dropped, the one after it goes instead
+void drop_oldest_started() {
+    int wakes = 0;
+    outbound_queue queue = make_queue(wakes);
+    CHECK(forward(queue, 1, "a", overflow_policy::DROP_OLDEST));
+    CHECK(forward(queue, 2, "b", overflow_policy::DROP_OLDEST));
+    packet_type type;
+    const shared_bytes first = queue.next_chunk(type);
+    CHECK(first && (*first)[2] == 1);
+    CHECK(forward(queue, 3, "c", overflow_policy::DROP_OLDEST));
+    queue.on_written(first->size());
+    CHECK(drain(queue) == std::vector<int>({ 3 }));
+}
+
+void conflate() {
+    int wakes = 0;
+    outbound_queue queue = make_queue(wakes);
+    CHECK(forward(queue, 1, "a", overflow_policy::CONFLATE));
+    CHECK(forward(queue, 2, "b", overflow_policy::CONFLATE));
+    // same topic as the first: it takes its place
+    CHECK(forward(queue, 3, "a", overflow_policy::CONFLATE));
+    // no queued message of its topic: the oldest goes
+    CHECK(forward(queue, 4, "c", overflow_policy::CONFLATE));
+    CHECK(drain(queue) == std::vector<int>({ 2, 4 }));
+}
+
+void disconnect() {
+    int wakes = 0;
+    outbound_queue queue = make_queue(wakes);
+    CHECK(forward(queue, 1, "a", overflow_policy::DISCONNECT));
+    CHECK(forward(queue, 2, "b", overflow_policy::DISCONNECT));
+    CHECK(!forward(queue, 3, "c", overflow_policy::DISCONNECT));
+    // our own responses are not forwarded messages, they are dropped too once
+    // the DISCONNECT is queued
+    queue.push(make_packet(9));
+    CHECK(!forward(queue, 4, "d", overflow_policy::DROP_NEWEST));
+
+    packet_type type;
+    const shared_bytes chunk = queue.next_chunk(type);
+    CHECK(chunk && type == packet_type::DISCONNECT);
+    // QUOTA_EXCEEDED
+    CHECK(chunk && chunk->size() >= 3 && (*chunk)[2] == 0x97);
+    queue.on_written(chunk ? chunk->size() : 0);
+    CHECK(!queue.next_chunk(type));
+}
+
+} // namespace
+
+int main() {
+    drop_newest();
+    drop_oldest();
+    drop_oldest_started();
+    conflate();
+    disconnect();
+    return test::result();
+}
@@ -0,0 +1,123 @@
+// The token buckets of lmqtt_rate_limit.h, on a clock we move by hand: the burst
+// goes through, the rate is what is left after it, an idle bucket refills.
+#include "lmqtt.h"
+#include "check.h"
+
+namespace {
+
+using namespace std::chrono_literals;
+using lmqtt::rate::clock;
+using lmqtt::rate::token_bucket;
+
+lmqtt::rate_limit make_limit(uint64_t perSecond, uint64_t burst) {
+    lmqtt::rate_limit limit;
+    limit._perSecond = perSecond;
+    limit._burst = burst;
+    return limit;
+}
+
+void disabled() {
+    token_bucket bucket;
+    const clock::time_point now = clock::now();
+    CHECK(!bucket.is_enabled());
+    for (int i = 0; i < 1000; ++i) {
+        bucket.charge(1000, now);
+    }
+    CHECK(bucket.conforms(now));
+    CHECK(bucket.get_wait(now) == clock::duration::zero());
+}
+
+void burst_then_rate() {
+    // 10 per second (one every 100 ms), 5 on top
+    token_bucket bucket(make_limit(10, 5));
+    const clock::time_point start = clock::now();
+    CHECK(bucket.is_enabled());
+    CHECK(bucket.is_full(start));
+
+    // the burst, and the token of the current interval
+    int taken = 0;
+    while (bucket.conforms(start) && taken < 100) {
+        bucket.charge(1, start);
+        ++taken;
+    }
+    CHECK(taken == 6);
+    CHECK(bucket.get_wait(start) == 100ms);
+    CHECK(!bucket.is_full(start));
+
+    // then one every 100 ms
+    CHECK(!bucket.conforms(start + 99ms));
+    CHECK(bucket.conforms(start + 100ms));
+    bucket.charge(1, start + 100ms);
+    CHECK(!bucket.conforms(start + 150ms));
+    CHECK(bucket.get_wait(start + 150ms) == 50ms);
+
+    // idle long enough, it is full again
+    CHECK(bucket.is_full(start + 700ms));
+    CHECK(bucket.conforms(start + 700ms));
+}
+
+// a charge can be bigger than what is left, the bucket then owes it
+void debt() {
+    // 1000 bytes per second, 1000 on top
+    token_bucket bucket(make_limit(1000, 1000));
+    const clock::time_point start = clock::now();
+    CHECK(bucket.conforms(start));
+    bucket.charge(5000, start);
+    CHECK(!bucket.conforms(start));
+    CHECK(bucket.get_wait(start) == 4s);
+    CHECK(bucket.conforms(start + 4s));
+}
+
+// the client's buckets and the listener's: the slowest one decides
+void limiter() {
+    lmqtt::listener_limits limits;
+    limits._clientPublishes = make_limit(100, 0);
+    limits._listenerBytes = make_limit(1000, 0);
+    lmqtt::rate::listener_quota quota(limits);
+    lmqtt::rate::publish_limiter first(limits, &quota);
+    lmqtt::rate::publish_limiter second(limits, &quota);
+    CHECK(first.is_enabled());
+
+    const clock::time_point start = clock::now();
+    first.charge(500, start);
+    // 10 ms for the client's publishes, 500 ms for the listener's bytes
+    CHECK(first.get_wait(start) == 500ms);
+    // the other client did not publish, but shares the listener's bytes
+    CHECK(!second.is_listener_conforming(start));
+    CHECK(second.get_wait(start) == 500ms);
+    CHECK(second.is_listener_conforming(start + 500ms));
+}
+
+void sources() {
+    // one connection per second and address, 2 on top
+    lmqtt::rate::source_limiter limiter(make_limit(1, 2));
+    const asio::ip::address first = asio::ip::make_address("192.0.2.1");
+    const asio::ip::address second = asio::ip::make_address("2001:db8::1");
+    const clock::time_point start = clock::now();
+
+    int admitted = 0;
+    for (int i = 0; i < 10; ++i) {
+        admitted += limiter.admit(first, start) ? 1 : 0;
+    }
+    CHECK(admitted == 3);
+    CHECK(limiter.admit(second, start));
+    CHECK(limiter.get_source_count() == 2);
+
+    // the v4 mapped form of an address is the same source
+    CHECK(!limiter.admit(asio::ip::make_address("::ffff:192.0.2.1"), start));
+
+    // refilled buckets are forgotten
+    CHECK(limiter.admit(second, start + 10s));
+    CHECK(limiter.get_source_count() == 1);
+}
+
+} // namespace
+
+int main() {
+    disabled();
+    burst_then_rate();
+    debt();
+    limiter();
+    sources();
+    return test::result();
+}
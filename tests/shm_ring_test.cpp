@@ -0,0 +1,127 @@
+// A client region (shm::channel::create) attached by the broker side, with
+// bytes going both ways across the end of the rings many times over.
+#include <fcntl.h>
+#include <vector>
+#include "lmqtt.h"
+#include "check.h"
+
+#if defined(LMQTT_HAS_SHM_TRANSPORT)
+
+namespace {
+
+using lmqtt::return_code;
+using lmqtt::shm::channel;
+using lmqtt::shm::side;
+
+// attach() takes the descriptors it is given
+int duplicate(int fd) {
+    return ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+// what position i of a stream holds
+uint8_t pattern(uint64_t position) {
+    return static_cast<uint8_t>(position * 7 + (position >> 8));
+}
+
+// writes total bytes by pieces of chunk from one side, reads them on the other
+// one as they come, each read smaller than the writes so the positions drift
+void transfer(channel& writer, channel& reader, uint64_t total, size_t chunk) {
+    std::vector<uint8_t> out(chunk);
+    std::vector<uint8_t> in(chunk / 2 + 1);
+    uint64_t written = 0;
+    uint64_t read = 0;
+    bool intact = true;
+    while (read < total) {
+        if (written < total && writer.writable()) {
+            const size_t size = static_cast<size_t>(std::min<uint64_t>(chunk, total - written));
+            for (size_t i = 0; i < size; ++i) {
+                out[i] = pattern(written + i);
+            }
+            written += writer.write(out.data(), size);
+        }
+        const size_t size = reader.read(in.data(), in.size());
+        for (size_t i = 0; i < size; ++i) {
+            intact = intact && (in[i] == pattern(read + i));
+        }
+        read += size;
+        // nothing in flight and no room to write: the ring lost track, do not spin
+        if (!size && written == read && written < total && !writer.writable()) {
+            break;
+        }
+    }
+    CHECK(written == total);
+    CHECK(read == total);
+    CHECK(intact);
+    CHECK(!reader.readable());
+}
+
+void wraparound() {
+    channel client;
+    CHECK(client.create(lmqtt::shm::MIN_RING_SIZE) == return_code::OK);
+    CHECK(client.get_side() == side::CLIENT);
+
+    channel broker;
+    CHECK(broker.attach(
+        duplicate(client.get_memfd()),
+        duplicate(client.get_event_fd(side::BROKER)),
+        duplicate(client.get_event_fd(side::CLIENT))
+    ) == return_code::OK);
+    CHECK(broker.get_side() == side::BROKER);
+    CHECK(broker.is_mapped());
+
+    // an odd chunk size never lines up with the end of the ring
+    const uint64_t total = lmqtt::shm::MIN_RING_SIZE * 10 + 123;
+    transfer(client, broker, total, 1000);
+    transfer(broker, client, total, 1000);
+
+    // written in place, the reservation can not cross the end of the ring
+    CHECK(client.writable() == lmqtt::shm::MIN_RING_SIZE);
+    const size_t beforeEnd = lmqtt::shm::MIN_RING_SIZE - static_cast<size_t>(total % lmqtt::shm::MIN_RING_SIZE);
+    CHECK(client.reserve(beforeEnd + 1) == nullptr);
+    uint8_t* place = client.reserve(beforeEnd);
+    CHECK(place != nullptr);
+    if (place) {
+        std::memset(place, 0xAB, beforeEnd);
+        client.commit(beforeEnd);
+    }
+    CHECK(broker.readable() == beforeEnd);
+
+    // the client stops writing: the broker reads what is left, then sees it
+    client.close_write();
+    CHECK(broker.is_peer_closed());
+    std::vector<uint8_t> rest(beforeEnd);
+    CHECK(broker.read(rest.data(), rest.size()) == beforeEnd);
+    CHECK(rest == std::vector<uint8_t>(beforeEnd, 0xAB));
+}
+
+// a region that could still be shrunk under the broker is refused
+void unsealed() {
+    channel client;
+    CHECK(client.create(lmqtt::shm::MIN_RING_SIZE) == return_code::OK);
+    const int memfd = ::memfd_create("lmqtt_test", MFD_CLOEXEC);
+    CHECK(memfd >= 0 && ::ftruncate(memfd, lmqtt::shm::HEADER_SIZE + 2 * lmqtt::shm::MIN_RING_SIZE) == 0);
+    channel broker;
+    CHECK(broker.attach(
+        memfd,
+        duplicate(client.get_event_fd(side::BROKER)),
+        duplicate(client.get_event_fd(side::CLIENT))
+    ) != return_code::OK);
+    CHECK(!broker.is_mapped());
+}
+
+} // namespace
+
+int main() {
+    wraparound();
+    unsealed();
+    return test::result();
+}
+
+#else
+
+int main() {
+    std::fprintf(stderr, "no shared memory transport on this platform\n");
+    return 0;
+}
+
+#endif
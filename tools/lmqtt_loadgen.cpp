@@ -0,0 +1,1064 @@
+// MQTT v5 load generator, built on the broker's own codec (variable byte integers,
+// streamed PUBLISH decoding) and latency histograms.
+//
+//   connect : connection storm. Opens --connections connections at --connect-rate per
+//             second (0: as fast as possible), measures TCP connect -> CONNACK and
+//             holds them open for --hold seconds.
+//   publish : --subscribers subscribe (a --wildcards fraction of them with '+' or '#'
+//             filters), then --publishers publish --rate messages per second each, of
+//             --size bytes at --qos, for --duration seconds. Each payload starts with
+//             the time it was sent, so subscribers measure the end to end latency.
+//
+// Connections are spread over --threads io threads. Past ~28k connections to a
+// single port the ephemeral ports run out, --source-ips N binds the clients to
+// 127.0.0.1 ... 127.0.0.N (loopback only) to go further.
+//
+// Results go to stdout (or --json <file>) as JSON, progress to stderr.
+//
+// usage: lmqtt_loadgen <connect|publish> [--option value]...
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+#include "lmqtt_common.h"
+#include "lmqtt_utils.h"
+#include "lmqtt_stream_decoder.h"
+#include "lmqtt_histogram.h"
+
+namespace {
+
+using asio::ip::tcp;
+using lmqtt::packet_type;
+using lmqtt::reason_code;
+using lmqtt::return_code;
+
+enum class mode : uint8_t {
+    CONNECT,
+    PUBLISH
+};
+
+struct options {
+    mode _mode = mode::CONNECT;
+    std::string _host = "127.0.0.1";
+    uint16_t _port = 1883;
+    size_t _threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t _sourceIps = 1;
+    double _connectTimeout = 60;
+
+    // connect
+    size_t _connections = 1000;
+    double _connectRate = 0;
+    double _hold = 0;
+
+    // publish
+    size_t _publishers = 1;
+    size_t _subscribers = 1;
+    size_t _topics = 1;
+    double _wildcards = 0;
+    double _rate = 1000;
+    size_t _size = 64;
+    uint8_t _qos = 0;
+    double _duration = 10;
+
+    std::string _json;
+};
+
+[[nodiscard]] uint64_t now_ns() noexcept {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// ---- client packets
+
+void append_u16(std::vector<uint8_t>& out, uint16_t value) {
+    out.push_back(static_cast<uint8_t>(value >> 8));
+    out.push_back(static_cast<uint8_t>(value & 0xFF));
+}
+
+void append_string(std::vector<uint8_t>& out, std::string_view str) {
+    append_u16(out, static_cast<uint16_t>(str.size()));
+    out.insert(out.end(), str.begin(), str.end());
+}
+
+// control field, remaining length, then the body
+void append_packet(std::vector<uint8_t>& out, uint8_t controlField, const std::vector<uint8_t>& body) {
+    out.push_back(controlField);
+    uint8_t buff[4];
+    uint8_t size = 0;
+    (void)lmqtt::utils::encode_variable_int(buff, 4, static_cast<uint32_t>(body.size()), size);
+    out.insert(out.end(), buff, buff + size);
+    out.insert(out.end(), body.begin(), body.end());
+}
+
+std::vector<uint8_t> make_connect_packet(std::string_view clientId) {
+    std::vector<uint8_t> body;
+    append_string(body, "MQTT");
+    body.push_back(0x05);                   // protocol version
+    body.push_back(0x02);                   // clean start
+    append_u16(body, 0);                    // no keep alive
+    body.push_back(0x00);                   // no properties
+    append_string(body, clientId);
+    std::vector<uint8_t> packet;
+    append_packet(packet, 0x10, body);
+    return packet;
+}
+
+std::vector<uint8_t> make_subscribe_packet(std::string_view filter, uint8_t qos) {
+    std::vector<uint8_t> body;
+    append_u16(body, 1);                    // packet id
+    body.push_back(0x00);                   // no properties
+    append_string(body, filter);
+    body.push_back(qos);                    // subscription options
+    std::vector<uint8_t> packet;
+    append_packet(packet, 0x82, body);
+    return packet;
+}
+
+// PUBLISH with room for the packet id (if QoS > 0) and the send time, both patched
+// for each message. The payload starts with the send time (ns, steady clock)
+struct publish_template {
+    std::vector<uint8_t> _bytes;
+    size_t _packetIdOffset = 0;
+    size_t _timestampOffset = 0;
+};
+
+publish_template make_publish_template(std::string_view topic, uint8_t qos, size_t payloadSize) {
+    std::vector<uint8_t> body;
+    append_string(body, topic);
+    size_t packetIdOffset = 0;
+    if (qos) {
+        packetIdOffset = body.size();
+        append_u16(body, 0);
+    }
+    body.push_back(0x00);                   // no properties
+    const size_t timestampOffset = body.size();
+    body.resize(body.size() + std::max<size_t>(payloadSize, sizeof(uint64_t)), 'x');
+
+    publish_template result;
+    append_packet(result._bytes, static_cast<uint8_t>(0x30 | (qos << 1)), body);
+    const size_t headerSize = result._bytes.size() - body.size();
+    result._packetIdOffset = headerSize + packetIdOffset;
+    result._timestampOffset = headerSize + timestampOffset;
+    return result;
+}
+
+void append_ack(std::vector<uint8_t>& out, uint8_t controlField, uint16_t packetId) {
+    out.push_back(controlField);
+    out.push_back(0x02);
+    append_u16(out, packetId);
+}
+
+const std::vector<uint8_t> DISCONNECT_PACKET{ 0xe0, 0x00 };
+
+// ---- workers
+
+class client;
+
+// counters are read by the main thread while the workers run
+struct worker_stats {
+    std::atomic<uint64_t> _connectAttempts{ 0 };
+    std::atomic<uint64_t> _connected{ 0 };
+    std::atomic<uint64_t> _connectFailed{ 0 };
+    std::atomic<uint64_t> _subscribed{ 0 };
+    std::atomic<uint64_t> _subscribeFailed{ 0 };
+    std::atomic<uint64_t> _published{ 0 };
+    std::atomic<uint64_t> _publishSkipped{ 0 };
+    std::atomic<uint64_t> _acked{ 0 };
+    std::atomic<uint64_t> _received{ 0 };
+    std::atomic<uint64_t> _dropped{ 0 };
+
+    // values in ns, only written by the worker thread
+    lmqtt::latency::histogram _connectLatency;
+    lmqtt::latency::histogram _endToEndLatency;
+    lmqtt::latency::histogram _ackLatency;
+};
+
+static void add(std::atomic<uint64_t>& counter, uint64_t value = 1) noexcept {
+    counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+// what a connection will do, decided before the run
+struct client_spec {
+    enum class role : uint8_t {
+        IDLE,
+        SUBSCRIBER,
+        PUBLISHER
+    };
+    role _role = role::IDLE;
+    uint32_t _index = 0;
+    // topic filter of a subscriber, topic of a publisher
+    std::string _topic;
+    size_t _sourceIp = 0;
+};
+
+class worker {
+public:
+    // connections still waiting for their CONNACK, so a connect storm does not
+    // overflow the listen backlog when it is not rate limited
+    static constexpr size_t MAX_PENDING_CONNECTS = 512;
+    static constexpr auto TICK = std::chrono::milliseconds(1);
+
+    worker(size_t id, const options& opts, tcp::endpoint server, std::vector<asio::ip::address> sourceIps) :
+        _id(id), _options(opts), _server(server), _sourceIps(std::move(sourceIps)), _timer(_context) {}
+
+    void add_spec(client_spec spec) {
+        _specs.emplace_back(std::move(spec));
+    }
+
+    [[nodiscard]] size_t spec_count() const noexcept {
+        return _specs.size();
+    }
+
+    void start(double connectRate) {
+        _connectRate = connectRate;
+        _lastTick = now_ns();
+        schedule_tick();
+        _thread = std::thread([this]() { _context.run(); });
+    }
+
+    void start_publishing() {
+        asio::post(_context, [this]() {
+            _publishing = true;
+            _lastPublish = now_ns();
+        });
+    }
+
+    void stop_publishing() {
+        asio::post(_context, [this]() { _publishing = false; });
+    }
+
+    void disconnect_all();
+
+    void stop() {
+        _context.stop();
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+    }
+
+    [[nodiscard]] worker_stats& stats() noexcept {
+        return _stats;
+    }
+
+    [[nodiscard]] const options& get_options() const noexcept {
+        return _options;
+    }
+
+    [[nodiscard]] asio::io_context& context() noexcept {
+        return _context;
+    }
+
+    [[nodiscard]] size_t id() const noexcept {
+        return _id;
+    }
+
+    void on_connack() {
+        --_pendingConnects;
+    }
+
+    void on_connect_failed() {
+        --_pendingConnects;
+    }
+
+    // per publisher, once the run is over: its topic and what it published
+    template <typename Fn>
+    void for_each_publisher(Fn&& fn) const;
+
+private:
+    void schedule_tick() {
+        _timer.expires_after(TICK);
+        _timer.async_wait([this](std::error_code ec) {
+            if (ec) {
+                return;
+            }
+            tick();
+            schedule_tick();
+        });
+    }
+
+    void tick();
+
+    size_t _id;
+    options _options;
+    tcp::endpoint _server;
+    std::vector<asio::ip::address> _sourceIps;
+    asio::io_context _context;
+    asio::steady_timer _timer;
+    std::thread _thread;
+
+    std::vector<client_spec> _specs;
+    size_t _nextSpec = 0;
+    std::vector<std::shared_ptr<client>> _clients;
+    std::vector<std::shared_ptr<client>> _publishers;
+
+    double _connectRate = 0;
+    double _connectCredit = 0;
+    size_t _pendingConnects = 0;
+    uint64_t _lastTick = 0;
+
+    bool _publishing = false;
+    uint64_t _lastPublish = 0;
+
+    worker_stats _stats;
+};
+
+class client : public std::enable_shared_from_this<client> {
+public:
+    // QoS 1 and 2 messages waiting for their acknowledgement, per publisher
+    static constexpr uint32_t MAX_INFLIGHT = 1024;
+    // packet ids go around a multiple of MAX_INFLIGHT, so ids in flight never share a slot
+    static constexpr uint32_t PACKET_ID_CYCLE = (0xFFFF / MAX_INFLIGHT) * MAX_INFLIGHT;
+    // past this much unsent data the publisher skips messages instead of buffering them
+    static constexpr size_t MAX_PENDING_BYTES = 1 << 20;
+
+    client(worker& owner, client_spec spec) :
+        _worker(owner), _spec(std::move(spec)), _socket(owner.context()), _sink(*this) {
+        if (_spec._role == client_spec::role::PUBLISHER) {
+            const options& opts = _worker.get_options();
+            _publish = make_publish_template(_spec._topic, opts._qos, opts._size);
+            if (opts._qos) {
+                _inflightSendTime.resize(MAX_INFLIGHT);
+            }
+        }
+    }
+
+    void start(const tcp::endpoint& server, const asio::ip::address* source) {
+        add(_worker.stats()._connectAttempts);
+        _connectStart = now_ns();
+        std::error_code ec;
+        _socket.open(server.protocol(), ec);
+        if (!ec && source) {
+            _socket.bind(tcp::endpoint(*source, 0), ec);
+        }
+        if (ec) {
+            close();
+            return;
+        }
+        _socket.async_connect(server, [self = shared_from_this()](std::error_code ec) {
+            if (ec) {
+                self->close();
+                return;
+            }
+            std::error_code ignored;
+            self->_socket.set_option(tcp::no_delay(true), ignored);
+            const std::string clientId = "lmqtt-lg-" + std::to_string(self->_worker.id()) + "-" + std::to_string(self->_spec._index);
+            self->send(make_connect_packet(clientId));
+            self->read();
+        });
+    }
+
+    [[nodiscard]] bool is_ready() const noexcept {
+        return _ready && _socket.is_open();
+    }
+
+    [[nodiscard]] const client_spec& spec() const noexcept {
+        return _spec;
+    }
+
+    [[nodiscard]] uint64_t published() const noexcept {
+        return _published;
+    }
+
+    void publish() {
+        if (!is_ready()) {
+            return;
+        }
+        const uint8_t qos = _worker.get_options()._qos;
+        if ((qos && _inflight == MAX_INFLIGHT) || _outBuffer.size() > MAX_PENDING_BYTES) {
+            add(_worker.stats()._publishSkipped);
+            return;
+        }
+
+        const size_t start = _outBuffer.size();
+        _outBuffer.insert(_outBuffer.end(), _publish._bytes.begin(), _publish._bytes.end());
+        const uint64_t sendTime = now_ns();
+        std::memcpy(_outBuffer.data() + start + _publish._timestampOffset, &sendTime, sizeof(sendTime));
+        if (qos) {
+            const uint16_t packetId = static_cast<uint16_t>(_sequence++ % PACKET_ID_CYCLE + 1);
+            _outBuffer[start + _publish._packetIdOffset] = static_cast<uint8_t>(packetId >> 8);
+            _outBuffer[start + _publish._packetIdOffset + 1] = static_cast<uint8_t>(packetId & 0xFF);
+            _inflightSendTime[(packetId - 1) % MAX_INFLIGHT] = sendTime;
+            ++_inflight;
+        }
+        ++_published;
+        add(_worker.stats()._published);
+        flush();
+    }
+
+    void disconnect() {
+        if (!_socket.is_open()) {
+            return;
+        }
+        _ready = false;
+        _closing = true;
+        send(DISCONNECT_PACKET);
+    }
+
+private:
+    // hands the first 8 payload bytes (the send time) to the client
+    class timestamp_sink : public lmqtt::publish_sink {
+    public:
+        explicit timestamp_sink(client& owner) :
+            _owner(owner) {}
+
+        void on_publish_begin(const lmqtt::publish_header& header) override {
+            _qos = header._qos;
+            _packetId = header._packetId;
+            _size = 0;
+        }
+
+        void on_payload_chunk(const uint8_t* data, uint32_t size) override {
+            const uint32_t toCopy = std::min<uint32_t>(size, sizeof(_timestamp) - _size);
+            std::memcpy(_timestamp + _size, data, toCopy);
+            _size += toCopy;
+        }
+
+        void on_publish_end() override {
+            _owner.on_message(_size == sizeof(_timestamp) ? _timestamp : nullptr, _qos, _packetId);
+        }
+
+    private:
+        client& _owner;
+        uint8_t _timestamp[sizeof(uint64_t)];
+        uint32_t _size = 0;
+        uint8_t _qos = 0;
+        uint16_t _packetId = 0;
+    };
+
+    // fixed header, then the body: PUBLISH bodies go through the stream decoder,
+    // the others are small and buffered
+    enum class read_state : uint8_t {
+        FIXED_HEADER,
+        BODY
+    };
+
+    void close() {
+        if (_closed) {
+            return;
+        }
+        _closed = true;
+        std::error_code ignored;
+        _socket.close(ignored);
+        if (_ready && !_closing) {
+            // the broker let go of a working connection
+            add(_worker.stats()._dropped);
+        }
+        _ready = false;
+        if (!_connacked) {
+            // never got there, the connect storm moves on
+            _connacked = true;
+            add(_worker.stats()._connectFailed);
+            _worker.on_connect_failed();
+        }
+    }
+
+    void send(const std::vector<uint8_t>& bytes) {
+        _outBuffer.insert(_outBuffer.end(), bytes.begin(), bytes.end());
+        flush();
+    }
+
+    // one write at a time, what is queued meanwhile goes in the next one
+    void flush() {
+        if (_writing || _outBuffer.empty() || !_socket.is_open()) {
+            return;
+        }
+        _writing = true;
+        _writeBuffer.swap(_outBuffer);
+        _outBuffer.clear();
+        asio::async_write(
+            _socket,
+            asio::buffer(_writeBuffer),
+            [self = shared_from_this()](std::error_code ec, size_t /*length*/) {
+                self->_writing = false;
+                if (ec) {
+                    self->close();
+                    return;
+                }
+                if (self->_closing && self->_outBuffer.empty()) {
+                    // the DISCONNECT is out
+                    std::error_code ignored;
+                    self->_socket.shutdown(tcp::socket::shutdown_send, ignored);
+                    return;
+                }
+                self->flush();
+            }
+        );
+    }
+
+    void read() {
+        _socket.async_read_some(
+            asio::buffer(_readBuffer),
+            [self = shared_from_this()](std::error_code ec, size_t length) {
+                if (ec) {
+                    self->close();
+                    return;
+                }
+                if (!self->parse(self->_readBuffer.data(), static_cast<uint32_t>(length))) {
+                    self->close();
+                    return;
+                }
+                self->read();
+            }
+        );
+    }
+
+    [[nodiscard]] bool parse(const uint8_t* data, uint32_t size) {
+        uint32_t pos = 0;
+        while (pos < size) {
+            if (_readState == read_state::FIXED_HEADER) {
+                const uint8_t byte = data[pos++];
+                if (!_headerSize) {
+                    _controlField = byte;
+                    _remainingLength = 0;
+                    _multiplier = 1;
+                    _headerSize = 1;
+                    continue;
+                }
+                _remainingLength += (byte & 0x7f) * _multiplier;
+                _multiplier *= 0x80;
+                if (++_headerSize > 5) {
+                    return false;
+                }
+                if (byte & 0x80) {
+                    continue;
+                }
+                _headerSize = 0;
+                _readState = read_state::BODY;
+                _bodyLeft = _remainingLength;
+                _body.clear();
+                if (static_cast<packet_type>(_controlField >> 4) == packet_type::PUBLISH) {
+                    _decoder.reset(_controlField & 0xf, _remainingLength, &_sink);
+                }
+                if (!_bodyLeft && !on_packet()) {
+                    return false;
+                }
+                continue;
+            }
+
+            const uint32_t available = std::min(size - pos, _bodyLeft);
+            if (static_cast<packet_type>(_controlField >> 4) == packet_type::PUBLISH) {
+                uint32_t consumed = 0;
+                if (_decoder.feed(data + pos, available, consumed) != reason_code::SUCCESS) {
+                    return false;
+                }
+                pos += consumed;
+                _bodyLeft -= consumed;
+            } else {
+                if (_body.size() + available > lmqtt::publish_stream_decoder::VARIABLE_HEADER_LIMIT) {
+                    return false;
+                }
+                _body.insert(_body.end(), data + pos, data + pos + available);
+                pos += available;
+                _bodyLeft -= available;
+            }
+            if (!_bodyLeft && !on_packet()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // a whole packet was read, PUBLISH packets were already handled by the sink
+    [[nodiscard]] bool on_packet() {
+        _readState = read_state::FIXED_HEADER;
+        worker_stats& stats = _worker.stats();
+        switch (static_cast<packet_type>(_controlField >> 4)) {
+        case packet_type::CONNACK:
+        {
+            if (_body.size() < 2 || _connacked) {
+                return false;
+            }
+            _connacked = true;
+            _worker.on_connack();
+            if (_body[1] >= 0x80) {
+                add(stats._connectFailed);
+                return false;
+            }
+            add(stats._connected);
+            stats._connectLatency.record(now_ns() - _connectStart);
+            if (_spec._role == client_spec::role::SUBSCRIBER) {
+                send(make_subscribe_packet(_spec._topic, _worker.get_options()._qos));
+            } else {
+                _ready = true;
+            }
+            return true;
+        }
+        case packet_type::SUBACK:
+        {
+            // packet id, properties, one reason code
+            if (_body.size() < 4) {
+                return false;
+            }
+            uint32_t propertyLength = 0;
+            uint8_t varSize = 0;
+            if (lmqtt::utils::decode_variable_int(_body.data() + 2, propertyLength, varSize, static_cast<uint32_t>(_body.size() - 2)) != return_code::OK) {
+                return false;
+            }
+            const size_t codeOffset = 2 + varSize + 1 + propertyLength;
+            if (codeOffset >= _body.size() || _body[codeOffset] >= 0x80) {
+                add(stats._subscribeFailed);
+                return true;
+            }
+            add(stats._subscribed);
+            _ready = true;
+            return true;
+        }
+        case packet_type::PUBACK:
+        case packet_type::PUBCOMP:
+        {
+            if (_body.size() < 2 || !_inflight) {
+                return false;
+            }
+            const uint16_t packetId = (_body[0] << 8) | _body[1];
+            stats._ackLatency.record(now_ns() - _inflightSendTime[(packetId - 1) % MAX_INFLIGHT]);
+            add(stats._acked);
+            --_inflight;
+            return true;
+        }
+        case packet_type::PUBREC:
+        {
+            if (_body.size() < 2) {
+                return false;
+            }
+            std::vector<uint8_t> pubrel;
+            append_ack(pubrel, 0x62, (_body[0] << 8) | _body[1]);
+            send(pubrel);
+            return true;
+        }
+        case packet_type::PUBREL:
+        {
+            if (_body.size() < 2) {
+                return false;
+            }
+            std::vector<uint8_t> pubcomp;
+            append_ack(pubcomp, 0x70, (_body[0] << 8) | _body[1]);
+            send(pubcomp);
+            return true;
+        }
+        case packet_type::DISCONNECT:
+            return false;
+        default:
+            return true;
+        }
+    }
+
+    void on_message(const uint8_t* timestamp, uint8_t qos, uint16_t packetId) {
+        worker_stats& stats = _worker.stats();
+        add(stats._received);
+        if (timestamp) {
+            uint64_t sendTime = 0;
+            std::memcpy(&sendTime, timestamp, sizeof(sendTime));
+            const uint64_t now = now_ns();
+            if (now >= sendTime) {
+                stats._endToEndLatency.record(now - sendTime);
+            }
+        }
+        if (qos == 1) {
+            std::vector<uint8_t> puback;
+            append_ack(puback, 0x40, packetId);
+            send(puback);
+        } else if (qos == 2) {
+            std::vector<uint8_t> pubrec;
+            append_ack(pubrec, 0x50, packetId);
+            send(pubrec);
+        }
+    }
+
+    worker& _worker;
+    client_spec _spec;
+    tcp::socket _socket;
+
+    uint64_t _connectStart = 0;
+    bool _connacked = false;
+    bool _ready = false;
+    bool _closing = false;
+    bool _closed = false;
+
+    // writing
+    std::vector<uint8_t> _outBuffer;
+    std::vector<uint8_t> _writeBuffer;
+    bool _writing = false;
+
+    // reading
+    std::array<uint8_t, 16384> _readBuffer;
+    read_state _readState = read_state::FIXED_HEADER;
+    uint8_t _controlField = 0;
+    uint32_t _headerSize = 0;
+    uint32_t _remainingLength = 0;
+    uint32_t _multiplier = 1;
+    uint32_t _bodyLeft = 0;
+    std::vector<uint8_t> _body;
+    lmqtt::publish_stream_decoder _decoder;
+    timestamp_sink _sink;
+
+    // publishing
+    publish_template _publish;
+    uint64_t _sequence = 0;
+    uint64_t _published = 0;
+    uint32_t _inflight = 0;
+    std::vector<uint64_t> _inflightSendTime;
+};
+
+void worker::tick() {
+    const uint64_t now = now_ns();
+    const double elapsed = static_cast<double>(now - _lastTick) / 1e9;
+    _lastTick = now;
+
+    // connect storm, paced by the rate or by the pending connects
+    if (_nextSpec < _specs.size()) {
+        size_t toStart = _specs.size() - _nextSpec;
+        if (_connectRate > 0) {
+            _connectCredit = std::min(_connectCredit + _connectRate * elapsed, static_cast<double>(toStart));
+            toStart = static_cast<size_t>(_connectCredit);
+            _connectCredit -= static_cast<double>(toStart);
+        }
+        toStart = std::min(toStart, MAX_PENDING_CONNECTS - std::min(MAX_PENDING_CONNECTS, _pendingConnects));
+        for (size_t i = 0; i < toStart; ++i) {
+            client_spec& spec = _specs[_nextSpec++];
+            auto c = std::make_shared<client>(*this, spec);
+            const asio::ip::address* source = _sourceIps.empty() ? nullptr : &_sourceIps[spec._sourceIp % _sourceIps.size()];
+            ++_pendingConnects;
+            c->start(_server, source);
+            if (spec._role == client_spec::role::PUBLISHER) {
+                _publishers.push_back(c);
+            }
+            _clients.emplace_back(std::move(c));
+        }
+    }
+
+    if (_publishing) {
+        // every publisher gets its share of the time since the last batch
+        const double publishElapsed = static_cast<double>(now - _lastPublish) / 1e9;
+        const double credit = _options._rate * publishElapsed;
+        const uint64_t toPublish = static_cast<uint64_t>(credit);
+        if (toPublish) {
+            // keep the fraction for the next tick
+            _lastPublish += static_cast<uint64_t>(static_cast<double>(toPublish) / _options._rate * 1e9);
+            for (auto& publisher : _publishers) {
+                for (uint64_t i = 0; i < toPublish; ++i) {
+                    publisher->publish();
+                }
+            }
+        }
+    }
+}
+
+void worker::disconnect_all() {
+    asio::post(_context, [this]() {
+        _publishing = false;
+        for (auto& c : _clients) {
+            c->disconnect();
+        }
+    });
+}
+
+template <typename Fn>
+void worker::for_each_publisher(Fn&& fn) const {
+    for (const auto& publisher : _publishers) {
+        fn(publisher->spec(), publisher->published());
+    }
+}
+
+// ---- results
+
+struct latency_result {
+    uint64_t _count = 0;
+    double _p50 = 0;
+    double _p90 = 0;
+    double _p99 = 0;
+    double _p999 = 0;
+    double _max = 0;
+    double _mean = 0;
+};
+
+// merges one histogram of every worker, values in us
+latency_result merge(std::vector<std::unique_ptr<worker>>& workers, lmqtt::latency::histogram worker_stats::* member) {
+    using lmqtt::latency::histogram;
+    std::vector<uint64_t> counts(histogram::BUCKET_COUNT, 0);
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    for (auto& w : workers) {
+        (w->stats().*member).merge_into(counts.data(), sum, max);
+    }
+    latency_result result;
+    for (uint64_t count : counts) {
+        result._count += count;
+    }
+    if (!result._count) {
+        return result;
+    }
+    auto percentile = [&](double p) {
+        return static_cast<double>(histogram::get_percentile(counts.data(), result._count, max, p)) / 1e3;
+    };
+    result._p50 = percentile(0.5);
+    result._p90 = percentile(0.9);
+    result._p99 = percentile(0.99);
+    result._p999 = percentile(0.999);
+    result._max = static_cast<double>(max) / 1e3;
+    result._mean = static_cast<double>(sum) / static_cast<double>(result._count) / 1e3;
+    return result;
+}
+
+uint64_t total(std::vector<std::unique_ptr<worker>>& workers, std::atomic<uint64_t> worker_stats::* member) {
+    uint64_t result = 0;
+    for (auto& w : workers) {
+        result += (w->stats().*member).load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+void write_latency(std::FILE* out, const char* name, const latency_result& r, bool last) {
+    std::fprintf(out,
+        "  \"%s\": { \"count\": %llu, \"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f }%s\n",
+        name, static_cast<unsigned long long>(r._count), r._mean, r._p50, r._p90, r._p99, r._p999, r._max, last ? "" : ",");
+}
+
+// ---- options
+
+[[nodiscard]] bool parse_options(int argc, char** argv, options& opts) {
+    if (argc < 2) {
+        return false;
+    }
+    const std::string_view modeName = argv[1];
+    if (modeName == "connect") {
+        opts._mode = mode::CONNECT;
+    } else if (modeName == "publish") {
+        opts._mode = mode::PUBLISH;
+    } else {
+        return false;
+    }
+
+    for (int i = 2; i + 1 < argc; i += 2) {
+        const std::string_view name = argv[i];
+        const std::string value = argv[i + 1];
+        if (name == "--host") opts._host = value;
+        else if (name == "--port") opts._port = static_cast<uint16_t>(std::stoul(value));
+        else if (name == "--threads") opts._threads = std::max<size_t>(1, std::stoul(value));
+        else if (name == "--source-ips") opts._sourceIps = std::clamp<size_t>(std::stoul(value), 1, 254);
+        else if (name == "--connect-timeout") opts._connectTimeout = std::stod(value);
+        else if (name == "--connections") opts._connections = std::stoul(value);
+        else if (name == "--connect-rate") opts._connectRate = std::stod(value);
+        else if (name == "--hold") opts._hold = std::stod(value);
+        else if (name == "--publishers") opts._publishers = std::stoul(value);
+        else if (name == "--subscribers") opts._subscribers = std::stoul(value);
+        else if (name == "--topics") opts._topics = std::max<size_t>(1, std::stoul(value));
+        else if (name == "--wildcards") opts._wildcards = std::clamp(std::stod(value), 0.0, 1.0);
+        else if (name == "--rate") opts._rate = std::stod(value);
+        else if (name == "--size") opts._size = std::stoul(value);
+        else if (name == "--qos") opts._qos = static_cast<uint8_t>(std::min<unsigned long>(2, std::stoul(value)));
+        else if (name == "--duration") opts._duration = std::stod(value);
+        else if (name == "--json") opts._json = value;
+        else return false;
+    }
+    return opts._rate > 0;
+}
+
+// hundreds of thousands of sockets need as many file descriptors
+void raise_fd_limit() {
+#ifdef __linux__
+    rlimit limit{};
+    if (!getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+}
+
+std::string get_topic(size_t index) {
+    return "bench/" + std::to_string(index) + "/data";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    options opts;
+    try {
+        if (!parse_options(argc, argv, opts)) {
+            std::fprintf(stderr,
+                "usage: %s <connect|publish> [--option value]...\n"
+                "  common : --host --port --threads --source-ips --connect-timeout --json\n"
+                "  connect: --connections --connect-rate --hold\n"
+                "  publish: --publishers --subscribers --topics --wildcards --rate --size --qos --duration\n",
+                argv[0]);
+            return 1;
+        }
+    } catch (std::exception& e) {
+        std::fprintf(stderr, "invalid option value: %s\n", e.what());
+        return 1;
+    }
+    raise_fd_limit();
+
+    const tcp::endpoint server(asio::ip::make_address(opts._host), opts._port);
+    std::vector<asio::ip::address> sourceIps;
+    if (opts._sourceIps > 1) {
+        for (size_t i = 1; i <= opts._sourceIps; ++i) {
+            sourceIps.emplace_back(asio::ip::address_v4(0x7F000000u | static_cast<uint32_t>(i)));
+        }
+    }
+
+    std::vector<std::unique_ptr<worker>> workers;
+    for (size_t i = 0; i < opts._threads; ++i) {
+        workers.emplace_back(std::make_unique<worker>(i, opts, server, sourceIps));
+    }
+
+    // subscribers first, so they are there when the publishers start
+    std::vector<client_spec> specs;
+    if (opts._mode == mode::CONNECT) {
+        for (size_t i = 0; i < opts._connections; ++i) {
+            specs.push_back({ client_spec::role::IDLE, static_cast<uint32_t>(i), "", i });
+        }
+    } else {
+        const size_t wildcardSubscribers = static_cast<size_t>(opts._wildcards * static_cast<double>(opts._subscribers));
+        for (size_t i = 0; i < opts._subscribers; ++i) {
+            std::string filter;
+            if (i < wildcardSubscribers) {
+                filter = (i % 2) ? "bench/#" : "bench/+/data";
+            } else {
+                filter = get_topic(i % opts._topics);
+            }
+            specs.push_back({ client_spec::role::SUBSCRIBER, static_cast<uint32_t>(i), std::move(filter), i });
+        }
+        for (size_t i = 0; i < opts._publishers; ++i) {
+            const size_t index = opts._subscribers + i;
+            specs.push_back({ client_spec::role::PUBLISHER, static_cast<uint32_t>(index), get_topic(i % opts._topics), index });
+        }
+    }
+    for (size_t i = 0; i < specs.size(); ++i) {
+        workers[i % workers.size()]->add_spec(std::move(specs[i]));
+    }
+    const uint64_t connectionCount = specs.size();
+
+    // connect (and subscribe), reporting progress every second
+    const uint64_t connectStart = now_ns();
+    for (auto& w : workers) {
+        w->start(opts._connectRate / static_cast<double>(workers.size()));
+    }
+    uint64_t connectEnd = connectStart;
+    for (;;) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        const uint64_t connected = total(workers, &worker_stats::_connected);
+        const uint64_t failed = total(workers, &worker_stats::_connectFailed);
+        const uint64_t subscribed = total(workers, &worker_stats::_subscribed) + total(workers, &worker_stats::_subscribeFailed);
+        connectEnd = now_ns();
+        const bool done = (connected + failed >= connectionCount) && (subscribed >= std::min<uint64_t>(connected, opts._mode == mode::PUBLISH ? opts._subscribers : 0));
+        const bool timedOut = static_cast<double>(connectEnd - connectStart) / 1e9 > opts._connectTimeout;
+        if (done || timedOut || ((connectEnd - connectStart) / 100000000) % 10 == 0) {
+            std::fprintf(stderr, "connected %llu / %llu, failed %llu, subscribed %llu\n",
+                static_cast<unsigned long long>(connected),
+                static_cast<unsigned long long>(connectionCount),
+                static_cast<unsigned long long>(failed),
+                static_cast<unsigned long long>(subscribed));
+        }
+        if (done || timedOut) {
+            break;
+        }
+    }
+    const double connectSeconds = static_cast<double>(connectEnd - connectStart) / 1e9;
+
+    double publishSeconds = 0;
+    if (opts._mode == mode::CONNECT) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(opts._hold));
+    } else {
+        const uint64_t publishStart = now_ns();
+        for (auto& w : workers) {
+            w->start_publishing();
+        }
+        for (double elapsed = 0; elapsed < opts._duration; elapsed += 1) {
+            std::this_thread::sleep_for(std::chrono::duration<double>(std::min(1.0, opts._duration - elapsed)));
+            std::fprintf(stderr, "published %llu, received %llu\n",
+                static_cast<unsigned long long>(total(workers, &worker_stats::_published)),
+                static_cast<unsigned long long>(total(workers, &worker_stats::_received)));
+        }
+        for (auto& w : workers) {
+            w->stop_publishing();
+        }
+        publishSeconds = static_cast<double>(now_ns() - publishStart) / 1e9;
+
+        // let what is on its way arrive
+        uint64_t received = total(workers, &worker_stats::_received);
+        for (int i = 0; i < 20; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            const uint64_t now = total(workers, &worker_stats::_received);
+            if (now == received) {
+                break;
+            }
+            received = now;
+        }
+    }
+
+    for (auto& w : workers) {
+        w->disconnect_all();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    for (auto& w : workers) {
+        w->stop();
+    }
+
+    // what the subscribers should have received: each message once per matching subscriber
+    uint64_t expected = 0;
+    if (opts._mode == mode::PUBLISH) {
+        const size_t wildcardSubscribers = static_cast<size_t>(opts._wildcards * static_cast<double>(opts._subscribers));
+        std::vector<uint64_t> subscribersPerTopic(opts._topics, wildcardSubscribers);
+        for (size_t i = wildcardSubscribers; i < opts._subscribers; ++i) {
+            ++subscribersPerTopic[i % opts._topics];
+        }
+        for (auto& w : workers) {
+            w->for_each_publisher([&](const client_spec& spec, uint64_t published) {
+                expected += published * subscribersPerTopic[(spec._index - opts._subscribers) % opts._topics];
+            });
+        }
+    }
+
+    std::FILE* out = opts._json.empty() ? stdout : std::fopen(opts._json.c_str(), "w");
+    if (!out) {
+        std::fprintf(stderr, "could not open %s\n", opts._json.c_str());
+        return 1;
+    }
+
+    const uint64_t connected = total(workers, &worker_stats::_connected);
+    const uint64_t published = total(workers, &worker_stats::_published);
+    const uint64_t received = total(workers, &worker_stats::_received);
+    std::fprintf(out, "{\n");
+    std::fprintf(out, "  \"mode\": \"%s\",\n", opts._mode == mode::CONNECT ? "connect" : "publish");
+    std::fprintf(out,
+        "  \"config\": { \"host\": \"%s\", \"port\": %u, \"threads\": %zu, \"source_ips\": %zu, \"connections\": %llu, \"connect_rate\": %.1f, "
+        "\"publishers\": %zu, \"subscribers\": %zu, \"topics\": %zu, \"wildcards\": %.3f, \"rate\": %.1f, \"size\": %zu, \"qos\": %u, \"duration\": %.1f },\n",
+        opts._host.c_str(), opts._port, opts._threads, opts._sourceIps, static_cast<unsigned long long>(connectionCount), opts._connectRate,
+        opts._mode == mode::PUBLISH ? opts._publishers : 0, opts._mode == mode::PUBLISH ? opts._subscribers : 0,
+        opts._topics, opts._wildcards, opts._rate, opts._size, opts._qos, opts._duration);
+    std::fprintf(out,
+        "  \"connections\": { \"attempted\": %llu, \"connected\": %llu, \"failed\": %llu, \"dropped\": %llu, \"seconds\": %.3f, \"per_second\": %.1f },\n",
+        static_cast<unsigned long long>(total(workers, &worker_stats::_connectAttempts)),
+        static_cast<unsigned long long>(connected),
+        static_cast<unsigned long long>(total(workers, &worker_stats::_connectFailed)),
+        static_cast<unsigned long long>(total(workers, &worker_stats::_dropped)),
+        connectSeconds,
+        connectSeconds > 0 ? static_cast<double>(connected) / connectSeconds : 0.0);
+    if (opts._mode == mode::PUBLISH) {
+        std::fprintf(out,
+            "  \"messages\": { \"published\": %llu, \"skipped\": %llu, \"acked\": %llu, \"received\": %llu, \"expected\": %llu, "
+            "\"seconds\": %.3f, \"published_per_second\": %.1f, \"received_per_second\": %.1f },\n",
+            static_cast<unsigned long long>(published),
+            static_cast<unsigned long long>(total(workers, &worker_stats::_publishSkipped)),
+            static_cast<unsigned long long>(total(workers, &worker_stats::_acked)),
+            static_cast<unsigned long long>(received),
+            static_cast<unsigned long long>(expected),
+            publishSeconds,
+            publishSeconds > 0 ? static_cast<double>(published) / publishSeconds : 0.0,
+            publishSeconds > 0 ? static_cast<double>(received) / publishSeconds : 0.0);
+    }
+    // latencies in us
+    write_latency(out, "connect_latency_us", merge(workers, &worker_stats::_connectLatency), false);
+    write_latency(out, "ack_latency_us", merge(workers, &worker_stats::_ackLatency), false);
+    write_latency(out, "end_to_end_latency_us", merge(workers, &worker_stats::_endToEndLatency), true);
+    std::fprintf(out, "}\n");
+    if (out != stdout) {
+        std::fclose(out);
+    }
+    return 0;
+}
@@ -0,0 +1,393 @@
+// Replays a capture file (see lmqtt_capture.h) against a broker: every captured
+// connection gets its own socket and sends exactly the bytes it sent originally,
+// in the same order and, unless told otherwise, at the same pace.
+//
+//   --speed X      X times the original pace (1 by default), 0 for as fast as possible:
+//                  each connection keeps its own order, not the order between them
+//                  (a SUBSCRIBE can then land after the PUBLISH it was meant for)
+//   --in-process   runs the broker in this process and feeds it through memory
+//                  streams (see lmqtt_server::connect_in_memory), so a fix can be
+//                  benchmarked against a capture without deploying anything, and
+//                  without the kernel's socket path in the numbers (--host and
+//                  --port are then ignored)
+//
+// What the broker sends back is read and thrown away. The results (bytes, time it
+// took, how late records were sent compared to the schedule) go to stdout, or
+// --json <file>, as JSON.
+//
+// usage: lmqtt_replay <capture file> [--host h] [--port p] [--speed x] [--in-process] [--json file]
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "lmqtt.h"
+#include "lmqtt_capture.h"
+#include "lmqtt_histogram.h"
+
+namespace {
+
+using asio::ip::tcp;
+using lmqtt::capture::record;
+using lmqtt::capture::record_kind;
+
+struct options {
+    std::string _path;
+    std::string _host = "127.0.0.1";
+    uint16_t _port = 1883;
+    double _speed = 1;
+    bool _inProcess = false;
+    std::string _json;
+};
+
+// one captured connection, over a TCP socket or a memory stream
+template <typename Socket>
+struct stream {
+    explicit stream(Socket socket) :
+        _socket(std::move(socket)) {}
+
+    Socket _socket;
+    bool _connected = false;
+    bool _failed = false;   // could not connect, or the broker closed it
+    bool _closing = false;  // CLOSE or LOST replayed, closed once everything is written
+    bool _writing = false;
+    bool _shutdown = false;
+    std::vector<uint8_t> _outBuffer;
+    std::vector<uint8_t> _writeBuffer;
+    std::array<uint8_t, 4096> _readBuffer;
+};
+
+template <typename Socket>
+class replayer {
+public:
+    using stream_ptr = std::shared_ptr<stream<Socket>>;
+
+    // records handled in a row before letting the reads run
+    static constexpr size_t MAX_BATCH = 1024;
+    // once the capture is over, how long writes have to drain
+    static constexpr auto DRAIN_TIMEOUT = std::chrono::seconds(5);
+
+    // memory streams need the broker they connect to, in this process
+    replayer(const options& opts, std::vector<record> records, lmqtt::lmqtt_server* broker = nullptr) :
+        _options(opts), _records(std::move(records)), _timer(_context),
+        _server(asio::ip::make_address(opts._host), opts._port), _broker(broker) {}
+
+    void run() {
+        _start = std::chrono::steady_clock::now();
+        asio::post(_context, [this]() { replay_next(); });
+        _context.run();
+        _end = std::chrono::steady_clock::now();
+    }
+
+    void write_results(std::FILE* out) const {
+        using lmqtt::latency::histogram;
+        std::vector<uint64_t> counts(histogram::BUCKET_COUNT, 0);
+        uint64_t sum = 0;
+        uint64_t max = 0;
+        _lateness.merge_into(counts.data(), sum, max);
+        uint64_t count = 0;
+        for (uint64_t c : counts) {
+            count += c;
+        }
+        auto percentile = [&](double p) {
+            return static_cast<double>(histogram::get_percentile(counts.data(), count, max, p)) / 1e3;
+        };
+
+        const double captureSeconds = _records.empty() ? 0.0 : static_cast<double>(_records.back()._time) / 1e9;
+        const double replaySeconds = std::chrono::duration<double>(_end - _start).count();
+        std::fprintf(out, "{\n");
+        std::fprintf(out, "  \"capture\": \"%s\",\n", _options._path.c_str());
+        std::fprintf(out, "  \"speed\": %.3f,\n", _options._speed);
+        std::fprintf(out, "  \"in_process\": %s,\n", _options._inProcess ? "true" : "false");
+        std::fprintf(out, "  \"records\": %zu,\n", _records.size());
+        std::fprintf(out, "  \"streams\": { \"opened\": %llu, \"failed\": %llu, \"lost\": %llu },\n",
+            static_cast<unsigned long long>(_opened),
+            static_cast<unsigned long long>(_connectFailed),
+            static_cast<unsigned long long>(_lost));
+        std::fprintf(out, "  \"bytes\": { \"sent\": %llu, \"received\": %llu },\n",
+            static_cast<unsigned long long>(_bytesSent),
+            static_cast<unsigned long long>(_bytesReceived));
+        std::fprintf(out, "  \"capture_seconds\": %.3f,\n", captureSeconds);
+        std::fprintf(out, "  \"replay_seconds\": %.3f,\n", replaySeconds);
+        std::fprintf(out, "  \"sent_bytes_per_second\": %.1f,\n", replaySeconds > 0 ? static_cast<double>(_bytesSent) / replaySeconds : 0.0);
+        // how far behind the schedule records went out, in us (not measured at speed 0)
+        std::fprintf(out, "  \"lateness_us\": { \"count\": %llu, \"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f }\n",
+            static_cast<unsigned long long>(count), percentile(0.5), percentile(0.99), percentile(0.999), static_cast<double>(max) / 1e3);
+        std::fprintf(out, "}\n");
+    }
+
+private:
+    void replay_next() {
+        for (size_t batch = 0; _next < _records.size(); ++batch) {
+            const record& rec = _records[_next];
+            if (_options._speed > 0) {
+                const auto due = _start + std::chrono::nanoseconds(static_cast<uint64_t>(static_cast<double>(rec._time) / _options._speed));
+                const auto now = std::chrono::steady_clock::now();
+                if (due > now) {
+                    _timer.expires_at(due);
+                    _timer.async_wait([this](std::error_code ec) {
+                        if (!ec) {
+                            replay_next();
+                        }
+                    });
+                    return;
+                }
+                if (batch == MAX_BATCH) {
+                    asio::post(_context, [this]() { replay_next(); });
+                    return;
+                }
+                _lateness.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - due).count()));
+            } else if (batch == MAX_BATCH) {
+                asio::post(_context, [this]() { replay_next(); });
+                return;
+            }
+            replay(rec);
+            ++_next;
+        }
+        _drainDeadline = std::chrono::steady_clock::now() + DRAIN_TIMEOUT;
+        wait_for_drain();
+    }
+
+    void replay(const record& rec) {
+        switch (rec._kind) {
+        case record_kind::OPEN:
+            ++_opened;
+            open(rec._stream);
+            break;
+        case record_kind::DATA:
+        {
+            auto it = _streams.find(rec._stream);
+            if (it == _streams.end() || it->second->_failed) {
+                return;
+            }
+            it->second->_outBuffer.insert(it->second->_outBuffer.end(), rec._data.begin(), rec._data.end());
+            flush(it->second);
+            break;
+        }
+        case record_kind::LOST:
+            ++_lost;
+            [[fallthrough]];
+        case record_kind::CLOSE:
+        {
+            auto it = _streams.find(rec._stream);
+            if (it == _streams.end()) {
+                return;
+            }
+            it->second->_closing = true;
+            flush(it->second);
+            break;
+        }
+        }
+    }
+
+    void open(uint32_t id) {
+        if constexpr (std::is_same_v<Socket, tcp::socket>) {
+            auto s = std::make_shared<stream<Socket>>(tcp::socket(_context));
+            _streams[id] = s;
+            s->_socket.async_connect(_server, [this, s](std::error_code ec) {
+                if (ec) {
+                    s->_failed = true;
+                    ++_connectFailed;
+                    return;
+                }
+                std::error_code ignored;
+                s->_socket.set_option(tcp::no_delay(true), ignored);
+                on_connected(s);
+            });
+        } else {
+            // connected as soon as it exists, the broker's end is added on its io thread
+            auto s = std::make_shared<stream<Socket>>(_broker->connect_in_memory(_context.get_executor()));
+            _streams[id] = s;
+            on_connected(s);
+        }
+    }
+
+    void on_connected(const stream_ptr& s) {
+        s->_connected = true;
+        read(s);
+        flush(s);
+    }
+
+    void flush(const stream_ptr& s) {
+        if (!s->_connected || s->_writing) {
+            return;
+        }
+        if (s->_outBuffer.empty()) {
+            if (s->_closing && !s->_shutdown) {
+                // the broker still gets to read everything, the socket is closed
+                // when it closes its side
+                std::error_code ignored;
+                s->_socket.shutdown(asio::socket_base::shutdown_send, ignored);
+                s->_shutdown = true;
+            }
+            return;
+        }
+        s->_writing = true;
+        s->_writeBuffer.swap(s->_outBuffer);
+        s->_outBuffer.clear();
+        asio::async_write(
+            s->_socket,
+            asio::buffer(s->_writeBuffer),
+            [this, s](std::error_code ec, size_t length) {
+                s->_writing = false;
+                if (ec) {
+                    // the broker closed it, like it would have in production
+                    s->_outBuffer.clear();
+                    s->_failed = true;
+                    return;
+                }
+                _bytesSent += length;
+                flush(s);
+            }
+        );
+    }
+
+    // what the broker sends is only counted
+    void read(const stream_ptr& s) {
+        s->_socket.async_read_some(
+            asio::buffer(s->_readBuffer),
+            [this, s](std::error_code ec, size_t length) {
+                if (ec) {
+                    std::error_code ignored;
+                    s->_socket.close(ignored);
+                    return;
+                }
+                _bytesReceived += length;
+                read(s);
+            }
+        );
+    }
+
+    // every record is out, waits for the writes before closing what is left
+    void wait_for_drain() {
+        bool pending = false;
+        for (auto& [id, s] : _streams) {
+            // still connecting, writing, or waiting for the broker to close
+            if (!s->_failed && (!s->_connected || s->_writing || !s->_outBuffer.empty() || (s->_shutdown && s->_socket.is_open()))) {
+                pending = true;
+                break;
+            }
+        }
+        if (pending && std::chrono::steady_clock::now() < _drainDeadline) {
+            _timer.expires_after(std::chrono::milliseconds(10));
+            _timer.async_wait([this](std::error_code ec) {
+                if (!ec) {
+                    wait_for_drain();
+                }
+            });
+            return;
+        }
+        for (auto& [id, s] : _streams) {
+            std::error_code ignored;
+            s->_socket.close(ignored);
+        }
+        _context.stop();
+    }
+
+    options _options;
+    std::vector<record> _records;
+    size_t _next = 0;
+
+    asio::io_context _context;
+    asio::steady_timer _timer;
+    tcp::endpoint _server;
+    lmqtt::lmqtt_server* _broker;
+    std::unordered_map<uint32_t, stream_ptr> _streams;
+
+    std::chrono::steady_clock::time_point _start;
+    std::chrono::steady_clock::time_point _end;
+    std::chrono::steady_clock::time_point _drainDeadline;
+
+    uint64_t _opened = 0;
+    uint64_t _connectFailed = 0;
+    uint64_t _lost = 0;
+    uint64_t _bytesSent = 0;
+    uint64_t _bytesReceived = 0;
+    lmqtt::latency::histogram _lateness;
+};
+
+template <typename Socket>
+[[nodiscard]] int replay_capture(const options& opts, std::vector<record> records, lmqtt::lmqtt_server* broker) {
+    replayer<Socket> replay(opts, std::move(records), broker);
+    replay.run();
+
+    std::FILE* out = opts._json.empty() ? stdout : std::fopen(opts._json.c_str(), "w");
+    if (!out) {
+        std::fprintf(stderr, "could not open %s\n", opts._json.c_str());
+        return 1;
+    }
+    replay.write_results(out);
+    if (out != stdout) {
+        std::fclose(out);
+    }
+    return 0;
+}
+
+[[nodiscard]] bool parse_options(int argc, char** argv, options& opts) {
+    if (argc < 2) {
+        return false;
+    }
+    opts._path = argv[1];
+    for (int i = 2; i < argc; ++i) {
+        const std::string_view name = argv[i];
+        if (name == "--in-process") {
+            opts._inProcess = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            return false;
+        }
+        const std::string value = argv[++i];
+        if (name == "--host") opts._host = value;
+        else if (name == "--port") opts._port = static_cast<uint16_t>(std::stoul(value));
+        else if (name == "--speed") opts._speed = std::max(0.0, std::stod(value));
+        else if (name == "--json") opts._json = value;
+        else return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    options opts;
+    try {
+        if (!parse_options(argc, argv, opts)) {
+            std::fprintf(stderr, "usage: %s <capture file> [--host h] [--port p] [--speed x] [--in-process] [--json file]\n", argv[0]);
+            return 1;
+        }
+    } catch (std::exception& e) {
+        std::fprintf(stderr, "invalid option value: %s\n", e.what());
+        return 1;
+    }
+
+    // the whole capture is loaded first, reading the file must not slow the replay
+    lmqtt::capture::reader reader;
+    if (reader.open(opts._path) != lmqtt::return_code::OK) {
+        std::fprintf(stderr, "%s is not a capture file\n", opts._path.c_str());
+        return 1;
+    }
+    std::vector<record> records;
+    record rec;
+    while (reader.next(rec) == lmqtt::return_code::OK) {
+        records.push_back(std::move(rec));
+    }
+    std::fprintf(stderr, "%zu records loaded\n", records.size());
+
+    if (!opts._inProcess) {
+        return replay_capture<tcp::socket>(opts, std::move(records), nullptr);
+    }
+
+    // the results are on stdout
+    lmqtt::log::logger::instance().set_output(stderr);
+    // nothing connects over TCP, any free port will do for the listener
+    lmqtt::server_config config;
+    config._port = 0;
+    lmqtt::lmqtt_server server(config);
+    if (!server.start()) {
+        std::fprintf(stderr, "could not start the broker\n");
+        return 1;
+    }
+    const int result = replay_capture<lmqtt::memory_stream>(opts, std::move(records), &server);
+    server.stop();
+    return result;
+}
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Self-signed certificates to try the TLS listeners locally (server_config::_tlsListeners),
+# never for production. Writes to the given directory (./certs by default):
+#   ca.pem                    the certificate authority, for the clients (--cafile)
+#   server.pem, server.key    the broker's certificate and key, valid for localhost
+#                             and 127.0.0.1 (_certificateFile, _privateKeyFile)
+# ECDSA P-256 keys: their handshakes are cheaper than RSA ones.
+#
+# usage: make_test_certs.sh [directory] [days]
+set -e
+
+dir=${1:-certs}
+days=${2:-365}
+mkdir -p "$dir"
+cd "$dir"
+
+openssl ecparam -name prime256v1 -genkey -noout -out ca.key
+openssl req -x509 -new -key ca.key -sha256 -days "$days" -subj "/CN=lmqtt test CA" -out ca.pem
+
+openssl ecparam -name prime256v1 -genkey -noout -out server.key
+openssl req -new -key server.key -subj "/CN=localhost" -out server.csr
+printf "subjectAltName=DNS:localhost,IP:127.0.0.1\nextendedKeyUsage=serverAuth\n" > server.ext
+openssl x509 -req -in server.csr -CA ca.pem -CAkey ca.key -CAcreateserial -sha256 -days "$days" \
+    -extfile server.ext -out server.pem
+rm -f server.csr server.ext ca.srl
+
+echo "certificates written to $dir"